@@ -1,56 +1,101 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
+#include <memory_resource>
+#include <new>
 #include <utility>
+#include <vector>
 
-class ArenaAllocator {
+#include <sys/mman.h>
+
+/* The arena is also a std::pmr::memory_resource, so containers stored in it
+** (e.g. std::pmr::vector) can take their buffers from it as well. Freeing is
+** a no-op; everything is given back at once by reset() or the destructor.
+** Containers keep a pointer to the arena, so they must not grow after the
+** arena was moved. A moved-from arena holds no blocks: it is empty, and it
+** takes a new first block of the same size when it is used again.
+*/
+class ArenaAllocator final : public std::pmr::memory_resource {
 public:
-    explicit ArenaAllocator(const size_t max_num_bytes)
-        : m_size { max_num_bytes } // the buffer size
-        , m_buffer { new std::byte[max_num_bytes] } // allocate the buffer
-        , m_offset { m_buffer } // set the offset to the beginning of the buffer
+    // what the allocator currently holds, e.g. for reporting memory usage
+    struct Stats {
+        size_t bytes_used; // bytes handed out since the last reset, including alignment padding
+        size_t bytes_reserved; // the total size of all blocks
+        size_t blocks; // the number of blocks
+        size_t high_water; // the most bytes that were ever in use at once
+    };
+
+    // a position in the arena which can be rewound to later
+    struct Mark {
+        size_t block;
+        size_t offset;
+        size_t used_before;
+    };
+
+    explicit ArenaAllocator(const size_t block_size, const bool huge_pages = false)
+        : m_huge_pages { huge_pages } // back the blocks with 2 MiB pages when the system allows it
+        , m_block_size { block_size }
     {
+        // the first block, every later one grows from its size
+        add_block(block_size);
     }
 
     // copying is deactivated, because the buffer would cause conflicts
     ArenaAllocator(const ArenaAllocator&) = delete;
     ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
-    // move constructor and move assignment operator
+    // both moves leave other empty, without blocks
     ArenaAllocator(ArenaAllocator&& other) noexcept
-        : m_size { std::exchange(other.m_size, 0) }
-        , m_buffer { std::exchange(other.m_buffer, nullptr) }
+        : m_huge_pages { other.m_huge_pages }
+        , m_block_size { other.m_block_size }
+        , m_blocks { std::move(other.m_blocks) }
+        , m_current { std::exchange(other.m_current, 0) }
         , m_offset { std::exchange(other.m_offset, nullptr) }
+        , m_end { std::exchange(other.m_end, nullptr) }
+        , m_used_before { std::exchange(other.m_used_before, 0) }
+        , m_high_water { std::exchange(other.m_high_water, 0) }
     {
+        other.m_blocks.clear();
     }
 
-    // move assignment operator
+    // the blocks of this arena are freed, whatever was allocated in them must be dead
     ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
     {
-        std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
-        std::swap(m_offset, other.m_offset);
+        if (this == &other) {
+            return *this;
+        }
+        for (const Block& block : m_blocks) {
+            free_block(block);
+        }
+        m_huge_pages = other.m_huge_pages;
+        m_block_size = other.m_block_size;
+        m_blocks = std::move(other.m_blocks);
+        other.m_blocks.clear();
+        m_current = std::exchange(other.m_current, 0);
+        m_offset = std::exchange(other.m_offset, nullptr);
+        m_end = std::exchange(other.m_end, nullptr);
+        m_used_before = std::exchange(other.m_used_before, 0);
+        m_high_water = std::exchange(other.m_high_water, 0);
         return *this;
     }
 
+    // here we allocate raw memory, moving on to the next block when the current one is full
+    [[nodiscard]] void* alloc_bytes(const size_t size, const size_t alignment)
+    {
+        if (void* memory = bump(size, alignment)) {
+            return memory;
+        }
+        next_block(size + alignment);
+        return bump(size, alignment);
+    }
+
     // here we allocate the memory for the object, in the generic way
     template <typename T>
     [[nodiscard]] T* alloc()
     {
-        // we calculate the remaining number of bytes
-        size_t remaining_num_bytes = m_size - static_cast<size_t>(m_offset - m_buffer);
-        // we align the address of the memory
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
-        // if the address is not aligned, we throw an exception
-        if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
-        }
-        // we move the offset to the next available memory
-        m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
-        // we return the address of the memory
-        return static_cast<T*>(aligned_address);
+        return static_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
     }
 
     template <typename T, typename... Args>
@@ -61,18 +106,164 @@ public:
         return new (allocated_memory) T { std::forward<Args>(args)... };
     }
 
-    ~ArenaAllocator()
+    [[nodiscard]] Mark mark() const
+    {
+        if (m_blocks.empty()) { // moved from
+            return { 0, 0, 0 };
+        }
+        return { m_current, static_cast<size_t>(m_offset - m_blocks[m_current].data), m_used_before };
+    }
+
+    // everything allocated after the mark is given back, the blocks are kept for reuse
+    void rewind(const Mark mark)
+    {
+        m_high_water = std::max(m_high_water, bytes_used());
+        if (m_blocks.empty()) { // moved from, nothing was allocated
+            return;
+        }
+        m_current = mark.block;
+        m_offset = m_blocks[m_current].data + mark.offset;
+        m_end = m_blocks[m_current].data + m_blocks[m_current].size;
+        m_used_before = mark.used_before;
+    }
+
+    // gives back everything, so the arena can be reused by the next compilation
+    void reset()
+    {
+        rewind({ 0, 0, 0 });
+    }
+
+    [[nodiscard]] Stats stats() const
+    {
+        size_t reserved = 0;
+        for (const Block& block : m_blocks) {
+            reserved += block.size;
+        }
+        return { bytes_used(), reserved, m_blocks.size(), std::max(m_high_water, bytes_used()) };
+    }
+
+    ~ArenaAllocator() override
     {
-        // No destructors are called for the stored objects. Thus, memory
-        // leaks are possible (e.g. when storing std::vector objects or
-        // other non-trivially destructable objects in the allocator).
-        // Although this could be changed, it would come with additional
-        // runtime overhead and therefore is not implemented.
-        delete[] m_buffer;
+        // No destructors are called for the stored objects. This is fine as
+        // long as everything they own lives in the arena too, which is why
+        // containers in the AST are std::pmr containers backed by it.
+        for (const Block& block : m_blocks) {
+            free_block(block);
+        }
     }
 
 private:
-    size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
\ No newline at end of file
+    void* do_allocate(const size_t bytes, const size_t alignment) override
+    {
+        return alloc_bytes(bytes, alignment);
+    }
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+        // memory is only given back by reset(), rewind() or the destructor
+    }
+
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    struct Block {
+        std::byte* data;
+        size_t size;
+        bool mapped; // true if the block comes from mmap instead of new[]
+    };
+
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    void* bump(const size_t size, const size_t alignment)
+    {
+        // we calculate the remaining number of bytes
+        size_t remaining_num_bytes = static_cast<size_t>(m_end - m_offset);
+        // we align the address of the memory
+        auto pointer = static_cast<void*>(m_offset);
+        const auto aligned_address = std::align(alignment, size, pointer, remaining_num_bytes);
+        if (aligned_address == nullptr) {
+            return nullptr;
+        }
+        // we move the offset to the next available memory
+        m_offset = static_cast<std::byte*>(aligned_address) + size;
+        return aligned_address;
+    }
+
+    [[nodiscard]] size_t bytes_used() const
+    {
+        if (m_blocks.empty()) { // moved from
+            return 0;
+        }
+        return m_used_before + static_cast<size_t>(m_offset - m_blocks[m_current].data);
+    }
+
+    // moves on to the next block that can hold min_size bytes, allocating one if needed
+    void next_block(const size_t min_size)
+    {
+        if (m_blocks.empty()) { // moved from
+            add_block(std::max(m_block_size, min_size));
+            return;
+        }
+        m_used_before += static_cast<size_t>(m_offset - m_blocks[m_current].data);
+        // blocks kept from before a reset are reused if they are big enough
+        while (m_current + 1 < m_blocks.size() && m_blocks[m_current + 1].size < min_size) {
+            m_current++;
+        }
+        if (m_current + 1 == m_blocks.size()) {
+            // every new block is twice as large as the last one, so the number of blocks stays logarithmic
+            add_block(std::max(m_blocks.back().size * 2, min_size));
+        }
+        m_current++;
+        m_offset = m_blocks[m_current].data;
+        m_end = m_offset + m_blocks[m_current].size;
+    }
+
+    void add_block(size_t size)
+    {
+        Block block { nullptr, size, false };
+        if (m_huge_pages) {
+            block.size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+            void* memory = mmap(nullptr, block.size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory == MAP_FAILED) {
+                // no reserved huge pages, ask for transparent ones instead
+                memory = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED) {
+                    throw std::bad_alloc {};
+                }
+                madvise(memory, block.size, MADV_HUGEPAGE);
+            }
+            block.data = static_cast<std::byte*>(memory);
+            block.mapped = true;
+        }
+        else {
+            block.data = new std::byte[size];
+        }
+        m_blocks.push_back(block);
+        if (m_blocks.size() == 1) {
+            m_offset = block.data;
+            m_end = block.data + block.size;
+        }
+    }
+
+    static void free_block(const Block& block)
+    {
+        if (block.mapped) {
+            munmap(block.data, block.size);
+        }
+        else {
+            delete[] block.data;
+        }
+    }
+
+    bool m_huge_pages;
+    size_t m_block_size; // the size of the first block
+    std::vector<Block> m_blocks;
+    size_t m_current = 0; // the block we are allocating from
+    std::byte* m_offset = nullptr; // the next free byte in the current block
+    std::byte* m_end = nullptr; // the end of the current block
+    size_t m_used_before = 0; // the bytes used in the blocks before the current one
+    size_t m_high_water = 0;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "instr.hpp"
+#include "output_buffer.hpp"
+
+/* Prints the instructions as nasm assembly into an OutputBuffer */
+class AsmWriter final : public InstrSink {
+public:
+    explicit AsmWriter(OutputBuffer& output)
+        : m_output(output)
+    {
+        m_output << "global _start\n_start:\n";
+    }
+
+    void emit(const Instr& instr) override
+    {
+        switch (instr.op) {
+        case Op::label:
+            write(instr.dst);
+            m_output << ":\n";
+            return;
+        case Op::comment:
+            m_output << "    ;; " << instr.comment << "\n";
+            return;
+        default:
+            break;
+        }
+        m_output << "    " << to_string(instr.op);
+        if (instr.dst.kind != Operand::Kind::none) {
+            m_output << ' ';
+            write(instr.dst);
+        }
+        if (instr.src.kind != Operand::Kind::none) {
+            m_output << ", ";
+            // lea only computes the address, nasm takes it without a size
+            write(instr.src, instr.op != Op::lea);
+        }
+        m_output << '\n';
+    }
+
+private:
+    void write(const Operand& operand, const bool sized = true)
+    {
+        switch (operand.kind) {
+        case Operand::Kind::none:
+            break;
+        case Operand::Kind::reg:
+            m_output << reg_name(operand.reg, operand.width);
+            break;
+        case Operand::Kind::imm:
+            m_output << operand.value;
+            break;
+        case Operand::Kind::mem:
+            m_output << (sized ? "QWORD [" : "[") << to_string(operand.reg);
+            if (operand.scale != 0) {
+                m_output << " + " << to_string(operand.index) << '*' << static_cast<int>(operand.scale);
+            }
+            if (operand.disp > 0) {
+                m_output << " + " << operand.disp;
+            }
+            else if (operand.disp < 0) {
+                m_output << " - " << -static_cast<int64_t>(operand.disp);
+            }
+            m_output << ']';
+            break;
+        case Operand::Kind::label:
+            m_output << "label" << operand.value;
+            break;
+        }
+    }
+
+    static const char* reg_name(const Reg reg, const uint8_t width)
+    {
+        constexpr const char* names32[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                            "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+        constexpr const char* names8[] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                                           "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+        if (width == 32) {
+            return names32[static_cast<uint8_t>(reg)];
+        }
+        if (width == 8) {
+            return names8[static_cast<uint8_t>(reg)];
+        }
+        return to_string(reg);
+    }
+
+    OutputBuffer& m_output;
+};
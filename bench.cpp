@@ -0,0 +1,251 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compiler.hpp"
+#include "corpus.hpp"
+
+/* Benchmarks of the compiler on the generated corpus: the lexer, the parser,
+** the arena, the generator and the peephole pass on their own, whole
+** compiles, and the binaries they make. It is built like the compiler,
+**     g++ -std=c++20 -O2 -o hydro_bench bench.cpp
+** and prints a line per benchmark and program with the best time of a run,
+** the number of runs and the source throughput. --corpus DIR also writes the
+** programs there, to look at them or to compile them with --time-report, and
+** with --no-bench that is all it does, which is how tests/run_tests.py gets
+** them.
+*/
+namespace bench {
+
+// a benchmark runs for at least this long, and at least min_runs times
+constexpr double min_time_ms = 200;
+constexpr size_t min_runs = 3;
+
+// written to, so the compiler can't drop the work whose result ends up there
+inline volatile size_t g_result = 0;
+
+class NullSink final : public InstrSink {
+public:
+    void emit(const Instr&) override
+    {
+        g_result = g_result + 1;
+    }
+};
+
+struct Options {
+    size_t scale = 100;
+    std::string filter; // only the benchmarks or programs with this in their name
+    std::string corpus_dir;
+    bool run = true; // --no-run skips running the binaries
+    bool bench = true; // --no-bench only writes the corpus
+};
+
+// the best time of a run in ms, and how many runs there were
+template <typename Body>
+std::pair<double, size_t> measure(Body&& body)
+{
+    double best = 0;
+    double total = 0;
+    size_t runs = 0;
+    while (runs < min_runs || total < min_time_ms) {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = runs == 0 ? ms : std::min(best, ms);
+        total += ms;
+        runs++;
+    }
+    return { best, runs };
+}
+
+// the throughput is of the source, a benchmark that doesn't read it passes 0 bytes
+inline void report(const std::string& name, const std::string& program, const std::pair<double, size_t> time,
+                   const size_t bytes)
+{
+    std::cout << std::left << std::setw(16) << name << std::setw(16) << program << std::right << std::fixed
+              << std::setprecision(3) << std::setw(12) << time.first << " ms" << std::setw(8) << time.second
+              << " runs";
+    if (bytes != 0) {
+        std::cout << std::setw(10) << std::setprecision(1) << static_cast<double>(bytes) / 1000.0 / time.first
+                  << " MB/s";
+    }
+    std::cout << std::endl;
+}
+
+inline bool selected(const Options& options, const std::string& name, const corpus::Program* program)
+{
+    return options.filter.empty() || name.find(options.filter) != std::string::npos
+        || (program != nullptr && program->name.find(options.filter) != std::string::npos);
+}
+
+inline void bench_tokenize(const corpus::Program& program)
+{
+    Interner interner;
+    std::vector<Token> tokens;
+    report("tokenize", program.name, measure([&] {
+               interner.clear();
+               Tokenizer(program.src, interner).tokenize(tokens);
+               g_result = tokens.size();
+           }),
+           program.src.size());
+}
+
+inline void bench_parse(const corpus::Program& program)
+{
+    Interner interner;
+    Parser parser;
+    report("parse_prog", program.name, measure([&] {
+               interner.clear();
+               Tokenizer tokenizer(program.src, interner);
+               parser.reset(tokenizer);
+               g_result = parser.parse_prog()->stmts.size();
+           }),
+           program.src.size());
+}
+
+/* The optimized program is generated again and again, into a sink that
+** drops the instructions, and then once more through the peephole pass,
+** which the compiler puts in front of the backend
+*/
+inline void bench_gen(const corpus::Program& program)
+{
+    Interner interner;
+    Parser parser;
+    Tokenizer tokenizer(program.src, interner);
+    parser.reset(tokenizer);
+    NodeProg prog = parser.parse_prog().value();
+    Optimizer().run(prog, interner);
+    NullSink sink;
+    // kept from one run to the next, like the compiler does
+    Generator::Buffers buffers;
+    Peephole::Buffers peephole_buffers;
+    report("gen_prog", program.name, measure([&] {
+               Generator generator(prog, interner, sink, buffers, 4);
+               generator.gen_prog();
+           }),
+           program.src.size());
+    report("peephole", program.name, measure([&] {
+               Peephole peephole(sink, peephole_buffers);
+               Generator generator(prog, interner, peephole, buffers, 4);
+               generator.gen_prog();
+               peephole.finish();
+           }),
+           program.src.size());
+}
+
+inline void bench_compile(const corpus::Program& program, const std::string& dir, Compiler& compiler,
+                          const bool run)
+{
+    const std::string input_path = dir + "/" + program.name + ".hy";
+    const std::string output_path = dir + "/" + program.name;
+    std::ofstream(input_path) << program.src;
+    const CompileOptions options;
+    if (const std::optional<std::string> error = compiler.compile(input_path, output_path, options)) {
+        std::cerr << program.name << ": " << *error << std::endl;
+        return;
+    }
+    report("compile", program.name, measure([&] { compiler.compile(input_path, output_path, options); }),
+           program.src.size());
+
+    if (run) {
+        report("run", program.name, measure([&] {
+                   const pid_t pid = fork();
+                   if (pid == 0) {
+                       execl(output_path.c_str(), output_path.c_str(), nullptr);
+                       _exit(127);
+                   }
+                   int status = 0;
+                   waitpid(pid, &status, 0);
+                   g_result = static_cast<size_t>(status);
+               }),
+               0);
+    }
+    ::unlink(output_path.c_str());
+    ::unlink(input_path.c_str());
+}
+
+// many small nodes, the way the parser allocates them, with the arena reused from one run to the next
+inline void bench_arena()
+{
+    ArenaAllocator arena(64 * 1024);
+    report("arena_emplace", "", measure([&] {
+               arena.reset();
+               for (uint32_t i = 0; i < 1'000'000; i++) {
+                   g_result = arena.emplace<NodeStmtLet>(i, i)->expr;
+               }
+           }),
+           0);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    bench::Options options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            options.scale = static_cast<size_t>(std::atoi(argv[++i]));
+        }
+        else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--corpus" && i + 1 < argc) {
+            options.corpus_dir = argv[++i];
+        }
+        else if (arg == "--no-run") {
+            options.run = false;
+        }
+        else if (arg == "--no-bench") {
+            options.bench = false;
+        }
+        else {
+            std::cerr << "hydro_bench [--scale N] [--filter TEXT] [--corpus DIR] [--no-run] [--no-bench]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::vector<corpus::Program> programs = corpus::all(options.scale);
+    if (!options.corpus_dir.empty()) {
+        for (const corpus::Program& program : programs) {
+            std::ofstream(options.corpus_dir + "/" + program.name + ".hy") << program.src;
+        }
+    }
+    if (!options.bench) {
+        return EXIT_SUCCESS;
+    }
+    char dir_template[] = "/tmp/hydro_bench.XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    if (dir == nullptr) {
+        std::cerr << "Could not make a directory in /tmp" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Compiler compiler;
+    for (const corpus::Program& program : programs) {
+        if (bench::selected(options, "tokenize", &program)) {
+            bench::bench_tokenize(program);
+        }
+        if (bench::selected(options, "parse_prog", &program)) {
+            bench::bench_parse(program);
+        }
+        if (bench::selected(options, "gen_prog", &program) || bench::selected(options, "peephole", &program)) {
+            bench::bench_gen(program);
+        }
+        if (bench::selected(options, "compile", &program) || bench::selected(options, "run", &program)) {
+            bench::bench_compile(program, dir, compiler, options.run);
+        }
+    }
+    if (bench::selected(options, "arena_emplace", nullptr)) {
+        bench::bench_arena();
+    }
+    ::rmdir(dir);
+    return EXIT_SUCCESS;
+}
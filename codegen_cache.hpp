@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "instr.hpp"
+
+/* A 64-bit hash of a sequence of words. Every step is a bijection of the
+** state, so two sequences collide about as often as two random numbers do.
+*/
+class Hasher {
+public:
+    explicit Hasher(const uint64_t seed = 0)
+        : m_state(seed)
+    {
+    }
+
+    void add(const uint64_t word)
+    {
+        // the finalizer of splitmix64
+        uint64_t x = m_state + word + 0x9E3779B97F4A7C15;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+        m_state = x ^ (x >> 31);
+    }
+
+    void add(const std::string_view text)
+    {
+        add(text.size());
+        for (size_t i = 0; i < text.size(); i += 8) {
+            uint64_t word = 0;
+            std::memcpy(&word, text.data() + i, std::min<size_t>(8, text.size() - i));
+            add(word);
+        }
+    }
+
+    [[nodiscard]] uint64_t value() const
+    {
+        return m_state;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+/* Passes the instructions on, and keeps a copy of them while a statement is
+** being recorded for the cache. It sits after the peephole pass, so what is
+** recorded is what the encoder gets.
+*/
+class RecordingSink final : public InstrSink {
+public:
+    explicit RecordingSink(InstrSink& next)
+        : m_next(next)
+    {
+    }
+
+    void emit(const Instr& instr) override
+    {
+        if (m_recording != nullptr) {
+            m_recording->push_back(instr);
+        }
+        m_next.emit(instr);
+    }
+
+    // nullptr stops the recording
+    void record_into(std::vector<Instr>* instrs)
+    {
+        m_recording = instrs;
+    }
+
+private:
+    InstrSink& m_next;
+    std::vector<Instr>* m_recording = nullptr;
+};
+
+/* The instructions generated for the top-level statements of a file, kept on
+** disk from one compile of it to the next. An entry is found by a key that
+** the generator computes from everything the instructions depend on, so an
+** unchanged statement is copied instead of generated again. The file of an
+** input only keeps the entries its last compile used, so it doesn't grow as
+** the input is edited, and it is only written again when that changed.
+*/
+class CodegenCache {
+public:
+    struct Entry {
+        size_t first; // where the instructions start in the code of the cache
+        uint32_t size;
+        LabelId labels; // the number of labels of the statement, they are numbered from 0 in its instructions
+        bool used;
+    };
+
+    // loads the entries of the last compile of the input with the same salt, a missing or broken file is no entry
+    void open(const std::string& dir, const std::string& input_path, const uint64_t salt)
+    {
+        m_entries.clear();
+        m_code.clear();
+        m_comments.clear();
+        m_dir = dir;
+        m_input_path = input_path;
+        m_salt = salt;
+        Hasher name(salt);
+        name.add(input_path);
+        m_path = dir + "/" + hex(name.value()) + ".cache";
+        m_dirty = false;
+        load();
+    }
+
+    [[nodiscard]] uint64_t salt() const
+    {
+        return m_salt;
+    }
+
+    const Entry* find(const uint64_t key)
+    {
+        const auto it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            return nullptr;
+        }
+        it->second.used = true;
+        return &it->second;
+    }
+
+    [[nodiscard]] std::span<const Instr> instrs(const Entry& entry) const
+    {
+        return std::span(m_code).subspan(entry.first, entry.size);
+    }
+
+    void insert(const uint64_t key, const std::span<const Instr> instrs, const LabelId labels)
+    {
+        m_entries.insert_or_assign(key, Entry { m_code.size(), static_cast<uint32_t>(instrs.size()), labels, true });
+        m_code.insert(m_code.end(), instrs.begin(), instrs.end());
+        m_dirty = true;
+    }
+
+    // writes the entries used since open if they aren't what the file holds, returns false if that failed
+    bool save()
+    {
+        const bool all_used = std::ranges::all_of(m_entries, [](const auto& pair) { return pair.second.used; });
+        if (!m_dirty && all_used) {
+            return true;
+        }
+
+        std::string data(magic, sizeof(magic));
+        put(data, m_salt);
+        put(data, static_cast<uint32_t>(m_input_path.size()));
+        data += m_input_path;
+        // the comments are a few string literals of the generator, the instructions refer to them by number
+        std::unordered_map<const char*, uint16_t> comment_ids;
+        std::vector<const char*> comments;
+        for (const Instr& instr : m_code) {
+            if (instr.comment != nullptr && comment_ids.try_emplace(instr.comment, comments.size()).second) {
+                comments.push_back(instr.comment);
+            }
+        }
+        put(data, static_cast<uint16_t>(comments.size()));
+        for (const char* comment : comments) {
+            put(data, static_cast<uint16_t>(std::strlen(comment)));
+            data += comment;
+        }
+
+        put(data, static_cast<uint32_t>(std::ranges::count_if(m_entries, [](const auto& pair) {
+            return pair.second.used;
+        })));
+        for (const auto& [key, entry] : m_entries) {
+            if (!entry.used) {
+                continue;
+            }
+            put(data, key);
+            put(data, entry.labels);
+            put(data, entry.size);
+            for (const Instr& instr : instrs(entry)) {
+                put(data, static_cast<uint8_t>(instr.op));
+                put(data, static_cast<uint16_t>(instr.comment == nullptr ? 0 : comment_ids[instr.comment] + 1));
+                put_operand(data, instr.dst);
+                put_operand(data, instr.src);
+            }
+        }
+
+        // the directory is made on the first compile, it is fine if it exists
+        ::mkdir(m_dir.c_str(), 0755);
+        // written next to it and renamed, so a compile that is killed never leaves half a file
+        const std::string tmp_path = m_path + "." + std::to_string(::getpid()) + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out.write(data.data(), static_cast<std::streamsize>(data.size()))) {
+                return false;
+            }
+        }
+        return std::rename(tmp_path.c_str(), m_path.c_str()) == 0;
+    }
+
+private:
+    static constexpr char magic[8] = { 'H', 'Y', 'D', 'R', 'O', 'C', '0', '2' };
+
+    static std::string hex(const uint64_t value)
+    {
+        constexpr char digits[] = "0123456789abcdef";
+        std::string text(16, '0');
+        for (int i = 0; i < 16; i++) {
+            text[15 - i] = digits[(value >> (4 * i)) & 0xF];
+        }
+        return text;
+    }
+
+    template <typename T>
+    static void put(std::string& data, const T value)
+    {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // only the fields the kind of operand uses are written
+    static void put_operand(std::string& data, const Operand& operand)
+    {
+        put(data, static_cast<uint8_t>(operand.kind));
+        switch (operand.kind) {
+        case Operand::Kind::none:
+            break;
+        case Operand::Kind::reg:
+            put(data, operand.width);
+            put(data, static_cast<uint8_t>(operand.reg));
+            break;
+        case Operand::Kind::imm:
+            put(data, operand.value);
+            break;
+        case Operand::Kind::mem:
+            put(data, static_cast<uint8_t>(operand.reg));
+            put(data, static_cast<uint8_t>(operand.index));
+            put(data, operand.scale);
+            put(data, operand.disp);
+            break;
+        case Operand::Kind::label:
+            put(data, static_cast<LabelId>(operand.value));
+            break;
+        }
+    }
+
+    /* Reads the file back, every read checks that the data is there and a
+    ** failed one drops the whole file
+    */
+    class Reader {
+    public:
+        explicit Reader(const std::string& data)
+            : m_data(data)
+        {
+        }
+
+        template <typename T>
+        bool get(T& value)
+        {
+            if (m_data.size() - m_pos < sizeof(T)) {
+                return false;
+            }
+            std::memcpy(&value, m_data.data() + m_pos, sizeof(T));
+            m_pos += sizeof(T);
+            return true;
+        }
+
+        bool get_text(const size_t size, std::string_view& text)
+        {
+            if (m_data.size() - m_pos < size) {
+                return false;
+            }
+            text = std::string_view(m_data).substr(m_pos, size);
+            m_pos += size;
+            return true;
+        }
+
+        bool get_reg(Reg& reg)
+        {
+            uint8_t value = 0;
+            if (!get(value) || value > static_cast<uint8_t>(Reg::r15)) {
+                return false;
+            }
+            reg = static_cast<Reg>(value);
+            return true;
+        }
+
+        bool get_operand(Operand& operand)
+        {
+            uint8_t kind = 0;
+            if (!get(kind)) {
+                return false;
+            }
+            operand = {};
+            operand.kind = static_cast<Operand::Kind>(kind);
+            switch (operand.kind) {
+            case Operand::Kind::none:
+                return true;
+            case Operand::Kind::reg:
+                return get(operand.width) && get_reg(operand.reg);
+            case Operand::Kind::imm:
+                return get(operand.value);
+            case Operand::Kind::mem:
+                return get_reg(operand.reg) && get_reg(operand.index) && get(operand.scale) && get(operand.disp);
+            case Operand::Kind::label: {
+                LabelId label = 0;
+                if (!get(label)) {
+                    return false;
+                }
+                operand.value = label;
+                return true;
+            }
+            }
+            return false;
+        }
+
+    private:
+        const std::string& m_data;
+        size_t m_pos = 0;
+    };
+
+    void load()
+    {
+        std::ifstream in(m_path, std::ios::binary);
+        if (!in) {
+            return;
+        }
+        const std::string data { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        if (!parse(data)) {
+            m_entries.clear();
+            m_code.clear();
+        }
+    }
+
+    bool parse(const std::string& data)
+    {
+        Reader reader(data);
+        std::string_view text;
+        uint64_t salt = 0;
+        uint32_t path_size = 0;
+        if (!reader.get_text(sizeof(magic), text) || text != std::string_view(magic, sizeof(magic))
+            || !reader.get(salt) || salt != m_salt || !reader.get(path_size) || !reader.get_text(path_size, text)
+            || text != m_input_path) {
+            return false;
+        }
+        uint16_t comment_count = 0;
+        if (!reader.get(comment_count)) {
+            return false;
+        }
+        std::vector<const char*> comments;
+        for (uint16_t i = 0; i < comment_count; i++) {
+            uint16_t size = 0;
+            if (!reader.get(size) || !reader.get_text(size, text)) {
+                return false;
+            }
+            comments.push_back(m_comments.emplace_back(text).c_str());
+        }
+
+        uint32_t count = 0;
+        if (!reader.get(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t key = 0;
+            Entry entry { .first = m_code.size(), .size = 0, .labels = 0, .used = false };
+            if (!reader.get(key) || !reader.get(entry.labels) || !reader.get(entry.size)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < entry.size; j++) {
+                Instr instr { .op = Op::mov };
+                uint8_t op = 0;
+                uint16_t comment = 0;
+                if (!reader.get(op) || op > static_cast<uint8_t>(Op::comment) || !reader.get(comment)
+                    || comment > comments.size() || !reader.get_operand(instr.dst) || !reader.get_operand(instr.src)) {
+                    return false;
+                }
+                instr.op = static_cast<Op>(op);
+                instr.comment = comment == 0 ? nullptr : comments[comment - 1];
+                m_code.push_back(instr);
+            }
+            m_entries.insert_or_assign(key, entry);
+        }
+        return true;
+    }
+
+    std::string m_dir;
+    std::string m_path;
+    std::string m_input_path;
+    uint64_t m_salt = 0;
+    bool m_dirty = false; // an entry was added since the file was loaded
+    std::unordered_map<uint64_t, Entry> m_entries;
+    std::vector<Instr> m_code; // the instructions of every entry, one after another
+    std::deque<std::string> m_comments; // the texts of the loaded comments, the instructions point into them
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/* An error in the program being compiled. Every stage throws it instead of
+** exiting, so the driver can report it for the file and go on with the next
+** one.
+*/
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+
+    static CompileError undeclared(const std::string_view name)
+    {
+        return CompileError("Undeclared identifier: " + std::string(name));
+    }
+
+    static CompileError redeclared(const std::string_view name)
+    {
+        return CompileError("Identifier already used: " + std::string(name));
+    }
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "compiler.hpp"
+
+/* A compile server on a Unix socket, so a build that compiles thousands of
+** files pays for starting the compiler once. A client connects, sends its
+** working directory and then the arguments of a run, one per line, ending
+** with an empty line. The answer is the error messages of the run, then a
+** last line "status <n>" with its exit status. The requests are served one
+** after another, by compilers that keep their memory from one to the next,
+** so a client gets request_timeout_ms to send its request and to take the
+** answer, and is dropped after that. The socket is only open to the user
+** running the server, since a request makes it write wherever it can.
+*/
+namespace compile_server {
+
+// a request bigger than this is dropped
+constexpr size_t max_request_size = 1024 * 1024;
+// so a client that never finishes its request can't keep the others waiting
+constexpr int request_timeout_ms = 5000;
+
+inline bool write_all(const int fd, const std::string& data)
+{
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/* The lines up to the first empty one, or up to the end of the stream.
+** Fails if the whole request took longer than request_timeout_ms.
+*/
+inline bool read_request(const int fd, std::vector<std::string>& lines)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(request_timeout_ms);
+    std::string data;
+    char chunk[4096];
+    while (data.find("\n\n") == std::string::npos) {
+        const auto now = std::chrono::steady_clock::now();
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+        pollfd ready { .fd = fd, .events = POLLIN, .revents = 0 };
+        if (left <= 0 || ::poll(&ready, 1, static_cast<int>(left)) <= 0) {
+            return false;
+        }
+        const ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n < 0 || data.size() + static_cast<size_t>(n) > max_request_size) {
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        data.append(chunk, static_cast<size_t>(n));
+    }
+    lines.clear();
+    size_t start = 0;
+    for (size_t end; (end = data.find('\n', start)) != std::string::npos; start = end + 1) {
+        if (end == start) {
+            break;
+        }
+        lines.push_back(data.substr(start, end - start));
+    }
+    return !lines.empty();
+}
+
+inline bool socket_address(const std::string& path, sockaddr_un& address)
+{
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    path.copy(address.sun_path, path.size());
+    return true;
+}
+
+// serves requests until the process is killed
+inline int run_server(const std::string& socket_path)
+{
+    sockaddr_un address {};
+    if (!socket_address(socket_path, address)) {
+        return EXIT_FAILURE;
+    }
+    // a client that goes away before its answer must not take the server with it
+    std::signal(SIGPIPE, SIG_IGN);
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    // a socket left behind by a server that was killed is in the way
+    ::unlink(socket_path.c_str());
+    // nobody can connect before the listen, so the socket is private from the start
+    if (listener < 0 || ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || ::chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0 || ::listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "Could not listen on " << socket_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::deque<Compiler> compilers;
+    std::vector<std::string> request;
+    std::ostringstream errors;
+    while (true) {
+        const int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        // a client that doesn't take its answer is dropped like one that doesn't send its request
+        const timeval timeout { .tv_sec = request_timeout_ms / 1000, .tv_usec = request_timeout_ms % 1000 * 1000 };
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (read_request(client, request)) {
+            // the first line is the working directory of the client, the arguments are relative to it
+            errors.str({});
+            const int status = run_compiler(std::span(request).subspan(1), request[0], compilers, errors);
+            write_all(client, errors.str() + "status " + std::to_string(status) + "\n");
+        }
+        ::close(client);
+    }
+}
+
+// sends the arguments to the server and exits like the compiler would have
+inline int run_client(const std::string& socket_path, const std::span<const std::string> args)
+{
+    sockaddr_un address {};
+    if (!socket_address(socket_path, address)) {
+        return EXIT_FAILURE;
+    }
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Could not connect to " << socket_path << std::endl;
+        return EXIT_FAILURE;
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        std::cerr << "Could not get the working directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string request = std::string(cwd) + "\n";
+    for (const std::string& arg : args) {
+        request += arg + "\n";
+    }
+    request += "\n";
+    if (!write_all(fd, request)) {
+        std::cerr << "Could not send the request to " << socket_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string answer;
+    char chunk[4096];
+    for (ssize_t n; (n = ::read(fd, chunk, sizeof(chunk))) > 0;) {
+        answer.append(chunk, static_cast<size_t>(n));
+    }
+    ::close(fd);
+    const size_t last_line = answer.rfind("status ");
+    if (last_line == std::string::npos || (last_line != 0 && answer[last_line - 1] != '\n')) {
+        std::cerr << "No answer from " << socket_path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cerr << answer.substr(0, last_line);
+    return std::atoi(answer.c_str() + last_line + 7);
+}
+
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "asm_writer.hpp"
+#include "compile_error.hpp"
+#include "compiler_context.hpp"
+#include "elf_writer.hpp"
+#include "generation.hpp"
+#include "optimizer.hpp"
+#include "output_buffer.hpp"
+#include "parallel_generation.hpp"
+#include "parallel_parser.hpp"
+#include "peephole.hpp"
+#include "profile.hpp"
+#include "reg_generation.hpp"
+#include "source.hpp"
+#include "ssa_generation.hpp"
+#include "thread_pool.hpp"
+#include "time_report.hpp"
+#include "token_pipeline.hpp"
+#include "x86_encoder.hpp"
+
+/* The flags of a run, the same for every file it compiles */
+struct CompileOptions {
+    bool regalloc = false; // use the register allocating backend instead of the stack machine
+    bool use_ssa = false; // generate through the SSA form, regalloc then picks linear scan over stack slots
+    bool optimize = true; // -O0 turns the optimizer off
+    bool use_nasm = false; // write <output>.asm and build it with nasm and ld, for debugging
+    std::optional<uint64_t> unroll; // how many copies of the body an unrolled loop gets, 4 unless -O0
+    size_t threads = 1; // big files are parsed and generated in parts on this many threads, what -j leaves over
+    bool pipeline = false; // --pipeline lexes on a thread of its own while the file is parsed
+    std::string cache_dir; // --cache DIR keeps the code of the top-level statements there, for the next compile
+    std::optional<TimeReport::Format> time_report; // --time-report[=json] reports where the time of every file went
+    bool instrument = false; // --instrument makes the program count its branches and loops into <output>.profile
+    bool profile_use = false; // --profile-use lays the code out by the counts in <output>.profile
+};
+
+/* Compiles one file after another, keeping what the next file can use again:
+** the context of the stages, the assembly chunks and the machine code
+** buffer all hold on to their memory, so once the first few files have
+** grown them, compiling allocates little.
+*/
+class Compiler {
+public:
+    /* Compiles the file into the executable at output_path, returns the
+    ** error if that failed. The phases that ran are timed into the report
+    ** if there is one.
+    */
+    std::optional<std::string> compile(const std::string& input_path, const std::string& output_path,
+                                       const CompileOptions& options, TimeReport* report = nullptr)
+    {
+        m_report = report;
+        if (m_report != nullptr) {
+            m_report->start(input_path);
+        }
+        try {
+            compile_file(input_path, output_path, options);
+        }
+        catch (const CompileError& error) {
+            return error.what();
+        }
+        return {};
+    }
+
+private:
+    // changes whenever the generator would generate something else for the same statement
+    static constexpr uint64_t cache_version = 3;
+
+    static std::string shell_quote(const std::string& text)
+    {
+        std::string quoted = "'";
+        for (const char c : text) {
+            if (c == '\'') {
+                quoted += "'\\''";
+            }
+            else {
+                quoted += c;
+            }
+        }
+        return quoted + "'";
+    }
+
+    void end_phase(const std::string_view name)
+    {
+        if (m_report != nullptr) {
+            m_report->end_phase(name);
+        }
+    }
+
+    void compile_file(const std::string& input_path, const std::string& output_path, const CompileOptions& options)
+    {
+        // the mapping stays alive until codegen is done, the tokens point into it
+        if (!m_source.open(input_path.c_str())) {
+            throw CompileError("Could not read " + input_path);
+        }
+        end_phase("read");
+
+        // the parser pulls the tokens as it goes, they are never all in memory
+        Interner& interner = m_context.interner;
+        Parser& parser = m_context.parser;
+        FlatExprs pool = m_context.reset();
+        std::optional<NodeProg>& prog = m_context.prog;
+        if (options.threads > 1) {
+            prog = m_parallel_parser.parse(m_source.view(), interner, options.threads);
+        }
+        const bool chunked = prog.has_value();
+        // a small file, or one the chunks found an error in, is parsed in one go
+        if (!prog.has_value() && options.pipeline) {
+            PipelinedTokenizer tokenizer(m_source.view(), interner);
+            parser.reset(tokenizer, std::move(pool));
+            prog = parser.parse_prog();
+        }
+        else if (!prog.has_value()) {
+            Tokenizer tokenizer(m_source.view(), interner);
+            parser.reset(tokenizer, std::move(pool));
+            prog = parser.parse_prog();
+        }
+        if (!prog.has_value()) {
+            throw CompileError("Invalid program");
+        }
+        // the tokens are lexed while they are parsed, so the two are one phase
+        end_phase("parse");
+        if (m_report != nullptr) {
+            TimeReport::Counts& counts = m_report->counts();
+            counts.tokens = chunked ? m_parallel_parser.tokens_read() : parser.tokens_read();
+            counts.arena_bytes = chunked ? m_parallel_parser.arena_bytes() : parser.arena_stats().bytes_used;
+            m_report->count_nodes(prog.value());
+        }
+
+        if (options.optimize) {
+            m_context.optimizer.run(prog.value(), interner);
+            end_phase("optimize");
+        }
+
+        const bool has_fns = uses_functions(prog.value());
+        if (has_fns && (options.use_ssa || options.regalloc)) {
+            throw CompileError("Functions are only supported by the stack machine, not by --regalloc or --ssa");
+        }
+
+        // the optimizer doesn't add or drop statements, so the sites are the same with and without it
+        std::optional<ProfileSites> sites;
+        std::optional<Profile> profile;
+        std::string profile_path;
+        if (options.instrument || options.profile_use) {
+            // the program writes its profile wherever it is run from
+            std::error_code path_error;
+            profile_path = std::filesystem::absolute(output_path + ".profile", path_error).string();
+            sites.emplace(prog.value());
+        }
+        if (options.profile_use) {
+            profile.emplace(*sites, profile_path);
+        }
+        /* An instrumented or profiled program is generated whole, the cache and
+        ** the regions don't know the sites, and so is one with functions, a call
+        ** can be inlined or not depending on all of them
+        */
+        const bool cached = !options.cache_dir.empty() && !sites.has_value() && !has_fns;
+
+        // the instructions are either printed for nasm or encoded straight into machine code
+        m_assembly.clear();
+        m_encoder.clear();
+        AsmWriter writer(m_assembly);
+        InstrSink& backend = options.use_nasm ? static_cast<InstrSink&>(writer) : m_encoder;
+        std::optional<CountingSink> counter;
+        if (m_report != nullptr) {
+            counter.emplace(backend, m_report->counts());
+        }
+        InstrSink& sink = counter.has_value() ? static_cast<InstrSink&>(*counter) : backend;
+        // with a cache the instructions that reach the sink are recorded, for the next compile
+        RecordingSink recorder(sink);
+        InstrSink& out = cached ? recorder : sink;
+        // the peephole pass sits between the generator and the sink unless optimizations are off
+        Peephole peephole(out, m_context.peephole);
+        InstrSink& gen_sink = options.optimize ? static_cast<InstrSink&>(peephole) : out;
+        const uint64_t unroll = options.unroll.value_or(options.optimize ? 4 : 1);
+        if (options.use_ssa) {
+            SsaFunction fn = SsaBuilder(prog.value(), interner).build();
+            if (options.optimize) {
+                SsaPassManager().run(fn);
+            }
+            SsaGenerator generator(std::move(fn), gen_sink,
+                                   options.regalloc ? SsaGenerator::Strategy::linear_scan
+                                                    : SsaGenerator::Strategy::stack_slots);
+            generator.gen_prog();
+        }
+        else if (options.regalloc) {
+            RegGenerator generator(prog.value(), interner, gen_sink, unroll);
+            if (options.optimize) {
+                generator.hoist_loop_bounds();
+            }
+            generator.gen_prog();
+        }
+        // without a cache a big program is generated in regions on several threads, each region with its own peephole pass
+        else if (cached || sites.has_value() || has_fns
+                 || !m_parallel_generator.gen_prog(prog.value(), interner, out, unroll, options.optimize,
+                                                   options.threads)) {
+            Generator generator(prog.value(), interner, gen_sink, m_context.generator, unroll);
+            if (options.instrument) {
+                generator.instrument(*sites);
+            }
+            if (profile.has_value()) {
+                generator.use_profile(*profile);
+            }
+            if (options.optimize) {
+                generator.inline_functions();
+                generator.hoist_loop_bounds();
+            }
+            // only the stack machine is cached, the other backends allocate registers over the whole program
+            if (cached) {
+                Hasher salt(cache_version);
+                salt.add(unroll);
+                // the peephole pass runs before the recorder
+                salt.add(options.optimize);
+                m_cache.open(options.cache_dir, input_path, salt.value());
+                generator.use_cache(m_cache, recorder);
+            }
+            generator.gen_prog();
+            if (cached && !m_cache.save()) {
+                throw CompileError("Could not write the cache in " + options.cache_dir);
+            }
+        }
+        peephole.finish();
+        // the instructions are printed or encoded as they are generated, so that is part of the phase
+        end_phase("generate");
+
+        if (options.use_nasm) {
+            // the chunks go straight to the file, the text is never put together in one string
+            const std::string asm_path = output_path + ".asm";
+            const int fd = ::open(asm_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || !m_assembly.write_to(fd)) {
+                throw CompileError("Could not write " + asm_path);
+            }
+            ::close(fd);
+            end_phase("write");
+            const std::string object_path = output_path + ".o";
+            // system() gives -1 when no shell ran, and the status of the shell otherwise, 0 when the command succeeded
+            if (system(("nasm -felf64 " + shell_quote(asm_path) + " -o " + shell_quote(object_path)).c_str()) != 0) {
+                throw CompileError("Could not assemble " + asm_path);
+            }
+            end_phase("nasm");
+            if (system(("ld -o " + shell_quote(output_path) + " " + shell_quote(object_path)).c_str()) != 0) {
+                throw CompileError("Could not link " + object_path);
+            }
+            end_phase("ld");
+            return;
+        }
+
+        // the program starts with its first instruction
+        if (!m_encoder.finish()) {
+            throw CompileError(m_encoder.error());
+        }
+        const std::vector<uint8_t> data = options.instrument ? sites->data(profile_path) : std::vector<uint8_t>();
+        if (!write_elf(output_path.c_str(), m_encoder.code(), 0, data, ProfileSites::data_address)) {
+            throw CompileError("Could not write " + output_path);
+        }
+        end_phase("write");
+    }
+
+    SourceFile m_source;
+    CompilerContext m_context;
+    ParallelParser m_parallel_parser;
+    ParallelGenerator m_parallel_generator;
+    OutputBuffer m_assembly;
+    X86Encoder m_encoder;
+    CodegenCache m_cache;
+    TimeReport* m_report = nullptr; // the report of the file being compiled, if it was asked for
+};
+
+/* What to compile and how, from the command line or from a request to the
+** compile server. An argument @file names a manifest with one input per
+** line, blank lines and lines starting with # are skipped.
+*/
+struct Invocation {
+    CompileOptions options;
+    std::vector<std::string> inputs;
+    bool batch = false; // more than one input or a manifest, every output is named after its input
+    size_t jobs = 1; // -j N compiles N files at a time
+};
+
+inline void print_usage(std::ostream& errors)
+{
+    errors << "Incorrect usage. Correct usage is..." << std::endl;
+    errors << "hydro [--regalloc] [--ssa] [-O0] [--nasm] [--unroll N] [--pipeline] [--cache DIR] [--time-report[=json]] [--instrument] [--profile-use] [-j N] <input.hy | @manifest>..." << std::endl;
+    errors << "hydro --daemon <socket>" << std::endl;
+    errors << "hydro --connect <socket> <arguments as above>" << std::endl;
+}
+
+// a path relative to the directory of the run, which is the current one if cwd is empty
+inline std::string resolve_path(const std::string& cwd, const std::string& path)
+{
+    if (cwd.empty() || path.starts_with('/')) {
+        return path;
+    }
+    return cwd + "/" + path;
+}
+
+// returns nothing if the arguments are wrong, after saying why
+inline std::optional<Invocation> parse_args(const std::span<const std::string> args, const std::string& cwd,
+                                            std::ostream& errors)
+{
+    Invocation invocation;
+    CompileOptions& options = invocation.options;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg == "--regalloc") {
+            options.regalloc = true;
+        }
+        else if (arg == "--ssa") {
+            options.use_ssa = true;
+        }
+        else if (arg == "-O0") {
+            options.optimize = false;
+        }
+        else if (arg == "--nasm") {
+            options.use_nasm = true;
+        }
+        else if (arg == "--unroll" && i + 1 < args.size() && std::atoi(args[i + 1].c_str()) > 0) {
+            options.unroll = static_cast<uint64_t>(std::atoi(args[++i].c_str()));
+        }
+        else if (arg == "--pipeline") {
+            options.pipeline = true;
+        }
+        else if (arg == "--cache" && i + 1 < args.size()) {
+            options.cache_dir = resolve_path(cwd, args[++i]);
+        }
+        else if (arg == "--time-report") {
+            options.time_report = TimeReport::Format::text;
+        }
+        else if (arg == "--time-report=json") {
+            options.time_report = TimeReport::Format::json;
+        }
+        else if (arg == "--instrument") {
+            options.instrument = true;
+        }
+        else if (arg == "--profile-use") {
+            options.profile_use = true;
+        }
+        else if (arg == "-j" && i + 1 < args.size() && std::atoi(args[i + 1].c_str()) > 0) {
+            invocation.jobs = static_cast<size_t>(std::atoi(args[++i].c_str()));
+        }
+        else if (arg.starts_with("-j") && std::atoi(arg.c_str() + 2) > 0) {
+            invocation.jobs = static_cast<size_t>(std::atoi(arg.c_str() + 2));
+        }
+        else if (arg.starts_with('@')) {
+            std::ifstream manifest(resolve_path(cwd, arg.substr(1)));
+            if (!manifest) {
+                errors << "Could not read " << arg.substr(1) << std::endl;
+                return {};
+            }
+            for (std::string line; std::getline(manifest, line);) {
+                if (!line.empty() && !line.starts_with('#')) {
+                    invocation.inputs.push_back(line);
+                }
+            }
+            invocation.batch = true;
+        }
+        else if (!arg.starts_with('-')) {
+            invocation.inputs.push_back(arg);
+        }
+        else {
+            print_usage(errors);
+            return {};
+        }
+    }
+    if (invocation.inputs.empty()) {
+        print_usage(errors);
+        return {};
+    }
+    if ((options.instrument || options.profile_use) && (options.regalloc || options.use_ssa)) {
+        errors << "--instrument and --profile-use only work with the stack machine backend" << std::endl;
+        return {};
+    }
+    if (options.instrument && options.use_nasm) {
+        errors << "--instrument needs the built-in encoder, not --nasm" << std::endl;
+        return {};
+    }
+    invocation.batch = invocation.batch || invocation.inputs.size() > 1;
+    return invocation;
+}
+
+// foo/bar.hy is built into foo/bar, anything else gets .out appended
+inline std::string output_path_for(const std::string& input_path)
+{
+    if (input_path.ends_with(".hy")) {
+        return input_path.substr(0, input_path.size() - 3);
+    }
+    return input_path + ".out";
+}
+
+/* Compiles every input of the arguments, a single one into `out` like it
+** always was, and reports the errors with the name of the file in batch
+** mode. Returns the exit status of the run.
+*/
+inline int run_compiler(const std::span<const std::string> args, const std::string& cwd,
+                        std::deque<Compiler>& compilers, std::ostream& errors)
+{
+    const std::optional<Invocation> invocation = parse_args(args, cwd, errors);
+    if (!invocation.has_value()) {
+        return EXIT_FAILURE;
+    }
+    const std::vector<std::string>& inputs = invocation->inputs;
+    // every worker has a compiler of its own, they last as long as the caller keeps them
+    WorkStealingPool pool(std::min(invocation->jobs, inputs.size()));
+    while (compilers.size() < pool.threads()) {
+        compilers.emplace_back();
+    }
+    // the threads a worker doesn't need for other files go into parsing and generating its file
+    CompileOptions options = invocation->options;
+    options.threads = std::max<size_t>(1, invocation->jobs / pool.threads());
+    std::vector<std::optional<std::string>> results(inputs.size());
+    std::vector<TimeReport> reports(options.time_report.has_value() ? inputs.size() : 0);
+    pool.run(inputs.size(), [&](const size_t worker, const size_t index) {
+        const std::string input_path = resolve_path(cwd, inputs[index]);
+        const std::string output_path = invocation->batch ? output_path_for(input_path) : resolve_path(cwd, "out");
+        results[index] = compilers[worker].compile(input_path, output_path, options,
+                                                   reports.empty() ? nullptr : &reports[index]);
+    });
+
+    // the errors come out in the order of the inputs, however the files were spread over the workers
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (results[i].has_value()) {
+            if (invocation->batch) {
+                errors << inputs[i] << ": ";
+            }
+            errors << *results[i] << std::endl;
+            status = EXIT_FAILURE;
+        }
+        // a file that failed gets the phases up to the error
+        if (!reports.empty() && options.time_report == TimeReport::Format::json) {
+            reports[i].write_json(errors);
+        }
+        else if (!reports.empty()) {
+            reports[i].write_text(errors);
+        }
+    }
+    return status;
+}
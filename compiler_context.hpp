@@ -0,0 +1,42 @@
+#pragma once
+
+#include <optional>
+
+#include "flat_ast.hpp"
+#include "generation.hpp"
+#include "interner.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "peephole.hpp"
+
+/* What a compile leaves behind for the next one: the interner's table, the
+** parser with the arena the nodes of the program are in, the program, and
+** the buffers of the optimizer, the generator and the peephole pass. The
+** expressions move between two pools, the parser fills one and the
+** optimizer rebuilds them into the other. Every stage gets the program by
+** reference and everything keeps its memory, so once a few files have
+** grown it, compiling another one on a single thread with the stack
+** machine allocates nothing.
+*/
+struct CompilerContext {
+    Interner interner;
+    Parser parser;
+    std::optional<NodeProg> prog; // the program being compiled, until the next reset
+    Optimizer optimizer;
+    Generator::Buffers generator;
+    Peephole::Buffers peephole;
+
+    /* Forgets the names and the program, whose nodes go when the parser is
+    ** reset. Returns the pool of its expressions, for the parser.
+    */
+    FlatExprs reset()
+    {
+        interner.clear();
+        FlatExprs pool;
+        if (prog.has_value()) {
+            pool = std::move(prog->exprs);
+            prog.reset();
+        }
+        return pool;
+    }
+};
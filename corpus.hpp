@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Generated .hy programs for the benchmarks, each one stressing a part of
+** the compiler and growing with its scale. The programs are valid, divide
+** only by constants other than 0 and end in an exit, so their binaries can
+** be run too. The same scale always gives the same program.
+*/
+namespace corpus {
+
+struct Program {
+    std::string name;
+    std::string src;
+};
+
+// a linear congruential generator, enough to vary the programs and the same everywhere
+class Random {
+public:
+    explicit Random(const uint64_t seed)
+        : m_state(seed)
+    {
+    }
+
+    // below bound, which must not be 0
+    uint64_t next(const uint64_t bound)
+    {
+        m_state = m_state * 6364136223846793005 + 1442695040888963407;
+        return (m_state >> 33) % bound;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+inline std::string var(const size_t index)
+{
+    return "v" + std::to_string(index);
+}
+
+// lets whose expressions nest `depth` parentheses deep, to the left and to the right
+inline std::string deep_exprs(const size_t scale, const size_t depth = 32)
+{
+    static constexpr const char* ops[] = { " + ", " - ", " * ", " / " };
+    Random random(1);
+    // v0 is assigned to, so the optimizer can't fold the lets
+    std::string src = "let v0 = 1;\nv0 = v0 + 2;\n";
+    for (size_t i = 1; i <= scale; i++) {
+        std::string expr = var(i - 1);
+        for (size_t d = 0; d < depth; d++) {
+            const std::string lit = std::to_string(random.next(9) + 1);
+            const char* op = ops[random.next(4)];
+            if (d % 2 == 0) {
+                expr = "(" + expr + op + lit + ")";
+            }
+            else if (op[1] == '/') {
+                // the divisor must stay a constant
+                expr = "(" + lit + " + " + expr + ")";
+            }
+            else {
+                expr = "(" + lit + op + expr + ")";
+            }
+        }
+        src += "let " + var(i) + " = " + expr + ";\n";
+    }
+    return src + "exit(" + var(scale) + ");\n";
+}
+
+// many lets, each using a few of the ones before it
+inline std::string many_lets(const size_t scale)
+{
+    Random random(2);
+    std::string src = "let v0 = 7;\nv0 = v0 * 3;\n";
+    for (size_t i = 1; i <= scale; i++) {
+        src += "let " + var(i) + " = " + var(random.next(i)) + " * " + std::to_string(random.next(9) + 1) + " + "
+            + var(random.next(i)) + " - " + std::to_string(i) + ";\n";
+    }
+    return src + "exit(" + var(scale) + ");\n";
+}
+
+// scopes `depth` deep, every level declaring a variable and assigning to the one outside
+inline std::string nested_scopes(const size_t scale, const size_t depth = 16)
+{
+    std::string src = "let s = 0;\n";
+    for (size_t i = 0; i < scale; i++) {
+        std::string inner = "s = s + " + std::to_string(i % 7) + ";\n";
+        for (size_t d = depth; d-- > 0;) {
+            const std::string name = "d" + std::to_string(d);
+            const std::string outer = d == 0 ? "s" : "d" + std::to_string(d - 1);
+            inner = "{\nlet " + name + " = " + outer + " + 1;\n" + inner + outer + " = " + name + " * 2;\n}\n";
+        }
+        src += inner;
+    }
+    return src + "exit(s);\n";
+}
+
+/* If statements with `length` elifs. The branch of x is the first k with
+** x / k not 0, counting down, so every value of x takes a branch of its own.
+*/
+inline std::string elif_chains(const size_t scale, const size_t length = 32)
+{
+    std::string src = "let x = 0;\nlet s = 0;\n";
+    for (size_t i = 0; i < scale; i++) {
+        src += "x = " + std::to_string(i % (length + 2)) + ";\n";
+        src += "if (x / " + std::to_string(length + 1) + ") {\n";
+        for (size_t k = length; k > 0; k--) {
+            src += "  s = s + " + std::to_string(k) + ";\n} elif (x / " + std::to_string(k) + ") {\n";
+        }
+        src += "  s = s * 3;\n} else {\n  s = s - 1;\n}\n";
+    }
+    return src + "exit(s);\n";
+}
+
+// loops `depth` deep with scale iterations each, the benchmark of the generated code
+inline std::string nested_loops(const size_t scale, const size_t depth = 3)
+{
+    std::string src = "let s = 0;\n";
+    std::string body = "s = s + i0";
+    for (size_t d = 1; d < depth; d++) {
+        body += " * " + std::string("i") + std::to_string(d) + " / 3";
+    }
+    body += ";\n";
+    for (size_t d = depth; d-- > 0;) {
+        body = "for i" + std::to_string(d) + " = 1 : 1 : " + std::to_string(scale) + " {\n" + body + "}\n";
+    }
+    return src + body + "exit(s);\n";
+}
+
+/* Small functions called from a loop, every other one calling a recursive
+** one, so half of them are inlined and the other half are called with a frame
+*/
+inline std::string calls(const size_t scale, const size_t iterations = 100)
+{
+    Random random(3);
+    std::string src = "fn fib(n) {\n  if (n - 1) {\n    if (n) {\n      return fib(n - 1) + fib(n - 2);\n    }\n"
+                      "    return 0;\n  }\n  return 1;\n}\n";
+    std::string body;
+    for (size_t i = 0; i < scale; i++) {
+        const std::string name = "f" + std::to_string(i);
+        const std::string tail = i % 2 == 0 ? "t + 1" : "t + fib(" + std::to_string(random.next(8)) + ")";
+        src += "fn " + name + "(a, b) {\n  let t = a * " + std::to_string(random.next(9) + 1) + " + b;\n  if (t - "
+            + std::to_string(random.next(50)) + ") {\n    return t / " + std::to_string(random.next(9) + 1)
+            + ";\n  }\n  return " + tail + ";\n}\n";
+        body += "  s = s + " + name + "(i, s / 1000);\n";
+    }
+    return src + "let s = 0;\nfor i = 1 : 1 : " + std::to_string(iterations) + " {\n" + body + "}\nexit(s);\n";
+}
+
+// the program without its exit at the end
+inline std::string body(const std::string& src)
+{
+    return src.substr(0, src.rfind("exit("));
+}
+
+// all of the above in one program, each part in a scope of its own so their names don't clash
+inline std::string mixed(const size_t scale)
+{
+    return "{\n" + body(deep_exprs(scale / 4)) + "}\n{\n" + body(many_lets(scale)) + "}\n{\n"
+        + body(nested_scopes(scale / 16)) + "}\n{\n" + body(elif_chains(scale / 16)) + "}\n" + nested_loops(16);
+}
+
+// every kind of program, their size or running time grows with the scale
+inline std::vector<Program> all(const size_t scale)
+{
+    return {
+        { "deep_exprs", deep_exprs(scale * 4) },
+        { "many_lets", many_lets(scale * 40) },
+        { "nested_scopes", nested_scopes(scale) },
+        { "elif_chains", elif_chains(scale) },
+        { "nested_loops", nested_loops(scale) },
+        { "mixed", mixed(scale * 40) },
+        { "calls", calls(scale) },
+    };
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+inline bool write_elf_part(const int fd, const uint8_t* bytes, const size_t size)
+{
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = ::write(fd, bytes + written, size - written);
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/* Writes a static x86-64 ELF executable: the headers followed by the code,
+** all in one read+execute segment loaded at a fixed address. This is all
+** the kernel needs to run the program, there are no sections or symbols.
+** Data, if there is any, gets a read+write segment of its own at
+** data_address, which has to be page aligned.
+*/
+inline bool write_elf(const char* path, const std::vector<uint8_t>& code, const size_t entry_offset,
+                      const std::vector<uint8_t>& data = {}, const uint64_t data_address = 0)
+{
+    constexpr uint64_t base_address = 0x400000;
+    constexpr size_t page_size = 0x1000;
+    const size_t segment_count = data.empty() ? 1 : 2;
+    const size_t headers_size = sizeof(Elf64_Ehdr) + segment_count * sizeof(Elf64_Phdr);
+
+    Elf64_Ehdr header {};
+    std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = base_address + headers_size + entry_offset;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = segment_count;
+
+    Elf64_Phdr segment {};
+    segment.p_type = PT_LOAD;
+    segment.p_flags = PF_R | PF_X;
+    segment.p_offset = 0;
+    segment.p_vaddr = base_address;
+    segment.p_paddr = base_address;
+    segment.p_filesz = headers_size + code.size();
+    segment.p_memsz = segment.p_filesz;
+    segment.p_align = page_size;
+
+    // the data starts on the page after the code, the file offset and the address of a segment agree on the page
+    const size_t data_offset = (headers_size + code.size() + page_size - 1) / page_size * page_size;
+    Elf64_Phdr data_segment {};
+    data_segment.p_type = PT_LOAD;
+    data_segment.p_flags = PF_R | PF_W;
+    data_segment.p_offset = data_offset;
+    data_segment.p_vaddr = data_address;
+    data_segment.p_paddr = data_address;
+    data_segment.p_filesz = data.size();
+    data_segment.p_memsz = data.size();
+    data_segment.p_align = page_size;
+
+    uint8_t headers[sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr)];
+    std::memcpy(headers, &header, sizeof(header));
+    std::memcpy(headers + sizeof(header), &segment, sizeof(segment));
+    std::memcpy(headers + sizeof(header) + sizeof(segment), &data_segment, sizeof(data_segment));
+
+    // the parts go to the file as they are, the code isn't copied into an image first
+    const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        return false;
+    }
+    static constexpr uint8_t zeros[page_size] {};
+    bool ok = write_elf_part(fd, headers, headers_size) && write_elf_part(fd, code.data(), code.size());
+    if (!data.empty()) {
+        ok = ok && write_elf_part(fd, zeros, data_offset - headers_size - code.size())
+            && write_elf_part(fd, data.data(), data.size());
+    }
+    return ::close(fd) == 0 && ok;
+}
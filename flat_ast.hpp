@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "interner.hpp"
+
+/* The index of an expression node in FlatExprs */
+using ExprId = uint32_t;
+
+enum class ExprKind : uint8_t {
+    int_lit,
+    ident,
+    add,
+    multi,
+    sub,
+    div,
+    shl, // only created by the optimizer, the right operand is always an int_lit
+    shr, // likewise
+    call // lhs is the Symbol of the function and rhs the number of arguments, which come right before it
+};
+
+inline bool is_bin_expr(const ExprKind kind)
+{
+    return kind >= ExprKind::add && kind <= ExprKind::shr;
+}
+
+/* Expressions are stored flat, one entry per node spread over parallel
+** arrays and referred to by 32-bit ids, instead of as a graph of variants.
+** Operands are always added before the node using them, so the nodes of an
+** expression form a contiguous post-order range [firsts[root], root]. A pass
+** can visit an expression with a plain loop over that range, and there are
+** no parenthesis nodes since the order already encodes the grouping. The
+** arguments of a call are the expressions right before it, one after the
+** other, so the loop has their values when it gets to the call.
+*/
+struct FlatExprs {
+    std::vector<ExprKind> kinds;
+    std::vector<ExprId> firsts; // the first node of the expression ending at each node
+    std::vector<uint32_t> lhs; // the left operand, the Symbol of an identifier, the low half of a literal
+    std::vector<uint32_t> rhs; // the right operand, the high half of a literal
+
+    ExprId add_int_lit(const uint64_t value)
+    {
+        return add(ExprKind::int_lit, static_cast<uint32_t>(value), static_cast<uint32_t>(value >> 32), next_id());
+    }
+
+    ExprId add_ident(const Symbol name)
+    {
+        return add(ExprKind::ident, name, 0, next_id());
+    }
+
+    // both operands must already be in the pool, the left one first
+    ExprId add_bin(const ExprKind kind, const ExprId lhs_id, const ExprId rhs_id)
+    {
+        return add(kind, lhs_id, rhs_id, firsts[lhs_id]);
+    }
+
+    // the arguments must be the last expressions added, the first of them starting at first
+    ExprId add_call(const Symbol name, const ExprId first, const uint32_t num_args)
+    {
+        return add(ExprKind::call, name, num_args, num_args == 0 ? next_id() : first);
+    }
+
+    // the root of every argument of the call, in order
+    void call_args(const ExprId call, std::vector<ExprId>& args) const
+    {
+        args.resize(rhs[call]);
+        ExprId end = call;
+        for (size_t i = args.size(); i-- > 0;) {
+            args[i] = end - 1;
+            end = firsts[end - 1];
+        }
+    }
+
+    [[nodiscard]] uint64_t int_value(const ExprId id) const
+    {
+        return static_cast<uint64_t>(rhs[id]) << 32 | lhs[id];
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return kinds.size();
+    }
+
+    void clear()
+    {
+        kinds.clear();
+        firsts.clear();
+        lhs.clear();
+        rhs.clear();
+    }
+
+    void reserve(const size_t num_nodes)
+    {
+        kinds.reserve(num_nodes);
+        firsts.reserve(num_nodes);
+        lhs.reserve(num_nodes);
+        rhs.reserve(num_nodes);
+    }
+
+private:
+    [[nodiscard]] ExprId next_id() const
+    {
+        return static_cast<ExprId>(kinds.size());
+    }
+
+    ExprId add(const ExprKind kind, const uint32_t a, const uint32_t b, const ExprId first)
+    {
+        kinds.push_back(kind);
+        firsts.push_back(first);
+        lhs.push_back(a);
+        rhs.push_back(b);
+        return static_cast<ExprId>(kinds.size() - 1);
+    }
+};
@@ -2,118 +2,194 @@
 
 #include <algorithm>
 #include <cassert>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
+#include <fcntl.h>
+
+#include "codegen_cache.hpp"
+#include "compile_error.hpp"
+#include "instr.hpp"
+#include "loops.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "registers.hpp"
+#include "strength_reduction.hpp"
+#include "symbol_table.hpp"
 
 class Generator {
 public:
-    explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
-    {
-    }
-
-    void gen_term(const NodeTerm* term)
-    {
-        struct TermVisitor {
-            Generator& gen;
+    struct Var {
+        size_t stack_loc;
+        bool in_reg = false; // only loop variables and hoisted loop bounds get a register
+        Reg reg = Reg::rax;
+    };
 
-            void operator()(const NodeTermIntLit* term_int_lit) const
-            {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
+    // what the generator knows about a function before it generates a call of it
+    struct FnInfo {
+        LabelId label;
+        size_t size = 0; // the statements and expression nodes of its body
+        bool calls = false;
+        bool leaf = false; // every call in its body is inlined, so it needs no frame
+    };
 
-            void operator()(const NodeTermIdent* term_ident) const
-            {
-                const auto it = std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
-                gen.push(offset.str());
-            }
+    /* Everything a generator allocates, kept by its owner for the next
+    ** generator. Once the buffers have grown to the programs it sees,
+    ** generating one allocates nothing.
+    */
+    struct Buffers {
+        ScopedSymbolTable<Var> vars;
+        ScopedSymbolTable<Var> fn_vars;
+        ScopedSymbolTable<Var> inline_vars;
+        LoopAnalysis loops;
+        std::vector<Instr> cold;
+        std::deque<std::vector<Instr>> cold_blocks; // one per depth of the blocks going out of line
+        std::vector<Instr> recorded;
+        std::vector<uint32_t> key_ids;
+        std::vector<Symbol> key_names;
+        std::vector<uint32_t> fn_index;
+        std::vector<FnInfo> fns;
+    };
 
-            void operator()(const NodeTermParen* term_paren) const
-            {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor({ .gen = *this });
-        std::visit(visitor, term->var);
+    // loops with a known trip count are unrolled `unroll` times
+    // the program must outlive the generator, several generators can work on parts of it at once, each with its buffers
+    Generator(const NodeProg& prog, const Interner& interner, InstrSink& sink, Buffers& buffers,
+              const uint64_t unroll = 1)
+        : m_prog(prog)
+        , m_interner(interner)
+        , m_sink(&sink)
+        , m_vars(buffers.vars)
+        , m_loops(buffers.loops)
+        , m_unroll(unroll)
+        , m_cold(buffers.cold)
+        , m_cold_blocks(buffers.cold_blocks)
+        , m_recorded(buffers.recorded)
+        , m_fn_index(buffers.fn_index)
+        , m_fns(buffers.fns)
+        , m_fn_vars(buffers.fn_vars)
+        , m_inline_vars(buffers.inline_vars)
+        , m_key_ids(buffers.key_ids)
+        , m_key_names(buffers.key_names)
+    {
+        // a generator that stopped at an error left its tables as they were
+        m_vars.reset(interner.size());
+        m_fn_vars.reset(0);
+        m_inline_vars.reset(0);
+        m_loops.reset(prog.exprs);
+        m_cold.clear();
+        m_fn_index.clear();
+        m_key_names.clear();
     }
 
-    void gen_bin_expr(const NodeBinExpr* bin_expr)
+    /* Top-level statements that were generated before are copied out of the
+    ** cache. The recorder is where the sink sends the instructions, the
+    ** sink is flushed after every top-level statement and what comes out
+    ** of it is cached.
+    */
+    void use_cache(CodegenCache& cache, RecordingSink& recorder)
     {
-        struct BinExprVisitor {
-            Generator& gen;
-
-            void operator()(const NodeBinExprSub* sub) const
-            {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprAdd* add) const
-            {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
+        m_cache = &cache;
+        m_recorder = &recorder;
+        m_key_ids.assign(m_interner.size(), no_key_id);
+    }
 
-            void operator()(const NodeBinExprMulti* multi) const
-            {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
+    /* Counts the loop iterations and branches of the program into the
+    ** counters of the sites, which the program writes to its profile when
+    ** it exits. The data segment of the executable has to be the one of the
+    ** sites.
+    */
+    void instrument(const ProfileSites& sites)
+    {
+        m_instrumented = &sites;
+    }
 
-            void operator()(const NodeBinExprDiv* div) const
-            {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-        };
+    /* The counts of a run lay the code out: a branch that was seldom taken
+    ** goes out of line, after the end of the program, and a loop whose body
+    ** seldom ran isn't unrolled
+    */
+    void use_profile(const Profile& profile)
+    {
+        m_profile = &profile;
+    }
 
-        BinExprVisitor visitor { .gen = *this };
-        std::visit(visitor, bin_expr->var);
+    /* A call of a small function that calls nothing itself is replaced by
+    ** the body of the function, the others stay calls
+    */
+    void inline_functions()
+    {
+        m_inline = true;
     }
 
-    void gen_expr(const NodeExpr* expr)
+    /* The end and the step of a loop that can't change them are evaluated
+    ** once, before the loop, instead of every time Hy evaluates them
+    */
+    void hoist_loop_bounds()
     {
-        struct ExprVisitor {
-            Generator& gen;
+        m_hoist = true;
+    }
 
-            void operator()(const NodeTerm* term) const
-            {
-                gen.gen_term(term);
+    /* The nodes of an expression are in post-order, so evaluating them one after
+    ** another on the stack leaves the value of the expression on top
+    */
+    void gen_expr(const ExprId expr)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        for (ExprId id = exprs.firsts[expr]; id <= expr; id++) {
+            switch (exprs.kinds[id]) {
+            case ExprKind::int_lit:
+                // a constant factor or divisor is part of the instructions of its parent instead
+                if (id < expr && is_constant_operand(id + 1)) {
+                    break;
+                }
+                emit(Op::mov, op_reg(Reg::rax), op_imm(exprs.int_value(id)));
+                push(op_reg(Reg::rax));
+                break;
+            case ExprKind::ident: {
+                const Var* var = m_vars.find(exprs.lhs[id]);
+                if (var == nullptr) {
+                    throw CompileError::undeclared(m_interner.name(exprs.lhs[id]));
+                }
+                push(var_operand(*var));
+                break;
             }
-
-            void operator()(const NodeBinExpr* bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
+            case ExprKind::add:
+                gen_bin_expr(Op::add);
+                break;
+            case ExprKind::multi:
+                if (is_constant_operand(id)) {
+                    pop(Reg::rax);
+                    strength::gen_mul(*m_sink, Reg::rax, Reg::rax, exprs.int_value(exprs.rhs[id]));
+                    push(op_reg(Reg::rax));
+                    break;
+                }
+                gen_bin_expr(Op::imul);
+                break;
+            case ExprKind::sub:
+                gen_bin_expr(Op::sub);
+                break;
+            case ExprKind::div:
+                if (is_constant_operand(id)) {
+                    pop(m_tmp);
+                    strength::gen_div(*m_sink, Reg::rax, m_tmp, exprs.int_value(exprs.rhs[id]));
+                    push(op_reg(Reg::rax));
+                    break;
+                }
+                gen_bin_expr(Op::div);
+                break;
+            case ExprKind::shl:
+                gen_shift(Op::shl);
+                break;
+            case ExprKind::shr:
+                gen_shift(Op::shr);
+                break;
+            case ExprKind::call:
+                gen_call(id);
+                break;
             }
-        };
-
-        ExprVisitor visitor { .gen = *this };
-        std::visit(visitor, expr->var);
+        }
     }
 
     void gen_scope(const NodeScope* scope)
@@ -125,36 +201,44 @@ public:
         end_scope();
     }
 
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label)
+    // reached is how often the profile run got to the predicate
+    void gen_if_pred(const NodeIfPred* pred, const LabelId end_label, const uint64_t reached = 0)
     {
         struct PredVisitor {
             Generator& gen;
-            const std::string& end_label;
+            const LabelId end_label;
+            const uint64_t reached;
 
             void operator()(const NodeIfPredElif* elif) const
             {
-                gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
+                gen.comment("elif");
+                const uint64_t taken = gen.profile_count(elif->scope);
+                if (gen.is_cold(taken, reached)) {
+                    gen.gen_cold_branch(elif->expr, elif->scope, end_label);
+                }
+                else {
+                    const LabelId label = gen.create_label();
+                    gen.gen_branch(elif->expr, Op::jz, label);
+                    gen.count_site(elif->scope);
+                    gen.gen_scope(elif->scope);
+                    gen.emit(Op::jmp, op_label(end_label));
+                    // a failed last elif falls through to the end of the chain from here
+                    gen.label(label);
+                }
                 if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
+                    gen.gen_if_pred(elif->pred.value(), end_label, reached - std::min(reached, taken));
                 }
             }
 
             void operator()(const NodeIfPredElse* else_) const
             {
-                gen.m_output << "    ;; else\n";
+                gen.comment("else");
+                gen.count_site(else_->scope);
                 gen.gen_scope(else_->scope);
             }
         };
 
-        PredVisitor visitor { .gen = *this, .end_label = end_label };
+        PredVisitor visitor { .gen = *this, .end_label = end_label, .reached = reached };
         std::visit(visitor, pred->var);
     }
 
@@ -165,170 +249,1047 @@ public:
 
             void operator()(const NodeStmtExit* stmt_exit) const
             {
-                gen.m_output << "    ;; exit\n";
+                gen.comment("exit");
                 gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-                gen.m_output << "    ;; /exit\n";
+                gen.emit(Op::mov, op_reg(Reg::rax), op_imm(60));
+                gen.pop(Reg::rdi);
+                gen.gen_write_profile();
+                gen.emit(Op::syscall);
+                gen.comment("/exit");
             }
 
             void operator()(const NodeStmtLet* stmt_let) const
             {
-                gen.m_output << "    ;; let\n";
-                if (std::ranges::find_if(
-                        std::as_const(gen.m_vars),
-                        [&](const Var& var) { return var.name == stmt_let->ident.value.value(); })
-                    != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                gen.comment("let");
+                if (!gen.m_vars.declare(stmt_let->ident, { .stack_loc = gen.m_stack_size })) {
+                    throw CompileError::redeclared(gen.m_interner.name(stmt_let->ident));
                 }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
                 gen.gen_expr(stmt_let->expr);
-                gen.m_output << "    ;; /let\n";
+                gen.comment("/let");
             }
 
             void operator()(const NodeStmtAssign* stmt_assign) const
             {
-                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var& var) {
-                    return var.name == stmt_assign->ident.value.value();
-                });
-                if (it == gen.m_vars.end()) {
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                const Var* var = gen.m_vars.find(stmt_assign->ident);
+                if (var == nullptr) {
+                    throw CompileError::undeclared(gen.m_interner.name(stmt_assign->ident));
                 }
                 gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
+                gen.pop(Reg::rax);
+                gen.emit(Op::mov, gen.var_operand(*var), op_reg(Reg::rax));
             }
 
             void operator()(const NodeScope* scope) const
             {
-                gen.m_output << "    ;; scope\n";
+                gen.comment("scope");
                 gen.gen_scope(scope);
-                gen.m_output << "    ;; /scope\n";
+                gen.comment("/scope");
             }
 
             void operator()(const NodeStmtIf* stmt_if) const
             {
-                gen.m_output << "    ;; if\n";
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
+                gen.comment("if");
+                gen.count_site(stmt_if);
+                const uint64_t reached = gen.profile_count(stmt_if);
+                const uint64_t taken = gen.profile_count(stmt_if->scope);
+                if (gen.is_cold(taken, reached)) {
+                    const LabelId end_label = gen.create_label();
+                    gen.gen_cold_branch(stmt_if->expr, stmt_if->scope, end_label);
+                    if (stmt_if->pred.has_value()) {
+                        gen.gen_if_pred(stmt_if->pred.value(), end_label, reached - std::min(reached, taken));
+                    }
+                    gen.label(end_label);
+                    gen.comment("/if");
+                    return;
+                }
+                const LabelId label = gen.create_label();
+                gen.gen_branch(stmt_if->expr, Op::jz, label);
+                gen.count_site(stmt_if->scope);
                 gen.gen_scope(stmt_if->scope);
                 if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+                    const LabelId end_label = gen.create_label();
+                    gen.emit(Op::jmp, op_label(end_label));
+                    gen.label(label);
+                    gen.gen_if_pred(stmt_if->pred.value(), end_label, reached - std::min(reached, taken));
+                    gen.label(end_label);
                 }
                 else {
-                    gen.m_output << label << ":\n";
+                    gen.label(label);
                 }
-                gen.m_output << "    ;; /if\n";
+                gen.comment("/if");
             }
 
             void operator()(const NodeStmtFor* stmt_for) const
             {
-                gen.m_output << "    ;; for loop\n";
+                gen.comment("for loop");
+                gen.gen_for(stmt_for);
+                gen.comment("/for loop");
+            }
+
+            void operator()(const NodeStmtReturn* stmt_return) const
+            {
+                gen.comment("return");
+                gen.gen_expr(stmt_return->expr);
+                gen.pop(Reg::rax);
+                gen.gen_return();
+                gen.comment("/return");
+            }
+        };
+
+        StmtVisitor visitor { .gen = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    /* Sends the instructions of the whole program to the sink, the functions
+    ** after its end and the blocks that went out of line after them
+    */
+    void gen_prog()
+    {
+        index_fns();
+        gen_top_level(m_prog.stmts);
+        gen_exit();
+        for (size_t index = 0; index < m_prog.fns.size(); index++) {
+            gen_fn(index);
+        }
+        for (const Instr& instr : m_cold) {
+            m_sink->emit(instr);
+        }
+    }
+
+    // top-level statements, the ones before them were generated or skipped already
+    void gen_top_level(const std::span<NodeStmt* const> stmts)
+    {
+        for (const NodeStmt* stmt : stmts) {
+            if (m_cache != nullptr) {
+                gen_cached_stmt(stmt);
+            }
+            else {
+                gen_stmt(stmt);
+            }
+        }
+    }
+
+    /* Takes on what a top-level statement leaves behind for the ones after it,
+    ** without generating it: a let leaves its value on the stack. The
+    ** statement is checked when it is generated, a let that is already
+    ** visible is simply not declared again here.
+    */
+    void skip_top_level(const NodeStmt* stmt)
+    {
+        if (const auto* stmt_let = std::get_if<NodeStmtLet*>(&stmt->var)) {
+            m_vars.declare((*stmt_let)->ident, { .stack_loc = m_stack_size });
+            m_stack_size++;
+        }
+    }
+
+    // the end of the program, if it didn't exit before
+    void gen_exit()
+    {
+        emit(Op::mov, op_reg(Reg::rax), op_imm(60));
+        emit(Op::mov, op_reg(Reg::rdi), op_imm(0));
+        gen_write_profile();
+        emit(Op::syscall);
+    }
+
+    // how many labels were created, they are numbered from 0
+    [[nodiscard]] LabelId label_count() const
+    {
+        return m_label_count;
+    }
 
-                gen.gen_expr(stmt_for->start);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << gen.m_stack_size * 8 << "], rax\n"; // Stocare pe stivă
+private:
+    // an end or step of a loop: an immediate, or a value evaluated once and kept in a register or on the stack
+    struct LoopValue {
+        bool is_imm;
+        uint64_t imm;
+        Var home;
+    };
 
-                const std::string loop_label = gen.create_label();
-                const std::string end_label = gen.create_label();
+    // the registers the stack machine never uses for expressions
+    static constexpr RegSet loop_regs { Reg::rsi, Reg::r8,  Reg::r9,  Reg::r10, Reg::r11,
+                                        Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+    /* A function only takes loop registers a call may clobber, and r11 as its
+    ** scratch register instead of rbx, so rbx and r12 to r15 are the same
+    ** after a call, the way the SysV ABI has it. The caller pushes the
+    ** others of its loop registers that are in use.
+    */
+    static constexpr RegSet fn_loop_regs { Reg::rsi, Reg::r8, Reg::r9, Reg::r10 };
+    static constexpr Reg caller_saved_regs[] = { Reg::rsi, Reg::r8, Reg::r9, Reg::r10, Reg::r11 };
+    // the registers of the arguments, in order
+    static constexpr Reg arg_regs[] = { Reg::rdi, Reg::rsi, Reg::rdx, Reg::rcx, Reg::r8, Reg::r9 };
+    // a function with a body at most this big is inlined, if it calls nothing
+    static constexpr size_t max_inline_size = 32;
+    static constexpr uint32_t no_fn = UINT32_MAX;
 
-                gen.m_output << loop_label << ":\n";
+    // numbers the functions by name and looks at their bodies, before any call is generated
+    void index_fns()
+    {
+        if (m_prog.fns.empty()) {
+            return;
+        }
+        const FlatExprs& exprs = m_prog.exprs;
+        m_fn_index.assign(m_interner.size(), no_fn);
+        m_fns.clear();
+        for (size_t index = 0; index < m_prog.fns.size(); index++) {
+            const NodeFn* fn = m_prog.fns[index];
+            if (m_fn_index[fn->name] != no_fn) {
+                throw CompileError::redeclared(m_interner.name(fn->name));
+            }
+            if (fn->params.size() > std::size(arg_regs)) {
+                throw CompileError("Too many parameters: " + std::string(m_interner.name(fn->name)));
+            }
+            m_fn_index[fn->name] = static_cast<uint32_t>(index);
+            FnInfo info { .label = create_label() };
+            info.size = for_each_expr(fn->body, [&](const ExprId expr) {
+                for (ExprId id = exprs.firsts[expr]; id <= expr; id++) {
+                    info.size++;
+                    info.calls = info.calls || exprs.kinds[id] == ExprKind::call;
+                }
+            });
+            m_fns.push_back(info);
+        }
+        // which functions are inlined is only known once every one was looked at
+        for (size_t index = 0; index < m_prog.fns.size(); index++) {
+            bool leaf = true;
+            for_each_expr(m_prog.fns[index]->body, [&](const ExprId expr) {
+                for (ExprId id = exprs.firsts[expr]; id <= expr; id++) {
+                    if (exprs.kinds[id] == ExprKind::call) {
+                        const std::optional<uint32_t> callee = find_fn(id);
+                        leaf = leaf && callee.has_value() && is_inlined(*callee);
+                    }
+                }
+            });
+            m_fns[index].leaf = leaf;
+        }
+    }
 
-                gen.gen_expr(stmt_for->end);
-                gen.pop("rax");
-                gen.m_output << "    mov rax, [rsp + " << gen.m_stack_size * 8 << "]\n";
-                gen.m_output << "    cmp rax, rbx\n";
-                gen.m_output << "    jg " << end_label << "\n";
+    // the function the call is of, if there is one with that many parameters
+    [[nodiscard]] std::optional<uint32_t> find_fn(const ExprId call) const
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const Symbol name = exprs.lhs[call];
+        if (name >= m_fn_index.size() || m_fn_index[name] == no_fn
+            || m_prog.fns[m_fn_index[name]]->params.size() != exprs.rhs[call]) {
+            return {};
+        }
+        return m_fn_index[name];
+    }
 
-                gen.gen_scope(stmt_for->body);
+    [[nodiscard]] bool is_inlined(const uint32_t index) const
+    {
+        return m_inline && !m_fns[index].calls && m_fns[index].size <= max_inline_size;
+    }
 
-                gen.gen_expr(stmt_for->step);
-                gen.pop("rax");
-                gen.m_output << "    mov rax, [rsp + " << gen.m_stack_size * 8 << "]\n";
-                gen.m_output << "    add rax, rbx\n";
-                gen.m_output << "    mov [rsp + " << gen.m_stack_size * 8 << "], rax\n";
+    // calls f with the root of every expression in the scope, returns the number of statements
+    template <typename F>
+    size_t for_each_expr(const NodeScope* scope, F&& f) const // NOLINT(*-no-recursion)
+    {
+        struct ExprVisitor {
+            const Generator& gen;
+            F& f;
 
-                gen.m_output << "    jmp " << loop_label << "\n";
+            size_t operator()(const NodeStmtExit* stmt_exit) const
+            {
+                f(stmt_exit->expr);
+                return 1;
+            }
 
-                gen.m_output << end_label << ":\n";
+            size_t operator()(const NodeStmtLet* stmt_let) const
+            {
+                f(stmt_let->expr);
+                return 1;
+            }
+
+            size_t operator()(const NodeScope* scope) const
+            {
+                return 1 + gen.for_each_expr(scope, f);
+            }
+
+            size_t operator()(const NodeStmtIf* stmt_if) const
+            {
+                f(stmt_if->expr);
+                size_t count = 1 + gen.for_each_expr(stmt_if->scope, f);
+                for (std::optional<NodeIfPred*> pred = stmt_if->pred; pred.has_value();) {
+                    if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        f((*elif)->expr);
+                        count += 1 + gen.for_each_expr((*elif)->scope, f);
+                        pred = (*elif)->pred;
+                    }
+                    else {
+                        count += 1 + gen.for_each_expr(std::get<NodeIfPredElse*>(pred.value()->var)->scope, f);
+                        pred.reset();
+                    }
+                }
+                return count;
+            }
+
+            size_t operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                f(stmt_assign->expr);
+                return 1;
+            }
+
+            size_t operator()(const NodeStmtFor* stmt_for) const
+            {
+                f(stmt_for->start);
+                f(stmt_for->step);
+                f(stmt_for->end);
+                return 1 + gen.for_each_expr(stmt_for->body, f);
+            }
+
+            size_t operator()(const NodeStmtReturn* stmt_return) const
+            {
+                f(stmt_return->expr);
+                return 1;
             }
         };
 
-        StmtVisitor visitor { .gen = *this };
-        std::visit(visitor, stmt->var);
+        ExprVisitor visitor { .gen = *this, .f = f };
+        size_t count = 0;
+        for (const NodeStmt* stmt : scope->stmts) {
+            count += std::visit(visitor, stmt->var);
+        }
+        return count;
+    }
+
+    /* The arguments are on the stack, the last one on top. They are copied
+    ** into their registers above the loop registers the caller saves, the
+    ** stack is aligned to 16 bytes for the call, and the result replaces
+    ** them on the stack.
+    */
+    void gen_call(const ExprId call)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const Symbol name = exprs.lhs[call];
+        const std::optional<uint32_t> index = find_fn(call);
+        if (!index.has_value()) {
+            if (name >= m_fn_index.size() || m_fn_index[name] == no_fn) {
+                throw CompileError::undeclared(m_interner.name(name));
+            }
+            throw CompileError("Wrong number of arguments: " + std::string(m_interner.name(name)));
+        }
+        const size_t num_args = exprs.rhs[call];
+        if (is_inlined(*index)) {
+            gen_inlined_call(*index, num_args);
+            return;
+        }
+        Reg saved[std::size(caller_saved_regs)] {};
+        size_t num_saved = 0;
+        for (const Reg reg : caller_saved_regs) {
+            if (m_loop_regs.contains(reg) && !m_free_loop_regs.contains(reg)) {
+                saved[num_saved++] = reg;
+                push(op_reg(reg));
+            }
+        }
+        for (size_t i = 0; i < num_args; i++) {
+            const auto disp = static_cast<int32_t>((num_saved + num_args - 1 - i) * 8);
+            emit(Op::mov, op_reg(arg_regs[i]), op_mem(Reg::rsp, disp));
+        }
+        // an even number of slots leaves the stack aligned, at the start of the program and in a frame
+        const bool pad = m_stack_size % 2 != 0;
+        if (pad) {
+            emit(Op::sub, op_reg(Reg::rsp), op_imm(8));
+        }
+        emit(Op::call, op_label(m_fns[*index].label));
+        if (pad) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm(8));
+        }
+        for (size_t i = num_saved; i-- > 0;) {
+            pop(saved[i]);
+        }
+        if (num_args != 0) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm(num_args * 8));
+            m_stack_size -= num_args;
+        }
+        push(op_reg(Reg::rax));
     }
 
-    [[nodiscard]] std::string gen_prog()
+    /* The arguments on the stack are the parameters, in a symbol table of
+    ** their own, and a return leaves the body by a jump to its end with the
+    ** result in rax. The body calls nothing, so this never nests.
+    */
+    void gen_inlined_call(const uint32_t index, const size_t num_args)
     {
-        m_output << "global _start\n_start:\n";
+        const NodeFn* fn = m_prog.fns[index];
+        comment("inlined call");
+        const LabelId end_label = create_label();
+        m_inline_end = end_label;
+        m_inline_base = m_stack_size - num_args;
+        std::swap(m_vars, m_inline_vars);
+        begin_scope();
+        for (size_t i = 0; i < num_args; i++) {
+            declare_param(fn->params[i], { .stack_loc = m_inline_base + i });
+        }
+        gen_scope(fn->body);
+        end_scope();
+        emit(Op::mov, op_reg(Reg::rax), op_imm(0));
+        label(end_label);
+        push(op_reg(Reg::rax));
+        std::swap(m_vars, m_inline_vars);
+        m_inline_end.reset();
+        comment("/inlined call");
+    }
 
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+    /* A function is generated with a stack, variables and loop registers of
+    ** its own. A leaf keeps the parameters in the registers they came in if
+    ** they are loop registers, and takes a free one or a stack slot for the
+    ** others. Any other function sets up an rbp frame and pushes them.
+    */
+    void gen_fn(const size_t index)
+    {
+        const NodeFn* fn = m_prog.fns[index];
+        const FnInfo& info = m_fns[index];
+        const size_t stack_size = m_stack_size;
+        const RegSet free_loop_regs = m_free_loop_regs;
+        std::swap(m_vars, m_fn_vars);
+        m_stack_size = 0;
+        m_loop_regs = fn_loop_regs;
+        m_free_loop_regs = fn_loop_regs;
+        m_tmp = Reg::r11;
+        m_framed = !info.leaf;
+
+        comment("fn");
+        label(info.label);
+        if (m_framed) {
+            emit(Op::push, op_reg(Reg::rbp));
+            emit(Op::mov, op_reg(Reg::rbp), op_reg(Reg::rsp));
         }
+        begin_scope();
+        bool in_place[std::size(arg_regs)] {};
+        for (size_t i = 0; i < fn->params.size(); i++) {
+            in_place[i] = !m_framed && m_free_loop_regs.contains(arg_regs[i]);
+            if (in_place[i]) {
+                m_free_loop_regs.erase(arg_regs[i]);
+                declare_param(fn->params[i], { .stack_loc = 0, .in_reg = true, .reg = arg_regs[i] });
+            }
+        }
+        // the registers left free hold no parameter
+        for (size_t i = 0; i < fn->params.size(); i++) {
+            if (in_place[i]) {
+                continue;
+            }
+            if (!m_framed && !m_free_loop_regs.empty()) {
+                const Reg reg = m_free_loop_regs.first();
+                m_free_loop_regs.erase(reg);
+                emit(Op::mov, op_reg(reg), op_reg(arg_regs[i]));
+                declare_param(fn->params[i], { .stack_loc = 0, .in_reg = true, .reg = reg });
+            }
+            else {
+                declare_param(fn->params[i], { .stack_loc = m_stack_size });
+                push(op_reg(arg_regs[i]));
+            }
+        }
+        gen_scope(fn->body);
+        end_scope();
+        // a body that ends without a return returns 0
+        emit(Op::mov, op_reg(Reg::rax), op_imm(0));
+        gen_ret();
+        comment("/fn");
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+        std::swap(m_vars, m_fn_vars);
+        m_stack_size = stack_size;
+        m_loop_regs = loop_regs;
+        m_free_loop_regs = free_loop_regs;
+        m_tmp = Reg::rbx;
+        m_framed = false;
     }
 
-private:
-    void push(const std::string& reg)
+    void declare_param(const Symbol name, const Var& var)
     {
-        m_output << "    push " << reg << "\n";
+        if (!m_vars.declare(name, var)) {
+            throw CompileError::redeclared(m_interner.name(name));
+        }
+    }
+
+    // the result is in rax, an inlined body jumps to its end instead of returning
+    void gen_return()
+    {
+        if (!m_inline_end.has_value()) {
+            gen_ret();
+            return;
+        }
+        if (m_stack_size != m_inline_base) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm((m_stack_size - m_inline_base) * 8));
+        }
+        emit(Op::jmp, op_label(*m_inline_end));
+    }
+
+    // the stack of the function is dropped, the return address is on top again
+    void gen_ret()
+    {
+        if (m_framed) {
+            if (m_stack_size != 0) {
+                emit(Op::mov, op_reg(Reg::rsp), op_reg(Reg::rbp));
+            }
+            emit(Op::pop, op_reg(Reg::rbp));
+        }
+        else if (m_stack_size != 0) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm(m_stack_size * 8));
+        }
+        emit(Op::ret);
+    }
+
+    /* The loop variable lives in a register while there is one. When the body
+    ** can't change them and hoisting is on, the end and the step are evaluated
+    ** once, before the loop. The test is at the bottom, so an iteration takes
+    ** a single jump.
+    */
+    void gen_for(const NodeStmtFor* stmt_for)
+    {
+        const LoopInfo info = m_loops.analyze(stmt_for);
+        // the loop variable is only visible inside the loop
+        begin_scope();
+        if (m_vars.find(stmt_for->var) != nullptr) {
+            throw CompileError::redeclared(m_interner.name(stmt_for->var));
+        }
+        const Var var = eval_into_home(stmt_for->start);
+        m_vars.declare(stmt_for->var, var);
+
+        if (m_unroll > 1 && info.trip_count.has_value() && *info.trip_count != 0 && !info.has_inner_loop
+            && is_hot(stmt_for)) {
+            gen_unrolled_for(stmt_for, var, *info.trip_count);
+            end_scope();
+            return;
+        }
+
+        const size_t stack_before = m_stack_size;
+        const std::optional<LoopValue> end = hoist(stmt_for->end, info.end_invariant);
+        const std::optional<LoopValue> step = hoist(stmt_for->step, info.step_invariant);
+
+        const LabelId top_label = create_label();
+        const LabelId check_label = create_label();
+        emit(Op::jmp, op_label(check_label));
+        label(top_label);
+        count_site(stmt_for->body);
+        gen_scope(stmt_for->body);
+        if (step.has_value()) {
+            gen_arith(Op::add, var_operand(var), loop_operand(*step));
+        }
+        else {
+            gen_expr(stmt_for->step);
+            pop(Reg::rax);
+            emit(Op::add, var_operand(var), op_reg(Reg::rax));
+        }
+        label(check_label);
+        if (end.has_value()) {
+            gen_arith(Op::cmp, var_operand(var), loop_operand(*end));
+        }
+        else {
+            gen_expr(stmt_for->end);
+            pop(Reg::rax);
+            emit(Op::cmp, var_operand(var), op_reg(Reg::rax));
+        }
+        emit(Op::jle, op_label(top_label));
+
+        for (const std::optional<LoopValue>& value : { end, step }) {
+            if (value.has_value() && !value->is_imm && value->home.in_reg) {
+                m_free_loop_regs.insert(value->home.reg);
+            }
+        }
+        if (m_stack_size != stack_before) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm((m_stack_size - stack_before) * 8));
+            m_stack_size = stack_before;
+        }
+        end_scope();
+    }
+
+    /* The trip count is known and the body contains no loop, so the body is
+    ** repeated m_unroll times per iteration. What doesn't fill a whole
+    ** iteration is emitted once more after the loop, without a test.
+    */
+    void gen_unrolled_for(const NodeStmtFor* stmt_for, const Var& var, const uint64_t trips)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const uint64_t start = exprs.int_value(stmt_for->start);
+        const uint64_t step = exprs.int_value(stmt_for->step);
+        const uint64_t blocks = trips / m_unroll;
+        uint64_t rest = trips % m_unroll;
+        if (blocks > 1) {
+            const LabelId top_label = create_label();
+            label(top_label);
+            for (uint64_t i = 0; i < m_unroll; i++) {
+                count_site(stmt_for->body);
+                gen_scope(stmt_for->body);
+                gen_arith(Op::add, var_operand(var), op_imm(step));
+            }
+            // start + trips * step can't overflow, the analysis checked
+            gen_arith(Op::cmp, var_operand(var), op_imm(start + blocks * m_unroll * step));
+            emit(Op::jl, op_label(top_label));
+        }
+        else {
+            rest += blocks * m_unroll;
+        }
+        // the variable is dead after the last copy, so that one isn't followed by an add
+        for (uint64_t i = 0; i < rest; i++) {
+            count_site(stmt_for->body);
+            gen_scope(stmt_for->body);
+            if (i + 1 < rest) {
+                gen_arith(Op::add, var_operand(var), op_imm(step));
+            }
+        }
+    }
+
+    // evaluates the expression and keeps it in a loop register, or on the stack when there is none left
+    Var eval_into_home(const ExprId expr)
+    {
+        const Var var { .stack_loc = m_stack_size };
+        gen_expr(expr);
+        if (m_free_loop_regs.empty()) {
+            // the value stays where gen_expr pushed it
+            return var;
+        }
+        const Reg reg = m_free_loop_regs.first();
+        m_free_loop_regs.erase(reg);
+        pop(reg);
+        return { .stack_loc = 0, .in_reg = true, .reg = reg };
+    }
+
+    // the value an invariant loop bound is kept in, if it doesn't have to be evaluated every time
+    std::optional<LoopValue> hoist(const ExprId expr, const bool invariant)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        if (exprs.kinds[expr] == ExprKind::int_lit) {
+            return LoopValue { .is_imm = true, .imm = exprs.int_value(expr), .home = {} };
+        }
+        if (!invariant || !m_hoist) {
+            return {};
+        }
+        return LoopValue { .is_imm = false, .imm = 0, .home = eval_into_home(expr) };
+    }
+
+    [[nodiscard]] Operand loop_operand(const LoopValue& value) const
+    {
+        return value.is_imm ? op_imm(value.imm) : var_operand(value.home);
+    }
+
+    // an add or cmp of two operands, going through rax for the combinations x86 can't encode
+    void gen_arith(const Op op, const Operand dst, Operand src)
+    {
+        const bool big_imm = src.kind == Operand::Kind::imm && src.value > static_cast<uint64_t>(INT32_MAX);
+        if (big_imm || (dst.kind == Operand::Kind::mem && src.kind == Operand::Kind::mem)) {
+            emit(Op::mov, op_reg(Reg::rax), src);
+            src = op_reg(Reg::rax);
+        }
+        emit(op, dst, src);
+    }
+
+    // true for a multiplication or division by a literal, which is never pushed
+    [[nodiscard]] bool is_constant_operand(const ExprId id) const
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        return (exprs.kinds[id] == ExprKind::multi || exprs.kinds[id] == ExprKind::div)
+            && exprs.kinds[exprs.rhs[id]] == ExprKind::int_lit;
+    }
+
+    // the right operand is on top of the stack and the left one below it
+    void gen_bin_expr(const Op op)
+    {
+        pop(m_tmp);
+        pop(Reg::rax);
+        // div divides rdx:rax, so rdx has to be zero
+        if (op == Op::div) {
+            emit(Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32));
+            emit(op, op_reg(m_tmp));
+        }
+        else {
+            emit(op, op_reg(Reg::rax), op_reg(m_tmp));
+        }
+        push(op_reg(Reg::rax));
+    }
+
+    // the shift amount is on top of the stack and the value below it
+    void gen_shift(const Op op)
+    {
+        pop(Reg::rcx);
+        pop(Reg::rax);
+        emit(op, op_reg(Reg::rax), op_reg(Reg::rcx, 8));
+        push(op_reg(Reg::rax));
+    }
+
+    /* Jumps to label if the predicate is zero with jz, or if it isn't with
+    ** jnz. A subtraction is not computed, cmp sets the flags the same way,
+    ** and a variable is compared in place. Anything else is evaluated and
+    ** tested.
+    */
+    void gen_branch(const ExprId expr, const Op jump, const LabelId label)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        switch (exprs.kinds[expr]) {
+        case ExprKind::sub:
+            gen_expr(exprs.lhs[expr]);
+            gen_expr(exprs.rhs[expr]);
+            pop(m_tmp);
+            pop(Reg::rax);
+            emit(Op::cmp, op_reg(Reg::rax), op_reg(m_tmp));
+            break;
+        case ExprKind::ident: {
+            const Var* var = m_vars.find(exprs.lhs[expr]);
+            if (var == nullptr) {
+                throw CompileError::undeclared(m_interner.name(exprs.lhs[expr]));
+            }
+            if (var->in_reg) {
+                emit(Op::test, op_reg(var->reg), op_reg(var->reg));
+            }
+            else {
+                emit(Op::cmp, var_operand(*var), op_imm(0));
+            }
+            break;
+        }
+        default:
+            gen_expr(expr);
+            pop(Reg::rax);
+            emit(Op::test, op_reg(Reg::rax), op_reg(Reg::rax));
+            break;
+        }
+        emit(jump, op_label(label));
+    }
+
+    // a loop body that ran fewer times than this in the profile run isn't worth unrolling
+    static constexpr uint64_t hot_iterations = 64;
+    // a branch taken at most once in this many times goes out of line
+    static constexpr uint64_t cold_ratio = 16;
+
+    [[nodiscard]] uint64_t profile_count(const void* node) const
+    {
+        return m_profile != nullptr ? m_profile->count(node) : 0;
+    }
+
+    [[nodiscard]] bool is_hot(const NodeStmtFor* stmt_for) const
+    {
+        return m_profile == nullptr || m_profile->count(stmt_for->body) >= hot_iterations;
+    }
+
+    [[nodiscard]] bool is_cold(const uint64_t taken, const uint64_t reached) const
+    {
+        return m_profile != nullptr && taken * cold_ratio <= reached;
+    }
+
+    /* The branch jumps out of line when it is taken, and the code after it
+    ** is what falls through. The block is generated where it is in the
+    ** program, with the stack and the variables as they are there, into a
+    ** buffer that gen_prog sends after the end of the program. It comes
+    ** back to end_label, where the stack is the same again.
+    */
+    void gen_cold_branch(const ExprId expr, const NodeScope* scope, const LabelId end_label)
+    {
+        const LabelId cold_label = create_label();
+        gen_branch(expr, Op::jnz, cold_label);
+        InstrSink* const sink = m_sink;
+        if (m_cold_blocks.size() == m_cold_depth) {
+            m_cold_blocks.emplace_back();
+        }
+        std::vector<Instr>& block = m_cold_blocks[m_cold_depth++];
+        block.clear();
+        InstrBuffer buffer(block);
+        m_sink = &buffer;
+        label(cold_label);
+        count_site(scope);
+        gen_scope(scope);
+        emit(Op::jmp, op_label(end_label));
+        m_sink = sink;
+        m_cold_depth--;
+        // a cold block inside this one is already there, they can be in any order
+        m_cold.insert(m_cold.end(), block.begin(), block.end());
+    }
+
+    /* Adds 1 to the counter of the site. It comes before a statement or a
+    ** loop body, where rax is free and the flags are dead.
+    */
+    void count_site(const void* node)
+    {
+        if (m_instrumented == nullptr) {
+            return;
+        }
+        emit(Op::mov, op_reg(Reg::rax), op_imm(ProfileSites::counter_address(m_instrumented->find(node).value())));
+        emit(Op::add, op_mem(Reg::rax), op_imm(1));
+    }
+
+    /* Writes the header and the counters to the profile, just before the
+    ** exit syscall, keeping rax and rdi for it. The syscalls take rcx and
+    ** r11, nothing needs them after.
+    */
+    void gen_write_profile()
+    {
+        if (m_instrumented == nullptr) {
+            return;
+        }
+        constexpr uint64_t sys_write = 1;
+        constexpr uint64_t sys_open = 2;
+        constexpr uint64_t sys_close = 3;
+        emit(Op::push, op_reg(Reg::rax));
+        emit(Op::push, op_reg(Reg::rdi));
+        emit(Op::mov, op_reg(Reg::rax), op_imm(sys_open));
+        emit(Op::mov, op_reg(Reg::rdi), op_imm(m_instrumented->path_address()));
+        emit(Op::mov, op_reg(Reg::rsi), op_imm(O_WRONLY | O_CREAT | O_TRUNC));
+        emit(Op::mov, op_reg(Reg::rdx), op_imm(0644));
+        emit(Op::syscall);
+        // if the open failed the write and the close fail too, and the program still exits
+        emit(Op::mov, op_reg(Reg::rdi), op_reg(Reg::rax));
+        emit(Op::mov, op_reg(Reg::rax), op_imm(sys_write));
+        emit(Op::mov, op_reg(Reg::rsi), op_imm(ProfileSites::data_address));
+        emit(Op::mov, op_reg(Reg::rdx), op_imm(m_instrumented->profile_size()));
+        emit(Op::syscall);
+        emit(Op::mov, op_reg(Reg::rax), op_imm(sys_close));
+        emit(Op::syscall);
+        emit(Op::pop, op_reg(Reg::rdi));
+        emit(Op::pop, op_reg(Reg::rax));
+    }
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {})
+    {
+        m_sink->emit({ .op = op, .dst = dst, .src = src });
+    }
+
+    void comment(const char* text)
+    {
+        m_sink->emit({ .op = Op::comment, .comment = text });
+    }
+
+    void label(const LabelId id)
+    {
+        emit(Op::label, op_label(id));
+    }
+
+    /* A top-level statement starts with no variable in a register and every
+    ** loop register free, so its instructions only depend on the statement,
+    ** on where the variables it names are relative to the top of the stack,
+    ** and on the options that salt the cache. Its labels are kept relative
+    ** to the first one it creates, the key doesn't depend on what came before.
+    */
+    void gen_cached_stmt(const NodeStmt* stmt)
+    {
+        const uint64_t key = stmt_key(stmt);
+        const LabelId first_label = m_label_count;
+        if (const CodegenCache::Entry* entry = m_cache->find(key)) {
+            // the sink is empty, the statement before was flushed
+            for (const Instr& instr : m_cache->instrs(*entry)) {
+                m_recorder->emit(move_labels(instr, first_label));
+            }
+            m_label_count += entry->labels;
+            skip_top_level(stmt);
+            return;
+        }
+
+        m_recorded.clear();
+        m_recorder->record_into(&m_recorded);
+        gen_stmt(stmt);
+        m_sink->flush();
+        m_recorder->record_into(nullptr);
+        for (Instr& instr : m_recorded) {
+            instr = move_labels(instr, -first_label);
+        }
+        m_cache->insert(key, m_recorded, m_label_count - first_label);
+    }
+
+    /* The key hashes the nodes of the statement, with the names numbered in
+    ** the order they first show up, each with the variable it refers to when
+    ** the statement starts. Renaming a variable or adding statements before
+    ** this one doesn't change it, moving a variable on the stack does.
+    */
+    uint64_t stmt_key(const NodeStmt* stmt)
+    {
+        Hasher hasher(m_cache->salt());
+        hash_stmt(hasher, stmt);
+        for (const Symbol name : m_key_names) {
+            m_key_ids[name] = no_key_id;
+        }
+        m_key_names.clear();
+        return hasher.value();
+    }
+
+    void hash_name(Hasher& hasher, const Symbol name)
+    {
+        if (m_key_ids[name] != no_key_id) {
+            hasher.add(m_key_ids[name]);
+            return;
+        }
+        m_key_ids[name] = static_cast<uint32_t>(m_key_names.size());
+        m_key_names.push_back(name);
+        hasher.add(m_key_ids[name]);
+        const Var* var = m_vars.find(name);
+        if (var == nullptr) {
+            hasher.add(UINT64_MAX);
+            return;
+        }
+        hasher.add(var->in_reg ? static_cast<uint64_t>(var->reg) : m_stack_size - var->stack_loc - 1);
+        hasher.add(var->in_reg);
+    }
+
+    void hash_expr(Hasher& hasher, const ExprId expr)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        hasher.add(expr - exprs.firsts[expr]);
+        for (ExprId id = exprs.firsts[expr]; id <= expr; id++) {
+            hasher.add(static_cast<uint64_t>(exprs.kinds[id]));
+            if (exprs.kinds[id] == ExprKind::int_lit) {
+                hasher.add(exprs.int_value(id));
+            }
+            else if (exprs.kinds[id] == ExprKind::ident) {
+                hash_name(hasher, exprs.lhs[id]);
+            }
+        }
+    }
+
+    void hash_scope(Hasher& hasher, const NodeScope* scope)
+    {
+        hasher.add(scope->stmts.size());
+        for (const NodeStmt* stmt : scope->stmts) {
+            hash_stmt(hasher, stmt);
+        }
+    }
+
+    void hash_if_pred(Hasher& hasher, const std::optional<NodeIfPred*>& pred)
+    {
+        hasher.add(pred.has_value() ? pred.value()->var.index() + 1 : 0);
+        if (!pred.has_value()) {
+            return;
+        }
+        if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+            hash_expr(hasher, (*elif)->expr);
+            hash_scope(hasher, (*elif)->scope);
+            hash_if_pred(hasher, (*elif)->pred);
+        }
+        else {
+            hash_scope(hasher, std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+        }
+    }
+
+    void hash_stmt(Hasher& hasher, const NodeStmt* stmt)
+    {
+        struct HashVisitor {
+            Generator& gen;
+            Hasher& hasher;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                gen.hash_expr(hasher, stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                gen.hash_name(hasher, stmt_let->ident);
+                gen.hash_expr(hasher, stmt_let->expr);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                gen.hash_scope(hasher, scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                gen.hash_expr(hasher, stmt_if->expr);
+                gen.hash_scope(hasher, stmt_if->scope);
+                gen.hash_if_pred(hasher, stmt_if->pred);
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                gen.hash_name(hasher, stmt_assign->ident);
+                gen.hash_expr(hasher, stmt_assign->expr);
+            }
+
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                gen.hash_name(hasher, stmt_for->var);
+                gen.hash_expr(hasher, stmt_for->start);
+                gen.hash_expr(hasher, stmt_for->step);
+                gen.hash_expr(hasher, stmt_for->end);
+                gen.hash_scope(hasher, stmt_for->body);
+            }
+
+            void operator()(const NodeStmtReturn* stmt_return) const
+            {
+                gen.hash_expr(hasher, stmt_return->expr);
+            }
+        };
+
+        hasher.add(stmt->var.index());
+        HashVisitor visitor { .gen = *this, .hasher = hasher };
+        std::visit(visitor, stmt->var);
+    }
+
+    void push(const Operand operand)
+    {
+        emit(Op::push, operand);
         m_stack_size++;
     }
 
-    void pop(const std::string& reg)
+    void pop(const Reg reg)
     {
-        m_output << "    pop " << reg << "\n";
+        emit(Op::pop, op_reg(reg));
         m_stack_size--;
     }
 
+    // the register of the variable, or its slot below the frame or relative to the current top of the stack
+    [[nodiscard]] Operand var_operand(const Var& var) const
+    {
+        if (var.in_reg) {
+            return op_reg(var.reg);
+        }
+        if (m_framed) {
+            return op_mem(Reg::rbp, -static_cast<int32_t>((var.stack_loc + 1) * 8));
+        }
+        return op_mem(Reg::rsp, static_cast<int32_t>((m_stack_size - var.stack_loc - 1) * 8));
+    }
+
     void begin_scope()
     {
-        m_scopes.push_back(m_vars.size());
+        m_vars.begin_scope();
     }
 
     void end_scope()
     {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
+        size_t pop_count = 0;
+        for (auto entry = m_vars.innermost_begin(); entry != m_vars.innermost_end(); entry++) {
+            if (entry->value.in_reg) {
+                m_free_loop_regs.insert(entry->value.reg);
+            }
+            else {
+                pop_count++;
+            }
+        }
         if (pop_count != 0) {
-            m_output << "    add rsp, " << pop_count * 8 << "\n";
+            emit(Op::add, op_reg(Reg::rsp), op_imm(pop_count * 8));
         }
         m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
-        }
-        m_scopes.pop_back();
+        m_vars.end_scope();
     }
 
-    std::string create_label()
+    LabelId create_label()
     {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+        return m_label_count++;
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    const NodeProg m_prog;
-    std::stringstream m_output;
+    const NodeProg& m_prog;
+    const Interner& m_interner;
+    InstrSink* m_sink; // the sink of the generator, or the buffer of a block that goes out of line
     size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
-    int m_label_count = 0;
+    ScopedSymbolTable<Var>& m_vars;
+    LoopAnalysis& m_loops;
+    uint64_t m_unroll;
+    RegSet m_loop_regs = loop_regs; // those of the program, or of the function being generated
+    RegSet m_free_loop_regs = loop_regs;
+    Reg m_tmp = Reg::rbx; // the right operand of a binary expression
+    LabelId m_label_count = 0;
+    CodegenCache* m_cache = nullptr;
+    RecordingSink* m_recorder = nullptr;
+    const ProfileSites* m_instrumented = nullptr;
+    const Profile* m_profile = nullptr;
+    std::vector<Instr>& m_cold; // the blocks that go out of line, after the end of the program
+    std::deque<std::vector<Instr>>& m_cold_blocks;
+    size_t m_cold_depth = 0; // how many blocks going out of line are being generated
+    std::vector<Instr>& m_recorded; // what came out of the sink for the statement being cached
+    bool m_inline = false;
+    bool m_hoist = false;
+    std::vector<uint32_t>& m_fn_index; // the function of each name, or no_fn
+    std::vector<FnInfo>& m_fns; // by index in the program
+    bool m_framed = false; // the variables on the stack are addressed from rbp
+    ScopedSymbolTable<Var>& m_fn_vars; // the variables of the program while a function is generated
+    ScopedSymbolTable<Var>& m_inline_vars; // those of the caller while a body is inlined
+    std::optional<LabelId> m_inline_end; // where a return in the inlined body jumps to
+    size_t m_inline_base = 0; // the stack size before the arguments of the inlined call
+    static constexpr uint32_t no_key_id = UINT32_MAX;
+    std::vector<uint32_t>& m_key_ids; // the number of each name in the key of the statement being hashed
+    std::vector<Symbol>& m_key_names; // the names numbered so far, to reset their ids
 };
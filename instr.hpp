@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "registers.hpp"
+
+/* Labels are numbered, they only get a name when the assembly is printed */
+using LabelId = uint32_t;
+
+/* The instructions the generators emit */
+enum class Op : uint8_t {
+    mov,
+    push,
+    pop,
+    add,
+    sub,
+    imul,
+    mul,
+    lea,
+    div,
+    xor_,
+    cmp,
+    test,
+    shl,
+    shr,
+    jmp,
+    jz,
+    jnz,
+    jg,
+    jl,
+    jle,
+    call,
+    ret,
+    syscall,
+    label, // not an instruction, defines the label in dst
+    comment // not an instruction either, only shows up in the assembly text
+};
+
+inline const char* to_string(const Op op)
+{
+    constexpr const char* names[] = { "mov", "push", "pop", "add", "sub", "imul", "mul", "lea", "div", "xor", "cmp",
+                                      "test", "shl", "shr", "jmp", "jz", "jnz", "jg", "jl", "jle", "call", "ret",
+                                      "syscall", "", "" };
+    return names[static_cast<uint8_t>(op)];
+}
+
+/* A register, an immediate, a [base + index * scale + disp] memory operand
+** or a label
+*/
+struct Operand {
+    enum class Kind : uint8_t {
+        none,
+        reg,
+        imm,
+        mem,
+        label
+    };
+    Kind kind = Kind::none;
+    uint8_t width = 64; // the width of a register operand in bits, memory operands are always 64 bits
+    Reg reg = Reg::rax; // the register, or the base of a memory operand
+    int32_t disp = 0;
+    Reg index = Reg::rax;
+    uint8_t scale = 0; // 1, 2, 4 or 8 if the memory operand has an index, otherwise 0
+    uint64_t value = 0; // the immediate or the label
+
+    bool operator==(const Operand&) const = default;
+};
+
+inline Operand op_reg(const Reg reg, const uint8_t width = 64)
+{
+    return { .kind = Operand::Kind::reg, .width = width, .reg = reg };
+}
+
+inline Operand op_imm(const uint64_t value)
+{
+    return { .kind = Operand::Kind::imm, .value = value };
+}
+
+inline Operand op_mem(const Reg base, const int32_t disp = 0)
+{
+    return { .kind = Operand::Kind::mem, .reg = base, .disp = disp };
+}
+
+inline Operand op_mem(const Reg base, const Reg index, const uint8_t scale, const int32_t disp = 0)
+{
+    return { .kind = Operand::Kind::mem, .reg = base, .disp = disp, .index = index, .scale = scale };
+}
+
+inline Operand op_label(const LabelId label)
+{
+    return { .kind = Operand::Kind::label, .value = label };
+}
+
+struct Instr {
+    Op op;
+    Operand dst {};
+    Operand src {};
+    const char* comment = nullptr; // the text of a comment, always a string literal
+};
+
+/* The instruction with its labels renumbered by adding offset, which wraps
+** around, so code generated with its labels numbered from 0 can be moved
+** after other code and back
+*/
+inline Instr move_labels(Instr instr, const LabelId offset)
+{
+    for (Operand* operand : { &instr.dst, &instr.src }) {
+        if (operand->kind == Operand::Kind::label) {
+            operand->value = static_cast<LabelId>(operand->value + offset);
+        }
+    }
+    return instr;
+}
+
+/* Where the generators send their instructions, e.g. the assembly printer
+** or the machine code encoder. Nothing is formatted or encoded before this.
+*/
+class InstrSink {
+public:
+    virtual ~InstrSink() = default;
+    virtual void emit(const Instr& instr) = 0;
+    // sends on what the sink holds back, nothing emitted later changes it
+    virtual void flush() { }
+};
+
+/* Keeps the instructions in a vector, to send them on later */
+class InstrBuffer final : public InstrSink {
+public:
+    explicit InstrBuffer(std::vector<Instr>& code)
+        : m_code(code)
+    {
+    }
+
+    void emit(const Instr& instr) override
+    {
+        m_code.push_back(instr);
+    }
+
+private:
+    std::vector<Instr>& m_code;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+/* A dense id for an identifier, so that later stages can compare names as integers */
+using Symbol = uint32_t;
+
+/* Hands out one Symbol per distinct identifier. The names are views into the
+** source, so the source has to outlive the interner. The table is open
+** addressed in a plain vector, a name costs no allocation of its own, and
+** clearing it keeps the memory for the next file.
+*/
+class Interner {
+public:
+    Symbol intern(const std::string_view name)
+    {
+        // at most half full, so a probe ends soon
+        if ((m_names.size() + 1) * 2 > m_slots.size()) {
+            grow();
+        }
+        const size_t hash = std::hash<std::string_view>()(name);
+        const size_t mask = m_slots.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            const Symbol sym = m_slots[slot];
+            if (sym == no_symbol) {
+                // here we only pay for an insertion the first time a name is seen
+                m_slots[slot] = static_cast<Symbol>(m_names.size());
+                m_names.push_back(name);
+                m_hashes.push_back(hash);
+                return m_slots[slot];
+            }
+            if (m_hashes[sym] == hash && m_names[sym] == name) {
+                return sym;
+            }
+        }
+    }
+
+    [[nodiscard]] std::string_view name(const Symbol sym) const
+    {
+        return m_names.at(sym);
+    }
+
+    // forgets every name but keeps the table, for the next file
+    void clear()
+    {
+        std::fill(m_slots.begin(), m_slots.end(), no_symbol);
+        m_names.clear();
+        m_hashes.clear();
+    }
+
+    // the number of symbols handed out, every Symbol is below this
+    [[nodiscard]] size_t size() const
+    {
+        return m_names.size();
+    }
+
+private:
+    static constexpr Symbol no_symbol = std::numeric_limits<Symbol>::max();
+    static constexpr size_t min_slots = 64;
+
+    // doubles the table, the names go back in by the hashes they were stored with
+    void grow()
+    {
+        m_slots.assign(std::max(min_slots, m_slots.size() * 2), no_symbol);
+        const size_t mask = m_slots.size() - 1;
+        for (Symbol sym = 0; sym < m_names.size(); sym++) {
+            size_t slot = m_hashes[sym] & mask;
+            while (m_slots[slot] != no_symbol) {
+                slot = (slot + 1) & mask;
+            }
+            m_slots[slot] = sym;
+        }
+    }
+
+    std::vector<Symbol> m_slots; // a power of 2 of them, each no_symbol or the Symbol of a name
+    std::vector<std::string_view> m_names; // by Symbol
+    std::vector<size_t> m_hashes; // by Symbol
+};
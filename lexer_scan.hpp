@@ -0,0 +1,283 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* The classes a source character can belong to. Every byte of the input is
+** classified with a single table load instead of going through the locale
+** sensitive <cctype> functions.
+*/
+enum class CharClass : uint8_t {
+    invalid,
+    space, // ' ', '\t', '\n', '\v', '\f', '\r'
+    alpha,
+    digit,
+    slash, // '/' may start a comment, so it gets its own class
+    punct // every other single character token
+};
+
+namespace scan {
+
+constexpr std::array<CharClass, 256> make_char_classes()
+{
+    std::array<CharClass, 256> table {};
+    for (auto& cls : table) {
+        cls = CharClass::invalid;
+    }
+    for (const unsigned char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+        table[c] = CharClass::space;
+    }
+    for (unsigned char c = 'a'; c <= 'z'; c++) {
+        table[c] = CharClass::alpha;
+        table[c - 'a' + 'A'] = CharClass::alpha;
+    }
+    for (unsigned char c = '0'; c <= '9'; c++) {
+        table[c] = CharClass::digit;
+    }
+    table['/'] = CharClass::slash;
+    for (const unsigned char c : { '(', ')', ';', '=', '+', '*', '-', '{', '}', ':', ',' }) {
+        table[c] = CharClass::punct;
+    }
+    return table;
+}
+
+inline constexpr std::array<CharClass, 256> char_classes = make_char_classes();
+
+inline CharClass classify(const char c)
+{
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+inline bool is_alnum(const char c)
+{
+    const CharClass cls = classify(c);
+    return cls == CharClass::alpha || cls == CharClass::digit;
+}
+
+#if defined(__AVX2__)
+/* 32 byte blocks. The comparisons are signed, so bytes >= 0x80 never fall
+** into one of the ASCII ranges below.
+*/
+constexpr size_t block_size = 32;
+using Block = __m256i;
+
+inline Block load(const char* p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+inline Block in_range(const Block v, const char lo, const char hi)
+{
+    return _mm256_and_si256(
+        _mm256_cmpgt_epi8(v, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), v));
+}
+
+inline Block equal(const Block v, const char c)
+{
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+}
+
+inline Block either(const Block a, const Block b)
+{
+    return _mm256_or_si256(a, b);
+}
+
+inline Block lower(const Block v)
+{
+    return _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+}
+
+inline uint32_t mask(const Block v)
+{
+    return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+}
+
+constexpr uint32_t full_mask = 0xFFFFFFFFu;
+#elif defined(__SSE2__)
+// 16 byte blocks, available on every x86-64 CPU
+constexpr size_t block_size = 16;
+using Block = __m128i;
+
+inline Block load(const char* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline Block in_range(const Block v, const char lo, const char hi)
+{
+    return _mm_and_si128(
+        _mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(lo - 1))),
+        _mm_cmplt_epi8(v, _mm_set1_epi8(static_cast<char>(hi + 1))));
+}
+
+inline Block equal(const Block v, const char c)
+{
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+inline Block either(const Block a, const Block b)
+{
+    return _mm_or_si128(a, b);
+}
+
+inline Block lower(const Block v)
+{
+    return _mm_or_si128(v, _mm_set1_epi8(0x20));
+}
+
+inline uint32_t mask(const Block v)
+{
+    return static_cast<uint32_t>(_mm_movemask_epi8(v));
+}
+
+constexpr uint32_t full_mask = 0xFFFFu;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+constexpr bool has_simd = true;
+
+inline uint32_t alnum_mask(const Block v)
+{
+    return mask(either(in_range(lower(v), 'a', 'z'), in_range(v, '0', '9')));
+}
+
+inline uint32_t space_mask(const Block v)
+{
+    // '\t', '\n', '\v', '\f' and '\r' are the contiguous range 9..13
+    return mask(either(equal(v, ' '), in_range(v, '\t', '\r')));
+}
+#else
+constexpr bool has_simd = false;
+#endif
+
+/* Returns the first character after a run of letters and digits */
+template <bool Simd>
+const char* skip_alnum(const char* p, const char* end)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    if constexpr (Simd) {
+        while (static_cast<size_t>(end - p) >= block_size) {
+            const uint32_t m = alnum_mask(load(p));
+            if (m != full_mask) {
+                return p + __builtin_ctz(~m);
+            }
+            p += block_size;
+        }
+    }
+#endif
+    while (p != end && is_alnum(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/* Returns the first character after a run of digits */
+template <bool Simd>
+const char* skip_digits(const char* p, const char* end)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    if constexpr (Simd) {
+        while (static_cast<size_t>(end - p) >= block_size) {
+            const uint32_t m = mask(in_range(load(p), '0', '9'));
+            if (m != full_mask) {
+                return p + __builtin_ctz(~m);
+            }
+            p += block_size;
+        }
+    }
+#endif
+    while (p != end && classify(*p) == CharClass::digit) {
+        p++;
+    }
+    return p;
+}
+
+/* Returns the first character after a run of whitespace. The newlines that
+** are skipped are added to line_count.
+*/
+template <bool Simd>
+const char* skip_spaces(const char* p, const char* end, int& line_count)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    if constexpr (Simd) {
+        while (static_cast<size_t>(end - p) >= block_size) {
+            const Block v = load(p);
+            const uint32_t m = space_mask(v);
+            const uint32_t newlines = mask(equal(v, '\n'));
+            if (m != full_mask) {
+                const int run = __builtin_ctz(~m);
+                // only the newlines inside the run of whitespace are counted
+                line_count += __builtin_popcount(newlines & ((1u << run) - 1));
+                return p + run;
+            }
+            line_count += __builtin_popcount(newlines);
+            p += block_size;
+        }
+    }
+#endif
+    while (p != end && classify(*p) == CharClass::space) {
+        if (*p == '\n') {
+            line_count++;
+        }
+        p++;
+    }
+    return p;
+}
+
+/* Returns the position of the next '\n', or end if there is none */
+template <bool Simd>
+const char* find_newline(const char* p, const char* end)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    if constexpr (Simd) {
+        while (static_cast<size_t>(end - p) >= block_size) {
+            const uint32_t m = mask(equal(load(p), '\n'));
+            if (m != 0) {
+                return p + __builtin_ctz(m);
+            }
+            p += block_size;
+        }
+    }
+#endif
+    while (p != end && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+/* Returns the position of the next "*\/", or end if the comment is never closed */
+template <bool Simd>
+const char* find_block_comment_end(const char* p, const char* end)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    if constexpr (Simd) {
+        // the block must also cover the character that follows a '*'
+        while (static_cast<size_t>(end - p) > block_size) {
+            uint32_t m = mask(equal(load(p), '*'));
+            while (m != 0) {
+                const char* star = p + __builtin_ctz(m);
+                if (star[1] == '/') {
+                    return star;
+                }
+                m &= m - 1;
+            }
+            p += block_size;
+        }
+    }
+#endif
+    while (p != end) {
+        if (*p == '*' && p + 1 != end && p[1] == '/') {
+            return p;
+        }
+        p++;
+    }
+    return end;
+}
+
+} // namespace scan
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "parser.hpp"
+
+/* What the backends need to know about a for loop before lowering it */
+struct LoopInfo {
+    bool end_invariant = true; // the end reads nothing the loop changes and calls nothing, so it can be evaluated once
+    bool step_invariant = true; // the same for the step, which also can't divide by 0
+    bool has_inner_loop = false;
+    std::optional<uint64_t> trip_count; // known when start, step and end are literals the body can't change
+};
+
+/* Finds the variables the body of a loop assigns to, and from that which
+** parts of the loop header are invariant. The loop runs while the variable
+** is not greater than the end, compared signed, and the step is added after
+** every iteration. A step is only evaluated after a body, so one that may
+** trap isn't invariant: evaluated before the loop, it would trap in a loop
+** that never runs, or before the body could exit.
+*/
+class LoopAnalysis {
+public:
+    LoopAnalysis() = default;
+
+    explicit LoopAnalysis(const FlatExprs& exprs)
+        : m_exprs(&exprs)
+    {
+    }
+
+    // the loops of another program, the buffer keeps its memory
+    void reset(const FlatExprs& exprs)
+    {
+        m_exprs = &exprs;
+        m_assigned.clear();
+    }
+
+    LoopInfo analyze(const NodeStmtFor* stmt_for)
+    {
+        m_assigned.clear();
+        m_inner_loop = false;
+        m_assigned.push_back(stmt_for->var);
+        collect(stmt_for->body);
+        std::sort(m_assigned.begin(), m_assigned.end());
+        const bool body_assigns_var
+            = std::count(m_assigned.begin(), m_assigned.end(), stmt_for->var) > 1;
+
+        LoopInfo info;
+        info.end_invariant = !reads_assigned(stmt_for->end);
+        info.step_invariant = !reads_assigned(stmt_for->step) && !may_trap(stmt_for->step);
+        info.has_inner_loop = m_inner_loop;
+        if (!body_assigns_var && is_literal(stmt_for->start) && is_literal(stmt_for->step)
+            && is_literal(stmt_for->end)) {
+            info.trip_count = count_trips(static_cast<int64_t>(m_exprs->int_value(stmt_for->start)),
+                                          static_cast<int64_t>(m_exprs->int_value(stmt_for->step)),
+                                          static_cast<int64_t>(m_exprs->int_value(stmt_for->end)));
+        }
+        return info;
+    }
+
+private:
+    // the number of iterations, unless the loop never ends or the variable overflows
+    static std::optional<uint64_t> count_trips(const int64_t start, const int64_t step, const int64_t end)
+    {
+        if (step <= 0) {
+            return {};
+        }
+        if (start > end) {
+            return 0;
+        }
+        const __int128 trips = (static_cast<__int128>(end) - start) / step + 1;
+        if (start + trips * step > INT64_MAX) {
+            return {};
+        }
+        return static_cast<uint64_t>(trips);
+    }
+
+    [[nodiscard]] bool is_literal(const ExprId expr) const
+    {
+        return m_exprs->kinds[expr] == ExprKind::int_lit;
+    }
+
+    // a call counts too, it could exit, and evaluating it once before the loop would move that
+    [[nodiscard]] bool reads_assigned(const ExprId expr) const
+    {
+        for (ExprId id = m_exprs->firsts[expr]; id <= expr; id++) {
+            if (m_exprs->kinds[id] == ExprKind::call) {
+                return true;
+            }
+            if (m_exprs->kinds[id] == ExprKind::ident
+                && std::binary_search(m_assigned.begin(), m_assigned.end(), m_exprs->lhs[id])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // a division by anything but a literal other than 0
+    [[nodiscard]] bool may_trap(const ExprId expr) const
+    {
+        for (ExprId id = m_exprs->firsts[expr]; id <= expr; id++) {
+            if (m_exprs->kinds[id] == ExprKind::div
+                && (!is_literal(m_exprs->rhs[id]) || m_exprs->int_value(m_exprs->rhs[id]) == 0)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void collect(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct AssignVisitor {
+            LoopAnalysis& loops;
+
+            void operator()(const NodeStmtExit*) const
+            {
+            }
+
+            void operator()(const NodeStmtLet*) const
+            {
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                loops.m_assigned.push_back(stmt_assign->ident);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                loops.collect(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                loops.collect(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        loops.collect((*elif)->scope);
+                        pred = (*elif)->pred;
+                    }
+                    else {
+                        loops.collect(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+            }
+
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                loops.m_inner_loop = true;
+                loops.m_assigned.push_back(stmt_for->var);
+                loops.collect(stmt_for->body);
+            }
+
+            void operator()(const NodeStmtReturn*) const
+            {
+            }
+        };
+
+        AssignVisitor visitor { .loops = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    void collect(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        for (const NodeStmt* stmt : scope->stmts) {
+            collect(stmt);
+        }
+    }
+
+    const FlatExprs* m_exprs = nullptr;
+    std::vector<Symbol> m_assigned;
+    bool m_inner_loop = false;
+};
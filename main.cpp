@@ -1,46 +1,25 @@
-#include <fstream>
+#include <deque>
 #include <iostream>
-#include <optional>
-#include <sstream>
+#include <span>
+#include <string>
 #include <vector>
 
-#include "generation.hpp"
+#include "compile_server.hpp"
+#include "compiler.hpp"
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2) {
-        std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "hydro <input.hy>" << std::endl;
-        return EXIT_FAILURE;
-    }
+    const std::vector<std::string> args(argv + 1, argv + argc);
 
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+    // hydro --daemon <socket> serves compile requests from clients
+    if (args.size() == 2 && args[0] == "--daemon") {
+        return compile_server::run_server(args[1]);
     }
-
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
-
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
-
-    if (!prog.has_value()) {
-        std::cerr << "Invalid program" << std::endl;
-        exit(EXIT_FAILURE);
+    // hydro --connect <socket> ... hands the rest of the arguments to a server
+    if (args.size() >= 2 && args[0] == "--connect") {
+        return compile_server::run_client(args[1], std::span(args).subspan(2));
     }
 
-    {
-        Generator generator(prog.value());
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
-    }
-
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
-
-    return EXIT_SUCCESS;
+    std::deque<Compiler> compilers;
+    return run_compiler(args, "", compilers, std::cerr);
 }
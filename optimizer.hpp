@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cassert>
+#include <optional>
+#include <vector>
+
+#include "parser.hpp"
+#include "symbol_table.hpp"
+
+/* Simplifies the expressions of a program before code generation.
+** Constant subtrees are folded, the values of `let` variables that are never
+** assigned to are propagated into their uses, and the identities x + 0,
+** x - 0, x * 1, x / 1 and x * 0 are applied. Multiplications and divisions
+** by powers of two become shifts, and literal factors are moved to the right
+** where the backends look for them. The arithmetic is unsigned 64 bit, like
+** the generated code, and divisions by zero are left for the runtime. A call
+** is never dropped, even from x * 0, since it could exit, and neither is a
+** division by anything but a constant other than 0, since it could trap.
+** Functions are simplified on their own, they don't see the variables of
+** the program.
+**
+** An optimizer can run on one program after another and keeps its buffers
+** in between, so once they have grown a run allocates nothing.
+*/
+class Optimizer {
+public:
+    void run(NodeProg& prog, const Interner& interner)
+    {
+        m_prog = &prog;
+        m_consts.reset(interner.size());
+        m_assigned.assign(interner.size(), false);
+        for (const NodeStmt* stmt : prog.stmts) {
+            find_assigned(stmt);
+        }
+        for (const NodeFn* fn : prog.fns) {
+            find_assigned(fn->body);
+        }
+        // the expressions are rebuilt into the pool of the run before, which stays in post-order
+        std::swap(m_old, prog.exprs);
+        prog.exprs.clear();
+        prog.exprs.reserve(m_old.size());
+        m_consts.begin_scope();
+        for (const NodeStmt* stmt : prog.stmts) {
+            opt_stmt(stmt);
+        }
+        m_consts.end_scope();
+        // the lets of the program are out of scope again, and the parameters are never constant
+        for (const NodeFn* fn : prog.fns) {
+            opt_scope(fn->body);
+        }
+    }
+
+private:
+    // marks every variable that is the target of an assignment or a loop variable
+    void find_assigned(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct AssignVisitor {
+            Optimizer& opt;
+
+            void operator()(const NodeStmtExit*) const
+            {
+            }
+
+            void operator()(const NodeStmtLet*) const
+            {
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                opt.m_assigned[stmt_assign->ident] = true;
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                opt.find_assigned(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                opt.find_assigned(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        opt.find_assigned((*elif)->scope);
+                        pred = (*elif)->pred;
+                    }
+                    else {
+                        opt.find_assigned(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+            }
+
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                opt.m_assigned[stmt_for->var] = true;
+                opt.find_assigned(stmt_for->body);
+            }
+
+            void operator()(const NodeStmtReturn*) const
+            {
+            }
+        };
+
+        AssignVisitor visitor { .opt = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    void find_assigned(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        for (const NodeStmt* stmt : scope->stmts) {
+            find_assigned(stmt);
+        }
+    }
+
+    void opt_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        m_consts.begin_scope();
+        for (const NodeStmt* stmt : scope->stmts) {
+            opt_stmt(stmt);
+        }
+        m_consts.end_scope();
+    }
+
+    void opt_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            Optimizer& opt;
+
+            void operator()(NodeStmtExit* stmt_exit) const
+            {
+                stmt_exit->expr = opt.opt_expr(stmt_exit->expr);
+            }
+
+            void operator()(NodeStmtLet* stmt_let) const
+            {
+                stmt_let->expr = opt.opt_expr(stmt_let->expr);
+                const FlatExprs& exprs = opt.m_prog->exprs;
+                if (!opt.m_assigned[stmt_let->ident] && exprs.kinds[stmt_let->expr] == ExprKind::int_lit) {
+                    opt.m_consts.declare(stmt_let->ident, exprs.int_value(stmt_let->expr));
+                }
+            }
+
+            void operator()(NodeStmtAssign* stmt_assign) const
+            {
+                stmt_assign->expr = opt.opt_expr(stmt_assign->expr);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                opt.opt_scope(scope);
+            }
+
+            void operator()(NodeStmtIf* stmt_if) const
+            {
+                stmt_if->expr = opt.opt_expr(stmt_if->expr);
+                opt.opt_scope(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        (*elif)->expr = opt.opt_expr((*elif)->expr);
+                        opt.opt_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    }
+                    else {
+                        opt.opt_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        pred = {};
+                    }
+                }
+            }
+
+            void operator()(NodeStmtFor* stmt_for) const
+            {
+                stmt_for->start = opt.opt_expr(stmt_for->start);
+                stmt_for->step = opt.opt_expr(stmt_for->step);
+                stmt_for->end = opt.opt_expr(stmt_for->end);
+                opt.opt_scope(stmt_for->body);
+            }
+
+            void operator()(NodeStmtReturn* stmt_return) const
+            {
+                stmt_return->expr = opt.opt_expr(stmt_return->expr);
+            }
+        };
+
+        StmtVisitor visitor { .opt = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    // returns the id of the simplified expression in the new pool
+    ExprId opt_expr(const ExprId root)
+    {
+        // first the value of every constant node, children come before their parents
+        const ExprId first = m_old.firsts[root];
+        m_values.assign(root - first + 1, std::nullopt);
+        m_has_call.assign(root - first + 1, false);
+        m_may_trap.assign(root - first + 1, false);
+        for (ExprId id = first; id <= root; id++) {
+            if (m_old.kinds[id] == ExprKind::call) {
+                m_has_call[id - first] = true;
+            }
+            else if (is_bin_expr(m_old.kinds[id])) {
+                const ExprId lhs = m_old.lhs[id] - first;
+                const ExprId rhs = m_old.rhs[id] - first;
+                m_has_call[id - first] = m_has_call[lhs] || m_has_call[rhs];
+                // the value of the divisor is already known here if it is a constant
+                const bool divisor_may_be_zero = m_old.kinds[id] == ExprKind::div && m_values[rhs].value_or(0) == 0;
+                m_may_trap[id - first] = m_may_trap[lhs] || m_may_trap[rhs] || divisor_may_be_zero;
+            }
+            m_values[id - first] = fold(id, first);
+        }
+        m_first = first;
+        return emit(root);
+    }
+
+    [[nodiscard]] std::optional<uint64_t> value_of(const ExprId id) const
+    {
+        return m_values[id - m_first];
+    }
+
+    [[nodiscard]] std::optional<uint64_t> fold(const ExprId id, const ExprId first) const
+    {
+        switch (m_old.kinds[id]) {
+        case ExprKind::int_lit:
+            return m_old.int_value(id);
+        case ExprKind::ident:
+            if (const uint64_t* value = m_consts.find(m_old.lhs[id])) {
+                return *value;
+            }
+            return {};
+        case ExprKind::call:
+            return {};
+        default:
+            break;
+        }
+        const std::optional<uint64_t> lhs = m_values[m_old.lhs[id] - first];
+        const std::optional<uint64_t> rhs = m_values[m_old.rhs[id] - first];
+        if (m_old.kinds[id] == ExprKind::multi && !m_has_call[id - first] && !m_may_trap[id - first]
+            && ((lhs.has_value() && *lhs == 0) || (rhs.has_value() && *rhs == 0))) {
+            return 0;
+        }
+        if (!lhs.has_value() || !rhs.has_value()) {
+            return {};
+        }
+        switch (m_old.kinds[id]) {
+        case ExprKind::add:
+            return *lhs + *rhs;
+        case ExprKind::sub:
+            return *lhs - *rhs;
+        case ExprKind::multi:
+            return *lhs * *rhs;
+        case ExprKind::div:
+            if (*rhs == 0) {
+                return {};
+            }
+            return *lhs / *rhs;
+        case ExprKind::shl:
+            return *rhs < 64 ? *lhs << *rhs : 0;
+        case ExprKind::shr:
+            return *rhs < 64 ? *lhs >> *rhs : 0;
+        default:
+            assert(false); // Unreachable;
+            return {};
+        }
+    }
+
+    /* What is left to do for a node being copied: copy a subtree, add a
+    ** binary node over the last two results, add one over the last result
+    ** and a literal, or add a call over the results of its arguments
+    */
+    struct EmitTask {
+        enum class Step { copy, add_bin, add_bin_lit, add_call } step;
+        ExprId id = 0; // the node to copy, or the call in the old pool
+        ExprKind kind = ExprKind::int_lit;
+        uint64_t literal = 0;
+    };
+
+    /* Copies the simplified subtree into the new pool, operands first. The
+    ** tasks are on a stack of their own instead of the call stack, so a
+    ** long chain of operators can't overflow it.
+    */
+    ExprId emit(const ExprId root)
+    {
+        FlatExprs& exprs = m_prog->exprs;
+        m_tasks.push_back({ .step = EmitTask::Step::copy, .id = root });
+        while (!m_tasks.empty()) {
+            const EmitTask task = m_tasks.back();
+            m_tasks.pop_back();
+            if (task.step == EmitTask::Step::add_bin) {
+                const ExprId rhs = m_results.back();
+                m_results.pop_back();
+                m_results.back() = exprs.add_bin(task.kind, m_results.back(), rhs);
+            }
+            else if (task.step == EmitTask::Step::add_bin_lit) {
+                m_results.back() = exprs.add_bin(task.kind, m_results.back(), exprs.add_int_lit(task.literal));
+            }
+            else if (task.step == EmitTask::Step::add_call) {
+                const uint32_t num_args = m_old.rhs[task.id];
+                const size_t args = m_results.size() - num_args;
+                const ExprId first = num_args == 0 ? 0 : exprs.firsts[m_results[args]];
+                m_results.resize(args);
+                m_results.push_back(exprs.add_call(m_old.lhs[task.id], first, num_args));
+            }
+            else {
+                copy(task.id);
+            }
+        }
+        const ExprId result = m_results.back();
+        m_results.pop_back();
+        return result;
+    }
+
+    // the node is added here if it is a leaf, otherwise the tasks that add it are pushed
+    void copy(ExprId id)
+    {
+        FlatExprs& exprs = m_prog->exprs;
+        while (true) {
+            if (const std::optional<uint64_t> value = value_of(id)) {
+                m_results.push_back(exprs.add_int_lit(*value));
+                return;
+            }
+            const ExprKind kind = m_old.kinds[id];
+            if (kind == ExprKind::ident) {
+                m_results.push_back(exprs.add_ident(m_old.lhs[id]));
+                return;
+            }
+            if (kind == ExprKind::call) {
+                // the arguments are copied in order, so they end up right before the call
+                m_tasks.push_back({ .step = EmitTask::Step::add_call, .id = id });
+                m_old.call_args(id, m_args);
+                for (size_t i = m_args.size(); i-- > 0;) {
+                    m_tasks.push_back({ .step = EmitTask::Step::copy, .id = m_args[i] });
+                }
+                return;
+            }
+            const ExprId lhs = m_old.lhs[id];
+            const ExprId rhs = m_old.rhs[id];
+            const std::optional<uint64_t> lhs_value = value_of(lhs);
+            const std::optional<uint64_t> rhs_value = value_of(rhs);
+
+            // x + 0, x - 0, x * 1 and x / 1 are x, and so are 0 + x and 1 * x
+            if (rhs_value.has_value()) {
+                if ((*rhs_value == 0 && (kind == ExprKind::add || kind == ExprKind::sub))
+                    || (*rhs_value == 1 && (kind == ExprKind::multi || kind == ExprKind::div))) {
+                    id = lhs;
+                    continue;
+                }
+            }
+            if (lhs_value.has_value()) {
+                if ((*lhs_value == 0 && kind == ExprKind::add) || (*lhs_value == 1 && kind == ExprKind::multi)) {
+                    id = rhs;
+                    continue;
+                }
+            }
+
+            // multiplying and dividing by a power of two are shifts
+            if (kind == ExprKind::multi && rhs_value.has_value() && is_power_of_two(*rhs_value)) {
+                push_shift(ExprKind::shl, lhs, *rhs_value);
+            }
+            else if (kind == ExprKind::multi && lhs_value.has_value() && is_power_of_two(*lhs_value)) {
+                push_shift(ExprKind::shl, rhs, *lhs_value);
+            }
+            else if (kind == ExprKind::div && rhs_value.has_value() && is_power_of_two(*rhs_value)) {
+                push_shift(ExprKind::shr, lhs, *rhs_value);
+            }
+            // a literal factor goes on the right, where the backends turn it into shifts and lea
+            else if (kind == ExprKind::multi && lhs_value.has_value() && !rhs_value.has_value()) {
+                m_tasks.push_back({ .step = EmitTask::Step::add_bin_lit, .kind = kind, .literal = *lhs_value });
+                m_tasks.push_back({ .step = EmitTask::Step::copy, .id = rhs });
+            }
+            else {
+                // the stack is last in first out, so the left operand is copied first
+                m_tasks.push_back({ .step = EmitTask::Step::add_bin, .kind = kind });
+                m_tasks.push_back({ .step = EmitTask::Step::copy, .id = rhs });
+                m_tasks.push_back({ .step = EmitTask::Step::copy, .id = lhs });
+            }
+            return;
+        }
+    }
+
+    void push_shift(const ExprKind kind, const ExprId operand, const uint64_t power)
+    {
+        const auto amount = static_cast<uint64_t>(__builtin_ctzll(power));
+        m_tasks.push_back({ .step = EmitTask::Step::add_bin_lit, .kind = kind, .literal = amount });
+        m_tasks.push_back({ .step = EmitTask::Step::copy, .id = operand });
+    }
+
+    static bool is_power_of_two(const uint64_t value)
+    {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+
+    NodeProg* m_prog = nullptr; // the program of the run
+    FlatExprs m_old; // the pool before the pass
+    ScopedSymbolTable<uint64_t> m_consts; // the variables whose value is known
+    std::vector<bool> m_assigned; // per Symbol, true if the variable is ever assigned to
+    std::vector<std::optional<uint64_t>> m_values; // the constant value of each node of the current expression
+    std::vector<bool> m_has_call; // whether each node of the current expression calls a function
+    std::vector<bool> m_may_trap; // whether it divides by something that isn't a constant other than 0
+    ExprId m_first = 0; // the first node of the current expression
+    std::vector<EmitTask> m_tasks; // what emit has left to do
+    std::vector<ExprId> m_results; // the copied subtrees the tasks are waiting for
+    std::vector<ExprId> m_args; // the arguments of the call being copied
+};
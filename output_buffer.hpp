@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Collects the generated assembly in fixed size chunks. Appending never
+** moves what was written before, integers are formatted with to_chars (no
+** locale or stream state involved), and the chunks are handed to writev()
+** as they are, so the output is never copied into one big string.
+** Lines never straddle two chunks: when a chunk fills up, the unfinished
+** line is moved over to the next one. A reader can therefore take every
+** chunk as a run of whole lines.
+*/
+class OutputBuffer {
+public:
+    explicit OutputBuffer(const size_t chunk_size = 64 * 1024)
+        : m_chunk_size(chunk_size)
+    {
+    }
+
+    OutputBuffer& operator<<(const std::string_view text)
+    {
+        append(text);
+        return *this;
+    }
+
+    OutputBuffer& operator<<(const char* text)
+    {
+        append(std::string_view(text));
+        return *this;
+    }
+
+    OutputBuffer& operator<<(const char c)
+    {
+        append(std::string_view(&c, 1));
+        return *this;
+    }
+
+    template <typename T>
+        requires std::is_integral_v<T> && (!std::is_same_v<T, char>) && (!std::is_same_v<T, bool>)
+    OutputBuffer& operator<<(const T value)
+    {
+        char digits[24];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(std::string_view(digits, static_cast<size_t>(result.ptr - digits)));
+        return *this;
+    }
+
+    // the written text, one run of whole lines per chunk
+    [[nodiscard]] std::vector<std::string_view> chunks() const
+    {
+        std::vector<std::string_view> views;
+        views.reserve(m_chunks.size());
+        for (const Chunk& chunk : m_chunks) {
+            views.emplace_back(chunk.data.get(), chunk.used);
+        }
+        return views;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        size_t total = 0;
+        for (const Chunk& chunk : m_chunks) {
+            total += chunk.used;
+        }
+        return total;
+    }
+
+    // forgets the text but keeps the chunks, so the buffer can be filled again without allocating
+    void clear()
+    {
+        for (Chunk& chunk : m_chunks) {
+            chunk.used = 0;
+        }
+        m_current = 0;
+        m_line_start = 0;
+    }
+
+    // writes every chunk to the file descriptor with as few writev() calls as possible
+    bool write_to(const int fd) const
+    {
+        std::vector<iovec> iovs;
+        for (const Chunk& chunk : m_chunks) {
+            if (chunk.used != 0) {
+                iovs.push_back({ chunk.data.get(), chunk.used });
+            }
+        }
+        size_t next = 0;
+        while (next < iovs.size()) {
+            const int count = static_cast<int>(std::min<size_t>(iovs.size() - next, IOV_MAX));
+            const ssize_t written = ::writev(fd, &iovs[next], count);
+            if (written < 0) {
+                return false;
+            }
+            // a short write leaves us somewhere inside an iovec
+            auto remaining = static_cast<size_t>(written);
+            while (next < iovs.size() && remaining >= iovs[next].iov_len) {
+                remaining -= iovs[next].iov_len;
+                next++;
+            }
+            if (remaining != 0) {
+                iovs[next].iov_base = static_cast<char*>(iovs[next].iov_base) + remaining;
+                iovs[next].iov_len -= remaining;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t used;
+    };
+
+    void append(const std::string_view text)
+    {
+        if (m_chunks.empty() || m_chunks[m_current].capacity - m_chunks[m_current].used < text.size()) {
+            next_chunk(text.size());
+        }
+        Chunk& chunk = m_chunks[m_current];
+        std::memcpy(chunk.data.get() + chunk.used, text.data(), text.size());
+        chunk.used += text.size();
+        // only whole lines are ever left behind in a full chunk
+        for (size_t i = text.size(); i-- > 0;) {
+            if (text[i] == '\n') {
+                m_line_start = chunk.used - (text.size() - i - 1);
+                break;
+            }
+        }
+    }
+
+    void next_chunk(const size_t text_size)
+    {
+        // the unfinished line moves along with the text that continues it
+        size_t carry = 0;
+        const char* carry_from = nullptr;
+        if (!m_chunks.empty()) {
+            Chunk& chunk = m_chunks[m_current];
+            carry = chunk.used - m_line_start;
+            carry_from = chunk.data.get() + m_line_start;
+            chunk.used = m_line_start;
+        }
+        const size_t needed = carry + text_size;
+        // a chunk left over from before clear() is reused when it is big enough
+        size_t index = m_chunks.empty() ? 0 : m_current + 1;
+        while (index < m_chunks.size() && m_chunks[index].capacity < needed) {
+            index++;
+        }
+        if (index >= m_chunks.size()) {
+            const size_t capacity = std::max(m_chunk_size, needed);
+            m_chunks.push_back({ std::make_unique<char[]>(capacity), capacity, 0 });
+            index = m_chunks.size() - 1;
+        }
+        // the chunks skipped over stay empty
+        Chunk& next = m_chunks[index];
+        if (carry != 0) {
+            std::memmove(next.data.get(), carry_from, carry);
+        }
+        next.used = carry;
+        m_current = index;
+        m_line_start = 0;
+    }
+
+    size_t m_chunk_size;
+    std::vector<Chunk> m_chunks;
+    size_t m_current = 0; // the chunk being written to
+    size_t m_line_start = 0; // where the unfinished line starts in the current chunk
+};
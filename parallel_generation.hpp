@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "compile_error.hpp"
+#include "generation.hpp"
+#include "instr.hpp"
+#include "peephole.hpp"
+#include "thread_pool.hpp"
+
+/* Generates the stack machine code of a big program on several threads. The
+** top-level statements are cut into regions of consecutive statements, and
+** every region is generated by a generator of its own into a buffer of its
+** own, after skipping the statements before it, which only declares their
+** lets. The labels of a region are numbered from 0, so the buffers are
+** renumbered as they are sent on in order, and the labels come out numbered
+** as if one generator had done it all.
+*/
+class ParallelGenerator {
+public:
+    // a region has at least this many expression nodes, smaller ones don't pay for their thread
+    static constexpr size_t min_region_exprs = 16 * 1024;
+
+    /* Sends the code of the whole program to the sink, through a peephole
+    ** pass per region and hoisted loop bounds when optimize is set. Returns
+    ** false, having sent nothing, if the program is worth no more than one
+    ** region. An error is the one a single generator would have stopped at:
+    ** a region that fails had everything before it generated without one.
+    */
+    bool gen_prog(const NodeProg& prog, const Interner& interner, InstrSink& sink, const uint64_t unroll,
+                  const bool optimize, const size_t threads)
+    {
+        const size_t stmt_count = prog.stmts.size();
+        const size_t count = std::min({ threads * regions_per_thread, prog.exprs.kinds.size() / min_region_exprs,
+                                        stmt_count });
+        if (threads < 2 || count < 2) {
+            return false;
+        }
+        if (m_regions.size() < count) {
+            m_regions.resize(count);
+        }
+        const std::span<Region> regions = std::span(m_regions).first(count);
+        WorkStealingPool pool(std::min(threads, count));
+        pool.run(count, [&](size_t, const size_t index) {
+            Region& region = regions[index];
+            region.code.clear();
+            region.error.reset();
+            const size_t first = stmt_count * index / count;
+            const size_t last = stmt_count * (index + 1) / count;
+            InstrBuffer buffer(region.code);
+            Peephole peephole(buffer, region.peephole);
+            InstrSink& gen_sink = optimize ? static_cast<InstrSink&>(peephole) : buffer;
+            Generator generator(prog, interner, gen_sink, region.generator, unroll);
+            if (optimize) {
+                generator.hoist_loop_bounds();
+            }
+            try {
+                for (size_t i = 0; i < first; i++) {
+                    generator.skip_top_level(prog.stmts[i]);
+                }
+                generator.gen_top_level(std::span(prog.stmts).subspan(first, last - first));
+                if (index + 1 == count) {
+                    generator.gen_exit();
+                }
+            }
+            catch (const CompileError& error) {
+                region.error = error;
+            }
+            peephole.finish();
+            region.labels = generator.label_count();
+        });
+
+        for (const Region& region : regions) {
+            if (region.error.has_value()) {
+                throw *region.error;
+            }
+        }
+        LabelId first_label = 0;
+        for (const Region& region : regions) {
+            for (const Instr& instr : region.code) {
+                sink.emit(move_labels(instr, first_label));
+            }
+            first_label += region.labels;
+        }
+        return true;
+    }
+
+private:
+    // a few regions per thread, so a thread that finishes early can steal one
+    static constexpr size_t regions_per_thread = 4;
+
+    // a region keeps its buffers for the next program
+    struct Region {
+        std::vector<Instr> code;
+        Generator::Buffers generator;
+        Peephole::Buffers peephole;
+        LabelId labels = 0;
+        std::optional<CompileError> error;
+    };
+
+    std::vector<Region> m_regions; // only ever grows, the buffers of a bigger program stay for the next one
+};
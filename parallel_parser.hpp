@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "compile_error.hpp"
+#include "interner.hpp"
+#include "lexer_scan.hpp"
+#include "parser.hpp"
+#include "thread_pool.hpp"
+#include "tokenization.hpp"
+
+/* Parses a big file on several threads. A quick scan over the source finds
+** where top-level statements end, the source is cut there into chunks, and
+** every chunk is lexed and parsed on its own, with a parser and an interner
+** of its own. The chunks are then put together in order: their expressions
+** go into one pool and their names into the interner of the file, numbered
+** as if the file had been parsed in one go. A chunk that doesn't parse could
+** be the scan's mistake on a broken file, so then nothing is returned and
+** the file is parsed the usual way, which finds the real error.
+*/
+class ParallelParser {
+public:
+    // chunks are at least this big, smaller ones cost more to put together than they save
+    static constexpr size_t min_chunk_size = 64 * 1024;
+
+    /* The program, with its names in the interner, which must be empty. The
+    ** nodes live in the parsers of the chunks, so they stay valid until the
+    ** next parse. Returns nothing if the source is worth no more than one
+    ** chunk or a chunk failed.
+    */
+    std::optional<NodeProg> parse(const std::string_view src, Interner& interner, const size_t threads)
+    {
+        const size_t chunk_size = std::max(min_chunk_size, src.size() / (threads * chunks_per_thread) + 1);
+        m_chunks.clear();
+        if (threads < 2 || !split(src, chunk_size) || m_chunks.size() < 2) {
+            return {};
+        }
+        while (m_parsers.size() < m_chunks.size()) {
+            m_parsers.emplace_back();
+            m_interners.emplace_back();
+        }
+
+        WorkStealingPool pool(std::min(threads, m_chunks.size()));
+        pool.run(m_chunks.size(), [&](size_t, const size_t index) {
+            Chunk& chunk = m_chunks[index];
+            Interner& chunk_interner = m_interners[index];
+            chunk_interner.clear();
+            Tokenizer tokenizer(chunk.src, chunk_interner, chunk.first_line);
+            m_parsers[index].reset(tokenizer);
+            try {
+                chunk.prog = m_parsers[index].parse_prog();
+            }
+            catch (const CompileError&) {
+                chunk.prog.reset();
+            }
+        });
+        if (!std::ranges::all_of(m_chunks, [](const Chunk& chunk) { return chunk.prog.has_value(); })) {
+            return {};
+        }
+        return stitch(interner);
+    }
+
+    // what the parsers of the chunks consumed, after a parse that returned the program
+    [[nodiscard]] size_t tokens_read() const
+    {
+        size_t tokens = 0;
+        for (size_t i = 0; i < m_chunks.size(); i++) {
+            tokens += m_parsers[i].tokens_read();
+        }
+        return tokens;
+    }
+
+    [[nodiscard]] size_t arena_bytes() const
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < m_chunks.size(); i++) {
+            bytes += m_parsers[i].arena_stats().bytes_used;
+        }
+        return bytes;
+    }
+
+private:
+    // a few chunks per thread, so a thread that finishes early can steal one
+    static constexpr size_t chunks_per_thread = 4;
+
+    struct Chunk {
+        std::string_view src;
+        int first_line;
+        std::optional<NodeProg> prog;
+    };
+
+    /* Cuts the source after a `;` or a `}` that ends a top-level statement,
+    ** but not before an `elif` or an `else`, which still belong to the if.
+    ** Braces in comments don't count. Returns false if the braces don't
+    ** match, the file has an error then.
+    */
+    bool split(const std::string_view src, const size_t chunk_size)
+    {
+        size_t depth = 0;
+        size_t start = 0;
+        int line = 1;
+        const auto cut = [&](const size_t end) {
+            m_chunks.push_back({ src.substr(start, end - start), line, {} });
+            line += static_cast<int>(std::count(src.begin() + static_cast<std::ptrdiff_t>(start),
+                                                src.begin() + static_cast<std::ptrdiff_t>(end), '\n'));
+            start = end;
+        };
+        for (size_t i = 0; i < src.size(); i++) {
+            const char c = src[i];
+            if (c == '/' && i + 1 < src.size() && (src[i + 1] == '/' || src[i + 1] == '*')) {
+                i = skip_comment(src, i) - 1;
+            }
+            else if (c == '{') {
+                depth++;
+            }
+            else if (c == '}') {
+                if (depth == 0) {
+                    return false;
+                }
+                depth--;
+                if (depth == 0 && i + 1 - start >= chunk_size && !continues_if(src, i + 1)) {
+                    cut(i + 1);
+                }
+            }
+            else if (c == ';' && depth == 0 && i + 1 - start >= chunk_size) {
+                cut(i + 1);
+            }
+        }
+        if (depth != 0) {
+            return false;
+        }
+        if (start != src.size()) {
+            cut(src.size());
+        }
+        return true;
+    }
+
+    // the position after the comment that starts at pos
+    static size_t skip_comment(const std::string_view src, const size_t pos)
+    {
+        // the newline that ends a line comment is whitespace, it can stay
+        const size_t end = src[pos + 1] == '/' ? src.find('\n', pos + 2) : src.find("*/", pos + 2);
+        if (end == std::string_view::npos) {
+            return src.size();
+        }
+        return src[pos + 1] == '/' ? end : end + 2;
+    }
+
+    // whether the next token after pos is `elif` or `else`
+    static bool continues_if(const std::string_view src, size_t pos)
+    {
+        while (pos < src.size()) {
+            if (scan::classify(src[pos]) == CharClass::space) {
+                pos++;
+            }
+            else if (src[pos] == '/' && pos + 1 < src.size() && (src[pos + 1] == '/' || src[pos + 1] == '*')) {
+                pos = skip_comment(src, pos);
+            }
+            else {
+                break;
+            }
+        }
+        size_t end = pos;
+        while (end < src.size() && scan::is_alnum(src[end])) {
+            end++;
+        }
+        const std::string_view word = src.substr(pos, end - pos);
+        return word == "elif" || word == "else";
+    }
+
+    /* The chunks in order, with their expression ids moved past those of the
+    ** chunks before and their symbols renamed to those of the file
+    */
+    NodeProg stitch(Interner& interner)
+    {
+        NodeProg prog { std::pmr::vector<NodeStmt*>(), {}, std::pmr::vector<NodeFn*>() };
+        size_t num_stmts = 0;
+        size_t num_exprs = 0;
+        size_t num_fns = 0;
+        for (const Chunk& chunk : m_chunks) {
+            num_stmts += chunk.prog->stmts.size();
+            num_exprs += chunk.prog->exprs.size();
+            num_fns += chunk.prog->fns.size();
+        }
+        prog.stmts.reserve(num_stmts);
+        prog.exprs.reserve(num_exprs);
+        prog.fns.reserve(num_fns);
+
+        for (size_t c = 0; c < m_chunks.size(); c++) {
+            NodeProg& part = *m_chunks[c].prog;
+            // the names of a chunk are numbered by their first use in it, so doing the chunks in order
+            // numbers them by their first use in the file
+            const Interner& names = m_interners[c];
+            m_symbols.resize(names.size());
+            for (Symbol sym = 0; sym < names.size(); sym++) {
+                m_symbols[sym] = interner.intern(names.name(sym));
+            }
+
+            const auto base = static_cast<ExprId>(prog.exprs.size());
+            const FlatExprs& exprs = part.exprs;
+            for (ExprId id = 0; id < exprs.size(); id++) {
+                uint32_t lhs = exprs.lhs[id];
+                uint32_t rhs = exprs.rhs[id];
+                if (exprs.kinds[id] == ExprKind::ident || exprs.kinds[id] == ExprKind::call) {
+                    lhs = m_symbols[lhs];
+                }
+                else if (is_bin_expr(exprs.kinds[id])) {
+                    lhs += base;
+                    rhs += base;
+                }
+                prog.exprs.kinds.push_back(exprs.kinds[id]);
+                prog.exprs.firsts.push_back(exprs.firsts[id] + base);
+                prog.exprs.lhs.push_back(lhs);
+                prog.exprs.rhs.push_back(rhs);
+            }
+            for (NodeStmt* stmt : part.stmts) {
+                rebase_stmt(stmt, base);
+                prog.stmts.push_back(stmt);
+            }
+            for (NodeFn* fn : part.fns) {
+                fn->name = m_symbols[fn->name];
+                for (Symbol& param : fn->params) {
+                    param = m_symbols[param];
+                }
+                rebase_scope(fn->body, base);
+                prog.fns.push_back(fn);
+            }
+        }
+        return prog;
+    }
+
+    void rebase_scope(NodeScope* scope, const ExprId base) // NOLINT(*-no-recursion)
+    {
+        for (NodeStmt* stmt : scope->stmts) {
+            rebase_stmt(stmt, base);
+        }
+    }
+
+    void rebase_if_pred(std::optional<NodeIfPred*> pred, const ExprId base) // NOLINT(*-no-recursion)
+    {
+        while (pred.has_value()) {
+            if (NodeIfPredElif** elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                (*elif)->expr += base;
+                rebase_scope((*elif)->scope, base);
+                pred = (*elif)->pred;
+            }
+            else {
+                rebase_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope, base);
+                pred.reset();
+            }
+        }
+    }
+
+    void rebase_stmt(NodeStmt* stmt, const ExprId base) // NOLINT(*-no-recursion)
+    {
+        struct RebaseVisitor {
+            ParallelParser& parser;
+            ExprId base;
+
+            void operator()(NodeStmtExit* stmt_exit) const
+            {
+                stmt_exit->expr += base;
+            }
+
+            void operator()(NodeStmtLet* stmt_let) const
+            {
+                stmt_let->ident = parser.m_symbols[stmt_let->ident];
+                stmt_let->expr += base;
+            }
+
+            void operator()(NodeScope* scope) const
+            {
+                parser.rebase_scope(scope, base);
+            }
+
+            void operator()(NodeStmtIf* stmt_if) const
+            {
+                stmt_if->expr += base;
+                parser.rebase_scope(stmt_if->scope, base);
+                parser.rebase_if_pred(stmt_if->pred, base);
+            }
+
+            void operator()(NodeStmtAssign* stmt_assign) const
+            {
+                stmt_assign->ident = parser.m_symbols[stmt_assign->ident];
+                stmt_assign->expr += base;
+            }
+
+            void operator()(NodeStmtFor* stmt_for) const
+            {
+                stmt_for->var = parser.m_symbols[stmt_for->var];
+                stmt_for->start += base;
+                stmt_for->step += base;
+                stmt_for->end += base;
+                parser.rebase_scope(stmt_for->body, base);
+            }
+
+            void operator()(NodeStmtReturn* stmt_return) const
+            {
+                stmt_return->expr += base;
+            }
+        };
+
+        RebaseVisitor visitor { .parser = *this, .base = base };
+        std::visit(visitor, stmt->var);
+    }
+
+    // one of each for every chunk, kept from one file to the next like the parser of the compiler
+    std::deque<Parser> m_parsers;
+    std::deque<Interner> m_interners;
+    std::vector<Chunk> m_chunks; // after the parsers, the programs of the chunks are in their arenas
+    std::vector<Symbol> m_symbols; // the symbols in the file of the names of the chunk being put together
+};
@@ -1,76 +1,36 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <memory_resource>
 #include <variant>
+#include <vector>
 
 #include "arena.hpp"
+#include "compile_error.hpp"
+#include "flat_ast.hpp"
 #include "tokenization.hpp"
 
-struct NodeTermIntLit {
-    Token int_lit;
-};
-
-struct NodeTermIdent {
-    Token ident;
-};
-
-struct NodeExpr;
-
-struct NodeTermParen {
-    NodeExpr* expr;
-};
-
-struct NodeBinExprAdd {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExprMulti {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExprSub {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExprDiv {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*> var;
-};
-
-struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
-};
-
-struct NodeExpr {
-    std::variant<NodeTerm*, NodeBinExpr*> var;
-};
-
 struct NodeStmtExit {
-    NodeExpr* expr;
+    ExprId expr;
 };
 
 struct NodeStmtLet {
-    Token ident;
-    NodeExpr* expr {};
+    Symbol ident {};
+    ExprId expr {};
 };
 
 struct NodeStmt;
 
 struct NodeScope {
-    std::vector<NodeStmt*> stmts;
+    std::pmr::vector<NodeStmt*> stmts; // backed by the parser's arena
 };
 
 struct NodeIfPred;
 
 struct NodeIfPredElif {
-    NodeExpr* expr {};
+    ExprId expr {};
     NodeScope* scope {};
     std::optional<NodeIfPred*> pred;
 };
@@ -84,133 +44,187 @@ struct NodeIfPred {
 };
 
 struct NodeStmtIf {
-    NodeExpr* expr {};
+    ExprId expr {};
     NodeScope* scope {};
     std::optional<NodeIfPred*> pred;
 };
 
 struct NodeStmtAssign {
-    Token ident;
-    NodeExpr* expr {};
+    Symbol ident {};
+    ExprId expr {};
 };
 
 struct NodeStmtFor {
-    Token var; // the variable to iterate over
-    NodeExpr* start; // the expression to iterate over
-    NodeExpr* step; // the step value
-    NodeExpr* end;
+    Symbol var; // the variable to iterate over
+    ExprId start; // the expression to iterate over
+    ExprId step; // the step value
+    ExprId end;
     NodeScope* body;
 };
 
+// only inside a function
+struct NodeStmtReturn {
+    ExprId expr;
+};
+
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtFor*> var;
+    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtFor*, NodeStmtReturn*>
+        var;
+};
+
+/* A function sees its parameters and its own variables, not those of the
+** program, and returns 0 if its body ends without a return
+*/
+struct NodeFn {
+    Symbol name {};
+    std::pmr::vector<Symbol> params; // backed by the parser's arena
+    NodeScope* body {};
 };
 
 struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+    std::pmr::vector<NodeStmt*> stmts; // backed by the parser's arena
+    FlatExprs exprs; // every expression of the program
+    std::pmr::vector<NodeFn*> fns; // the functions, defined at the top level in any order, also in the arena
 };
 
+// the program defines or calls functions, which only the stack machine generates
+inline bool uses_functions(const NodeProg& prog)
+{
+    return !prog.fns.empty() || std::ranges::find(prog.exprs.kinds, ExprKind::call) != prog.exprs.kinds.end();
+}
+
 class Parser {
 public:
-    explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens))
-        , m_allocator(1024 * 1024 * 4) // 4 mb
+    Parser()
+        : m_allocator(1024 * 64) // 64 kb to start with, the arena grows with the input
     {
     }
 
-    void error_expected(const std::string& msg) const
+    /* Starts over on the tokens of another file, which are pulled from the
+    ** source as the parser needs them. The arena keeps its blocks, so the
+    ** nodes of the last program must not be used anymore. The expressions
+    ** go into the pool, which keeps its memory, the one of that program can
+    ** be given back here.
+    */
+    void reset(TokenSource& source, FlatExprs pool = {})
     {
-        std::cerr << "[Parse Error] Expected " << msg << " on line " << peek(-1).value().line << std::endl;
-        exit(EXIT_FAILURE);
+        m_source = &source;
+        m_index = 0;
+        m_pulled = 0;
+        m_allocator.reset();
+        m_exprs = std::move(pool);
+        m_exprs.clear();
+        m_in_fn = false;
+        // what an expression with an error left behind
+        m_pending_ops.clear();
+        m_operands.clear();
     }
 
-    std::optional<NodeTerm*> parse_term() // NOLINT(*-no-recursion)
+    // the tokens consumed since the reset, the end of the file is never consumed
+    [[nodiscard]] size_t tokens_read() const
     {
-        if (auto int_lit = try_consume(TokenType::int_lit)) {
-            auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_int_lit);
-            return term;
-        }
-        if (auto ident = try_consume(TokenType::ident)) {
-            auto expr_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
-            auto term = m_allocator.emplace<NodeTerm>(expr_ident);
-            return term;
-        }
-        if (const auto open_paren = try_consume(TokenType::open_paren)) {
-            auto expr = parse_expr();
-            if (!expr.has_value()) {
-                error_expected("expression");
-            }
-            try_consume_err(TokenType::close_paren);
-            auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_paren);
-            return term;
-        }
-        return {};
+        return m_index;
     }
 
-    std::optional<NodeExpr*> parse_expr(const int min_prec = 0) // NOLINT(*-no-recursion)
+    [[nodiscard]] ArenaAllocator::Stats arena_stats() const
     {
-        std::optional<NodeTerm*> term_lhs = parse_term();
-        if (!term_lhs.has_value()) {
-            return {};
-        }
-        auto expr_lhs = m_allocator.emplace<NodeExpr>(term_lhs.value());
+        return m_allocator.stats();
+    }
 
+    void error_expected(const std::string& msg)
+    {
+        throw CompileError("[Parse Error] Expected " + msg + " on line " + std::to_string(peek(-1).line));
+    }
+
+    /* Shunting-yard over explicit stacks, so the depth of an expression is
+    ** only bounded by memory. Operands and operators are taken turn by turn,
+    ** and an operator waits on its stack until one that doesn't bind tighter
+    ** comes after it. It is then added with its operands from the other
+    ** stack, which keeps the pool in post-order and adds the nodes in the
+    ** order precedence climbing would. The arguments of a call are parsed
+    ** by a call of their own, so only calls nest on the call stack. Returns
+    ** nothing if no expression starts here.
+    */
+    std::optional<ExprId> parse_expr() // NOLINT(*-no-recursion)
+    {
+        // an expression never starts inside another one, but the stacks are shared
+        const size_t ops_base = m_pending_ops.size();
+        const size_t operands_base = m_operands.size();
         while (true) {
-            std::optional<Token> curr_tok = peek();
-            std::optional<int> prec;
-            if (curr_tok.has_value()) {
-                prec = bin_prec(curr_tok->type);
-                if (!prec.has_value() || prec < min_prec) {
-                    break;
-                }
+            while (try_consume(TokenType::open_paren)) {
+                m_pending_ops.push_back(TokenType::open_paren);
             }
-            else {
-                break;
+            if (auto int_lit = try_consume(TokenType::int_lit)) {
+                m_operands.push_back(m_exprs.add_int_lit(parse_int(*int_lit)));
             }
-            const auto [type, line, value] = consume();
-            const int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-            if (!expr_rhs.has_value()) {
-                error_expected("expression");
-            }
-            auto expr = m_allocator.emplace<NodeBinExpr>();
-            auto expr_lhs2 = m_allocator.emplace<NodeExpr>();
-            if (type == TokenType::plus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto add = m_allocator.emplace<NodeBinExprAdd>(expr_lhs2, expr_rhs.value());
-                expr->var = add;
-            }
-            else if (type == TokenType::star) {
-                expr_lhs2->var = expr_lhs->var;
-                auto multi = m_allocator.emplace<NodeBinExprMulti>(expr_lhs2, expr_rhs.value());
-                expr->var = multi;
-            }
-            else if (type == TokenType::minus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto sub = m_allocator.emplace<NodeBinExprSub>(expr_lhs2, expr_rhs.value());
-                expr->var = sub;
+            else if (auto ident = try_consume(TokenType::ident)) {
+                // the token is gone from the lookahead once the next one is consumed
+                const Symbol name = ident->sym;
+                if (try_consume(TokenType::open_paren)) {
+                    m_operands.push_back(parse_call(name));
+                }
+                else {
+                    m_operands.push_back(m_exprs.add_ident(name));
+                }
             }
-            else if (type == TokenType::fslash) {
-                expr_lhs2->var = expr_lhs->var;
-                auto div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs2, expr_rhs.value());
-                expr->var = div;
+            else if (m_pending_ops.size() == ops_base) {
+                return {};
             }
             else {
-                assert(false); // Unreachable;
+                // after an operator or a parenthesis
+                error_expected("expression");
             }
-            expr_lhs->var = expr;
+
+            // closing parentheses, until an operator comes or the expression ends
+            while (true) {
+                if (const std::optional<int> prec = bin_prec(peek().type)) {
+                    reduce(ops_base, prec.value());
+                    m_pending_ops.push_back(consume().type);
+                    break;
+                }
+                reduce(ops_base, 0);
+                if (m_pending_ops.size() == ops_base) {
+                    const ExprId expr = m_operands.back();
+                    m_operands.resize(operands_base);
+                    return expr;
+                }
+                try_consume_err(TokenType::close_paren);
+                // the parenthesis only affects the order of the nodes, so it needs no node of its own
+                m_pending_ops.pop_back();
+            }
+        }
+    }
+
+    // the arguments of a call up to its closing parenthesis, the call comes after them in the pool
+    ExprId parse_call(const Symbol name) // NOLINT(*-no-recursion)
+    {
+        const auto first = static_cast<ExprId>(m_exprs.size());
+        uint32_t num_args = 0;
+        if (!try_consume(TokenType::close_paren)) {
+            do {
+                expect_expr();
+                num_args++;
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::close_paren);
         }
-        return expr_lhs;
+        return m_exprs.add_call(name, first, num_args);
+    }
+
+    ExprId expect_expr() // NOLINT(*-no-recursion)
+    {
+        const std::optional<ExprId> expr = parse_expr();
+        if (!expr.has_value()) {
+            error_expected("expression");
+        }
+        return expr.value();
     }
 
     std::optional<NodeScope*> parse_scope() // NOLINT(*-no-recursion)
     {
-        if (!try_consume(TokenType::open_curly).has_value()) {
+        if (!try_consume(TokenType::open_curly)) {
             return {};
         }
-        auto scope = m_allocator.emplace<NodeScope>();
+        auto scope = m_allocator.emplace<NodeScope>(std::pmr::vector<NodeStmt*>(&m_allocator));
         while (auto stmt = parse_stmt()) {
             scope->stmts.push_back(stmt.value());
         }
@@ -256,8 +270,7 @@ public:
 
     std::optional<NodeStmt*> parse_stmt() // NOLINT(*-no-recursion)
     {
-        if (peek().has_value() && peek().value().type == TokenType::exit && peek(1).has_value()
-            && peek(1).value().type == TokenType::open_paren) {
+        if (peek().type == TokenType::exit && peek(1).type == TokenType::open_paren) {
             consume();
             consume();
             auto stmt_exit = m_allocator.emplace<NodeStmtExit>();
@@ -273,12 +286,10 @@ public:
             stmt->var = stmt_exit;
             return stmt;
         }
-        if (peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value()
-            && peek(1).value().type == TokenType::ident && peek(2).has_value()
-            && peek(2).value().type == TokenType::eq) {
+        if (peek().type == TokenType::let && peek(1).type == TokenType::ident && peek(2).type == TokenType::eq) {
             consume();
             auto stmt_let = m_allocator.emplace<NodeStmtLet>();
-            stmt_let->ident = consume();
+            stmt_let->ident = consume().sym;
             consume();
             if (const auto expr = parse_expr()) {
                 stmt_let->expr = expr.value();
@@ -291,10 +302,9 @@ public:
             stmt->var = stmt_let;
             return stmt;
         }
-        if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()
-            && peek(1).value().type == TokenType::eq) {
+        if (peek().type == TokenType::ident && peek(1).type == TokenType::eq) {
             const auto assign = m_allocator.alloc<NodeStmtAssign>();
-            assign->ident = consume();
+            assign->ident = consume().sym;
             consume();
             if (const auto expr = parse_expr()) {
                 assign->expr = expr.value();
@@ -306,14 +316,14 @@ public:
             auto stmt = m_allocator.emplace<NodeStmt>(assign);
             return stmt;
         }
-        if (peek().has_value() && peek().value().type == TokenType::open_curly) {
+        if (peek().type == TokenType::open_curly) {
             if (auto scope = parse_scope()) {
                 auto stmt = m_allocator.emplace<NodeStmt>(scope.value());
                 return stmt;
             }
             error_expected("scope");
         }
-        if (auto if_ = try_consume(TokenType::if_)) {
+        if (try_consume(TokenType::if_)) {
             try_consume_err(TokenType::open_paren);
             auto stmt_if = m_allocator.emplace<NodeStmtIf>();
             if (const auto expr = parse_expr()) {
@@ -334,17 +344,29 @@ public:
             return stmt;
         }
 
-        if (auto for_ = try_consume(TokenType::for_)) {
+        if (m_in_fn && try_consume(TokenType::return_)) {
+            auto stmt_return = m_allocator.emplace<NodeStmtReturn>(expect_expr());
+            try_consume_err(TokenType::semi);
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_return);
+            return stmt;
+        }
+
+        if (try_consume(TokenType::for_)) {
             auto stmt_for = m_allocator.alloc<NodeStmtFor>();
-            stmt_for->var = consume();
+            stmt_for->var = try_consume_err(TokenType::ident).sym;
             try_consume_err(TokenType::eq);
-            stmt_for->start = parse_expr().value();
+            stmt_for->start = expect_expr();
             try_consume_err(TokenType::colon);
-            stmt_for->step = parse_expr().value();
+            stmt_for->step = expect_expr();
             try_consume_err(TokenType::colon);
-            stmt_for->end = parse_expr().value();
+            stmt_for->end = expect_expr();
 
-            stmt_for->body = parse_scope().value();
+            if (const auto scope = parse_scope()) {
+                stmt_for->body = scope.value();
+            }
+            else {
+                error_expected("scope");
+            }
 
             auto stmt = m_allocator.emplace<NodeStmt>(stmt_for);
             return stmt;
@@ -352,52 +374,149 @@ public:
         return {};
     }
 
+    // fn name(params) { body }, only at the top level
+    std::optional<NodeFn*> parse_fn()
+    {
+        if (!try_consume(TokenType::fn)) {
+            return {};
+        }
+        const Symbol name = try_consume_err(TokenType::ident).sym;
+        auto fn = m_allocator.emplace<NodeFn>(name, std::pmr::vector<Symbol>(&m_allocator));
+        try_consume_err(TokenType::open_paren);
+        if (!try_consume(TokenType::close_paren)) {
+            do {
+                fn->params.push_back(try_consume_err(TokenType::ident).sym);
+            } while (try_consume(TokenType::comma));
+            try_consume_err(TokenType::close_paren);
+        }
+        m_in_fn = true;
+        const std::optional<NodeScope*> body = parse_scope();
+        m_in_fn = false;
+        if (!body.has_value()) {
+            error_expected("scope");
+        }
+        fn->body = body.value();
+        return fn;
+    }
+
     std::optional<NodeProg> parse_prog()
     {
-        NodeProg prog;
-        while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
+        NodeProg prog { std::pmr::vector<NodeStmt*>(&m_allocator), {}, std::pmr::vector<NodeFn*>(&m_allocator) };
+        while (peek().type != TokenType::eof) {
+            if (auto fn = parse_fn()) {
+                prog.fns.push_back(fn.value());
+            }
+            else if (auto stmt = parse_stmt()) {
                 prog.stmts.push_back(stmt.value());
             }
             else {
                 error_expected("statement");
             }
         }
+        prog.exprs = std::move(m_exprs);
         return prog;
     }
 
 private:
-    [[nodiscard]] std::optional<Token> peek(const int offset = 0) const
+    // adds the operators on top of the stack that bind at least as tight as min_prec, up to a parenthesis
+    void reduce(const size_t ops_base, const int min_prec)
     {
-        if (m_index + offset >= m_tokens.size()) {
-            return {};
+        while (m_pending_ops.size() > ops_base && m_pending_ops.back() != TokenType::open_paren
+               && bin_prec(m_pending_ops.back()).value() >= min_prec) {
+            const TokenType type = m_pending_ops.back();
+            m_pending_ops.pop_back();
+            const ExprId rhs = m_operands.back();
+            m_operands.pop_back();
+            const ExprId lhs = m_operands.back();
+            // the operator is added after both of its operands, which keeps the pool in post-order
+            if (type == TokenType::plus) {
+                m_operands.back() = m_exprs.add_bin(ExprKind::add, lhs, rhs);
+            }
+            else if (type == TokenType::star) {
+                m_operands.back() = m_exprs.add_bin(ExprKind::multi, lhs, rhs);
+            }
+            else if (type == TokenType::minus) {
+                m_operands.back() = m_exprs.add_bin(ExprKind::sub, lhs, rhs);
+            }
+            else if (type == TokenType::fslash) {
+                m_operands.back() = m_exprs.add_bin(ExprKind::div, lhs, rhs);
+            }
+            else {
+                assert(false); // Unreachable;
+            }
+        }
+    }
+
+    // throws if the literal doesn't fit in 64 bits, instead of wrapping to a number nobody wrote
+    static uint64_t parse_int(const Token& int_lit)
+    {
+        const std::string_view text = int_lit.value.value();
+        uint64_t value = 0;
+        for (const char c : text) {
+            if (__builtin_mul_overflow(value, 10, &value)
+                || __builtin_add_overflow(value, static_cast<uint64_t>(c - '0'), &value)) {
+                throw CompileError("[Parse Error] Integer literal " + std::string(text)
+                                   + " does not fit in 64 bits on line " + std::to_string(int_lit.line));
+            }
+        }
+        return value;
+    }
+
+    /* The tokens from the one before the next up to the lookahead of
+    ** parse_stmt, which decides on a statement with up to three tokens
+    */
+    [[nodiscard]] const Token& peek(const int offset = 0)
+    {
+        assert(offset >= -1 && offset < static_cast<int>(lookahead));
+        if (m_index == 0 && offset < 0) {
+            // nothing was consumed yet, so the error is on the line of the first token
+            return peek();
+        }
+        const size_t index = m_index + static_cast<size_t>(offset);
+        while (m_pulled <= index) {
+            m_ring[m_pulled % ring_size] = m_source->next();
+            m_pulled++;
         }
-        return m_tokens.at(m_index + offset);
+        return m_ring[index % ring_size];
     }
 
-    Token consume()
+    const Token& consume()
     {
-        return m_tokens.at(m_index++);
+        const Token& token = peek();
+        if (token.type != TokenType::eof) {
+            m_index++;
+        }
+        return token;
     }
 
-    Token try_consume_err(const TokenType type)
+    const Token& try_consume_err(const TokenType type)
     {
-        if (peek().has_value() && peek().value().type == type) {
+        if (peek().type == type) {
             return consume();
         }
         error_expected(to_string(type));
-        return {};
+        return peek();
     }
 
-    std::optional<Token> try_consume(const TokenType type)
+    // returns the consumed token, or nullptr if the next one has another type
+    const Token* try_consume(const TokenType type)
     {
-        if (peek().has_value() && peek().value().type == type) {
-            return consume();
+        if (peek().type == type) {
+            return &consume();
         }
-        return {};
+        return nullptr;
     }
 
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
+    static constexpr size_t lookahead = 3;
+    static constexpr size_t ring_size = 4; // the lookahead and the token before it
+
+    TokenSource* m_source = nullptr;
+    std::array<Token, ring_size> m_ring {};
+    size_t m_index = 0; // the number of tokens consumed
+    size_t m_pulled = 0; // the number of tokens taken from the source
     ArenaAllocator m_allocator;
+    FlatExprs m_exprs;
+    std::vector<TokenType> m_pending_ops; // the operators and open parentheses parse_expr has yet to add
+    std::vector<ExprId> m_operands; // the operands they are waiting for
+    bool m_in_fn = false; // return is only a statement in the body of a function
 };
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "instr.hpp"
+
+/* A peephole rule looks at the last `window` instructions emitted, comments
+** left out. If it matches it returns true and puts what replaces them into
+** `out`, which may be nothing at all.
+*/
+struct PeepholeRule {
+    size_t window;
+    bool (*rewrite)(std::span<const Instr> instrs, std::vector<Instr>& out);
+};
+
+namespace peephole {
+
+// push x followed by pop y is mov y, x, or nothing when x is y
+inline bool push_pop(const std::span<const Instr> instrs, std::vector<Instr>& out)
+{
+    if (instrs[0].op != Op::push || instrs[1].op != Op::pop) {
+        return false;
+    }
+    if (instrs[0].dst != instrs[1].dst) {
+        out.push_back({ .op = Op::mov, .dst = instrs[1].dst, .src = instrs[0].dst });
+    }
+    return true;
+}
+
+/* push x / mov r, s / pop y is mov y, x / mov r, s, where s is an immediate
+** or a register other than y. The mov in between doesn't touch the stack, so
+** [rsp + n] means the same before the push and after the pop.
+*/
+inline bool push_mov_pop(const std::span<const Instr> instrs, std::vector<Instr>& out)
+{
+    const Instr& push = instrs[0];
+    const Instr& mov = instrs[1];
+    const Instr& pop = instrs[2];
+    if (push.op != Op::push || mov.op != Op::mov || pop.op != Op::pop || mov.dst.kind != Operand::Kind::reg
+        || mov.dst.reg == pop.dst.reg || mov.dst.reg == push.dst.reg) {
+        return false;
+    }
+    const bool plain_src = mov.src.kind == Operand::Kind::imm
+        || (mov.src.kind == Operand::Kind::reg && mov.src.reg != pop.dst.reg);
+    if (!plain_src) {
+        return false;
+    }
+    out.push_back({ .op = Op::mov, .dst = pop.dst, .src = push.dst });
+    out.push_back(mov);
+    return true;
+}
+
+// mov a, x / mov b, a / pop a is mov b, x / pop a, the pop overwrites a anyway
+inline bool forward_load(const std::span<const Instr> instrs, std::vector<Instr>& out)
+{
+    const Instr& load = instrs[0];
+    const Instr& copy = instrs[1];
+    const Instr& pop = instrs[2];
+    if (load.op != Op::mov || copy.op != Op::mov || pop.op != Op::pop || load.dst.kind != Operand::Kind::reg
+        || copy.dst.kind != Operand::Kind::reg || copy.src != load.dst || pop.dst != load.dst
+        || load.src.kind == Operand::Kind::reg) {
+        return false;
+    }
+    out.push_back({ .op = Op::mov, .dst = copy.dst, .src = load.src });
+    out.push_back(pop);
+    return true;
+}
+
+// a jump to the label right after it
+inline bool jump_to_next(const std::span<const Instr> instrs, std::vector<Instr>& out)
+{
+    if (instrs[0].op != Op::jmp || instrs[1].op != Op::label || instrs[0].dst != instrs[1].dst) {
+        return false;
+    }
+    out.push_back(instrs[1]);
+    return true;
+}
+
+// add x, 0, sub x, 0 and mov x, x
+inline bool no_op(const std::span<const Instr> instrs, std::vector<Instr>&)
+{
+    const Instr& instr = instrs[0];
+    if ((instr.op == Op::add || instr.op == Op::sub) && instr.src.kind == Operand::Kind::imm) {
+        return instr.src.value == 0;
+    }
+    return instr.op == Op::mov && instr.dst.kind == Operand::Kind::reg && instr.dst.width == 64
+        && instr.dst == instr.src;
+}
+
+/* Popping a scope and then pushing a register overwrites the slot that was
+** just freed: add rsp, n / push r is add rsp, n - 8 / mov [rsp], r. The flags
+** of the add change, but the generators never read flags after an add to rsp.
+*/
+inline bool free_then_push(const std::span<const Instr> instrs, std::vector<Instr>& out)
+{
+    const Instr& add = instrs[0];
+    const Instr& push = instrs[1];
+    if (add.op != Op::add || add.dst != op_reg(Reg::rsp) || add.src.kind != Operand::Kind::imm
+        || add.src.value < 8 || push.op != Op::push || push.dst.kind != Operand::Kind::reg) {
+        return false;
+    }
+    if (add.src.value != 8) {
+        out.push_back({ .op = Op::add, .dst = add.dst, .src = op_imm(add.src.value - 8) });
+    }
+    out.push_back({ .op = Op::mov, .dst = op_mem(Reg::rsp), .src = push.dst });
+    return true;
+}
+
+inline std::span<const PeepholeRule> default_rules()
+{
+    static constexpr PeepholeRule rules[] = {
+        { 2, push_pop },
+        { 3, push_mov_pop },
+        { 3, forward_load },
+        { 2, jump_to_next },
+        { 1, no_op },
+        { 2, free_then_push },
+    };
+    return rules;
+}
+
+}
+
+/* Keeps the instructions of the program in memory and applies the rules to
+** the end of the list every time an instruction comes in. A rewrite can make
+** another rule match what came before, so the rules are tried again until
+** none matches. finish() passes the result on to the real sink. The
+** buffers outlive the pass, so the next one starts with their memory.
+*/
+class Peephole final : public InstrSink {
+public:
+    struct Buffers {
+        std::vector<Instr> instrs;
+        std::vector<size_t> code; // the positions of the instructions that aren't comments
+        std::vector<Instr> window;
+        std::vector<Instr> replacement;
+    };
+
+    Peephole(InstrSink& sink, Buffers& buffers, const std::span<const PeepholeRule> rules = peephole::default_rules())
+        : m_sink(sink)
+        , m_rules(rules)
+        , m_instrs(buffers.instrs)
+        , m_code(buffers.code)
+        , m_window(buffers.window)
+        , m_replacement(buffers.replacement)
+    {
+        // a pass that stopped at an error left its instructions behind
+        m_instrs.clear();
+        m_code.clear();
+    }
+
+    void emit(const Instr& instr) override
+    {
+        m_instrs.push_back(instr);
+        if (instr.op == Op::comment) {
+            return;
+        }
+        m_code.push_back(m_instrs.size() - 1);
+        while (apply_rules()) { }
+    }
+
+    // the rules never match across a flush
+    void flush() override
+    {
+        finish();
+    }
+
+    void finish()
+    {
+        for (const Instr& instr : m_instrs) {
+            m_sink.emit(instr);
+        }
+        m_instrs.clear();
+        m_code.clear();
+    }
+
+    // how many times a rule matched
+    [[nodiscard]] size_t rewrites() const
+    {
+        return m_rewrites;
+    }
+
+private:
+    bool apply_rules()
+    {
+        for (const PeepholeRule& rule : m_rules) {
+            if (rule.window > m_code.size()) {
+                continue;
+            }
+            // the window in order, without the comments in between
+            m_window.clear();
+            for (size_t i = m_code.size() - rule.window; i < m_code.size(); i++) {
+                m_window.push_back(m_instrs[m_code[i]]);
+            }
+            m_replacement.clear();
+            if (!rule.rewrite(m_window, m_replacement)) {
+                continue;
+            }
+            // the matched instructions are near the end, so erasing them is cheap
+            for (size_t i = 0; i < rule.window; i++) {
+                m_instrs.erase(m_instrs.begin() + static_cast<std::ptrdiff_t>(m_code.back()));
+                m_code.pop_back();
+            }
+            for (const Instr& instr : m_replacement) {
+                m_instrs.push_back(instr);
+                m_code.push_back(m_instrs.size() - 1);
+            }
+            m_rewrites++;
+            return true;
+        }
+        return false;
+    }
+
+    InstrSink& m_sink;
+    std::span<const PeepholeRule> m_rules;
+    std::vector<Instr>& m_instrs;
+    std::vector<size_t>& m_code;
+    std::vector<Instr>& m_window;
+    std::vector<Instr>& m_replacement;
+    size_t m_rewrites = 0;
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "codegen_cache.hpp"
+#include "compile_error.hpp"
+#include "parser.hpp"
+
+/* The branches and loops of a program that --instrument counts and
+** --profile-use reads the counts of. Every site gets a counter: the body of
+** a loop counts its iterations, an if counts how often it was reached and
+** each of its branches how often it was taken. The sites are numbered in
+** the order they show up in the program, so the same program always numbers
+** them the same, and its shape is hashed to tell a profile of another
+** program from its own.
+**
+** An instrumented program keeps its counters in a segment of its own at
+** data_address: a header, a counter per site and the path the profile is
+** written to. Before it exits it writes the header and the counters there,
+** and that's the profile.
+*/
+class ProfileSites {
+public:
+    static constexpr uint64_t data_address = 0x40000000;
+    static constexpr uint64_t magic = 0x31304652504F5248; // HYPROF01 in the first 8 bytes
+    // the magic, the shape and the number of sites
+    static constexpr uint64_t header_size = 3 * sizeof(uint64_t);
+
+    explicit ProfileSites(const NodeProg& prog)
+    {
+        for (const NodeStmt* stmt : prog.stmts) {
+            add_stmt(stmt);
+        }
+        for (const NodeFn* fn : prog.fns) {
+            m_shape.add(fn->params.size());
+            add_scope(fn->body);
+        }
+        m_shape.add(m_sites.size());
+    }
+
+    // the number of the site, a loop body, an if or the scope of one of its branches
+    [[nodiscard]] std::optional<size_t> find(const void* node) const
+    {
+        const auto site = m_sites.find(node);
+        if (site == m_sites.end()) {
+            return {};
+        }
+        return site->second;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_sites.size();
+    }
+
+    [[nodiscard]] uint64_t shape() const
+    {
+        return m_shape.value();
+    }
+
+    [[nodiscard]] static uint64_t counter_address(const size_t site)
+    {
+        return data_address + header_size + site * sizeof(uint64_t);
+    }
+
+    // what the program writes, the header and the counters
+    [[nodiscard]] uint64_t profile_size() const
+    {
+        return header_size + size() * sizeof(uint64_t);
+    }
+
+    [[nodiscard]] uint64_t path_address() const
+    {
+        return data_address + profile_size();
+    }
+
+    // the segment of an instrumented program when it starts, with every counter 0
+    [[nodiscard]] std::vector<uint8_t> data(const std::string& profile_path) const
+    {
+        std::vector<uint8_t> data(profile_size() + profile_path.size() + 1);
+        const uint64_t header[] = { magic, shape(), size() };
+        std::memcpy(data.data(), header, sizeof(header));
+        std::memcpy(data.data() + profile_size(), profile_path.c_str(), profile_path.size() + 1);
+        return data;
+    }
+
+private:
+    void add_site(const void* node)
+    {
+        m_sites.emplace(node, m_sites.size());
+    }
+
+    void add_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        m_shape.add(scope->stmts.size());
+        for (const NodeStmt* stmt : scope->stmts) {
+            add_stmt(stmt);
+        }
+    }
+
+    void add_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        m_shape.add(stmt->var.index());
+        if (const auto* scope = std::get_if<NodeScope*>(&stmt->var)) {
+            add_scope(*scope);
+        }
+        else if (const auto* stmt_for = std::get_if<NodeStmtFor*>(&stmt->var)) {
+            add_site((*stmt_for)->body);
+            add_scope((*stmt_for)->body);
+        }
+        else if (const auto* stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            add_site(*stmt_if);
+            add_site((*stmt_if)->scope);
+            add_scope((*stmt_if)->scope);
+            for (std::optional<NodeIfPred*> pred = (*stmt_if)->pred; pred.has_value();) {
+                m_shape.add(pred.value()->var.index());
+                if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                    add_site((*elif)->scope);
+                    add_scope((*elif)->scope);
+                    pred = (*elif)->pred;
+                }
+                else {
+                    const NodeScope* scope = std::get<NodeIfPredElse*>(pred.value()->var)->scope;
+                    add_site(scope);
+                    add_scope(scope);
+                    pred.reset();
+                }
+            }
+        }
+    }
+
+    std::unordered_map<const void*, size_t> m_sites;
+    Hasher m_shape;
+};
+
+/* The counts a run of the instrumented program wrote, by site */
+class Profile {
+public:
+    // throws if the file isn't a profile of a program with these sites
+    Profile(const ProfileSites& sites, const std::string& path)
+        : m_sites(sites)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw CompileError("Could not read the profile " + path);
+        }
+        const std::vector<char> bytes { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+        if (bytes.size() != sites.profile_size()) {
+            throw CompileError("The profile " + path + " is not one of this program");
+        }
+        uint64_t header[3] {};
+        std::memcpy(header, bytes.data(), sizeof(header));
+        if (header[0] != ProfileSites::magic || header[1] != sites.shape() || header[2] != sites.size()) {
+            throw CompileError("The profile " + path + " is not one of this program");
+        }
+        m_counts.resize(sites.size());
+        std::memcpy(m_counts.data(), bytes.data() + ProfileSites::header_size, m_counts.size() * sizeof(uint64_t));
+    }
+
+    // 0 for a node that is not a site
+    [[nodiscard]] uint64_t count(const void* node) const
+    {
+        const std::optional<size_t> site = m_sites.find(node);
+        return site.has_value() ? m_counts[*site] : 0;
+    }
+
+private:
+    const ProfileSites& m_sites;
+    std::vector<uint64_t> m_counts;
+};
@@ -0,0 +1,696 @@
+#pragma once
+
+#include <cassert>
+#include <limits>
+
+#include "compile_error.hpp"
+#include "instr.hpp"
+#include "loops.hpp"
+#include "parser.hpp"
+#include "registers.hpp"
+#include "strength_reduction.hpp"
+#include "symbol_table.hpp"
+
+/* A code generator that keeps values in registers instead of going through
+** the machine stack for every operation. Expressions are evaluated in
+** Sethi-Ullman order, so the operand that needs more registers is computed
+** first, and `let` variables live in registers until they run out. Only
+** then are variables spilled to rbp-relative stack slots, and temporaries
+** that find no free register are pushed for the duration of one operation.
+*/
+class RegGenerator {
+public:
+    // loops with a known trip count are unrolled `unroll` times, the program must outlive the generator
+    RegGenerator(const NodeProg& prog, const Interner& interner, InstrSink& sink, const uint64_t unroll = 1)
+        : m_prog(prog)
+        , m_interner(interner)
+        , m_sink(sink)
+        , m_vars(interner.size())
+        , m_loops(m_prog.exprs)
+        , m_unroll(unroll)
+    {
+        compute_needs();
+    }
+
+    /* The end and the step of a loop that can't change them are evaluated
+    ** once, into a register, instead of every time Hy evaluates them
+    */
+    void hoist_loop_bounds()
+    {
+        m_hoist = true;
+    }
+
+    /* Evaluates the expression into dst, which must be a free register or a
+    ** variable's register. The operands are evaluated from a stack of tasks
+    ** instead of the call stack, so a long chain of operators can't
+    ** overflow it. A task either evaluates a subtree or finishes the
+    ** operation of a node whose operands were evaluated before it.
+    */
+    void gen_expr(const ExprId expr, const Reg dst)
+    {
+        // nothing evaluated here calls gen_expr again, but the stack must only be emptied down to the tasks of this call
+        const size_t base = m_tasks.size();
+        m_tasks.push_back({ .step = ExprTask::Step::eval, .expr = expr, .dst = dst });
+        while (m_tasks.size() > base) {
+            const ExprTask task = m_tasks.back();
+            m_tasks.pop_back();
+            run_task(task);
+        }
+    }
+
+    void gen_scope(const NodeScope* scope)
+    {
+        begin_scope();
+        for (const NodeStmt* stmt : scope->stmts) {
+            gen_stmt(stmt);
+        }
+        end_scope();
+    }
+
+    void gen_if_pred(const NodeIfPred* pred, const LabelId end_label)
+    {
+        struct PredVisitor {
+            RegGenerator& gen;
+            const LabelId end_label;
+
+            void operator()(const NodeIfPredElif* elif) const
+            {
+                gen.comment("elif");
+                const LabelId label = gen.create_label();
+                gen.gen_branch_if_zero(elif->expr, label);
+                gen.gen_scope(elif->scope);
+                gen.emit(Op::jmp, op_label(end_label));
+                // a failed last elif falls through to the end of the chain from here
+                gen.label(label);
+                if (elif->pred.has_value()) {
+                    gen.gen_if_pred(elif->pred.value(), end_label);
+                }
+            }
+
+            void operator()(const NodeIfPredElse* else_) const
+            {
+                gen.comment("else");
+                gen.gen_scope(else_->scope);
+            }
+        };
+
+        PredVisitor visitor { .gen = *this, .end_label = end_label };
+        std::visit(visitor, pred->var);
+    }
+
+    void gen_stmt(const NodeStmt* stmt)
+    {
+        struct StmtVisitor {
+            RegGenerator& gen;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                gen.comment("exit");
+                const Reg tmp = gen.take_reg();
+                gen.gen_expr(stmt_exit->expr, tmp);
+                gen.emit(Op::mov, op_reg(Reg::rdi), op_reg(tmp));
+                gen.emit(Op::mov, op_reg(Reg::rax), op_imm(60));
+                gen.emit(Op::syscall);
+                gen.release_reg(tmp);
+                gen.comment("/exit");
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                gen.comment("let");
+                if (gen.m_vars.find(stmt_let->ident) != nullptr) {
+                    throw CompileError::redeclared(gen.m_interner.name(stmt_let->ident));
+                }
+                gen.declare(stmt_let->ident, stmt_let->expr);
+                gen.comment("/let");
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                const Var* var = gen.m_vars.find(stmt_assign->ident);
+                if (var == nullptr) {
+                    throw CompileError::undeclared(gen.m_interner.name(stmt_assign->ident));
+                }
+                // the register of the variable is only a safe target if the expression doesn't read it
+                if (var->in_reg && !gen.reads_var(stmt_assign->expr, stmt_assign->ident)) {
+                    gen.gen_expr(stmt_assign->expr, var->reg);
+                    return;
+                }
+                const Reg tmp = gen.take_reg();
+                gen.gen_expr(stmt_assign->expr, tmp);
+                gen.emit(Op::mov, gen.var_operand(stmt_assign->ident), op_reg(tmp));
+                gen.release_reg(tmp);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                gen.comment("scope");
+                gen.gen_scope(scope);
+                gen.comment("/scope");
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                gen.comment("if");
+                const LabelId label = gen.create_label();
+                gen.gen_branch_if_zero(stmt_if->expr, label);
+                gen.gen_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    const LabelId end_label = gen.create_label();
+                    gen.emit(Op::jmp, op_label(end_label));
+                    gen.label(label);
+                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
+                    gen.label(end_label);
+                }
+                else {
+                    gen.label(label);
+                }
+                gen.comment("/if");
+            }
+
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                gen.comment("for loop");
+                gen.gen_for(stmt_for);
+                gen.comment("/for loop");
+            }
+
+            // only in functions, which the compiler doesn't give this backend
+            void operator()(const NodeStmtReturn*) const
+            {
+            }
+        };
+
+        StmtVisitor visitor { .gen = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    // sends the instructions of the whole program to the sink
+    void gen_prog()
+    {
+        // spilled variables are addressed from rbp, so temporaries can be pushed freely
+        emit(Op::mov, op_reg(Reg::rbp), op_reg(Reg::rsp));
+
+        for (const NodeStmt* stmt : m_prog.stmts) {
+            gen_stmt(stmt);
+        }
+
+        emit(Op::mov, op_reg(Reg::rax), op_imm(60));
+        emit(Op::mov, op_reg(Reg::rdi), op_imm(0));
+        emit(Op::syscall);
+    }
+
+private:
+    struct Var {
+        bool in_reg;
+        Reg reg; // if in_reg
+        size_t slot; // otherwise, the variable is at [rbp - (slot + 1) * 8]
+    };
+
+    // rax and rdx are kept free for div, rsp and rbp for the stack
+    static constexpr RegSet allocatable { Reg::rbx, Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8,  Reg::r9,
+                                          Reg::r10, Reg::r11, Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+
+    // variables only get a register while at least this many stay free for expressions
+    static constexpr int reserved_for_temps = 3;
+
+    /* The Sethi-Ullman number of every node: how many registers evaluating it
+    ** takes. The pool is in post-order, so one pass over it is enough.
+    */
+    void compute_needs()
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        m_need.resize(exprs.size());
+        for (ExprId id = 0; id < exprs.size(); id++) {
+            if (!is_bin_expr(exprs.kinds[id])) {
+                m_need[id] = 1;
+                continue;
+            }
+            const ExprId lhs = exprs.lhs[id];
+            const ExprId rhs = exprs.rhs[id];
+            // a literal factor or divisor takes no register either, it is part of the instructions
+            const bool constant_operand = (exprs.kinds[id] == ExprKind::multi || exprs.kinds[id] == ExprKind::div)
+                && exprs.kinds[rhs] == ExprKind::int_lit;
+            if (constant_operand || is_direct_operand(exprs.kinds[id], rhs)) {
+                m_need[id] = m_need[lhs];
+            }
+            else if (m_need[lhs] == m_need[rhs]) {
+                m_need[id] = m_need[lhs] + 1;
+            }
+            else {
+                m_need[id] = std::max(m_need[lhs], m_need[rhs]);
+            }
+        }
+    }
+
+    // true if the right operand can be used by the instruction as it is, without a register
+    [[nodiscard]] bool is_direct_operand(const ExprKind kind, const ExprId operand_id) const
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        if (kind == ExprKind::shl || kind == ExprKind::shr) {
+            // the optimizer only creates shifts by a literal
+            assert(exprs.kinds[operand_id] == ExprKind::int_lit);
+            return true;
+        }
+        switch (exprs.kinds[operand_id]) {
+        case ExprKind::ident:
+            return true;
+        case ExprKind::int_lit:
+            // div has no immediate form, and the others only take sign-extended 32 bit immediates
+            return kind != ExprKind::div && exprs.int_value(operand_id) <= std::numeric_limits<int32_t>::max();
+        default:
+            return false;
+        }
+    }
+
+    [[nodiscard]] Operand operand(const ExprId operand_id) const
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        if (exprs.kinds[operand_id] == ExprKind::ident) {
+            return var_operand(exprs.lhs[operand_id]);
+        }
+        return op_imm(exprs.int_value(operand_id));
+    }
+
+    void gen_op(const ExprKind kind, const Reg dst, const Operand src)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            emit(Op::add, op_reg(dst), src);
+            break;
+        case ExprKind::sub:
+            emit(Op::sub, op_reg(dst), src);
+            break;
+        case ExprKind::multi:
+            // the low 64 bits are the same as with mul, without touching rdx
+            emit(Op::imul, op_reg(dst), src);
+            break;
+        case ExprKind::div:
+            emit(Op::mov, op_reg(Reg::rax), op_reg(dst));
+            emit(Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32));
+            emit(Op::div, src);
+            emit(Op::mov, op_reg(dst), op_reg(Reg::rax));
+            break;
+        case ExprKind::shl:
+            emit(Op::shl, op_reg(dst), src);
+            break;
+        case ExprKind::shr:
+            emit(Op::shr, op_reg(dst), src);
+            break;
+        default:
+            assert(false); // Unreachable;
+        }
+    }
+
+    /* Jumps to label if the predicate is zero, straight from the flags of a
+    ** compare when it can: x - y is zero exactly when cmp x, y sets ZF, a
+    ** variable is compared in place, and a literal decides at compile time.
+    */
+    void gen_branch_if_zero(const ExprId expr, const LabelId label)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        switch (exprs.kinds[expr]) {
+        case ExprKind::int_lit:
+            if (exprs.int_value(expr) == 0) {
+                emit(Op::jmp, op_label(label));
+            }
+            return;
+        case ExprKind::ident: {
+            const Operand var = var_operand(exprs.lhs[expr]);
+            if (var.kind == Operand::Kind::reg) {
+                emit(Op::test, var, var);
+            }
+            else {
+                emit(Op::cmp, var, op_imm(0));
+            }
+            break;
+        }
+        case ExprKind::sub:
+            gen_compare(exprs.lhs[expr], exprs.rhs[expr]);
+            break;
+        default: {
+            const Reg tmp = take_reg();
+            gen_expr(expr, tmp);
+            emit(Op::test, op_reg(tmp), op_reg(tmp));
+            release_reg(tmp);
+            break;
+        }
+        }
+        emit(Op::jz, op_label(label));
+    }
+
+    // evaluates both operands like gen_expr does for a subtraction, but ends with cmp
+    void gen_compare(const ExprId lhs, const ExprId rhs)
+    {
+        const Reg dst = take_reg();
+        if (is_direct_operand(ExprKind::sub, rhs)) {
+            gen_expr(lhs, dst);
+            emit(Op::cmp, op_reg(dst), operand(rhs));
+        }
+        else if (!m_free.empty()) {
+            const Reg tmp = take_reg();
+            if (m_need[rhs] > m_need[lhs]) {
+                gen_expr(rhs, tmp);
+                gen_expr(lhs, dst);
+            }
+            else {
+                gen_expr(lhs, dst);
+                gen_expr(rhs, tmp);
+            }
+            emit(Op::cmp, op_reg(dst), op_reg(tmp));
+            release_reg(tmp);
+        }
+        else {
+            // add rsp, 8 would clobber the flags, so the right operand is popped into rax before the cmp
+            gen_expr(rhs, dst);
+            emit(Op::push, op_reg(dst));
+            gen_expr(lhs, dst);
+            emit(Op::pop, op_reg(Reg::rax));
+            emit(Op::cmp, op_reg(dst), op_reg(Reg::rax));
+        }
+        release_reg(dst);
+    }
+
+    /* The end and the step are evaluated once before the loop when the body
+    ** can't change them and there is a register to spare, and literals are
+    ** used as immediates. The test is at the bottom, so an iteration takes a
+    ** single jump.
+    */
+    void gen_for(const NodeStmtFor* stmt_for)
+    {
+        const LoopInfo info = m_loops.analyze(stmt_for);
+        // the loop variable is only visible inside the loop
+        begin_scope();
+        if (m_vars.find(stmt_for->var) != nullptr) {
+            throw CompileError::redeclared(m_interner.name(stmt_for->var));
+        }
+        declare(stmt_for->var, stmt_for->start);
+        // a register or an rbp slot, neither moves while the loop runs
+        const Operand var = var_operand(stmt_for->var);
+
+        if (m_unroll > 1 && info.trip_count.has_value() && *info.trip_count != 0 && !info.has_inner_loop) {
+            gen_unrolled_for(stmt_for, var, *info.trip_count);
+            end_scope();
+            return;
+        }
+
+        const std::optional<Operand> end = hoist(stmt_for->end, info.end_invariant);
+        const std::optional<Operand> step = hoist(stmt_for->step, info.step_invariant);
+        const LabelId top_label = create_label();
+        const LabelId check_label = create_label();
+        emit(Op::jmp, op_label(check_label));
+        label(top_label);
+        gen_scope(stmt_for->body);
+        gen_loop_op(Op::add, var, step, stmt_for->step);
+        label(check_label);
+        gen_loop_op(Op::cmp, var, end, stmt_for->end);
+        emit(Op::jle, op_label(top_label));
+
+        for (const std::optional<Operand>& value : { end, step }) {
+            if (value.has_value() && value->kind == Operand::Kind::reg) {
+                release_reg(value->reg);
+            }
+        }
+        end_scope();
+    }
+
+    /* The trip count is known and the body contains no loop, so the body is
+    ** repeated m_unroll times per iteration. What doesn't fill a whole
+    ** iteration is emitted once more after the loop, without a test.
+    */
+    void gen_unrolled_for(const NodeStmtFor* stmt_for, const Operand var, const uint64_t trips)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const uint64_t start = exprs.int_value(stmt_for->start);
+        const uint64_t step = exprs.int_value(stmt_for->step);
+        const uint64_t blocks = trips / m_unroll;
+        uint64_t rest = trips % m_unroll;
+        if (blocks > 1) {
+            const LabelId top_label = create_label();
+            label(top_label);
+            for (uint64_t i = 0; i < m_unroll; i++) {
+                gen_scope(stmt_for->body);
+                emit(Op::add, var, imm_operand(step));
+            }
+            // start + trips * step can't overflow, the analysis checked
+            emit(Op::cmp, var, imm_operand(start + blocks * m_unroll * step));
+            emit(Op::jl, op_label(top_label));
+        }
+        else {
+            rest += blocks * m_unroll;
+        }
+        // the variable is dead after the last copy, so that one isn't followed by an add
+        for (uint64_t i = 0; i < rest; i++) {
+            gen_scope(stmt_for->body);
+            if (i + 1 < rest) {
+                emit(Op::add, var, imm_operand(step));
+            }
+        }
+    }
+
+    // the operand an invariant loop bound is kept in, if it doesn't have to be evaluated every time
+    std::optional<Operand> hoist(const ExprId expr, const bool invariant)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        if (exprs.kinds[expr] == ExprKind::int_lit && exprs.int_value(expr) <= std::numeric_limits<int32_t>::max()) {
+            return op_imm(exprs.int_value(expr));
+        }
+        if (!invariant || !m_hoist || m_free.size() <= reserved_for_temps) {
+            return {};
+        }
+        const Reg reg = take_reg();
+        gen_expr(expr, reg);
+        return op_reg(reg);
+    }
+
+    void gen_loop_op(const Op op, const Operand var, const std::optional<Operand>& hoisted, const ExprId expr)
+    {
+        if (hoisted.has_value()) {
+            emit(op, var, *hoisted);
+            return;
+        }
+        const Reg tmp = take_reg();
+        gen_expr(expr, tmp);
+        emit(op, var, op_reg(tmp));
+        release_reg(tmp);
+    }
+
+    // an immediate if it fits in the instruction, otherwise the value goes through rax
+    Operand imm_operand(const uint64_t value)
+    {
+        if (value <= std::numeric_limits<int32_t>::max()) {
+            return op_imm(value);
+        }
+        emit(Op::mov, op_reg(Reg::rax), op_imm(value));
+        return op_reg(Reg::rax);
+    }
+
+    // declares the variable and initializes it with the expression
+    void declare(const Symbol name, const ExprId init)
+    {
+        if (m_free.size() > reserved_for_temps) {
+            const Reg reg = take_reg();
+            gen_expr(init, reg);
+            m_vars.declare(name, { .in_reg = true, .reg = reg, .slot = 0 });
+            return;
+        }
+        // spilled, the value is pushed into the next slot below rbp
+        const Reg tmp = take_reg();
+        gen_expr(init, tmp);
+        emit(Op::push, op_reg(tmp));
+        release_reg(tmp);
+        m_vars.declare(name, { .in_reg = false, .reg = Reg::rax, .slot = m_slots++ });
+    }
+
+    [[nodiscard]] Operand var_operand(const Symbol name) const
+    {
+        const Var* var = m_vars.find(name);
+        if (var == nullptr) {
+            throw CompileError::undeclared(m_interner.name(name));
+        }
+        if (var->in_reg) {
+            return op_reg(var->reg);
+        }
+        return op_mem(Reg::rbp, -static_cast<int32_t>((var->slot + 1) * 8));
+    }
+
+    [[nodiscard]] bool reads_var(const ExprId expr, const Symbol name) const
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        for (ExprId id = exprs.firsts[expr]; id <= expr; id++) {
+            if (exprs.kinds[id] == ExprKind::ident && exprs.lhs[id] == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Reg take_reg()
+    {
+        // statements only start with at least reserved_for_temps free registers
+        assert(!m_free.empty());
+        const Reg reg = m_free.first();
+        m_free.erase(reg);
+        return reg;
+    }
+
+    void release_reg(const Reg reg)
+    {
+        m_free.insert(reg);
+    }
+
+    void begin_scope()
+    {
+        m_vars.begin_scope();
+    }
+
+    void end_scope()
+    {
+        size_t pop_count = 0;
+        for (auto entry = m_vars.innermost_begin(); entry != m_vars.innermost_end(); entry++) {
+            if (entry->value.in_reg) {
+                release_reg(entry->value.reg);
+            }
+            else {
+                pop_count++;
+            }
+        }
+        if (pop_count != 0) {
+            emit(Op::add, op_reg(Reg::rsp), op_imm(pop_count * 8));
+        }
+        m_slots -= pop_count;
+        m_vars.end_scope();
+    }
+
+    struct ExprTask {
+        enum class Step {
+            eval, // evaluates expr into dst, pushing the tasks for its operands
+            mul_lit, // the left operand is in dst, multiplies it by the literal on the right
+            div_lit, // likewise for a division
+            direct, // the left operand is in dst, the right one is an immediate or a variable
+            with_tmp, // the operands are in dst and tmp, tmp is given back
+            push_rhs, // the right operand is in dst and waits on the stack
+            with_pushed, // the left operand is in dst, the right one on top of the stack
+        } step;
+        ExprId expr;
+        Reg dst;
+        Reg tmp = Reg::rax;
+    };
+
+    // the stack is last in first out, so the tasks of a node are pushed from the last to the first
+    void run_task(const ExprTask& task)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const ExprId expr = task.expr;
+        const Reg dst = task.dst;
+        const ExprKind kind = exprs.kinds[expr];
+        const ExprId lhs = exprs.lhs[expr];
+        const ExprId rhs = exprs.rhs[expr];
+        switch (task.step) {
+        case ExprTask::Step::eval:
+            break;
+        case ExprTask::Step::mul_lit:
+            strength::gen_mul(m_sink, dst, dst, exprs.int_value(rhs));
+            return;
+        case ExprTask::Step::div_lit:
+            strength::gen_div(m_sink, dst, dst, exprs.int_value(rhs));
+            return;
+        case ExprTask::Step::direct:
+            gen_op(kind, dst, operand(rhs));
+            return;
+        case ExprTask::Step::with_tmp:
+            gen_op(kind, dst, op_reg(task.tmp));
+            release_reg(task.tmp);
+            return;
+        case ExprTask::Step::push_rhs:
+            emit(Op::push, op_reg(dst));
+            return;
+        case ExprTask::Step::with_pushed:
+            gen_op(kind, dst, op_mem(Reg::rsp));
+            emit(Op::add, op_reg(Reg::rsp), op_imm(8));
+            return;
+        }
+
+        switch (kind) {
+        case ExprKind::int_lit:
+            emit(Op::mov, op_reg(dst), op_imm(exprs.int_value(expr)));
+            return;
+        case ExprKind::ident:
+            emit(Op::mov, op_reg(dst), var_operand(exprs.lhs[expr]));
+            return;
+        default:
+            break;
+        }
+        const auto push = [&](const ExprTask::Step step, const ExprId id, const Reg reg, const Reg tmp = Reg::rax) {
+            m_tasks.push_back({ .step = step, .expr = id, .dst = reg, .tmp = tmp });
+        };
+        // constant factors and divisors have cheaper sequences than imul and div
+        if (kind == ExprKind::multi && exprs.kinds[rhs] == ExprKind::int_lit) {
+            push(ExprTask::Step::mul_lit, expr, dst);
+            push(ExprTask::Step::eval, lhs, dst);
+            return;
+        }
+        if (kind == ExprKind::div && exprs.kinds[rhs] == ExprKind::int_lit) {
+            push(ExprTask::Step::div_lit, expr, dst);
+            push(ExprTask::Step::eval, lhs, dst);
+            return;
+        }
+        if (is_direct_operand(kind, rhs)) {
+            push(ExprTask::Step::direct, expr, dst);
+            push(ExprTask::Step::eval, lhs, dst);
+            return;
+        }
+        if (!m_free.empty()) {
+            const Reg tmp = take_reg();
+            push(ExprTask::Step::with_tmp, expr, dst, tmp);
+            // the side that needs more registers goes first, while the most are free
+            if (m_need[rhs] > m_need[lhs]) {
+                push(ExprTask::Step::eval, lhs, dst);
+                push(ExprTask::Step::eval, rhs, tmp);
+            }
+            else {
+                push(ExprTask::Step::eval, rhs, tmp);
+                push(ExprTask::Step::eval, lhs, dst);
+            }
+            return;
+        }
+        // out of registers, the right operand waits on the stack
+        push(ExprTask::Step::with_pushed, expr, dst);
+        push(ExprTask::Step::eval, lhs, dst);
+        push(ExprTask::Step::push_rhs, expr, dst);
+        push(ExprTask::Step::eval, rhs, dst);
+    }
+
+    LabelId create_label()
+    {
+        return m_label_count++;
+    }
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {})
+    {
+        m_sink.emit({ .op = op, .dst = dst, .src = src });
+    }
+
+    void comment(const char* text)
+    {
+        m_sink.emit({ .op = Op::comment, .comment = text });
+    }
+
+    void label(const LabelId id)
+    {
+        emit(Op::label, op_label(id));
+    }
+
+    const NodeProg& m_prog;
+    const Interner& m_interner;
+    InstrSink& m_sink;
+    std::vector<int> m_need;
+    RegSet m_free = allocatable;
+    size_t m_slots = 0; // the number of spilled variables
+    ScopedSymbolTable<Var> m_vars;
+    LoopAnalysis m_loops;
+    bool m_hoist = false;
+    uint64_t m_unroll;
+    LabelId m_label_count = 0;
+    std::vector<ExprTask> m_tasks; // what gen_expr has left to do
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+/* The x86-64 general purpose registers, in the order of their encoding */
+enum class Reg : uint8_t {
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15
+};
+
+inline const char* to_string(const Reg reg)
+{
+    constexpr const char* names[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                      "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+    return names[static_cast<uint8_t>(reg)];
+}
+
+/* A set of registers as a bit mask, indexed by the encoding */
+class RegSet {
+public:
+    constexpr RegSet() = default;
+
+    constexpr RegSet(const std::initializer_list<Reg> regs)
+    {
+        for (const Reg reg : regs) {
+            insert(reg);
+        }
+    }
+
+    constexpr void insert(const Reg reg)
+    {
+        m_bits |= bit(reg);
+    }
+
+    constexpr void erase(const Reg reg)
+    {
+        m_bits &= ~bit(reg);
+    }
+
+    [[nodiscard]] constexpr bool contains(const Reg reg) const
+    {
+        return (m_bits & bit(reg)) != 0;
+    }
+
+    [[nodiscard]] constexpr bool empty() const
+    {
+        return m_bits == 0;
+    }
+
+    [[nodiscard]] constexpr int size() const
+    {
+        return __builtin_popcount(m_bits);
+    }
+
+    // the register with the lowest encoding, the set must not be empty
+    [[nodiscard]] constexpr Reg first() const
+    {
+        return static_cast<Reg>(__builtin_ctz(m_bits));
+    }
+
+private:
+    static constexpr uint32_t bit(const Reg reg)
+    {
+        return 1u << static_cast<uint8_t>(reg);
+    }
+
+    uint32_t m_bits = 0;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A read-only view over the contents of a source file. Regular files are
+** memory-mapped, so the tokens can point straight into the mapping instead
+** of copying every identifier and literal. The object must stay alive as
+** long as any token, AST node or generator refers to the source.
+*/
+class SourceFile {
+public:
+    SourceFile() = default;
+
+    // copying is deactivated, because the mapping would be released twice
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    SourceFile(SourceFile&& other) noexcept
+        : m_data { std::exchange(other.m_data, nullptr) }
+        , m_size { std::exchange(other.m_size, 0) }
+        , m_mapped { std::exchange(other.m_mapped, false) }
+        , m_fallback { std::move(other.m_fallback) }
+    {
+        if (!m_mapped && m_data != nullptr) {
+            m_data = m_fallback.data();
+        }
+    }
+
+    SourceFile& operator=(SourceFile&& other) noexcept
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_mapped, other.m_mapped);
+        std::swap(m_fallback, other.m_fallback);
+        if (!m_mapped && m_data != nullptr) {
+            m_data = m_fallback.data();
+        }
+        if (!other.m_mapped && other.m_data != nullptr) {
+            other.m_data = other.m_fallback.data();
+        }
+        return *this;
+    }
+
+    // opens the file at the given path, returns false if it can't be read
+    bool open(const char* path)
+    {
+        release();
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                // the lexer walks the file front to back exactly once
+                madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(addr);
+                m_size = static_cast<size_t>(st.st_size);
+                m_mapped = true;
+                ::close(fd);
+                return true;
+            }
+        }
+        // pipes, empty files and failed mappings are read into an owned buffer
+        const bool ok = read_all(fd);
+        ::close(fd);
+        return ok;
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        return { m_data, m_size };
+    }
+
+    ~SourceFile()
+    {
+        release();
+    }
+
+private:
+    bool read_all(const int fd)
+    {
+        char chunk[64 * 1024];
+        while (true) {
+            const ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
+                break;
+            }
+            m_fallback.append(chunk, static_cast<size_t>(n));
+        }
+        m_data = m_fallback.data();
+        m_size = m_fallback.size();
+        return true;
+    }
+
+    void release()
+    {
+        if (m_mapped) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_fallback.clear();
+    }
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::string m_fallback;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+
+/* A bounded queue from one producer thread to one consumer thread. Each side
+** only writes its own index, so neither push nor pop takes a lock, and a side
+** that finds the queue full or empty sleeps on the index of the other one.
+** The values are filled and read where they are in the queue, big ones
+** aren't copied in and out.
+*/
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert(std::has_single_bit(Capacity), "the capacity must be a power of two");
+
+public:
+    /* The slot the producer fills next, after waiting for room. Returns
+    ** nullptr if the consumer closed the queue. push() hands it over.
+    */
+    T* back()
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            if (m_closed.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            const size_t head = m_head.load(std::memory_order_acquire);
+            if (tail - head < Capacity) {
+                return &m_slots[tail % Capacity];
+            }
+            m_head.wait(head, std::memory_order_acquire);
+        }
+    }
+
+    void push()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        m_tail.notify_one();
+    }
+
+    // the oldest slot the producer handed over, after waiting for one. pop() gives it back.
+    T& front()
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail;
+        while ((tail = m_tail.load(std::memory_order_acquire)) == head) {
+            m_tail.wait(tail, std::memory_order_acquire);
+        }
+        return m_slots[head % Capacity];
+    }
+
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        m_head.notify_one();
+    }
+
+    /* Called by the consumer when it stops before the end. The head moves
+    ** too, a producer waiting for room only wakes up when it changes.
+    */
+    void close()
+    {
+        m_closed.store(true, std::memory_order_release);
+        m_head.fetch_add(Capacity, std::memory_order_acq_rel);
+        m_head.notify_one();
+    }
+
+private:
+    std::array<T, Capacity> m_slots {};
+    // on lines of their own, so the two threads don't keep taking the line from each other
+    alignas(64) std::atomic<size_t> m_head = 0;
+    alignas(64) std::atomic<size_t> m_tail = 0;
+    std::atomic<bool> m_closed = false;
+};
@@ -0,0 +1,453 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "compile_error.hpp"
+#include "parser.hpp"
+#include "symbol_table.hpp"
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+enum class SsaOp : uint8_t {
+    constant,
+    phi,
+    copy, // left behind by the passes, stands for lhs until copy propagation removes it
+    add,
+    sub,
+    mul,
+    div,
+    shl,
+    shr
+};
+
+inline bool is_bin_op(const SsaOp op)
+{
+    return op >= SsaOp::add;
+}
+
+struct SsaValue {
+    SsaOp op;
+    BlockId block = 0;
+    ValueId lhs = 0; // the operands of a binary operation, or the source of a copy
+    ValueId rhs = 0;
+    uint64_t imm = 0; // the value of a constant
+    std::vector<ValueId> args {}; // the operands of a phi, one per predecessor of its block, in the same order
+};
+
+/* How a block ends. A branch goes to then_block if lhs isn't zero, a
+** branch_le if lhs <= rhs compared signed, and to else_block otherwise.
+*/
+struct SsaTerm {
+    enum class Kind : uint8_t {
+        jump,
+        branch,
+        branch_le,
+        exit
+    };
+    Kind kind = Kind::jump;
+    ValueId lhs = 0; // the condition, or the exit code
+    ValueId rhs = 0;
+    BlockId then_block = 0; // also the target of a jump
+    BlockId else_block = 0;
+};
+
+struct SsaBlock {
+    std::vector<ValueId> phis;
+    std::vector<ValueId> values; // in order of evaluation, constants are in no block
+    std::vector<BlockId> preds;
+    SsaTerm term;
+    bool removed = false;
+};
+
+/* A program in SSA form. Block 0 is the entry, and every value is defined
+** exactly once. Constants belong to no block, so they dominate every use.
+*/
+struct SsaFunction {
+    std::vector<SsaValue> values;
+    std::vector<SsaBlock> blocks;
+
+    [[nodiscard]] std::vector<BlockId> succs(const BlockId block) const
+    {
+        const SsaTerm& term = blocks[block].term;
+        switch (term.kind) {
+        case SsaTerm::Kind::jump:
+            return { term.then_block };
+        case SsaTerm::Kind::branch:
+        case SsaTerm::Kind::branch_le:
+            return { term.then_block, term.else_block };
+        case SsaTerm::Kind::exit:
+            break;
+        }
+        return {};
+    }
+
+    // the value a copy chain ends in
+    [[nodiscard]] ValueId resolve(ValueId value) const
+    {
+        while (values[value].op == SsaOp::copy) {
+            value = values[value].lhs;
+        }
+        return value;
+    }
+
+    [[nodiscard]] bool is_constant(const ValueId value) const
+    {
+        return values[value].op == SsaOp::constant;
+    }
+
+    ValueId add_constant(const uint64_t imm)
+    {
+        values.push_back({ .op = SsaOp::constant, .imm = imm });
+        return static_cast<ValueId>(values.size() - 1);
+    }
+};
+
+/* Lowers the AST into SSA form, following Braun et al., "Simple and
+** Efficient Construction of Static Single Assignment Form". Every block
+** remembers the current value of each variable it assigned, and reading a
+** variable it didn't assign asks the predecessors, placing phis where they
+** disagree. Loop headers are sealed once the back edge is known, so their
+** phis are completed then. The checks for undeclared and redeclared names
+** are the same as in the generators.
+*/
+class SsaBuilder {
+public:
+    SsaBuilder(const NodeProg& prog, const Interner& interner)
+        : m_prog(prog)
+        , m_interner(interner)
+        , m_scope(interner.size())
+    {
+    }
+
+    SsaFunction build()
+    {
+        m_current = new_block();
+        seal(m_current);
+        m_scope.begin_scope();
+        for (const NodeStmt* stmt : m_prog.stmts) {
+            build_stmt(stmt);
+        }
+        m_scope.end_scope();
+        // falling off the end of the program exits with 0
+        terminate({ .kind = SsaTerm::Kind::exit, .lhs = m_fn.add_constant(0) });
+        return std::move(m_fn);
+    }
+
+private:
+    BlockId new_block()
+    {
+        m_fn.blocks.emplace_back();
+        m_sealed.push_back(false);
+        m_incomplete.emplace_back();
+        return static_cast<BlockId>(m_fn.blocks.size() - 1);
+    }
+
+    void terminate(const SsaTerm& term)
+    {
+        m_fn.blocks[m_current].term = term;
+    }
+
+    void jump(const BlockId from, const BlockId to)
+    {
+        m_fn.blocks[from].term = { .kind = SsaTerm::Kind::jump, .then_block = to };
+        m_fn.blocks[to].preds.push_back(from);
+    }
+
+    ValueId add_value(SsaValue value)
+    {
+        value.block = m_current;
+        m_fn.values.push_back(std::move(value));
+        const auto id = static_cast<ValueId>(m_fn.values.size() - 1);
+        m_fn.blocks[m_current].values.push_back(id);
+        return id;
+    }
+
+    ValueId new_phi(const BlockId block)
+    {
+        m_fn.values.push_back({ .op = SsaOp::phi, .block = block });
+        const auto id = static_cast<ValueId>(m_fn.values.size() - 1);
+        m_fn.blocks[block].phis.push_back(id);
+        return id;
+    }
+
+    static uint64_t key(const Symbol var, const BlockId block)
+    {
+        return static_cast<uint64_t>(block) << 32 | var;
+    }
+
+    void write_var(const Symbol var, const BlockId block, const ValueId value)
+    {
+        m_defs[key(var, block)] = value;
+    }
+
+    ValueId read_var(const Symbol var, const BlockId block) // NOLINT(*-no-recursion)
+    {
+        if (const auto it = m_defs.find(key(var, block)); it != m_defs.end()) {
+            return it->second;
+        }
+        ValueId value;
+        const SsaBlock& b = m_fn.blocks[block];
+        if (!m_sealed[block]) {
+            // not every predecessor is known yet, the phi is completed by seal()
+            value = new_phi(block);
+            m_incomplete[block].push_back({ var, value });
+        }
+        else if (b.preds.size() == 1) {
+            value = read_var(var, b.preds[0]);
+        }
+        else if (b.preds.empty()) {
+            // only in code after an exit, which never runs
+            value = m_fn.add_constant(0);
+        }
+        else {
+            // the phi is recorded first, so a loop back to this block finds it
+            value = new_phi(block);
+            write_var(var, block, value);
+            value = add_phi_args(var, value);
+        }
+        write_var(var, block, value);
+        return value;
+    }
+
+    ValueId add_phi_args(const Symbol var, const ValueId phi) // NOLINT(*-no-recursion)
+    {
+        const BlockId block = m_fn.values[phi].block;
+        for (const BlockId pred : m_fn.blocks[block].preds) {
+            const ValueId arg = read_var(var, pred);
+            m_fn.values[phi].args.push_back(arg);
+        }
+        return remove_trivial_phi(phi);
+    }
+
+    // a phi whose operands are all the same value (or the phi itself) is just that value
+    ValueId remove_trivial_phi(const ValueId phi)
+    {
+        ValueId same = phi;
+        for (const ValueId arg : m_fn.values[phi].args) {
+            const ValueId resolved = m_fn.resolve(arg);
+            if (resolved == same || resolved == phi) {
+                continue;
+            }
+            if (same != phi) {
+                return phi;
+            }
+            same = resolved;
+        }
+        if (same == phi) {
+            same = m_fn.add_constant(0);
+        }
+        // the phi stays in its block as a copy, copy propagation removes it
+        SsaValue& value = m_fn.values[phi];
+        value.op = SsaOp::copy;
+        value.lhs = same;
+        value.args.clear();
+        return same;
+    }
+
+    void seal(const BlockId block)
+    {
+        for (const auto& [var, phi] : m_incomplete[block]) {
+            add_phi_args(var, phi);
+        }
+        m_incomplete[block].clear();
+        m_sealed[block] = true;
+    }
+
+    // the nodes are in post-order, so the operands of a node always have their values already
+    ValueId build_expr(const ExprId expr)
+    {
+        const FlatExprs& exprs = m_prog.exprs;
+        const ExprId first = exprs.firsts[expr];
+        m_expr_values.resize(expr - first + 1);
+        for (ExprId id = first; id <= expr; id++) {
+            ValueId value;
+            switch (exprs.kinds[id]) {
+            case ExprKind::int_lit:
+                value = m_fn.add_constant(exprs.int_value(id));
+                break;
+            case ExprKind::ident:
+                if (m_scope.find(exprs.lhs[id]) == nullptr) {
+                    throw CompileError::undeclared(m_interner.name(exprs.lhs[id]));
+                }
+                value = read_var(exprs.lhs[id], m_current);
+                break;
+            default:
+                value = add_value({ .op = bin_op(exprs.kinds[id]),
+                                    .lhs = m_expr_values[exprs.lhs[id] - first],
+                                    .rhs = m_expr_values[exprs.rhs[id] - first] });
+                break;
+            }
+            m_expr_values[id - first] = value;
+        }
+        return m_expr_values[expr - first];
+    }
+
+    static SsaOp bin_op(const ExprKind kind)
+    {
+        switch (kind) {
+        case ExprKind::add:
+            return SsaOp::add;
+        case ExprKind::sub:
+            return SsaOp::sub;
+        case ExprKind::multi:
+            return SsaOp::mul;
+        case ExprKind::div:
+            return SsaOp::div;
+        case ExprKind::shl:
+            return SsaOp::shl;
+        default:
+            return SsaOp::shr;
+        }
+    }
+
+    void declare(const Symbol var, const ValueId value)
+    {
+        if (!m_scope.declare(var, true)) {
+            throw CompileError::redeclared(m_interner.name(var));
+        }
+        write_var(var, m_current, value);
+    }
+
+    void build_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        m_scope.begin_scope();
+        for (const NodeStmt* stmt : scope->stmts) {
+            build_stmt(stmt);
+        }
+        m_scope.end_scope();
+    }
+
+    // a branch on the predicate, continuing in the block for the case it is true
+    BlockId build_branch(const ExprId expr)
+    {
+        const ValueId cond = build_expr(expr);
+        const BlockId then_block = new_block();
+        const BlockId else_block = new_block();
+        terminate({ .kind = SsaTerm::Kind::branch, .lhs = cond, .then_block = then_block, .else_block = else_block });
+        m_fn.blocks[then_block].preds.push_back(m_current);
+        m_fn.blocks[else_block].preds.push_back(m_current);
+        seal(then_block);
+        seal(else_block);
+        m_current = then_block;
+        return else_block;
+    }
+
+    void build_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            SsaBuilder& ssa;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                const ValueId code = ssa.build_expr(stmt_exit->expr);
+                ssa.terminate({ .kind = SsaTerm::Kind::exit, .lhs = code });
+                // whatever follows is unreachable, but still checked
+                ssa.m_current = ssa.new_block();
+                ssa.seal(ssa.m_current);
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                if (ssa.m_scope.find(stmt_let->ident) != nullptr) {
+                    throw CompileError::redeclared(ssa.m_interner.name(stmt_let->ident));
+                }
+                ssa.declare(stmt_let->ident, ssa.build_expr(stmt_let->expr));
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                if (ssa.m_scope.find(stmt_assign->ident) == nullptr) {
+                    throw CompileError::undeclared(ssa.m_interner.name(stmt_assign->ident));
+                }
+                ssa.write_var(stmt_assign->ident, ssa.m_current, ssa.build_expr(stmt_assign->expr));
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                ssa.build_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                const BlockId end = ssa.new_block();
+                BlockId next = ssa.build_branch(stmt_if->expr);
+                ssa.build_scope(stmt_if->scope);
+                ssa.jump(ssa.m_current, end);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    ssa.m_current = next;
+                    if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                        next = ssa.build_branch((*elif)->expr);
+                        ssa.build_scope((*elif)->scope);
+                        ssa.jump(ssa.m_current, end);
+                        pred = (*elif)->pred;
+                    }
+                    else {
+                        ssa.build_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        next = ssa.m_current;
+                        pred = {};
+                    }
+                }
+                ssa.jump(next, end);
+                ssa.seal(end);
+                ssa.m_current = end;
+            }
+
+            void operator()(const NodeStmtFor* stmt_for) const
+            {
+                const ValueId start = ssa.build_expr(stmt_for->start);
+                // the loop variable is only visible inside the loop
+                ssa.m_scope.begin_scope();
+                ssa.declare(stmt_for->var, start);
+
+                // the header runs the test, it is sealed once the back edge from the body is in
+                const BlockId header = ssa.new_block();
+                ssa.jump(ssa.m_current, header);
+                ssa.m_current = header;
+                const ValueId end = ssa.build_expr(stmt_for->end);
+                const ValueId var = ssa.read_var(stmt_for->var, ssa.m_current);
+                const BlockId body = ssa.new_block();
+                const BlockId exit = ssa.new_block();
+                ssa.terminate(
+                    { .kind = SsaTerm::Kind::branch_le, .lhs = var, .rhs = end, .then_block = body, .else_block = exit });
+                ssa.m_fn.blocks[body].preds.push_back(header);
+                ssa.m_fn.blocks[exit].preds.push_back(header);
+                ssa.seal(body);
+                ssa.seal(exit);
+
+                ssa.m_current = body;
+                ssa.build_scope(stmt_for->body);
+                const ValueId step = ssa.build_expr(stmt_for->step);
+                const ValueId next = ssa.add_value(
+                    { .op = SsaOp::add, .lhs = ssa.read_var(stmt_for->var, ssa.m_current), .rhs = step });
+                ssa.write_var(stmt_for->var, ssa.m_current, next);
+                ssa.jump(ssa.m_current, header);
+                ssa.seal(header);
+
+                ssa.m_scope.end_scope();
+                ssa.m_current = exit;
+            }
+
+            // only in functions, which the compiler doesn't give this backend
+            void operator()(const NodeStmtReturn*) const
+            {
+            }
+        };
+
+        StmtVisitor visitor { .ssa = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    const NodeProg& m_prog;
+    const Interner& m_interner;
+    SsaFunction m_fn;
+    ScopedSymbolTable<bool> m_scope; // only for the checks, the values are in m_defs
+    std::unordered_map<uint64_t, ValueId> m_defs; // the value of a variable at the end of a block
+    std::vector<bool> m_sealed;
+    std::vector<std::vector<std::pair<Symbol, ValueId>>> m_incomplete; // the phis waiting for seal()
+    std::vector<ValueId> m_expr_values;
+    BlockId m_current = 0;
+};
@@ -0,0 +1,507 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <queue>
+#include <span>
+#include <vector>
+
+#include "instr.hpp"
+#include "registers.hpp"
+#include "ssa.hpp"
+#include "ssa_passes.hpp"
+#include "strength_reduction.hpp"
+
+/* Generates code from the SSA form. Every value that isn't a constant is a
+** virtual register, and so is the incoming value of every phi: the blocks
+** before a phi's block store their operand into it right before they jump,
+** and the phi's block starts by copying it into the phi. Since each phi has
+** an incoming register of its own, storing it on an edge that isn't taken
+** does no harm, and edges never have to be split.
+**
+** The virtual registers are allocated by linear scan over live intervals,
+** spilling the interval that ends last when the registers run out. The
+** stack_slots strategy is the same scan without any register, so every
+** virtual register gets a stack slot. A slot is given back once its interval
+** ended, like a register, so the frame grows with the values live at the
+** same time and not with the size of the program. rax, rdx and rcx stay free
+** as scratch.
+*/
+class SsaGenerator {
+public:
+    enum class Strategy : uint8_t {
+        stack_slots,
+        linear_scan
+    };
+
+    SsaGenerator(SsaFunction fn, InstrSink& sink, const Strategy strategy)
+        : m_fn(std::move(fn))
+        , m_sink(sink)
+        , m_strategy(strategy)
+    {
+    }
+
+    void gen_prog()
+    {
+        m_order = ssa::reverse_postorder(m_fn);
+        m_in_vreg.assign(m_fn.values.size(), 0);
+        size_t vregs = m_fn.values.size();
+        for (const BlockId block : m_order) {
+            for (const ValueId phi : m_fn.blocks[block].phis) {
+                m_in_vreg[phi] = static_cast<uint32_t>(vregs++);
+            }
+        }
+        m_locations.assign(vregs, {});
+        m_labels.assign(m_fn.blocks.size(), 0);
+        for (const BlockId block : m_order) {
+            m_labels[block] = m_label_count++;
+        }
+        const bool with_regs = m_strategy == Strategy::linear_scan;
+        allocate(vregs, with_regs ? std::span<const Reg>(alloc_regs) : std::span<const Reg>());
+
+        // the slots are addressed from rbp
+        emit(Op::mov, op_reg(Reg::rbp), op_reg(Reg::rsp));
+        if (m_slots > 0) {
+            emit(Op::sub, op_reg(Reg::rsp), op_imm(m_slots * 8));
+        }
+        for (size_t i = 0; i < m_order.size(); i++) {
+            gen_block(m_order[i], i + 1 < m_order.size() ? m_order[i + 1] : ~BlockId { 0 });
+        }
+    }
+
+private:
+    // the pool the linear scan allocates from, rax, rdx and rcx are scratch
+    static constexpr Reg alloc_regs[]
+        = { Reg::rbx, Reg::rsi, Reg::rdi, Reg::r8,  Reg::r9,  Reg::r10,
+            Reg::r11, Reg::r12, Reg::r13, Reg::r14, Reg::r15 };
+
+    struct Interval {
+        uint32_t vreg;
+        size_t start;
+        size_t end;
+    };
+
+    // a stack slot nobody holds, and the last step of the interval that held it
+    struct FreeSlot {
+        Operand slot;
+        size_t end;
+    };
+
+    /* One step of the generated code, in the order it is emitted: a phi taking
+    ** its incoming value, an operation, a phi operand stored before a jump, or
+    ** the terminator. The liveness analysis walks the same steps.
+    */
+    struct Step {
+        uint32_t def; // none for a terminator
+        uint32_t uses[2];
+        uint8_t use_count;
+    };
+    static constexpr uint32_t none = ~uint32_t { 0 };
+
+    // a slot nobody holds from the step start on, a new one if none is free
+    Operand take_slot(const size_t start)
+    {
+        for (size_t i = m_free_slots.size(); i-- > 0;) {
+            if (m_free_slots[i].end < start) {
+                const Operand slot = m_free_slots[i].slot;
+                m_free_slots[i] = m_free_slots.back();
+                m_free_slots.pop_back();
+                return slot;
+            }
+        }
+        return op_mem(Reg::rbp, -static_cast<int32_t>(++m_slots * 8));
+    }
+
+    // the virtual register of a value, or none for a constant
+    [[nodiscard]] uint32_t vreg(const ValueId value) const
+    {
+        const ValueId resolved = m_fn.resolve(value);
+        return m_fn.is_constant(resolved) ? none : resolved;
+    }
+
+    // the index of the operand a phi of `block` takes from `pred`
+    [[nodiscard]] size_t pred_index(const BlockId block, const BlockId pred) const
+    {
+        const std::vector<BlockId>& preds = m_fn.blocks[block].preds;
+        return static_cast<size_t>(std::find(preds.begin(), preds.end(), pred) - preds.begin());
+    }
+
+    void block_steps(const BlockId id, std::vector<Step>& steps) const
+    {
+        const SsaBlock& block = m_fn.blocks[id];
+        for (const ValueId phi : block.phis) {
+            if (m_fn.values[phi].op == SsaOp::phi) {
+                steps.push_back({ phi, { m_in_vreg[phi], none }, 1 });
+            }
+        }
+        for (const ValueId id_value : block.values) {
+            const SsaValue& value = m_fn.values[id_value];
+            if (is_bin_op(value.op)) {
+                steps.push_back({ id_value, { vreg(value.lhs), vreg(value.rhs) }, 2 });
+            }
+        }
+        for (const BlockId succ : m_fn.succs(id)) {
+            const size_t index = pred_index(succ, id);
+            for (const ValueId phi : m_fn.blocks[succ].phis) {
+                if (m_fn.values[phi].op == SsaOp::phi) {
+                    steps.push_back({ m_in_vreg[phi], { vreg(m_fn.values[phi].args[index]), none }, 1 });
+                }
+            }
+        }
+        const SsaTerm& term = block.term;
+        switch (term.kind) {
+        case SsaTerm::Kind::jump:
+            steps.push_back({ none, { none, none }, 0 });
+            break;
+        case SsaTerm::Kind::branch:
+        case SsaTerm::Kind::exit:
+            steps.push_back({ none, { vreg(term.lhs), none }, 1 });
+            break;
+        case SsaTerm::Kind::branch_le:
+            steps.push_back({ none, { vreg(term.lhs), vreg(term.rhs) }, 2 });
+            break;
+        }
+    }
+
+    /* Live intervals, found one virtual register at a time: from every block
+    ** that uses it before defining it, liveness flows back through the
+    ** predecessors until it reaches the blocks that define it. An interval is
+    ** the hull of every step its register is live at, so a register that is
+    ** dead in a hole of its interval still keeps its location there.
+    */
+    std::vector<Interval> live_intervals(const size_t vregs) const
+    {
+        std::vector<size_t> starts(vregs, SIZE_MAX), ends(vregs, 0);
+        const auto extend = [&](const uint32_t reg, const size_t pos) {
+            starts[reg] = std::min(starts[reg], pos);
+            ends[reg] = std::max(ends[reg], pos);
+        };
+        std::vector<std::vector<BlockId>> def_blocks(vregs), exposed(vregs);
+        std::vector<size_t> first(m_fn.blocks.size(), SIZE_MAX), last(m_fn.blocks.size(), 0);
+        std::vector<BlockId> defined_in(vregs, ~BlockId { 0 });
+        std::vector<Step> steps;
+        size_t pos = 0;
+        for (const BlockId block : m_order) {
+            steps.clear();
+            block_steps(block, steps);
+            first[block] = pos;
+            for (const Step& step : steps) {
+                for (uint8_t i = 0; i < step.use_count; i++) {
+                    const uint32_t use = step.uses[i];
+                    if (use == none) {
+                        continue;
+                    }
+                    extend(use, pos);
+                    if (defined_in[use] != block && (exposed[use].empty() || exposed[use].back() != block)) {
+                        exposed[use].push_back(block);
+                    }
+                }
+                if (step.def != none) {
+                    extend(step.def, pos);
+                    if (defined_in[step.def] != block) {
+                        defined_in[step.def] = block;
+                        def_blocks[step.def].push_back(block);
+                    }
+                }
+                pos++;
+            }
+            last[block] = pos - 1;
+        }
+
+        // marked with the register currently walked, so they never have to be cleared
+        std::vector<uint32_t> defines(m_fn.blocks.size(), none), live_in(m_fn.blocks.size(), none);
+        std::vector<BlockId> work;
+        for (uint32_t reg = 0; reg < vregs; reg++) {
+            for (const BlockId block : def_blocks[reg]) {
+                defines[block] = reg;
+            }
+            work = exposed[reg];
+            for (const BlockId block : work) {
+                live_in[block] = reg;
+            }
+            while (!work.empty()) {
+                const BlockId block = work.back();
+                work.pop_back();
+                extend(reg, first[block]);
+                for (const BlockId pred : m_fn.blocks[block].preds) {
+                    if (first[pred] == SIZE_MAX) {
+                        continue; // never emitted
+                    }
+                    extend(reg, last[pred]);
+                    if (defines[pred] != reg && live_in[pred] != reg) {
+                        live_in[pred] = reg;
+                        work.push_back(pred);
+                    }
+                }
+            }
+        }
+
+        std::vector<Interval> intervals;
+        for (uint32_t reg = 0; reg < vregs; reg++) {
+            if (starts[reg] != SIZE_MAX) {
+                intervals.push_back({ reg, starts[reg], ends[reg] });
+            }
+        }
+        std::sort(intervals.begin(), intervals.end(),
+                  [](const Interval& a, const Interval& b) { return a.start < b.start; });
+        return intervals;
+    }
+
+    /* Poletto and Sarkar's linear scan over regs. An interval only gives its
+    ** register or its slot back once it ended before the next one starts, so
+    ** the operands of a step never share a location with its result. An
+    ** interval moved to the stack after it started needs a slot that was
+    ** free since its start, not just since the start of the next one.
+    */
+    void allocate(const size_t vregs, const std::span<const Reg> regs)
+    {
+        std::vector<Reg> free(regs.rbegin(), regs.rend());
+        std::vector<Interval> active; // in a register, sorted by end
+        const auto by_end = [](const Interval& a, const Interval& b) { return a.end < b.end; };
+        const auto by_end_first = [](const Interval& a, const Interval& b) { return a.end > b.end; };
+        // in a slot, the one that ends first on top, there can be many without registers
+        std::priority_queue<Interval, std::vector<Interval>, decltype(by_end_first)> spilled(by_end_first);
+        for (const Interval& interval : live_intervals(vregs)) {
+            while (!active.empty() && active.front().end < interval.start) {
+                free.push_back(m_locations[active.front().vreg].reg);
+                active.erase(active.begin());
+            }
+            while (!spilled.empty() && spilled.top().end < interval.start) {
+                m_free_slots.push_back({ m_locations[spilled.top().vreg], spilled.top().end });
+                spilled.pop();
+            }
+            if (!free.empty()) {
+                m_locations[interval.vreg] = op_reg(free.back());
+                free.pop_back();
+                active.insert(std::upper_bound(active.begin(), active.end(), interval, by_end), interval);
+                continue;
+            }
+            // the interval that lives longest goes to the stack
+            if (!active.empty() && active.back().end > interval.end) {
+                const Interval moved = active.back();
+                active.pop_back();
+                m_locations[interval.vreg] = m_locations[moved.vreg];
+                m_locations[moved.vreg] = take_slot(moved.start);
+                active.insert(std::upper_bound(active.begin(), active.end(), interval, by_end), interval);
+                spilled.push(moved);
+            }
+            else {
+                m_locations[interval.vreg] = take_slot(interval.start);
+                spilled.push(interval);
+            }
+        }
+    }
+
+    [[nodiscard]] static bool fits_imm(const uint64_t value)
+    {
+        return value <= static_cast<uint64_t>(INT32_MAX);
+    }
+
+    [[nodiscard]] Operand location(const ValueId value) const
+    {
+        return m_locations[m_fn.resolve(value)];
+    }
+
+    // a value as a source operand, a constant that is too big for an immediate goes through scratch
+    Operand source(const ValueId value, const Reg scratch)
+    {
+        const ValueId resolved = m_fn.resolve(value);
+        if (!m_fn.is_constant(resolved)) {
+            return m_locations[resolved];
+        }
+        const uint64_t imm = m_fn.values[resolved].imm;
+        if (fits_imm(imm)) {
+            return op_imm(imm);
+        }
+        emit(Op::mov, op_reg(scratch), op_imm(imm));
+        return op_reg(scratch);
+    }
+
+    // dst = src for any two locations, through rax when neither is a register
+    void move(const Operand dst, const ValueId value)
+    {
+        Operand src = source(value, Reg::rax);
+        if (src == dst) {
+            return;
+        }
+        if (dst.kind == Operand::Kind::mem && src.kind != Operand::Kind::reg) {
+            emit(Op::mov, op_reg(Reg::rax), src);
+            src = op_reg(Reg::rax);
+        }
+        emit(Op::mov, dst, src);
+    }
+
+    void move(const Operand dst, const Operand src)
+    {
+        if (src == dst) {
+            return;
+        }
+        if (dst.kind == Operand::Kind::mem && src.kind == Operand::Kind::mem) {
+            emit(Op::mov, op_reg(Reg::rax), src);
+            emit(Op::mov, dst, op_reg(Reg::rax));
+            return;
+        }
+        emit(Op::mov, dst, src);
+    }
+
+    void gen_value(const ValueId id)
+    {
+        const SsaValue& value = m_fn.values[id];
+        const Operand dst = m_locations[id];
+        const Reg work = dst.kind == Operand::Kind::reg ? dst.reg : Reg::rax;
+        // constant factors and divisors have cheaper sequences than imul and div
+        const ValueId rhs = m_fn.resolve(value.rhs);
+        if ((value.op == SsaOp::mul || value.op == SsaOp::div) && m_fn.is_constant(rhs)) {
+            Operand lhs = source(value.lhs, Reg::rcx);
+            if (lhs.kind != Operand::Kind::reg) {
+                emit(Op::mov, op_reg(Reg::rcx), lhs);
+                lhs = op_reg(Reg::rcx);
+            }
+            if (value.op == SsaOp::mul) {
+                strength::gen_mul(m_sink, work, lhs.reg, m_fn.values[rhs].imm);
+            }
+            else {
+                strength::gen_div(m_sink, work, lhs.reg, m_fn.values[rhs].imm);
+            }
+            move(dst, op_reg(work));
+            return;
+        }
+        if (value.op == SsaOp::div) {
+            move(op_reg(Reg::rax), value.lhs);
+            Operand divisor = source(value.rhs, Reg::rcx);
+            if (divisor.kind == Operand::Kind::imm) {
+                emit(Op::mov, op_reg(Reg::rcx), divisor);
+                divisor = op_reg(Reg::rcx);
+            }
+            emit(Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32));
+            emit(Op::div, divisor);
+            move(dst, op_reg(Reg::rax));
+            return;
+        }
+        move(op_reg(work), value.lhs);
+        Operand src = source(value.rhs, Reg::rdx);
+        switch (value.op) {
+        case SsaOp::add:
+            emit(Op::add, op_reg(work), src);
+            break;
+        case SsaOp::sub:
+            emit(Op::sub, op_reg(work), src);
+            break;
+        case SsaOp::mul:
+            emit(Op::imul, op_reg(work), src);
+            break;
+        case SsaOp::shl:
+        case SsaOp::shr: {
+            const Op op = value.op == SsaOp::shl ? Op::shl : Op::shr;
+            if (src.kind == Operand::Kind::imm && src.value < 64) {
+                emit(op, op_reg(work), src);
+                break;
+            }
+            move(op_reg(Reg::rcx), src);
+            emit(op, op_reg(work), op_reg(Reg::rcx, 8));
+            break;
+        }
+        default:
+            break;
+        }
+        move(dst, op_reg(work));
+    }
+
+    void gen_block(const BlockId id, const BlockId next)
+    {
+        const SsaBlock& block = m_fn.blocks[id];
+        label(m_labels[id]);
+        for (const ValueId phi : block.phis) {
+            if (m_fn.values[phi].op == SsaOp::phi) {
+                move(m_locations[phi], m_locations[m_in_vreg[phi]]);
+            }
+        }
+        for (const ValueId value : block.values) {
+            if (is_bin_op(m_fn.values[value].op)) {
+                gen_value(value);
+            }
+        }
+        // the phi operands go in before the jump, the flags are set after them
+        for (const BlockId succ : m_fn.succs(id)) {
+            const size_t index = pred_index(succ, id);
+            for (const ValueId phi : m_fn.blocks[succ].phis) {
+                if (m_fn.values[phi].op == SsaOp::phi) {
+                    move(m_locations[m_in_vreg[phi]], m_fn.values[phi].args[index]);
+                }
+            }
+        }
+        const SsaTerm& term = block.term;
+        switch (term.kind) {
+        case SsaTerm::Kind::jump:
+            jump_unless_next(term.then_block, next);
+            break;
+        case SsaTerm::Kind::branch: {
+            Operand cond = source(term.lhs, Reg::rax);
+            if (cond.kind == Operand::Kind::imm) {
+                emit(Op::mov, op_reg(Reg::rax), cond);
+                cond = op_reg(Reg::rax);
+            }
+            if (cond.kind == Operand::Kind::reg) {
+                emit(Op::test, cond, cond);
+            }
+            else {
+                emit(Op::cmp, cond, op_imm(0));
+            }
+            emit(Op::jz, op_label(m_labels[term.else_block]));
+            jump_unless_next(term.then_block, next);
+            break;
+        }
+        case SsaTerm::Kind::branch_le: {
+            Operand lhs = source(term.lhs, Reg::rax);
+            const Operand rhs = source(term.rhs, Reg::rdx);
+            if (lhs.kind == Operand::Kind::imm || (lhs.kind == Operand::Kind::mem && rhs.kind == Operand::Kind::mem)) {
+                emit(Op::mov, op_reg(Reg::rax), lhs);
+                lhs = op_reg(Reg::rax);
+            }
+            emit(Op::cmp, lhs, rhs);
+            // falling through into the body of a loop, the jump is to the exit
+            if (term.then_block == next) {
+                emit(Op::jg, op_label(m_labels[term.else_block]));
+                break;
+            }
+            emit(Op::jle, op_label(m_labels[term.then_block]));
+            jump_unless_next(term.else_block, next);
+            break;
+        }
+        case SsaTerm::Kind::exit:
+            move(op_reg(Reg::rdi), term.lhs);
+            emit(Op::mov, op_reg(Reg::rax), op_imm(60));
+            emit(Op::syscall);
+            break;
+        }
+    }
+
+    void jump_unless_next(const BlockId target, const BlockId next)
+    {
+        if (target != next) {
+            emit(Op::jmp, op_label(m_labels[target]));
+        }
+    }
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {})
+    {
+        m_sink.emit({ .op = op, .dst = dst, .src = src });
+    }
+
+    void label(const LabelId id)
+    {
+        emit(Op::label, op_label(id));
+    }
+
+    SsaFunction m_fn;
+    InstrSink& m_sink;
+    Strategy m_strategy;
+    std::vector<BlockId> m_order; // the layout, the reachable blocks in reverse postorder
+    std::vector<uint32_t> m_in_vreg; // the incoming virtual register of every phi
+    std::vector<Operand> m_locations; // indexed by virtual register
+    std::vector<LabelId> m_labels; // indexed by block
+    LabelId m_label_count = 0;
+    uint32_t m_slots = 0;
+    std::vector<FreeSlot> m_free_slots; // given back by the intervals that ended
+};
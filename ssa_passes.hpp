@@ -0,0 +1,482 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "ssa.hpp"
+
+/* A pass returns true if it changed the function */
+struct SsaPass {
+    const char* name;
+    bool (*run)(SsaFunction& fn);
+};
+
+namespace ssa {
+
+/* The blocks reachable from the entry, in reverse postorder. The successors
+** are visited last to first, so the block a branch goes to when its condition
+** holds comes right after it, like the body of a loop after its header.
+*/
+inline std::vector<BlockId> reverse_postorder(const SsaFunction& fn)
+{
+    std::vector<BlockId> order;
+    std::vector<bool> seen(fn.blocks.size(), false);
+    // an explicit stack of (block, next successor to visit)
+    std::vector<std::pair<BlockId, size_t>> stack { { 0, 0 } };
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        const std::vector<BlockId> succs = fn.succs(block);
+        if (next < succs.size()) {
+            const BlockId succ = succs[succs.size() - ++next];
+            if (!seen[succ]) {
+                seen[succ] = true;
+                stack.emplace_back(succ, 0);
+            }
+            continue;
+        }
+        order.push_back(block);
+        stack.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+/* The immediate dominator of every reachable block, from Cooper, Harvey and
+** Kennedy, "A Simple, Fast Dominance Algorithm"
+*/
+inline std::vector<BlockId> dominators(const SsaFunction& fn, const std::vector<BlockId>& order)
+{
+    constexpr BlockId none = ~BlockId { 0 };
+    std::vector<size_t> position(fn.blocks.size(), 0);
+    for (size_t i = 0; i < order.size(); i++) {
+        position[order[i]] = i;
+    }
+    std::vector<BlockId> idom(fn.blocks.size(), none);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            const BlockId block = order[i];
+            BlockId new_idom = none;
+            for (const BlockId pred : fn.blocks[block].preds) {
+                if (idom[pred] == none) {
+                    continue;
+                }
+                if (new_idom == none) {
+                    new_idom = pred;
+                    continue;
+                }
+                // walk both up the tree until they meet
+                BlockId a = pred;
+                BlockId b = new_idom;
+                while (a != b) {
+                    while (position[a] > position[b]) {
+                        a = idom[a];
+                    }
+                    while (position[b] > position[a]) {
+                        b = idom[b];
+                    }
+                }
+                new_idom = a;
+            }
+            if (idom[block] != new_idom) {
+                idom[block] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+/* Branches on constants become jumps, and the blocks that can't be reached
+** from the entry, like the code after an exit, are removed together with
+** their edges into phis.
+*/
+inline bool remove_unreachable(SsaFunction& fn)
+{
+    bool changed = false;
+    for (SsaBlock& block : fn.blocks) {
+        SsaTerm& term = block.term;
+        if (block.removed) {
+            continue;
+        }
+        const ValueId lhs = fn.resolve(term.lhs);
+        const ValueId rhs = fn.resolve(term.rhs);
+        bool taken;
+        if (term.kind == SsaTerm::Kind::branch && fn.is_constant(lhs)) {
+            taken = fn.values[lhs].imm != 0;
+        }
+        else if (term.kind == SsaTerm::Kind::branch_le && fn.is_constant(lhs) && fn.is_constant(rhs)) {
+            taken = static_cast<int64_t>(fn.values[lhs].imm) <= static_cast<int64_t>(fn.values[rhs].imm);
+        }
+        else {
+            continue;
+        }
+        const BlockId target = taken ? term.then_block : term.else_block;
+        const BlockId dropped = taken ? term.else_block : term.then_block;
+        const BlockId self = static_cast<BlockId>(&block - fn.blocks.data());
+        // the edge to the dropped block goes, and its phis lose their operand for it
+        SsaBlock& lost = fn.blocks[dropped];
+        const auto it = std::find(lost.preds.begin(), lost.preds.end(), self);
+        const auto index = it - lost.preds.begin();
+        lost.preds.erase(it);
+        for (const ValueId phi : lost.phis) {
+            if (fn.values[phi].op == SsaOp::phi) {
+                fn.values[phi].args.erase(fn.values[phi].args.begin() + index);
+            }
+        }
+        term = { .kind = SsaTerm::Kind::jump, .then_block = target };
+        changed = true;
+    }
+
+    std::vector<bool> reachable(fn.blocks.size(), false);
+    for (const BlockId block : reverse_postorder(fn)) {
+        reachable[block] = true;
+    }
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+        SsaBlock& block = fn.blocks[id];
+        if (block.removed || reachable[id]) {
+            continue;
+        }
+        block.removed = true;
+        block.phis.clear();
+        block.values.clear();
+        changed = true;
+        for (const BlockId succ : fn.succs(id)) {
+            SsaBlock& next = fn.blocks[succ];
+            for (size_t i = next.preds.size(); i-- > 0;) {
+                if (next.preds[i] != id) {
+                    continue;
+                }
+                next.preds.erase(next.preds.begin() + static_cast<std::ptrdiff_t>(i));
+                for (const ValueId phi : next.phis) {
+                    if (fn.values[phi].op == SsaOp::phi) {
+                        fn.values[phi].args.erase(fn.values[phi].args.begin() + static_cast<std::ptrdiff_t>(i));
+                    }
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+/* Every use of a copy becomes a use of what it copies, and phis whose
+** operands are all one value (apart from the phi itself) become copies of it
+** first. The copies are then removed.
+*/
+inline bool propagate_copies(SsaFunction& fn)
+{
+    bool changed = false;
+    bool found_trivial = true;
+    while (found_trivial) {
+        found_trivial = false;
+        for (const SsaBlock& block : fn.blocks) {
+            for (const ValueId phi : block.phis) {
+                SsaValue& value = fn.values[phi];
+                if (value.op != SsaOp::phi) {
+                    continue;
+                }
+                ValueId same = phi;
+                bool trivial = true;
+                for (const ValueId arg : value.args) {
+                    const ValueId resolved = fn.resolve(arg);
+                    if (resolved == phi || resolved == same) {
+                        continue;
+                    }
+                    if (same != phi) {
+                        trivial = false;
+                        break;
+                    }
+                    same = resolved;
+                }
+                if (trivial && same != phi) {
+                    value.op = SsaOp::copy;
+                    value.lhs = same;
+                    value.args.clear();
+                    found_trivial = true;
+                }
+            }
+        }
+    }
+
+    for (SsaBlock& block : fn.blocks) {
+        for (const ValueId phi : block.phis) {
+            for (ValueId& arg : fn.values[phi].args) {
+                const ValueId resolved = fn.resolve(arg);
+                changed |= resolved != arg;
+                arg = resolved;
+            }
+        }
+        for (const ValueId id : block.values) {
+            SsaValue& value = fn.values[id];
+            if (is_bin_op(value.op)) {
+                const ValueId lhs = fn.resolve(value.lhs);
+                const ValueId rhs = fn.resolve(value.rhs);
+                changed |= lhs != value.lhs || rhs != value.rhs;
+                value.lhs = lhs;
+                value.rhs = rhs;
+            }
+        }
+        const ValueId lhs = fn.resolve(block.term.lhs);
+        const ValueId rhs = fn.resolve(block.term.rhs);
+        changed |= lhs != block.term.lhs || rhs != block.term.rhs;
+        block.term.lhs = lhs;
+        block.term.rhs = rhs;
+
+        const auto is_copy = [&fn](const ValueId id) { return fn.values[id].op == SsaOp::copy; };
+        const size_t before = block.phis.size() + block.values.size();
+        std::erase_if(block.phis, is_copy);
+        std::erase_if(block.values, is_copy);
+        changed |= before != block.phis.size() + block.values.size();
+    }
+    return changed;
+}
+
+// the value of a binary operation on two constants, if it is defined
+inline std::optional<uint64_t> fold(const SsaOp op, const uint64_t lhs, const uint64_t rhs)
+{
+    switch (op) {
+    case SsaOp::add:
+        return lhs + rhs;
+    case SsaOp::sub:
+        return lhs - rhs;
+    case SsaOp::mul:
+        return lhs * rhs;
+    case SsaOp::div:
+        if (rhs == 0) {
+            return {};
+        }
+        return lhs / rhs;
+    // the count is masked like the shift instructions do
+    case SsaOp::shl:
+        return lhs << (rhs & 63);
+    case SsaOp::shr:
+        return lhs >> (rhs & 63);
+    default:
+        return {};
+    }
+}
+
+/* Global value numbering over the dominator tree. An operation that was
+** already computed with the same operands in a dominating block, or earlier
+** in the same block, becomes a copy of that value, and so does a phi with the
+** same operands as another phi of its block. Operations on constants are
+** folded on the way.
+*/
+inline bool number_values(SsaFunction& fn)
+{
+    const std::vector<BlockId> order = reverse_postorder(fn);
+    const std::vector<BlockId> idom = dominators(fn, order);
+    std::vector<std::vector<BlockId>> children(fn.blocks.size());
+    for (const BlockId block : order) {
+        if (block != 0) {
+            children[idom[block]].push_back(block);
+        }
+    }
+
+    struct Key {
+        SsaOp op;
+        ValueId lhs;
+        ValueId rhs;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const
+        {
+            return (static_cast<size_t>(key.op) * 0x9E3779B97F4A7C15ULL) ^ (static_cast<size_t>(key.lhs) << 32)
+                ^ key.rhs;
+        }
+    };
+    std::unordered_map<Key, ValueId, KeyHash> table;
+    // every literal is a constant of its own, one of them stands for all with the same value
+    std::unordered_map<uint64_t, ValueId> constants;
+    const auto canonical = [&](const ValueId id) {
+        if (!fn.is_constant(id)) {
+            return id;
+        }
+        return constants.try_emplace(fn.values[id].imm, id).first->second;
+    };
+    // what leaving a block has to remove from the table again
+    std::vector<Key> scoped;
+    std::vector<size_t> scope_starts;
+
+    bool changed = false;
+    const auto number_block = [&](const BlockId id) {
+        SsaBlock& block = fn.blocks[id];
+        for (size_t i = 0; i < block.phis.size(); i++) {
+            SsaValue& phi = fn.values[block.phis[i]];
+            for (size_t j = 0; j < i && phi.op == SsaOp::phi; j++) {
+                const SsaValue& other = fn.values[block.phis[j]];
+                if (other.op == SsaOp::phi && other.args == phi.args) {
+                    phi.op = SsaOp::copy;
+                    phi.lhs = block.phis[j];
+                    phi.args.clear();
+                    changed = true;
+                }
+            }
+        }
+        for (const ValueId id_value : block.values) {
+            SsaValue& value = fn.values[id_value];
+            if (!is_bin_op(value.op)) {
+                continue;
+            }
+            const ValueId lhs = canonical(fn.resolve(value.lhs));
+            const ValueId rhs = canonical(fn.resolve(value.rhs));
+            value.lhs = lhs;
+            value.rhs = rhs;
+            if (fn.is_constant(lhs) && fn.is_constant(rhs)) {
+                if (const std::optional<uint64_t> folded = fold(value.op, fn.values[lhs].imm, fn.values[rhs].imm)) {
+                    auto [it, inserted] = constants.try_emplace(*folded, 0);
+                    if (inserted) {
+                        it->second = fn.add_constant(*folded);
+                    }
+                    // add_constant may have moved the values
+                    fn.values[id_value].op = SsaOp::copy;
+                    fn.values[id_value].lhs = it->second;
+                    changed = true;
+                    continue;
+                }
+            }
+            // constants go on the right of commutative operations, where the generator wants them
+            if ((value.op == SsaOp::add || value.op == SsaOp::mul) && fn.is_constant(lhs)) {
+                std::swap(value.lhs, value.rhs);
+            }
+            Key key { value.op, value.lhs, value.rhs };
+            if ((value.op == SsaOp::add || value.op == SsaOp::mul) && key.lhs > key.rhs) {
+                std::swap(key.lhs, key.rhs);
+            }
+            const auto [it, inserted] = table.try_emplace(key, id_value);
+            if (inserted) {
+                scoped.push_back(key);
+            }
+            else {
+                value.op = SsaOp::copy;
+                value.lhs = it->second;
+                changed = true;
+            }
+        }
+    };
+
+    // a preorder walk of the dominator tree, with the table scoped to the subtree
+    std::vector<std::pair<BlockId, size_t>> stack { { 0, 0 } };
+    scope_starts.push_back(0);
+    number_block(0);
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        if (next < children[block].size()) {
+            const BlockId child = children[block][next++];
+            scope_starts.push_back(scoped.size());
+            number_block(child);
+            stack.emplace_back(child, 0);
+            continue;
+        }
+        while (scoped.size() > scope_starts.back()) {
+            table.erase(scoped.back());
+            scoped.pop_back();
+        }
+        scope_starts.pop_back();
+        stack.pop_back();
+    }
+    return changed;
+}
+
+/* Removes the values nothing depends on. The exit codes and the conditions
+** of the branches are used, and so is every division that might be by zero,
+** because removing it would remove the trap.
+*/
+inline bool remove_dead(SsaFunction& fn)
+{
+    std::vector<bool> live(fn.values.size(), false);
+    std::vector<ValueId> work;
+    const auto use = [&](const ValueId value) {
+        if (!live[value]) {
+            live[value] = true;
+            work.push_back(value);
+        }
+    };
+    for (const SsaBlock& block : fn.blocks) {
+        if (block.removed) {
+            continue;
+        }
+        use(block.term.lhs);
+        if (block.term.kind == SsaTerm::Kind::branch_le) {
+            use(block.term.rhs);
+        }
+        for (const ValueId id : block.values) {
+            const SsaValue& value = fn.values[id];
+            const ValueId divisor = fn.resolve(value.rhs);
+            if (value.op == SsaOp::div && !(fn.is_constant(divisor) && fn.values[divisor].imm != 0)) {
+                use(id);
+            }
+        }
+    }
+    while (!work.empty()) {
+        const SsaValue& value = fn.values[work.back()];
+        work.pop_back();
+        if (value.op == SsaOp::phi) {
+            for (const ValueId arg : value.args) {
+                use(arg);
+            }
+        }
+        else if (value.op == SsaOp::copy) {
+            use(value.lhs);
+        }
+        else if (is_bin_op(value.op)) {
+            use(value.lhs);
+            use(value.rhs);
+        }
+    }
+    bool changed = false;
+    for (SsaBlock& block : fn.blocks) {
+        const size_t before = block.phis.size() + block.values.size();
+        std::erase_if(block.phis, [&live](const ValueId id) { return !live[id]; });
+        std::erase_if(block.values, [&live](const ValueId id) { return !live[id]; });
+        changed |= before != block.phis.size() + block.values.size();
+    }
+    return changed;
+}
+
+inline std::vector<SsaPass> default_passes()
+{
+    return {
+        { "unreachable", remove_unreachable },
+        { "copy-prop", propagate_copies },
+        { "gvn", number_values },
+        { "copy-prop", propagate_copies },
+        { "dce", remove_dead },
+    };
+}
+
+}
+
+/* Runs the passes in order, over and over while any of them changes the
+** function, up to a limit of rounds
+*/
+class SsaPassManager {
+public:
+    explicit SsaPassManager(std::vector<SsaPass> passes = ssa::default_passes(), const int max_rounds = 8)
+        : m_passes(std::move(passes))
+        , m_max_rounds(max_rounds)
+    {
+    }
+
+    void run(SsaFunction& fn) const
+    {
+        for (int round = 0; round < m_max_rounds; round++) {
+            bool changed = false;
+            for (const SsaPass& pass : m_passes) {
+                changed |= pass.run(fn);
+            }
+            if (!changed) {
+                return;
+            }
+        }
+    }
+
+private:
+    std::vector<SsaPass> m_passes;
+    int m_max_rounds;
+};
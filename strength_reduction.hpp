@@ -0,0 +1,144 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+
+#include "instr.hpp"
+
+/* Cheaper instruction sequences for multiplying and dividing by a constant,
+** shared by the backends. Dividing by a constant is a multiplication by its
+** fixed-point reciprocal, which takes a few cycles where div takes dozens,
+** and small multipliers are one or two lea, which even beat imul.
+*/
+namespace strength {
+
+/* x / d is mulhi(x, multiplier) >> shift for every 64 bit x, from Granlund
+** and Montgomery, "Division by Invariant Integers using Multiplication".
+** When the reciprocal needs 65 bits, add is set and multiplier holds the low
+** 64 of them: the quotient is then (((x - t) >> 1) + t) >> shift with
+** t = mulhi(x, multiplier).
+*/
+struct MagicDivisor {
+    uint64_t multiplier;
+    uint8_t shift;
+    bool add;
+};
+
+// d must be at least 2 and not a power of two
+inline MagicDivisor magic_divisor(const uint64_t d)
+{
+    using u128 = unsigned __int128;
+    const auto l = static_cast<uint8_t>(64 - std::countl_zero(d - 1)); // ceil(log2(d))
+    // with one bit less of precision the reciprocal fits in 64 bits, if it is still exact enough
+    const u128 power = static_cast<u128>(1) << (63 + l);
+    const u128 multiplier = power / d + 1;
+    if (multiplier * d - power <= static_cast<u128>(1) << (l - 1)) {
+        return { static_cast<uint64_t>(multiplier), static_cast<uint8_t>(l - 1), false };
+    }
+    // 2^64 + multiplier is ceil(2^(64 + l) / d), which is always exact enough
+    const u128 low = ((static_cast<u128>(1) << 64) * ((static_cast<u128>(1) << l) - d)) / d + 1;
+    return { static_cast<uint64_t>(low), static_cast<uint8_t>(l - 1), true };
+}
+
+inline void emit(InstrSink& sink, const Op op, const Operand dst = {}, const Operand src = {})
+{
+    sink.emit({ .op = op, .dst = dst, .src = src });
+}
+
+/* dst = src / divisor. rax and rdx are clobbered before dst is written, so
+** src can't be either of them. dst can be anything, including src.
+*/
+inline void gen_div(InstrSink& sink, const Reg dst, const Reg src, const uint64_t divisor)
+{
+    if (divisor == 0) {
+        // the trap is the behavior of the program
+        emit(sink, Op::mov, op_reg(Reg::rax), op_reg(src));
+        emit(sink, Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32));
+        emit(sink, Op::div, op_reg(Reg::rdx));
+        return;
+    }
+    if (std::has_single_bit(divisor)) {
+        if (dst != src) {
+            emit(sink, Op::mov, op_reg(dst), op_reg(src));
+        }
+        if (divisor > 1) {
+            emit(sink, Op::shr, op_reg(dst), op_imm(static_cast<uint64_t>(std::countr_zero(divisor))));
+        }
+        return;
+    }
+    const MagicDivisor magic = magic_divisor(divisor);
+    emit(sink, Op::mov, op_reg(Reg::rax), op_imm(magic.multiplier));
+    emit(sink, Op::mul, op_reg(src));
+    Reg quotient = Reg::rdx;
+    if (magic.add) {
+        emit(sink, Op::mov, op_reg(Reg::rax), op_reg(src));
+        emit(sink, Op::sub, op_reg(Reg::rax), op_reg(Reg::rdx));
+        emit(sink, Op::shr, op_reg(Reg::rax), op_imm(1));
+        emit(sink, Op::add, op_reg(Reg::rax), op_reg(Reg::rdx));
+        quotient = Reg::rax;
+    }
+    if (magic.shift > 0) {
+        emit(sink, Op::shr, op_reg(quotient), op_imm(magic.shift));
+    }
+    emit(sink, Op::mov, op_reg(dst), op_reg(quotient));
+}
+
+// the lea scale that multiplies by factor on its own: 3, 5 or 9
+inline uint8_t lea_scale(const uint64_t factor)
+{
+    return factor == 3 || factor == 5 || factor == 9 ? static_cast<uint8_t>(factor - 1) : 0;
+}
+
+/* dst = src * factor, with shifts and lea for powers of two and the products
+** of 3, 5 and 9 with them or with each other, and imul for the rest. src and
+** dst may be the same register, rdx is clobbered when the factor doesn't fit
+** in an immediate, so neither may be rdx then.
+*/
+inline void gen_mul(InstrSink& sink, const Reg dst, const Reg src, const uint64_t factor)
+{
+    if (factor == 0) {
+        emit(sink, Op::xor_, op_reg(dst, 32), op_reg(dst, 32));
+        return;
+    }
+    const int zeros = std::countr_zero(factor);
+    const uint64_t odd = factor >> zeros;
+    uint8_t first = lea_scale(odd);
+    uint8_t second = 0;
+    for (const uint64_t a : { 3, 5, 9 }) {
+        if (first == 0 && odd % a == 0 && lea_scale(odd / a) != 0) {
+            first = lea_scale(a);
+            second = lea_scale(odd / a);
+        }
+    }
+    if (odd == 1 || first != 0) {
+        Reg from = src;
+        if (first != 0) {
+            emit(sink, Op::lea, op_reg(dst), op_mem(src, src, first));
+            from = dst;
+        }
+        if (second != 0) {
+            emit(sink, Op::lea, op_reg(dst), op_mem(dst, dst, second));
+        }
+        if (from != dst) {
+            emit(sink, Op::mov, op_reg(dst), op_reg(from));
+        }
+        if (zeros > 0) {
+            emit(sink, Op::shl, op_reg(dst), op_imm(static_cast<uint64_t>(zeros)));
+        }
+        return;
+    }
+    if (factor <= static_cast<uint64_t>(INT32_MAX)) {
+        if (dst != src) {
+            emit(sink, Op::mov, op_reg(dst), op_reg(src));
+        }
+        emit(sink, Op::imul, op_reg(dst), op_imm(factor));
+        return;
+    }
+    emit(sink, Op::mov, op_reg(Reg::rdx), op_imm(factor));
+    if (dst != src) {
+        emit(sink, Op::mov, op_reg(dst), op_reg(src));
+    }
+    emit(sink, Op::imul, op_reg(dst), op_reg(Reg::rdx));
+}
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "interner.hpp"
+
+/* The variables visible at a point of the program, indexed by Symbol.
+** Declarations are also kept in order on a log, and every scope remembers
+** how long the log was when it began, so leaving a scope only touches the
+** names it declared. Lookups, declarations and scope exits are O(1) amortized.
+*/
+template <typename T>
+class ScopedSymbolTable {
+public:
+    struct Entry {
+        Symbol name;
+        T value;
+    };
+
+    explicit ScopedSymbolTable(const size_t num_symbols = 0)
+        : m_slots(num_symbols, no_slot)
+    {
+    }
+
+    [[nodiscard]] const T* find(const Symbol name) const
+    {
+        if (name >= m_slots.size() || m_slots[name] == no_slot) {
+            return nullptr;
+        }
+        return &m_entries[m_slots[name]].value;
+    }
+
+    [[nodiscard]] T* find(const Symbol name)
+    {
+        return const_cast<T*>(std::as_const(*this).find(name));
+    }
+
+    // returns false if the name is already visible, shadowing is not allowed
+    bool declare(const Symbol name, T value)
+    {
+        if (name >= m_slots.size()) {
+            m_slots.resize(name + 1, no_slot);
+        }
+        if (m_slots[name] != no_slot) {
+            return false;
+        }
+        m_slots[name] = static_cast<uint32_t>(m_entries.size());
+        m_entries.push_back({ name, std::move(value) });
+        return true;
+    }
+
+    // forgets every name and sizes the table for another program, keeping the memory
+    void reset(const size_t num_symbols)
+    {
+        m_slots.assign(num_symbols, no_slot);
+        m_entries.clear();
+        m_scope_starts.clear();
+    }
+
+    void begin_scope()
+    {
+        m_scope_starts.push_back(m_entries.size());
+    }
+
+    void end_scope()
+    {
+        const size_t start = m_scope_starts.back();
+        while (m_entries.size() > start) {
+            m_slots[m_entries.back().name] = no_slot;
+            m_entries.pop_back();
+        }
+        m_scope_starts.pop_back();
+    }
+
+    // the number of names declared in the innermost scope
+    [[nodiscard]] size_t innermost_size() const
+    {
+        return m_entries.size() - m_scope_starts.back();
+    }
+
+    // the names declared in the innermost scope, oldest first
+    [[nodiscard]] const Entry* innermost_begin() const
+    {
+        return m_entries.data() + m_scope_starts.back();
+    }
+
+    [[nodiscard]] const Entry* innermost_end() const
+    {
+        return m_entries.data() + m_entries.size();
+    }
+
+    // the number of visible names
+    [[nodiscard]] size_t size() const
+    {
+        return m_entries.size();
+    }
+
+private:
+    static constexpr uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+
+    std::vector<uint32_t> m_slots; // per Symbol, the index of its entry or no_slot
+    std::vector<Entry> m_entries; // the visible declarations, in order
+    std::vector<size_t> m_scope_starts; // the size of m_entries when each scope began
+};
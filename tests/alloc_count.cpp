@@ -0,0 +1,92 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "../compiler.hpp"
+
+/* Counts the heap allocations of compiling each file again and again with
+** the same Compiler, on one thread with the stack machine, the way the
+** compile server does. It prints a line per file with the count of every
+** compile, and fails if a compile after the first one allocated, since
+** those should only reuse what the first one left behind. Built with
+**     g++ -std=c++20 -O2 -o alloc_count tests/alloc_count.cpp
+** by tests/run_tests.py.
+*/
+namespace {
+
+std::atomic<size_t> g_allocations = 0;
+
+void* allocate(const size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+}
+
+void* operator new(const size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](const size_t size)
+{
+    return allocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, char* argv[])
+{
+    constexpr size_t compiles = 4;
+    if (argc < 3) {
+        std::cerr << "alloc_count <output> <input.hy>..." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string output_path = argv[1];
+    Compiler compiler;
+    const CompileOptions options;
+    int status = EXIT_SUCCESS;
+    for (int i = 2; i < argc; i++) {
+        const std::string input_path = argv[i];
+        std::cout << input_path << ":";
+        for (size_t compile = 0; compile < compiles; compile++) {
+            const size_t before = g_allocations.load();
+            if (const std::optional<std::string> error = compiler.compile(input_path, output_path, options)) {
+                std::cout << " " << *error;
+                status = EXIT_FAILURE;
+                break;
+            }
+            const size_t count = g_allocations.load() - before;
+            std::cout << " " << count;
+            if (compile != 0 && count != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        std::cout << std::endl;
+    }
+    return status;
+}
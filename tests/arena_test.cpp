@@ -0,0 +1,122 @@
+#include <cstdint>
+#include <utility>
+
+#include "../arena.hpp"
+#include "check.hpp"
+
+/* The arena hands out aligned memory from chained blocks, gives it back
+** with reset() and rewind() while keeping the blocks, and is empty but
+** usable after either move.
+*/
+namespace {
+
+bool aligned(const void* p, const size_t alignment)
+{
+    return reinterpret_cast<uintptr_t>(p) % alignment == 0;
+}
+
+void check_empty(const ArenaAllocator& arena)
+{
+    const ArenaAllocator::Stats stats = arena.stats();
+    CHECK(stats.bytes_used == 0);
+    CHECK(stats.bytes_reserved == 0);
+    CHECK(stats.blocks == 0);
+    const ArenaAllocator::Mark mark = arena.mark();
+    CHECK(mark.block == 0 && mark.offset == 0 && mark.used_before == 0);
+}
+
+// still usable: it takes a block of its old first size and can be reset
+void check_usable(ArenaAllocator& arena, const size_t block_size)
+{
+    const auto* value = arena.emplace<uint64_t>(uint64_t { 7 });
+    CHECK(*value == 7);
+    CHECK(arena.stats().blocks == 1);
+    CHECK(arena.stats().bytes_reserved == block_size);
+    arena.reset();
+    CHECK(arena.stats().bytes_used == 0);
+}
+
+void test_alloc()
+{
+    ArenaAllocator arena(64);
+    const auto* byte = arena.alloc<char>();
+    const auto* word = arena.emplace<uint64_t>(uint64_t { 42 });
+    CHECK(aligned(word, alignof(uint64_t)));
+    CHECK(*word == 42);
+    CHECK(static_cast<const void*>(byte) != word);
+    // bigger than a block, a block of its size is chained
+    void* big = arena.alloc_bytes(1000, 16);
+    CHECK(aligned(big, 16));
+    CHECK(arena.stats().blocks == 2);
+    CHECK(arena.stats().bytes_used >= 1009);
+}
+
+void test_reset_keeps_blocks()
+{
+    ArenaAllocator arena(64);
+    for (int i = 0; i < 100; i++) {
+        (void)arena.alloc<uint64_t>();
+    }
+    const ArenaAllocator::Stats before = arena.stats();
+    arena.reset();
+    CHECK(arena.stats().bytes_used == 0);
+    CHECK(arena.stats().high_water == before.bytes_used);
+    for (int i = 0; i < 100; i++) {
+        (void)arena.alloc<uint64_t>();
+    }
+    CHECK(arena.stats().blocks == before.blocks);
+    CHECK(arena.stats().bytes_reserved == before.bytes_reserved);
+}
+
+void test_rewind()
+{
+    ArenaAllocator arena(64);
+    (void)arena.alloc<uint64_t>();
+    const ArenaAllocator::Mark mark = arena.mark();
+    const size_t used = arena.stats().bytes_used;
+    auto* first = arena.alloc<uint64_t>();
+    for (int i = 0; i < 50; i++) {
+        (void)arena.alloc<uint64_t>();
+    }
+    arena.rewind(mark);
+    CHECK(arena.stats().bytes_used == used);
+    // the memory after the mark is handed out again
+    CHECK(arena.alloc<uint64_t>() == first);
+}
+
+void test_moves()
+{
+    ArenaAllocator from(256);
+    auto* value = from.emplace<uint64_t>(uint64_t { 5 });
+    ArenaAllocator to(std::move(from));
+    CHECK(*value == 5);
+    CHECK(to.stats().blocks == 1);
+    check_empty(from); // NOLINT(bugprone-use-after-move)
+    check_usable(from, 256);
+
+    ArenaAllocator assigned(64);
+    (void)assigned.alloc_bytes(1000, 8);
+    assigned = std::move(to);
+    CHECK(*value == 5);
+    CHECK(assigned.stats().blocks == 1);
+    CHECK(assigned.stats().bytes_reserved == 256);
+    check_empty(to); // NOLINT(bugprone-use-after-move)
+    check_usable(to, 256);
+
+    // rewinding a moved-from arena to its mark does nothing
+    ArenaAllocator moved(std::move(assigned));
+    const ArenaAllocator::Mark mark = assigned.mark(); // NOLINT(bugprone-use-after-move)
+    assigned.rewind(mark);
+    check_empty(assigned);
+}
+
+}
+
+int main()
+{
+    test_alloc();
+    test_reset_keeps_blocks();
+    test_rewind();
+    test_moves();
+    return check_status();
+}
@@ -0,0 +1,82 @@
+#include <string>
+#include <vector>
+
+#include "../asm_writer.hpp"
+#include "check.hpp"
+
+/* The typed instructions printed as nasm: labels get their names only
+** here, memory operands are sized but for lea, and registers print at the
+** width of the operand. Renumbering labels wraps, so code can be moved
+** away and back.
+*/
+namespace {
+
+std::string print(const std::vector<Instr>& instrs)
+{
+    OutputBuffer output(64);
+    AsmWriter writer(output);
+    for (const Instr& instr : instrs) {
+        writer.emit(instr);
+    }
+    std::string text;
+    for (const std::string_view chunk : output.chunks()) {
+        text += chunk;
+    }
+    return text;
+}
+
+void test_print()
+{
+    const std::string text = print({
+        { Op::label, op_label(0) },
+        { Op::comment, {}, {}, "let" },
+        { Op::mov, op_reg(Reg::rax), op_imm(18446744073709551615ULL) },
+        { Op::push, op_mem(Reg::rsp, 8) },
+        { Op::mov, op_mem(Reg::rbp, -16), op_reg(Reg::r9) },
+        { Op::lea, op_reg(Reg::rax), op_mem(Reg::rbx, Reg::rbx, 4, 0) },
+        { Op::lea, op_reg(Reg::rdi), op_mem(Reg::rsi, Reg::r8, 8, -24) },
+        { Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32) },
+        { Op::shl, op_reg(Reg::r12), op_reg(Reg::rcx, 8) },
+        { Op::div, op_reg(Reg::rbx) },
+        { Op::jle, op_label(12) },
+        { Op::call, op_label(3) },
+        { Op::ret },
+        { Op::syscall },
+    });
+    CHECK(text
+          == "global _start\n"
+             "_start:\n"
+             "label0:\n"
+             "    ;; let\n"
+             "    mov rax, 18446744073709551615\n"
+             "    push QWORD [rsp + 8]\n"
+             "    mov QWORD [rbp - 16], r9\n"
+             "    lea rax, [rbx + rbx*4]\n"
+             "    lea rdi, [rsi + r8*8 - 24]\n"
+             "    xor edx, edx\n"
+             "    shl r12, cl\n"
+             "    div rbx\n"
+             "    jle label12\n"
+             "    call label3\n"
+             "    ret\n"
+             "    syscall\n");
+}
+
+void test_move_labels()
+{
+    const Instr jump { Op::jmp, op_label(5) };
+    CHECK(move_labels(jump, 10).dst.value == 15);
+    // moved down by the same offset, the label comes back
+    CHECK(move_labels(move_labels(jump, 10), static_cast<LabelId>(-10)).dst == jump.dst);
+    const Instr add { Op::add, op_reg(Reg::rax), op_imm(5) };
+    CHECK(move_labels(add, 10).src.value == 5);
+}
+
+}
+
+int main()
+{
+    test_print();
+    test_move_labels();
+    return check_status();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+/* What the unit tests in tests/ share. A failed CHECK prints where it is and
+** what it checked, the test goes on, and check_status() makes main fail at
+** the end. A test is a file tests/<name>_test.cpp, built and run by
+** tests/run_tests.py with the paths of the programs it checks as arguments,
+** which a test that needs no programs ignores.
+*/
+namespace check_detail {
+
+inline size_t g_failures = 0;
+
+inline void check(const bool ok, const char* what, const char* file, const int line)
+{
+    if (!ok) {
+        std::cerr << file << ":" << line << ": CHECK(" << what << ") failed" << std::endl;
+        g_failures++;
+    }
+}
+
+}
+
+#define CHECK(cond) check_detail::check(static_cast<bool>(cond), #cond, __FILE__, __LINE__)
+
+[[nodiscard]] inline int check_status()
+{
+    return check_detail::g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
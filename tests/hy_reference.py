@@ -0,0 +1,436 @@
+"""A reference interpreter of Hy and a generator of random programs for it.
+
+The interpreter reads the source itself, so it shares nothing with the
+compiler: values are unsigned 64 bit, a division by 0 traps, a for loop
+compares signed and evaluates its end before every iteration and its step
+after every body, and a function sees only its parameters and returns 0
+when its body ends without a return. run() gives what the shell would see
+as the exit status of the compiled binary, 136 for the trap of a division
+by 0.
+
+The generated programs are valid and always end. Their functions only call
+the ones before them and never exit, so no order of evaluating the operands
+of an expression can change what a program does.
+"""
+
+import random
+import re
+
+MASK = (1 << 64) - 1
+TRAP_STATUS = 128 + 8  # SIGFPE
+
+TOKEN = re.compile(r"\s+|//[^\n]*|/\*.*?\*/|(\d+|[A-Za-z_]\w*|[-+*/=;:(){},])", re.S)
+PRECEDENCE = {"+": 0, "-": 0, "*": 1, "/": 1}
+
+
+class Trap(Exception):
+    pass
+
+
+class Exit(Exception):
+    def __init__(self, code):
+        super().__init__(code)
+        self.code = code
+
+
+class Return(Exception):
+    def __init__(self, value):
+        super().__init__(value)
+        self.value = value
+
+
+def tokenize(src):
+    tokens = []
+    pos = 0
+    while pos < len(src):
+        match = TOKEN.match(src, pos)
+        if match is None:
+            raise SyntaxError(f"unexpected {src[pos]!r}")
+        if match.group(1) is not None:
+            tokens.append(match.group(1))
+        pos = match.end()
+    return tokens
+
+
+class Parser:
+    """Statements are tuples with their kind first, expressions too:
+    ("int", v), ("var", name), ("call", name, args) and (op, lhs, rhs)."""
+
+    def __init__(self, src):
+        self.tokens = tokenize(src)
+        self.pos = 0
+
+    def peek(self, offset=0):
+        index = self.pos + offset
+        return self.tokens[index] if index < len(self.tokens) else None
+
+    def take(self, expected=None):
+        token = self.peek()
+        if token is None or (expected is not None and token != expected):
+            raise SyntaxError(f"expected {expected} at token {self.pos}, got {token}")
+        self.pos += 1
+        return token
+
+    def loop_bounds(self, names):
+        """The start, the step and the end of a loop, which ends soon whatever
+        the body does: the step is 1 to 4 and the end at most 8. With traps
+        either may divide by an expression, which is 0 at times, and half
+        the loops with such a step never run, so they never evaluate it."""
+        rng = self.rng
+        start = rng.randint(0, 3)
+        step = str(rng.randint(1, 3))
+        end = str(rng.randint(0, 8))
+        if self.traps and rng.random() < 0.5:
+            # 1 / x is 0 or 1 for any x but 0
+            step = f"{step} + 1 / ({self.divisor(names)})"
+            if rng.random() < 0.5:
+                start = rng.randint(1, 3)
+                end = str(rng.randint(0, start - 1))
+        if self.traps and rng.random() < 0.4:
+            end = f"{end} / ({self.divisor(names)})"
+        return start, step, end
+
+    def divisor(self, names):
+        """An expression of variables that is 0 more often than most"""
+        rng = self.rng
+        kind = rng.random()
+        if kind < 0.3:
+            return self.expr(names, 3)
+        name = rng.choice(names)
+        return f"{name} - {name}" if kind < 0.65 else f"{name} - {rng.choice(names)}"
+
+    def program(self):
+        fns = {}
+        stmts = []
+        while self.peek() is not None:
+            if self.peek() == "fn":
+                self.take()
+                name = self.take()
+                self.take("(")
+                params = []
+                while self.peek() != ")":
+                    params.append(self.take())
+                    if self.peek() == ",":
+                        self.take()
+                self.take(")")
+                fns[name] = (params, self.scope())
+            else:
+                stmts.append(self.stmt())
+        return fns, stmts
+
+    def scope(self):
+        self.take("{")
+        stmts = []
+        while self.peek() != "}":
+            stmts.append(self.stmt())
+        self.take("}")
+        return stmts
+
+    def stmt(self):
+        token = self.peek()
+        if token == "exit":
+            self.take()
+            self.take("(")
+            expr = self.expr()
+            self.take(")")
+            self.take(";")
+            return ("exit", expr)
+        if token == "let":
+            self.take()
+            name = self.take()
+            self.take("=")
+            expr = self.expr()
+            self.take(";")
+            return ("let", name, expr)
+        if token == "return":
+            self.take()
+            expr = self.expr()
+            self.take(";")
+            return ("return", expr)
+        if token == "{":
+            return ("scope", self.scope())
+        if token == "if":
+            self.take()
+            branches = [(self.paren_expr(), self.scope())]
+            otherwise = None
+            while self.peek() == "elif":
+                self.take()
+                branches.append((self.paren_expr(), self.scope()))
+            if self.peek() == "else":
+                self.take()
+                otherwise = self.scope()
+            return ("if", branches, otherwise)
+        if token == "for":
+            self.take()
+            var = self.take()
+            self.take("=")
+            start = self.expr()
+            self.take(":")
+            step = self.expr()
+            self.take(":")
+            end = self.expr()
+            return ("for", var, start, step, end, self.scope())
+        name = self.take()
+        self.take("=")
+        expr = self.expr()
+        self.take(";")
+        return ("assign", name, expr)
+
+    def paren_expr(self):
+        self.take("(")
+        expr = self.expr()
+        self.take(")")
+        return expr
+
+    def expr(self, min_prec=0):
+        lhs = self.term()
+        while self.peek() in PRECEDENCE and PRECEDENCE[self.peek()] >= min_prec:
+            op = self.take()
+            lhs = (op, lhs, self.expr(PRECEDENCE[op] + 1))
+        return lhs
+
+    def term(self):
+        token = self.take()
+        if token.isdigit():
+            return ("int", int(token))
+        if token == "(":
+            expr = self.expr()
+            self.take(")")
+            return expr
+        if self.peek() == "(":
+            self.take()
+            args = []
+            while self.peek() != ")":
+                args.append(self.expr())
+                if self.peek() == ",":
+                    self.take()
+            self.take(")")
+            return ("call", token, args)
+        return ("var", token)
+
+
+def to_signed(value):
+    return value - (1 << 64) if value >> 63 else value
+
+
+class Interpreter:
+    def __init__(self, fns):
+        self.fns = fns
+
+    def expr(self, expr, scopes):
+        kind = expr[0]
+        if kind == "int":
+            return expr[1] & MASK
+        if kind == "var":
+            return lookup(scopes, expr[1])[expr[1]]
+        if kind == "call":
+            params, body = self.fns[expr[1]]
+            args = [self.expr(arg, scopes) for arg in expr[2]]
+            try:
+                self.block(body, [dict(zip(params, args))])
+            except Return as ret:
+                return ret.value
+            return 0
+        lhs = self.expr(expr[1], scopes)
+        rhs = self.expr(expr[2], scopes)
+        if kind == "+":
+            return (lhs + rhs) & MASK
+        if kind == "-":
+            return (lhs - rhs) & MASK
+        if kind == "*":
+            return (lhs * rhs) & MASK
+        if rhs == 0:
+            raise Trap()
+        return lhs // rhs
+
+    def block(self, stmts, scopes):
+        scopes.append({})
+        for stmt in stmts:
+            self.stmt(stmt, scopes)
+        scopes.pop()
+
+    def stmt(self, stmt, scopes):
+        kind = stmt[0]
+        if kind == "exit":
+            raise Exit(self.expr(stmt[1], scopes) & 0xFF)
+        if kind == "let":
+            scopes[-1][stmt[1]] = self.expr(stmt[2], scopes)
+        elif kind == "assign":
+            value = self.expr(stmt[2], scopes)
+            lookup(scopes, stmt[1])[stmt[1]] = value
+        elif kind == "return":
+            raise Return(self.expr(stmt[1], scopes))
+        elif kind == "scope":
+            self.block(stmt[1], scopes)
+        elif kind == "if":
+            for cond, body in stmt[1]:
+                if self.expr(cond, scopes) != 0:
+                    self.block(body, scopes)
+                    return
+            if stmt[2] is not None:
+                self.block(stmt[2], scopes)
+        elif kind == "for":
+            _, var, start, step, end, body = stmt
+            scopes.append({var: self.expr(start, scopes)})
+            while to_signed(scopes[-1][var]) <= to_signed(self.expr(end, scopes)):
+                self.block(body, scopes)
+                scopes[-1][var] = (scopes[-1][var] + self.expr(step, scopes)) & MASK
+            scopes.pop()
+
+
+def lookup(scopes, name):
+    for scope in reversed(scopes):
+        if name in scope:
+            return scope
+    raise NameError(name)
+
+
+def run(src):
+    """The exit status of the program, as the shell reports it"""
+    fns, stmts = Parser(src).program()
+    try:
+        Interpreter(fns).block(stmts, [])
+    except Exit as ex:
+        return ex.code
+    except Trap:
+        return TRAP_STATUS
+    return 0
+
+
+class Generator:
+    """Random programs: lets, assignments, scopes, if chains, for loops and,
+    with fns, functions called from expressions. With traps, a divisor can
+    be any expression, so some programs divide by 0; without, divisors are
+    constants other than 0, and so are loop bounds. A function calls the
+    ones before it outside its loops only, which keeps the number of calls
+    small."""
+
+    LITERALS = [0, 1, 2, 3, 4, 7, 8, 16, 100, 1000, 1 << 31, (1 << 63) - 1, 1 << 63, MASK]
+
+    def __init__(self, seed, fns=False, traps=False):
+        self.rng = random.Random(seed)
+        self.with_fns = fns
+        self.traps = traps
+        self.count = 0
+        self.fns = []  # the name and the parameter count of the functions so far
+        self.callable = []  # the ones an expression may call here
+
+    def name(self, prefix):
+        self.count += 1
+        return f"{prefix}{self.count}"
+
+    def literal(self):
+        if self.rng.random() < 0.1:
+            return str(self.rng.choice(self.LITERALS))
+        return str(self.rng.choice([0, 1, 2, 3, 5, 8, 10, self.rng.randint(0, 5000)]))
+
+    def expr(self, names, depth=0):
+        rng = self.rng
+        if depth > 4 or rng.random() < 0.3:
+            if names and rng.random() < 0.6:
+                return rng.choice(names)
+            return self.literal()
+        if self.callable and rng.random() < 0.1:
+            fn, params = rng.choice(self.callable)
+            return f"{fn}({', '.join(self.expr(names, depth + 2) for _ in range(params))})"
+        op = rng.choice("+-*/")
+        lhs = self.expr(names, depth + 1)
+        if op == "/" and (not self.traps or rng.random() < 0.7):
+            rhs = str(rng.choice([1, 2, 3, 5, 7, 8, 10, 16, 64, 1000]))
+        else:
+            rhs = self.expr(names, depth + 1)
+        text = f"{lhs} {op} {rhs}"
+        return text if rng.random() < 0.3 else f"({text})"
+
+    def block(self, names, frozen, out, indent, depth, in_fn):
+        """names are the variables in sight, frozen the ones the block must not assign"""
+        rng = self.rng
+        names = list(names)
+        for _ in range(rng.randint(1, 5)):
+            kind = rng.random()
+            assignable = [name for name in names if name not in frozen]
+            if kind < 0.3 or not names:
+                name = self.name("v")
+                out.append(f"{indent}let {name} = {self.expr(names)};")
+                names.append(name)
+            elif kind < 0.55 and assignable:
+                out.append(f"{indent}{rng.choice(assignable)} = {self.expr(names)};")
+            elif kind < 0.65 and depth < 3:
+                out.append(f"{indent}{{")
+                self.block(names, frozen, out, indent + "    ", depth + 1, in_fn)
+                out.append(f"{indent}}}")
+            elif kind < 0.8 and depth < 3:
+                out.append(f"{indent}if ({self.expr(names)}) {{")
+                self.block(names, frozen, out, indent + "    ", depth + 1, in_fn)
+                for _ in range(rng.randint(0, 2)):
+                    out.append(f"{indent}}} elif ({self.expr(names)}) {{")
+                    self.block(names, frozen, out, indent + "    ", depth + 1, in_fn)
+                if rng.random() < 0.5:
+                    out.append(f"{indent}}} else {{")
+                    self.block(names, frozen, out, indent + "    ", depth + 1, in_fn)
+                out.append(f"{indent}}}")
+            elif kind < 0.92 and depth < (2 if in_fn else 3):
+                var = self.name("i")
+                callable = self.callable
+                if in_fn:
+                    self.callable = []
+                start, step, end = self.loop_bounds(names + [var])
+                out.append(f"{indent}for {var} = {start} : {step} : {end} {{")
+                self.block(names + [var], frozen | {var}, out, indent + "    ", depth + 1, in_fn)
+                self.callable = callable
+                out.append(f"{indent}}}")
+            elif in_fn and rng.random() < 0.3:
+                out.append(f"{indent}return {self.expr(names)};")
+            elif not in_fn and depth > 0 and rng.random() < 0.2:
+                out.append(f"{indent}exit({self.expr(names)});")
+
+    def loop_bounds(self, names):
+        """The start, the step and the end of a loop, which ends soon whatever
+        the body does: the step is 1 to 4 and the end at most 8. With traps
+        either may divide by an expression, which is 0 at times, and half
+        the loops with such a step never run, so they never evaluate it."""
+        rng = self.rng
+        start = rng.randint(0, 3)
+        step = str(rng.randint(1, 3))
+        end = str(rng.randint(0, 8))
+        if self.traps and rng.random() < 0.5:
+            # 1 / x is 0 or 1 for any x but 0
+            step = f"{step} + 1 / ({self.divisor(names)})"
+            if rng.random() < 0.5:
+                start = rng.randint(1, 3)
+                end = str(rng.randint(0, start - 1))
+        if self.traps and rng.random() < 0.4:
+            end = f"{end} / ({self.divisor(names)})"
+        return start, step, end
+
+    def divisor(self, names):
+        """An expression of variables that is 0 more often than most"""
+        rng = self.rng
+        kind = rng.random()
+        if kind < 0.3:
+            return self.expr(names, 3)
+        name = rng.choice(names)
+        return f"{name} - {name}" if kind < 0.65 else f"{name} - {rng.choice(names)}"
+
+    def program(self):
+        out = []
+        if self.with_fns:
+            for _ in range(self.rng.randint(1, 4)):
+                fn = self.name("f")
+                params = [self.name("p") for _ in range(self.rng.randint(0, 6))]
+                out.append(f"fn {fn}({', '.join(params)}) {{")
+                self.callable = list(self.fns)
+                self.block(params, set(), out, "    ", 1, True)
+                if self.rng.random() < 0.8:
+                    out.append(f"    return {self.expr(params)};")
+                out.append("}")
+                self.fns.append((fn, len(params)))
+                self.callable = self.fns
+        names = []
+        for _ in range(self.rng.randint(1, 4)):
+            name = self.name("v")
+            out.append(f"let {name} = {self.expr(names)};")
+            names.append(name)
+        self.block(names, set(), out, "", 0, False)
+        out.append(f"exit({self.expr(names)});")
+        return "\n".join(out) + "\n"
@@ -0,0 +1,93 @@
+#include <string>
+#include <vector>
+
+#include "../interner.hpp"
+#include "../tokenization.hpp"
+#include "check.hpp"
+
+/* The perfect hash finds every keyword and nothing else, even names that
+** hash to the slot of a keyword, and the interner gives one dense Symbol per
+** name however much its table grows.
+*/
+namespace {
+
+std::optional<TokenType> keyword_type(const std::string_view text)
+{
+    for (const Keyword& keyword : keywords) {
+        if (keyword.text == text) {
+            return keyword.type;
+        }
+    }
+    return {};
+}
+
+void test_keywords()
+{
+    for (const Keyword& keyword : keywords) {
+        CHECK(lookup_keyword(keyword.text) == keyword.type);
+    }
+    // every name of up to 4 of these characters, which covers the keywords but for return and their near misses
+    const std::string chars = "_abcefilnorstxz";
+    std::vector<std::string> names = { "" };
+    for (size_t length = 1; length <= 4; length++) {
+        std::vector<std::string> longer;
+        for (const std::string& name : names) {
+            if (name.size() + 1 == length) {
+                for (const char c : chars) {
+                    longer.push_back(name + c);
+                }
+            }
+        }
+        names.insert(names.end(), longer.begin(), longer.end());
+    }
+    for (const Keyword& keyword : keywords) {
+        const std::string text(keyword.text);
+        names.push_back(text + "s");
+        names.push_back("x" + text);
+        names.push_back(text.substr(1));
+        names.push_back(text.substr(0, text.size() - 1));
+        for (size_t i = 0; i < text.size(); i++) {
+            std::string changed = text;
+            changed[i] = changed[i] == 'z' ? 'y' : 'z';
+            names.push_back(changed);
+        }
+    }
+    for (const std::string& name : names) {
+        if (!name.empty()) {
+            CHECK(lookup_keyword(name) == keyword_type(name));
+        }
+    }
+}
+
+void test_interner()
+{
+    constexpr size_t count = 10'000;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; i++) {
+        names.push_back("v" + std::to_string(i));
+    }
+    Interner interner;
+    for (size_t i = 0; i < count; i++) {
+        // dense and in the order the names were first seen
+        CHECK(interner.intern(names[i]) == i);
+        CHECK(interner.intern(names[i / 2]) == i / 2);
+    }
+    CHECK(interner.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(interner.intern(std::string(names[i])) == i);
+        CHECK(interner.name(static_cast<Symbol>(i)) == names[i]);
+    }
+    interner.clear();
+    CHECK(interner.size() == 0);
+    CHECK(interner.intern(names[42]) == 0);
+    CHECK(interner.intern(names[0]) == 1);
+}
+
+}
+
+int main()
+{
+    test_keywords();
+    test_interner();
+    return check_status();
+}
@@ -0,0 +1,111 @@
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../source.hpp"
+#include "../tokenization.hpp"
+#include "check.hpp"
+
+/* The SSE2/AVX2 block scanners must lex exactly what the scalar loop does.
+** Every program given on the command line and a set of sources built to put
+** tokens, comments and newlines on both sides of a 16 and 32 byte block
+** boundary are lexed both ways, and the tokens must be the same: the type,
+** the line, the slice of the source and the symbol. An error must be the
+** same error.
+*/
+namespace {
+
+struct Lexed {
+    std::vector<Token> tokens;
+    std::optional<std::string> error;
+};
+
+template <typename Lex>
+Lexed lex(Lex lex_all)
+{
+    Lexed lexed;
+    try {
+        lexed.tokens = lex_all();
+    }
+    catch (const CompileError& error) {
+        lexed.error = error.what();
+    }
+    return lexed;
+}
+
+bool same_token(const Token& a, const Token& b)
+{
+    // both views must be the same slice of the source, not just equal text
+    const bool same_value = a.value.has_value() == b.value.has_value()
+        && (!a.value.has_value() || (a.value->data() == b.value->data() && a.value->size() == b.value->size()));
+    return a.type == b.type && a.line == b.line && same_value && a.sym == b.sym;
+}
+
+void check_same(const std::string_view src, const std::string& what)
+{
+    Interner simd_names;
+    Interner scalar_names;
+    const Lexed simd = lex([&] { return Tokenizer(src, simd_names).tokenize(); });
+    const Lexed scalar = lex([&] { return Tokenizer(src, scalar_names).tokenize_scalar(); });
+    if (simd.error != scalar.error) {
+        std::cerr << what << ": the SIMD lexer says " << simd.error.value_or("nothing") << ", the scalar one "
+                  << scalar.error.value_or("nothing") << std::endl;
+    }
+    CHECK(simd.error == scalar.error);
+    CHECK(simd.tokens.size() == scalar.tokens.size());
+    for (size_t i = 0; i < simd.tokens.size() && i < scalar.tokens.size(); i++) {
+        if (!same_token(simd.tokens[i], scalar.tokens[i])) {
+            std::cerr << what << ": token " << i << " differs, on line " << simd.tokens[i].line << std::endl;
+            CHECK(same_token(simd.tokens[i], scalar.tokens[i]));
+            break;
+        }
+    }
+    for (size_t i = 0; i < simd.tokens.size(); i++) {
+        if (simd.tokens[i].type == TokenType::ident) {
+            CHECK(simd_names.name(simd.tokens[i].sym) == scalar_names.name(scalar.tokens[i].sym));
+        }
+    }
+}
+
+// runs of every kind of character, each as long as it takes to cross a block boundary
+std::vector<std::string> boundary_sources()
+{
+    const std::vector<std::string> fillers = { " ", "\n", "\t", "a", "7", "_x", "// c\n", "/* c */", "/*\n*/" };
+    std::vector<std::string> sources;
+    for (const std::string& filler : fillers) {
+        for (size_t count = 0; count <= 70; count++) {
+            std::string run;
+            for (size_t i = 0; i < count; i++) {
+                run += filler;
+            }
+            sources.push_back(run);
+            sources.push_back("let x = 1;" + run + "exit(x);");
+            sources.push_back(run + "/");
+            sources.push_back(run + "/* never closed " + run);
+            sources.push_back(run + "// no newline at the end");
+            sources.push_back(run + "let $ = 1;");
+        }
+    }
+    for (size_t length = 1; length <= 80; length++) {
+        sources.push_back("let " + std::string(length, 'v') + " = " + std::string(length, '9') + ";");
+        sources.push_back(std::string(length, '\n') + "exit(" + std::string(length, '1') + ");\n");
+    }
+    return sources;
+}
+
+}
+
+int main(const int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        SourceFile file;
+        CHECK(file.open(argv[i]));
+        check_same(file.view(), argv[i]);
+    }
+    size_t index = 0;
+    for (const std::string& src : boundary_sources()) {
+        check_same(src, "boundary source " + std::to_string(index++));
+    }
+    return check_status();
+}
@@ -0,0 +1,106 @@
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "../optimizer.hpp"
+#include "check.hpp"
+
+/* What the optimizer leaves of the expression of the last exit: the kinds
+** of its nodes in post-order, and the value when it folds to a literal.
+** Folding wraps like the generated code, constants are propagated from lets
+** that are never assigned, and the identities never drop a call or a
+** division that may trap.
+*/
+namespace {
+
+struct Optimized {
+    std::vector<ExprKind> kinds;
+    uint64_t value = 0; // if it is a single literal
+};
+
+Optimized optimize(const std::string_view src)
+{
+    Interner interner;
+    Tokenizer tokenizer(src, interner);
+    Parser parser;
+    parser.reset(tokenizer);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    CHECK(prog.has_value());
+    Optimizer optimizer;
+    optimizer.run(*prog, interner);
+    const FlatExprs& exprs = prog->exprs;
+    const ExprId root = std::get<NodeStmtExit*>(prog->stmts.back()->var)->expr;
+    Optimized optimized;
+    for (ExprId id = exprs.firsts[root]; id <= root; id++) {
+        optimized.kinds.push_back(exprs.kinds[id]);
+    }
+    if (optimized.kinds.size() == 1 && optimized.kinds.front() == ExprKind::int_lit) {
+        optimized.value = exprs.int_value(root);
+    }
+    return optimized;
+}
+
+bool folds_to(const std::string_view src, const uint64_t value)
+{
+    const Optimized optimized = optimize(src);
+    return optimized.kinds == std::vector { ExprKind::int_lit } && optimized.value == value;
+}
+
+bool becomes(const std::string_view src, const std::vector<ExprKind>& kinds)
+{
+    return optimize(src).kinds == kinds;
+}
+
+// x is assigned to, so its value isn't known
+constexpr std::string_view var_x = "let x = 3; x = x + 1; ";
+
+using enum ExprKind;
+
+void test_folding()
+{
+    CHECK(folds_to("exit(2 + 3 * 4);", 14));
+    CHECK(folds_to("exit((2 + 3) * 4);", 20));
+    CHECK(folds_to("exit(1 - 2);", UINT64_MAX));
+    CHECK(folds_to("exit(18446744073709551615 * 2);", UINT64_MAX - 1));
+    // unsigned, like the code
+    CHECK(folds_to("exit((0 - 8) / 2);", (UINT64_MAX - 7) / 2));
+    CHECK(folds_to("let a = 5; let b = a * 2; exit(b + a);", 15));
+}
+
+void test_identities()
+{
+    const std::string x(var_x);
+    CHECK(becomes(x + "exit(x + 0);", { ident }));
+    CHECK(becomes(x + "exit(0 + x);", { ident }));
+    CHECK(becomes(x + "exit(x - 0);", { ident }));
+    CHECK(becomes(x + "exit(x * 1);", { ident }));
+    CHECK(becomes(x + "exit(1 * x);", { ident }));
+    CHECK(becomes(x + "exit(x / 1);", { ident }));
+    CHECK(folds_to(x + "exit(x * 0);", 0));
+    CHECK(becomes(x + "exit(x * 8);", { ident, int_lit, shl }));
+    CHECK(becomes(x + "exit(x / 16);", { ident, int_lit, shr }));
+    // a literal factor goes to the right
+    CHECK(becomes(x + "exit(3 * x);", { ident, int_lit, multi }));
+}
+
+void test_kept()
+{
+    const std::string x(var_x);
+    // the division traps at runtime, it must stay
+    CHECK(becomes("exit(8 / 0);", { int_lit, int_lit, div }));
+    CHECK(optimize(x + "exit(x * (8 / 0));").kinds.size() > 1);
+    CHECK(optimize(x + "exit((1 / x) * 0);").kinds.size() > 1);
+    // a call could exit
+    CHECK(optimize("fn f() { exit(1); } exit(f() * 0);").kinds.size() > 1);
+}
+
+}
+
+int main()
+{
+    test_folding();
+    test_identities();
+    test_kept();
+    return check_status();
+}
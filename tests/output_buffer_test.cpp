@@ -0,0 +1,146 @@
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../output_buffer.hpp"
+#include "check.hpp"
+
+/* The buffer against a plain string: random lines and integers go into a
+** buffer with tiny chunks, and the chunks must hold the same text, each a
+** run of whole lines. Written with writev, more chunks than one call takes
+** and short writes to a pipe included, the file gets the same bytes.
+*/
+namespace {
+
+// what the buffer got and the string it should equal
+struct Filled {
+    OutputBuffer buffer;
+    std::string expected;
+
+    explicit Filled(const size_t chunk_size)
+        : buffer(chunk_size)
+    {
+    }
+
+    void fill(const unsigned seed, const size_t lines)
+    {
+        std::mt19937 rng(seed);
+        for (size_t line = 0; line < lines; line++) {
+            for (unsigned part = rng() % 4; part-- > 0;) {
+                switch (rng() % 3) {
+                case 0: {
+                    const std::string word(rng() % 40, static_cast<char>('a' + rng() % 26));
+                    buffer << word;
+                    expected += word;
+                    break;
+                }
+                case 1: {
+                    const uint64_t value = rng() % 2 != 0 ? UINT64_MAX - rng() : rng();
+                    buffer << value;
+                    expected += std::to_string(value);
+                    break;
+                }
+                default: {
+                    const int32_t value = -static_cast<int32_t>(rng() % 1000);
+                    buffer << value << ' ';
+                    expected += std::to_string(value) + ' ';
+                    break;
+                }
+                }
+            }
+            buffer << "\n";
+            expected += "\n";
+        }
+    }
+};
+
+void check_contents(const Filled& filled)
+{
+    std::string text;
+    const std::vector<std::string_view> chunks = filled.buffer.chunks();
+    for (const std::string_view chunk : chunks) {
+        // whole lines only, the unfinished one moved on to the next chunk
+        CHECK(chunk.empty() || chunk.back() == '\n');
+        text += chunk;
+    }
+    CHECK(text == filled.expected);
+    CHECK(filled.buffer.size() == filled.expected.size());
+}
+
+std::string read_all(const int fd)
+{
+    std::string text;
+    char chunk[4096];
+    ssize_t n = 0;
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+        text.append(chunk, static_cast<size_t>(n));
+    }
+    return text;
+}
+
+void test_lines()
+{
+    for (const size_t chunk_size : { 1, 7, 64, 4096 }) {
+        Filled filled(chunk_size);
+        filled.fill(static_cast<unsigned>(chunk_size), 2000);
+        check_contents(filled);
+    }
+}
+
+void test_reuse()
+{
+    Filled filled(256);
+    filled.fill(1, 1000);
+    const size_t chunks = filled.buffer.chunks().size();
+    filled.buffer.clear();
+    filled.expected.clear();
+    CHECK(filled.buffer.size() == 0);
+    // the same text fits in the chunks it left behind
+    filled.fill(1, 1000);
+    check_contents(filled);
+    CHECK(filled.buffer.chunks().size() == chunks);
+}
+
+void test_write()
+{
+    // lines of up to 40 bytes and chunks of 64, so far more chunks than IOV_MAX
+    Filled filled(64);
+    filled.fill(2, 20'000);
+    CHECK(filled.buffer.chunks().size() > IOV_MAX);
+    std::FILE* file = std::tmpfile();
+    CHECK(filled.buffer.write_to(fileno(file)));
+    CHECK(lseek(fileno(file), 0, SEEK_SET) == 0);
+    CHECK(read_all(fileno(file)) == filled.expected);
+    std::fclose(file);
+
+    // a pipe takes a few pages at a time, so writev comes back short
+    Filled small(64);
+    small.fill(3, 3000);
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        ::close(fds[0]);
+        _exit(small.buffer.write_to(fds[1]) ? 0 : 1);
+    }
+    ::close(fds[1]);
+    CHECK(read_all(fds[0]) == small.expected);
+    ::close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+}
+
+int main()
+{
+    test_lines();
+    test_reuse();
+    test_write();
+    return check_status();
+}
@@ -0,0 +1,234 @@
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "../parallel_parser.hpp"
+#include "../source.hpp"
+#include "check.hpp"
+
+/* A program parsed in chunks must be the program parsed in one go: the same
+** statements, the same expression pool node for node, and the same names
+** with the same numbers. That goes for every program given on the command
+** line big enough to be cut, and for big sources that put comments, braces
+** in comments and `elif` and `else` right where a cut could fall. A source
+** with an error anywhere is never returned, the usual parse reports it.
+*/
+namespace {
+
+// the statements with their symbols and expression ids, one line each
+class Dump {
+public:
+    std::string text;
+
+    void stmts(const std::pmr::vector<NodeStmt*>& list) // NOLINT(*-no-recursion)
+    {
+        for (const NodeStmt* stmt : list) {
+            std::visit([this](const auto* node) { this->node(node); }, stmt->var);
+        }
+    }
+
+private:
+    void line(const std::string& what, const std::vector<uint64_t>& fields)
+    {
+        text += what;
+        for (const uint64_t field : fields) {
+            text += " " + std::to_string(field);
+        }
+        text += "\n";
+    }
+
+    void node(const NodeStmtExit* stmt)
+    {
+        line("exit", { stmt->expr });
+    }
+
+    void node(const NodeStmtLet* stmt)
+    {
+        line("let", { stmt->ident, stmt->expr });
+    }
+
+    void node(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        line("{", {});
+        stmts(scope->stmts);
+        line("}", {});
+    }
+
+    void node(const NodeStmtIf* stmt) // NOLINT(*-no-recursion)
+    {
+        line("if", { stmt->expr });
+        node(stmt->scope);
+        std::optional<NodeIfPred*> pred = stmt->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                line("elif", { (*elif)->expr });
+                node((*elif)->scope);
+                pred = (*elif)->pred;
+            }
+            else {
+                line("else", {});
+                node(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                pred = {};
+            }
+        }
+    }
+
+    void node(const NodeStmtAssign* stmt)
+    {
+        line("assign", { stmt->ident, stmt->expr });
+    }
+
+    void node(const NodeStmtFor* stmt) // NOLINT(*-no-recursion)
+    {
+        line("for", { stmt->var, stmt->start, stmt->step, stmt->end });
+        node(stmt->body);
+    }
+
+    void node(const NodeStmtReturn* stmt)
+    {
+        line("return", { stmt->expr });
+    }
+};
+
+std::string dump(const NodeProg& prog, const Interner& interner)
+{
+    Dump dump;
+    dump.stmts(prog.stmts);
+    for (const NodeFn* fn : prog.fns) {
+        dump.text += "fn " + std::to_string(fn->name);
+        for (const Symbol param : fn->params) {
+            dump.text += " " + std::to_string(param);
+        }
+        dump.text += "\n";
+        dump.stmts(fn->body->stmts);
+    }
+    for (Symbol sym = 0; sym < interner.size(); sym++) {
+        dump.text += std::string(interner.name(sym)) + "\n";
+    }
+    return dump.text;
+}
+
+bool same_exprs(const FlatExprs& a, const FlatExprs& b)
+{
+    return a.kinds == b.kinds && a.firsts == b.firsts && a.lhs == b.lhs && a.rhs == b.rhs;
+}
+
+// the program the usual way, or nothing if it has an error
+std::optional<std::string> parse_whole(const std::string_view src, FlatExprs& exprs)
+{
+    Interner interner;
+    Tokenizer tokenizer(src, interner);
+    Parser parser;
+    parser.reset(tokenizer);
+    try {
+        std::optional<NodeProg> prog = parser.parse_prog();
+        exprs = prog->exprs;
+        return dump(*prog, interner);
+    }
+    catch (const CompileError&) {
+        return {};
+    }
+}
+
+/* Parses the source in chunks on each number of threads and compares. cut
+** says whether the source is big enough that it must have been cut.
+*/
+void check_same(ParallelParser& parallel, const std::string_view src, const std::string& what, const bool cut)
+{
+    FlatExprs whole_exprs;
+    const std::optional<std::string> whole = parse_whole(src, whole_exprs);
+    for (const size_t threads : { 2, 3, 8 }) {
+        Interner interner;
+        const std::optional<NodeProg> prog = parallel.parse(src, interner, threads);
+        if (!whole.has_value()) {
+            // a chunk may still parse a broken file if the scan cut it wrongly, but then not every chunk does
+            CHECK(!prog.has_value());
+            continue;
+        }
+        if (cut) {
+            CHECK(prog.has_value());
+        }
+        if (!prog.has_value()) {
+            continue;
+        }
+        const bool same = dump(*prog, interner) == *whole && same_exprs(prog->exprs, whole_exprs);
+        if (!same) {
+            std::cerr << what << " on " << threads << " threads: not the program parsed in one go" << std::endl;
+        }
+        CHECK(same);
+    }
+}
+
+// a top-level statement of every kind, with the comments and line breaks a cut has to go around
+std::string statement(const size_t i)
+{
+    const std::string n = std::to_string(i);
+    switch (i % 6) {
+    case 0:
+        return "let v" + n + " = " + n + " * (2 + " + n + ");\n";
+    case 1:
+        return "{ let s" + n + " = " + n + "; /* } ; { */ }\n";
+    case 2:
+        return "if (v0 - " + n + ") {\n    v0 = v0 + 1; // ; }\n}\n// a comment between\nelif (v0) { v0 = 2; }\n"
+            + "/* and\n another */ else { v0 = 3; }\n";
+    case 3:
+        return "for i = 0 : 1 : " + n + " { v0 = v0 + i; }\n";
+    case 4:
+        return "if (v0) { v0 = 1; }\nelse\n{\n    v0 = 4;\n}\n";
+    default:
+        return "v0 = v0 / " + n + ";\n";
+    }
+}
+
+std::string big_source(const size_t bytes)
+{
+    std::string src;
+    for (size_t i = 0; src.size() < bytes; i++) {
+        src += statement(i);
+    }
+    return src;
+}
+
+void test_generated()
+{
+    ParallelParser parallel;
+    const std::string src = big_source(ParallelParser::min_chunk_size * 5);
+    check_same(parallel, src, "generated source", true);
+    // too small to be worth cutting
+    Interner interner;
+    CHECK(!parallel.parse(big_source(1000), interner, 4).has_value());
+
+    // an error in the first, a middle or the last chunk, and braces that don't match
+    const size_t positions[] = { 100, src.size() / 2, src.size() - 10 };
+    for (const size_t position : positions) {
+        const size_t at = src.find(';', position);
+        check_same(parallel, src.substr(0, at) + src.substr(at + 1), "missing ; at " + std::to_string(at), false);
+        check_same(parallel, src.substr(0, at) + " $ " + src.substr(at), "invalid token at " + std::to_string(at),
+                   false);
+    }
+    check_same(parallel, src + "{", "an open brace at the end", false);
+    check_same(parallel, "}" + src, "a closing brace at the start", false);
+    // the parser is used again, with the chunks of the last parse gone
+    check_same(parallel, big_source(ParallelParser::min_chunk_size * 3), "a smaller source after", true);
+}
+
+void test_programs(const int argc, char* argv[])
+{
+    ParallelParser parallel;
+    for (int i = 1; i < argc; i++) {
+        SourceFile file;
+        CHECK(file.open(argv[i]));
+        check_same(parallel, file.view(), argv[i], false);
+    }
+}
+
+}
+
+int main(const int argc, char* argv[])
+{
+    test_generated();
+    test_programs(argc, argv);
+    return check_status();
+}
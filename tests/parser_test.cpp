@@ -0,0 +1,240 @@
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "../parser.hpp"
+#include "../source.hpp"
+#include "check.hpp"
+
+/* What the parser builds, looked at directly: the statement lists live in
+** the parser's arena, the expressions of every program given on the
+** command line are in post-order, each operand right before its user, and
+** looking past the last token finds the end of the file on its line.
+*/
+namespace {
+
+// the parser and the interner outlive the program they parsed
+struct Parsed {
+    Interner interner;
+    Parser parser;
+    std::optional<NodeProg> prog;
+    std::optional<std::string> error;
+
+    // the names of the last source may be gone with it
+    void parse(const std::string_view src)
+    {
+        interner.clear();
+        Tokenizer tokenizer(src, interner);
+        parser.reset(tokenizer);
+        error.reset();
+        try {
+            prog = parser.parse_prog();
+        }
+        catch (const CompileError& compile_error) {
+            prog.reset();
+            error = compile_error.what();
+        }
+    }
+};
+
+void check_resource(const NodeScope* scope, const std::pmr::memory_resource* resource);
+
+// every statement list below the statements takes its memory from the resource
+void check_resource(const std::pmr::vector<NodeStmt*>& stmts, // NOLINT(*-no-recursion)
+                    const std::pmr::memory_resource* resource)
+{
+    for (const NodeStmt* stmt : stmts) {
+        if (const auto inner = std::get_if<NodeScope*>(&stmt->var)) {
+            check_resource(*inner, resource);
+        }
+        else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            check_resource((*stmt_if)->scope, resource);
+            std::optional<NodeIfPred*> pred = (*stmt_if)->pred;
+            while (pred.has_value()) {
+                if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                    check_resource((*elif)->scope, resource);
+                    pred = (*elif)->pred;
+                }
+                else {
+                    check_resource(std::get<NodeIfPredElse*>(pred.value()->var)->scope, resource);
+                    pred = {};
+                }
+            }
+        }
+        else if (const auto stmt_for = std::get_if<NodeStmtFor*>(&stmt->var)) {
+            check_resource((*stmt_for)->body, resource);
+        }
+    }
+}
+
+void check_resource(const NodeScope* scope, const std::pmr::memory_resource* resource) // NOLINT(*-no-recursion)
+{
+    CHECK(scope->stmts.get_allocator().resource() == resource);
+    check_resource(scope->stmts, resource);
+}
+
+void test_arena()
+{
+    const std::string src = "fn f(a, b) { let c = a; { return c + b; } }\n"
+                            "let x = f(1, 2);\n"
+                            "{ let y = x; { y = y + 1; } }\n"
+                            "if (x) { x = 1; } elif (x - 1) { { x = 2; } } else { x = 3; }\n"
+                            "for i = 0 : 1 : 3 { x = x + i; }\n"
+                            "exit(x);\n";
+    Parsed parsed;
+    parsed.parse(src);
+    CHECK(parsed.prog.has_value());
+    const NodeProg& prog = parsed.prog.value();
+    const std::pmr::memory_resource* arena = prog.stmts.get_allocator().resource();
+    CHECK(arena != std::pmr::get_default_resource());
+    CHECK(prog.fns.get_allocator().resource() == arena);
+    for (const NodeFn* fn : prog.fns) {
+        CHECK(fn->params.get_allocator().resource() == arena);
+        check_resource(fn->body, arena);
+    }
+    check_resource(prog.stmts, arena);
+    CHECK(parsed.parser.arena_stats().bytes_used > 0);
+
+    // the next program reuses the blocks
+    const size_t blocks = parsed.parser.arena_stats().blocks;
+    parsed.parse(src);
+    CHECK(parsed.parser.arena_stats().blocks == blocks);
+}
+
+// every node is the last of its range, right after the range of its right operand, which follows the left one's
+void check_post_order(const FlatExprs& exprs)
+{
+    std::vector<ExprId> args;
+    for (ExprId id = 0; id < exprs.size(); id++) {
+        CHECK(exprs.firsts[id] <= id);
+        const ExprKind kind = exprs.kinds[id];
+        if (is_bin_expr(kind)) {
+            const ExprId lhs = exprs.lhs[id];
+            const ExprId rhs = exprs.rhs[id];
+            CHECK(rhs == id - 1);
+            CHECK(lhs + 1 == exprs.firsts[rhs]);
+            CHECK(exprs.firsts[id] == exprs.firsts[lhs]);
+        }
+        else if (kind == ExprKind::call) {
+            exprs.call_args(id, args);
+            CHECK(exprs.firsts[id] == (args.empty() ? id : exprs.firsts[args.front()]));
+            CHECK(args.empty() || args.back() == id - 1);
+        }
+        else {
+            CHECK(exprs.firsts[id] == id);
+        }
+    }
+}
+
+// a plain loop over the range of the expression, the way the passes walk it
+uint64_t evaluate(const FlatExprs& exprs, const ExprId root)
+{
+    std::vector<uint64_t> values;
+    for (ExprId id = exprs.firsts[root]; id <= root; id++) {
+        if (exprs.kinds[id] == ExprKind::int_lit) {
+            values.push_back(exprs.int_value(id));
+            continue;
+        }
+        const uint64_t rhs = values.back();
+        values.pop_back();
+        uint64_t& lhs = values.back();
+        switch (exprs.kinds[id]) {
+        case ExprKind::add:
+            lhs += rhs;
+            break;
+        case ExprKind::sub:
+            lhs -= rhs;
+            break;
+        case ExprKind::multi:
+            lhs *= rhs;
+            break;
+        case ExprKind::div:
+            lhs /= rhs;
+            break;
+        default:
+            CHECK(false);
+        }
+    }
+    CHECK(values.size() == 1);
+    return values.back();
+}
+
+void test_flat_exprs()
+{
+    const std::pair<std::string_view, uint64_t> cases[] = {
+        { "exit(1 + 2 * 3);", 7 },
+        { "exit((1 + 2) * 3);", 9 },
+        { "exit(10 - 3 - 2);", 5 },
+        { "exit(100 / 10 / 5);", 2 },
+        { "exit(((((7)))));", 7 },
+        { "exit(2 * (3 + 4) - 20 / (1 + 1));", 4 },
+        { "exit(1 - 2);", UINT64_MAX },
+    };
+    for (const auto& [src, value] : cases) {
+        Parsed parsed;
+        parsed.parse(src);
+        CHECK(parsed.prog.has_value());
+        const NodeProg& prog = parsed.prog.value();
+        check_post_order(prog.exprs);
+        const NodeStmtExit* stmt_exit = std::get<NodeStmtExit*>(prog.stmts.front()->var);
+        // no parenthesis nodes, an operand or operator per node
+        CHECK(stmt_exit->expr == prog.exprs.size() - 1);
+        CHECK(evaluate(prog.exprs, stmt_exit->expr) == value);
+    }
+}
+
+void test_eof()
+{
+    const std::pair<std::string_view, std::string_view> errors[] = {
+        { "let x = 1", "[Parse Error] Expected `;` on line 1" },
+        { "\n\nlet x = 1\n\n\n", "[Parse Error] Expected `;` on line 3" },
+        { "let x = 1;\nexit(x", "[Parse Error] Expected `)` on line 2" },
+        { "exit(", "[Parse Error] Expected expression on line 1" },
+        { "if (1) {", "[Parse Error] Expected `}` on line 1" },
+        { "let", "[Parse Error] Expected statement on line 1" },
+        // nothing consumed yet, the error is on the line of the first token
+        { "\n\n= 1;", "[Parse Error] Expected statement on line 3" },
+    };
+    Parsed parsed;
+    for (const auto& [src, error] : errors) {
+        parsed.parse(src);
+        CHECK(!parsed.prog.has_value());
+        CHECK(parsed.error == error);
+    }
+    for (const std::string_view src : { "", "\n\n", "// only\n/* comments */" }) {
+        parsed.parse(src);
+        CHECK(parsed.prog.has_value() && parsed.prog->stmts.empty());
+        CHECK(parsed.parser.tokens_read() == 0);
+    }
+    // the end of the file is never consumed
+    parsed.parse("let x = 1;\nexit(x);");
+    CHECK(parsed.prog.has_value() && parsed.prog->stmts.size() == 2);
+    CHECK(parsed.parser.tokens_read() == 10);
+}
+
+void test_programs(const int argc, char* argv[])
+{
+    Parsed parsed;
+    for (int i = 1; i < argc; i++) {
+        SourceFile file;
+        CHECK(file.open(argv[i]));
+        parsed.parse(file.view());
+        if (parsed.prog.has_value()) {
+            check_post_order(parsed.prog->exprs);
+        }
+    }
+}
+
+}
+
+int main(const int argc, char* argv[])
+{
+    test_arena();
+    test_flat_exprs();
+    test_eof();
+    test_programs(argc, argv);
+    return check_status();
+}
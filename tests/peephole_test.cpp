@@ -0,0 +1,252 @@
+#include <array>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "../peephole.hpp"
+#include "check.hpp"
+
+/* Each rule on the sequence it is for, and the whole pass against a small
+** machine: random straight-line code of pushes, pops, movs and stack
+** adjustments must leave the registers and the live stack as it was without
+** the pass. Comments in between must not stop a rule, and a flush must.
+*/
+namespace {
+
+class Recorder final : public InstrSink {
+public:
+    void emit(const Instr& instr) override
+    {
+        code.push_back(instr);
+    }
+
+    std::vector<Instr> code;
+};
+
+std::vector<Instr> optimize(const std::vector<Instr>& instrs)
+{
+    Recorder recorder;
+    Peephole::Buffers buffers;
+    Peephole peephole(recorder, buffers);
+    for (const Instr& instr : instrs) {
+        if (instr.op == Op::label && instr.dst.value == UINT32_MAX) {
+            peephole.flush();
+        }
+        else {
+            peephole.emit(instr);
+        }
+    }
+    peephole.finish();
+    return recorder.code;
+}
+
+bool same(const std::vector<Instr>& a, const std::vector<Instr>& b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].op != b[i].op || a[i].dst != b[i].dst || a[i].src != b[i].src) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const Operand rax = op_reg(Reg::rax);
+const Operand rbx = op_reg(Reg::rbx);
+const Operand rcx = op_reg(Reg::rcx);
+const Operand rsp = op_reg(Reg::rsp);
+const Instr comment { Op::comment, {}, {}, "c" };
+// not an instruction, optimize() calls flush() where it stands
+const Instr flush { Op::label, op_label(UINT32_MAX) };
+
+void test_rules()
+{
+    CHECK(same(optimize({ { Op::push, rax }, { Op::pop, rbx } }), { { Op::mov, rbx, rax } }));
+    CHECK(same(optimize({ { Op::push, rax }, comment, { Op::pop, rax } }), { comment }));
+    CHECK(same(optimize({ { Op::push, rax }, { Op::mov, rcx, op_imm(3) }, { Op::pop, rbx } }),
+               { { Op::mov, rbx, rax }, { Op::mov, rcx, op_imm(3) } }));
+    // the mov writes what the pop reads, it has to stay as it is
+    CHECK(same(optimize({ { Op::push, rax }, { Op::mov, rbx, op_imm(3) }, { Op::pop, rbx } }),
+               { { Op::push, rax }, { Op::mov, rbx, op_imm(3) }, { Op::pop, rbx } }));
+    CHECK(same(optimize({ { Op::mov, rax, op_imm(7) }, { Op::mov, rbx, rax }, { Op::pop, rax } }),
+               { { Op::mov, rbx, op_imm(7) }, { Op::pop, rax } }));
+    CHECK(same(optimize({ { Op::jmp, op_label(4) }, { Op::label, op_label(4) } }), { { Op::label, op_label(4) } }));
+    CHECK(same(optimize({ { Op::jmp, op_label(4) }, { Op::label, op_label(5) } }),
+               { { Op::jmp, op_label(4) }, { Op::label, op_label(5) } }));
+    CHECK(same(optimize({ { Op::add, rax, op_imm(0) }, { Op::sub, rbx, op_imm(0) }, { Op::mov, rcx, rcx } }), {}));
+    // mov ecx, ecx clears the upper half, it isn't a no-op
+    CHECK(same(optimize({ { Op::mov, op_reg(Reg::rcx, 32), op_reg(Reg::rcx, 32) } }),
+               { { Op::mov, op_reg(Reg::rcx, 32), op_reg(Reg::rcx, 32) } }));
+    CHECK(same(optimize({ { Op::add, rsp, op_imm(24) }, { Op::push, rax } }),
+               { { Op::add, rsp, op_imm(16) }, { Op::mov, op_mem(Reg::rsp), rax } }));
+    CHECK(same(optimize({ { Op::add, rsp, op_imm(8) }, { Op::push, rax } }), { { Op::mov, op_mem(Reg::rsp), rax } }));
+    // rewriting one rule makes the next one match what came before
+    CHECK(same(optimize({ { Op::push, rax }, { Op::push, rbx }, { Op::pop, rbx }, { Op::pop, rcx } }),
+               { { Op::mov, rcx, rax } }));
+    // mov rcx, rbx reads what the pop writes, so the push and the pop stay
+    CHECK(same(optimize({ { Op::push, rax }, { Op::push, rbx }, { Op::pop, rcx }, { Op::pop, rbx } }),
+               { { Op::push, rax }, { Op::mov, rcx, rbx }, { Op::pop, rbx } }));
+    CHECK(same(optimize({ { Op::push, rax }, flush, { Op::pop, rbx } }), { { Op::push, rax }, { Op::pop, rbx } }));
+}
+
+void test_rewrites()
+{
+    Recorder recorder;
+    Peephole::Buffers buffers;
+    Peephole peephole(recorder, buffers);
+    // two for push / push / pop / pop and one for the add of 0
+    for (const Instr& instr : { Instr { Op::push, rax }, Instr { Op::push, rbx }, Instr { Op::pop, rbx },
+             Instr { Op::pop, rcx }, Instr { Op::add, rcx, op_imm(0) }, Instr { Op::add, rcx, op_imm(1) } }) {
+        peephole.emit(instr);
+    }
+    peephole.finish();
+    CHECK(peephole.rewrites() == 3);
+    CHECK(recorder.code.size() == 2);
+}
+
+// the registers and the stack of a machine that runs push, pop, mov, add and sub
+struct Machine {
+    std::array<uint64_t, 16> regs {};
+    std::map<uint64_t, uint64_t> memory;
+
+    uint64_t& reg(const Reg reg)
+    {
+        return regs[static_cast<size_t>(reg)];
+    }
+
+    uint64_t& ref(const Operand& operand)
+    {
+        if (operand.kind == Operand::Kind::mem) {
+            return memory[reg(operand.reg) + static_cast<uint64_t>(static_cast<int64_t>(operand.disp))];
+        }
+        return reg(operand.reg);
+    }
+
+    uint64_t value(const Operand& operand)
+    {
+        return operand.kind == Operand::Kind::imm ? operand.value : ref(operand);
+    }
+
+    void run(const std::vector<Instr>& code)
+    {
+        for (const Instr& instr : code) {
+            switch (instr.op) {
+            case Op::push: {
+                const uint64_t pushed = value(instr.dst);
+                reg(Reg::rsp) -= 8;
+                memory[reg(Reg::rsp)] = pushed;
+                break;
+            }
+            case Op::pop:
+                ref(instr.dst) = memory[reg(Reg::rsp)];
+                reg(Reg::rsp) += 8;
+                break;
+            case Op::mov:
+                ref(instr.dst) = value(instr.src);
+                break;
+            case Op::add:
+                ref(instr.dst) += value(instr.src);
+                break;
+            case Op::sub:
+                ref(instr.dst) -= value(instr.src);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // what lies below the stack pointer is dead, a rule may leave it different
+    bool same_live_state(Machine& other)
+    {
+        if (regs != other.regs) {
+            return false;
+        }
+        for (uint64_t address = reg(Reg::rsp); address < stack_top; address += 8) {
+            if (memory[address] != other.memory[address]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static constexpr uint64_t stack_top = 0x10000;
+};
+
+std::vector<Instr> random_code(std::mt19937& rng)
+{
+    const Reg regs[] = { Reg::rax, Reg::rbx, Reg::rcx, Reg::rdx };
+    std::vector<Instr> code;
+    size_t depth = 4; // the slots on the stack, the machine starts with these
+    for (int i = 0; i < 40; i++) {
+        const Operand reg = op_reg(regs[rng() % 4]);
+        const Operand slot = op_mem(Reg::rsp, static_cast<int32_t>(rng() % depth * 8));
+        switch (rng() % 9) {
+        case 0:
+            code.push_back({ Op::push, rng() % 3 == 0 ? slot : reg });
+            depth++;
+            break;
+        case 1:
+            if (depth > 1) {
+                code.push_back({ Op::pop, reg });
+                depth--;
+            }
+            break;
+        case 2:
+            code.push_back({ Op::mov, reg, op_imm(rng() % 3) });
+            break;
+        case 3:
+            code.push_back({ Op::mov, reg, op_reg(regs[rng() % 4]) });
+            break;
+        case 4:
+            code.push_back({ Op::mov, reg, slot });
+            break;
+        case 5:
+            code.push_back({ Op::add, reg, op_imm(rng() % 2) });
+            break;
+        case 6:
+            if (depth > 3) {
+                code.push_back({ Op::add, rsp, op_imm(16) });
+                depth -= 2;
+            }
+            break;
+        case 7:
+            code.push_back(comment);
+            break;
+        default:
+            code.push_back({ Op::mov, slot, reg });
+            break;
+        }
+    }
+    return code;
+}
+
+void test_against_machine()
+{
+    std::mt19937 rng(1);
+    for (int test = 0; test < 20'000; test++) {
+        const std::vector<Instr> code = random_code(rng);
+        Machine plain;
+        plain.reg(Reg::rsp) = Machine::stack_top - 4 * 8;
+        for (uint64_t i = 0; i < 4; i++) {
+            plain.regs[i] = i * 100;
+            plain.memory[plain.reg(Reg::rsp) + i * 8] = i * 1000;
+        }
+        Machine optimized = plain;
+        plain.run(code);
+        optimized.run(optimize(code));
+        CHECK(plain.same_live_state(optimized));
+    }
+}
+
+}
+
+int main()
+{
+    test_rules();
+    test_rewrites();
+    test_against_machine();
+    return check_status();
+}
@@ -0,0 +1,161 @@
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/wait.h>
+#include <vector>
+
+#include "../compiler.hpp"
+#include "check.hpp"
+
+/* The sites of a program are numbered in the order they show up, and its
+** shape tells it from other programs. A profile that isn't the program's
+** own is turned down. An instrumented binary, built with and without the
+** optimizer, counts the iterations of its loops and the branches it took.
+*/
+namespace {
+
+struct Parsed {
+    Interner interner;
+    Parser parser;
+    std::optional<NodeProg> prog;
+
+    explicit Parsed(const std::string_view src)
+    {
+        Tokenizer tokenizer(src, interner);
+        parser.reset(tokenizer);
+        prog = parser.parse_prog();
+    }
+};
+
+const std::string_view counted = "let n = 0;\n"
+                                 "for i = 1 : 1 : 10 {\n"
+                                 "    if (i - 3) {\n"
+                                 "        n = n + 1;\n"
+                                 "    } elif (i - 5) {\n"
+                                 "        n = n + 2;\n"
+                                 "    } else {\n"
+                                 "        n = n + 4;\n"
+                                 "    }\n"
+                                 "}\n"
+                                 "exit(n);\n";
+
+void test_sites()
+{
+    const Parsed parsed(counted);
+    const ProfileSites sites(*parsed.prog);
+    const auto* stmt_for = std::get<NodeStmtFor*>(parsed.prog->stmts[1]->var);
+    const auto* stmt_if = std::get<NodeStmtIf*>(stmt_for->body->stmts[0]->var);
+    const auto* elif = std::get<NodeIfPredElif*>(stmt_if->pred.value()->var);
+    const auto* stmt_else = std::get<NodeIfPredElse*>(elif->pred.value()->var);
+    CHECK(sites.size() == 5);
+    CHECK(sites.find(stmt_for->body) == 0);
+    CHECK(sites.find(stmt_if) == 1);
+    CHECK(sites.find(stmt_if->scope) == 2);
+    CHECK(sites.find(elif->scope) == 3);
+    CHECK(sites.find(stmt_else->scope) == 4);
+    CHECK(!sites.find(stmt_for).has_value());
+
+    // the same program has the same shape, and a statement more or a different one changes it
+    CHECK(ProfileSites(*Parsed(counted).prog).shape() == sites.shape());
+    CHECK(ProfileSites(*Parsed("let a = 1;" + std::string(counted)).prog).shape() != sites.shape());
+    CHECK(ProfileSites(*Parsed("if (1) { let a = 1; }").prog).shape()
+          != ProfileSites(*Parsed("if (1) { exit(1); }").prog).shape());
+
+    const std::vector<uint8_t> data = sites.data("/p");
+    CHECK(data.size() == sites.profile_size() + 3);
+    CHECK(std::string_view(reinterpret_cast<const char*>(data.data()) + sites.profile_size()) == "/p");
+    CHECK(ProfileSites::counter_address(1) == ProfileSites::data_address + ProfileSites::header_size + 8);
+}
+
+std::optional<std::string> read_error(const ProfileSites& sites, const std::string& path)
+{
+    try {
+        const Profile profile(sites, path);
+    }
+    catch (const CompileError& error) {
+        return error.what();
+    }
+    return {};
+}
+
+void write(const std::string& path, const std::vector<uint64_t>& words)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(words.data()), static_cast<std::streamsize>(words.size() * 8));
+}
+
+void test_foreign_profiles(const std::string& dir)
+{
+    const Parsed parsed(counted);
+    const ProfileSites sites(*parsed.prog);
+    const std::string path = dir + "/foreign.profile";
+    const std::string foreign = "The profile " + path + " is not one of this program";
+    CHECK(read_error(sites, dir + "/missing.profile") == "Could not read the profile " + dir + "/missing.profile");
+    write(path, { ProfileSites::magic, sites.shape(), 5, 1, 2, 3, 4, 5 });
+    CHECK(!read_error(sites, path).has_value());
+    const Profile profile(sites, path);
+    CHECK(profile.count(std::get<NodeStmtFor*>(parsed.prog->stmts[1]->var)->body) == 1);
+    CHECK(profile.count(parsed.prog->stmts[0]) == 0);
+    write(path, { ProfileSites::magic, sites.shape(), 5, 1, 2, 3, 4 });
+    CHECK(read_error(sites, path) == foreign);
+    write(path, { ProfileSites::magic + 1, sites.shape(), 5, 1, 2, 3, 4, 5 });
+    CHECK(read_error(sites, path) == foreign);
+    write(path, { ProfileSites::magic, sites.shape() + 1, 5, 1, 2, 3, 4, 5 });
+    CHECK(read_error(sites, path) == foreign);
+}
+
+// the status of the binary, run in its directory, where it writes its profile
+int run(const std::string& dir, const std::string& binary)
+{
+    const int status = std::system(("cd " + dir + " && " + binary).c_str());
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_counts(const std::string& dir)
+{
+    const std::string source = dir + "/counted.hy";
+    std::ofstream(source) << counted;
+    const Parsed parsed(counted);
+    const ProfileSites sites(*parsed.prog);
+    Compiler compiler;
+    for (const bool optimize : { false, true }) {
+        CompileOptions options;
+        options.optimize = optimize;
+        options.instrument = true;
+        const std::string binary = dir + "/counted";
+        CHECK(!compiler.compile(source, binary, options).has_value());
+        // 9 times the if branch, once the elif for i = 3 and never the else
+        CHECK(run(dir, binary) == 9 + 2);
+        const Profile profile(sites, binary + ".profile");
+        const auto* stmt_for = std::get<NodeStmtFor*>(parsed.prog->stmts[1]->var);
+        const auto* stmt_if = std::get<NodeStmtIf*>(stmt_for->body->stmts[0]->var);
+        const auto* elif = std::get<NodeIfPredElif*>(stmt_if->pred.value()->var);
+        CHECK(profile.count(stmt_for->body) == 10);
+        CHECK(profile.count(stmt_if) == 10);
+        CHECK(profile.count(stmt_if->scope) == 9);
+        CHECK(profile.count(elif->scope) == 1);
+        CHECK(profile.count(std::get<NodeIfPredElse*>(elif->pred.value()->var)->scope) == 0);
+
+        // the binary laid out by the profile still exits the same
+        options.instrument = false;
+        options.profile_use = true;
+        CHECK(!compiler.compile(source, binary, options).has_value());
+        CHECK(run(dir, binary) == 9 + 2);
+    }
+}
+
+}
+
+int main()
+{
+    char dir_template[] = "/tmp/profile_test.XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    CHECK(dir != nullptr);
+    test_sites();
+    test_foreign_profiles(dir);
+    test_counts(dir);
+    std::system(("rm -rf " + std::string(dir)).c_str());
+    return check_status();
+}
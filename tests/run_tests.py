@@ -0,0 +1,606 @@
+#!/usr/bin/env python3
+"""The tests of the compiler. It builds hydro, hydro_bench, alloc_count and
+the unit tests into a directory of its own and checks:
+
+- cases: the programs in tests/cases, whose first line says what they do,
+  `// exit N` for the exit status of the binary (128 + the signal if it
+  dies of one) or `// error: TEXT` for a compile error containing TEXT.
+  The reference interpreter must agree with the exit ones too.
+- fuzz: random programs from hy_reference.py, which also runs them.
+- corpus: the programs of the benchmarks, written by hydro_bench. The small
+  ones are run by the reference interpreter, the big ones are compared with
+  the binary of the stack machine without optimization.
+- units: the tests/*_test.cpp, built with AddressSanitizer and UBSan and
+  run with the paths of the programs above.
+- deep: expressions far deeper than the native stack.
+
+Every program is compiled with each set of FLAG_SETS and its binary run.
+Programs with functions only compile with the stack machine, the other
+backends must reject them. On top of that, the binaries of -j and of a cold
+and a warm cache must be the same bytes as those of a plain compile, also
+after the file was edited between a compile and the next. A big program
+with errors put in must stop at the same error with -j as without, the
+JSON of --time-report=json must parse and count what is in the source, an
+--instrument run followed by --profile-use must still exit the same, and
+alloc_count checks that compiling a file again allocates nothing. The
+compile server must keep its socket to its user and go on serving while a
+client hangs without finishing its request, and --nasm must report a
+failed nasm or ld as the error of the file. With
+--tsan, a ThreadSanitizer build of hydro compiles the programs with -j and
+must not report a race.
+
+    tests/run_tests.py [--fuzz N] [--seed S] [--tsan] [--keep DIR]
+"""
+
+import argparse
+import json
+import os
+import re
+import resource
+import shutil
+import socket
+import stat
+import subprocess
+import sys
+import tempfile
+import time
+
+import hy_reference
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CASES = os.path.join(REPO, "tests", "cases")
+
+FLAG_SETS = [
+    [],
+    ["-O0"],
+    ["--unroll", "4"],
+    ["--pipeline"],
+    ["-j", "4"],
+    ["--regalloc"],
+    ["--regalloc", "-O0"],
+    ["--ssa"],
+    ["--ssa", "-O0"],
+    ["--ssa", "--regalloc"],
+]
+STACK_ONLY_ERROR = "only supported by the stack machine"
+CXXFLAGS = ["-std=c++20", "-Wall", "-Wextra", "-O2"]
+UNIT_CXXFLAGS = ["-fsanitize=address,undefined", "-fno-sanitize-recover=undefined", "-g"]
+# also built with -mavx2 when the machine has it, the default build only has the SSE2 scanners
+AVX2_UNIT_TESTS = ["lexer_test"]
+
+
+class Program:
+    """A file to compile and what it should do: exit with status, or fail to compile with error"""
+
+    def __init__(self, path, status=None, error=None, stack_bytes=None):
+        self.path = path
+        self.status = status
+        self.error = error
+        self.stack_bytes = stack_bytes  # the binaries have to run with that little stack
+        with open(path) as src:
+            self.has_fns = any(line.lstrip().startswith("fn ") for line in src)
+
+
+class Results:
+    def __init__(self):
+        self.checks = 0
+        self.failures = []
+
+    def check(self, ok, what):
+        self.checks += 1
+        if not ok:
+            self.failures.append(what)
+            print("FAIL " + what, flush=True)
+
+
+def build(out_dir, tsan):
+    targets = [("hydro", "main.cpp", []), ("hydro_bench", "bench.cpp", []),
+               ("alloc_count", "tests/alloc_count.cpp", [])]
+    if tsan:
+        targets.append(("hydro_tsan", "main.cpp", ["-fsanitize=thread", "-g"]))
+    targets += [(test, os.path.join("tests", test + ".cpp"), UNIT_CXXFLAGS) for test in unit_tests()]
+    targets += [(test + "_avx2", os.path.join("tests", test + ".cpp"), [*UNIT_CXXFLAGS, "-mavx2"])
+                for test in avx2_unit_tests()]
+    # all at once, each g++ is a process of its own
+    builds = [subprocess.Popen(["g++", *CXXFLAGS, *extra, "-o", os.path.join(out_dir, name), src], cwd=REPO)
+              for name, src, extra in targets]
+    for (name, _, _), process in zip(targets, builds):
+        if process.wait() != 0:
+            sys.exit(f"could not build {name}")
+
+
+def unit_tests():
+    names = os.listdir(os.path.join(REPO, "tests"))
+    return sorted(name[: -len(".cpp")] for name in names if name.endswith("_test.cpp"))
+
+
+def avx2_unit_tests():
+    with open("/proc/cpuinfo") as cpuinfo:
+        has_avx2 = " avx2" in cpuinfo.read()
+    return AVX2_UNIT_TESTS if has_avx2 else []
+
+
+def check_units(results, build_dir, programs):
+    """Every unit test gets the paths of the programs, the ones that read programs check them"""
+    paths = [program.path for program in programs]
+    for test in unit_tests() + [test + "_avx2" for test in avx2_unit_tests()]:
+        done = subprocess.run([os.path.join(build_dir, test), *paths], capture_output=True, text=True)
+        results.check(done.returncode == 0, f"{test}: {done.stderr.strip()[:2000]}")
+
+
+def run_binary(path, stack_bytes=None):
+    """The exit status of the binary, with at most stack_bytes of stack if it is given"""
+
+    def limit_stack():
+        resource.setrlimit(resource.RLIMIT_STACK, (stack_bytes, stack_bytes))
+
+    try:
+        status = subprocess.run([path], cwd=os.path.dirname(path), timeout=60,
+                                preexec_fn=limit_stack if stack_bytes else None).returncode
+    except subprocess.TimeoutExpired:
+        return "timeout"
+    return 128 - status if status < 0 else status
+
+
+def compile_batch(hydro, paths, flags, work_dir):
+    """Compiles the files in one batch, each into the path without .hy.
+    Returns the error of every file that failed."""
+    manifest = os.path.join(work_dir, "manifest")
+    with open(manifest, "w") as out:
+        out.write("\n".join(paths) + "\n")
+    for path in paths:
+        if os.path.exists(binary_of(path)):
+            os.remove(binary_of(path))
+    done = subprocess.run([hydro, *flags, "@" + manifest], capture_output=True, text=True)
+    errors = {}
+    for line in done.stderr.splitlines():
+        path, sep, error = line.partition(": ")
+        if sep and path in paths:
+            errors[path] = error
+    return errors
+
+
+def binary_of(path):
+    return path[: -len(".hy")]
+
+
+def check_programs(results, hydro, programs, flags, work_dir):
+    errors = compile_batch(hydro, [program.path for program in programs], flags, work_dir)
+    for program in programs:
+        what = f"{program.path} {' '.join(flags)}"
+        error = errors.get(program.path)
+        if program.has_fns and ("--regalloc" in flags or "--ssa" in flags):
+            results.check(error is not None and STACK_ONLY_ERROR in error, f"{what}: not rejected, {error}")
+        elif program.error is not None:
+            results.check(error is not None and program.error in error, f"{what}: error {error}, not {program.error}")
+        elif error is not None:
+            results.check(False, f"{what}: {error}")
+        else:
+            status = run_binary(binary_of(program.path), program.stack_bytes)
+            results.check(status == program.status, f"{what}: exit {status}, not {program.status}")
+
+
+def check_all_flags(results, hydro, programs, work_dir):
+    for flags in FLAG_SETS:
+        check_programs(results, hydro, programs, flags, work_dir)
+
+
+def read_bytes(path):
+    with open(path, "rb") as binary:
+        return binary.read()
+
+
+def check_same_binaries(results, hydro, programs, work_dir):
+    """-j and the cache must not change a single byte of the code"""
+    programs = [program for program in programs if program.error is None]
+    paths = [program.path for program in programs]
+    cache = os.path.join(work_dir, "cache")
+    shutil.rmtree(cache, ignore_errors=True)
+    compile_batch(hydro, paths, [], work_dir)
+    expected = {path: read_bytes(binary_of(path)) for path in paths}
+    for flags in (["-j", "4"], ["--cache", cache], ["--cache", cache]):
+        compile_batch(hydro, paths, flags, work_dir)
+        for path in paths:
+            same = os.path.exists(binary_of(path)) and read_bytes(binary_of(path)) == expected[path]
+            results.check(same, f"{path} {' '.join(flags)}: not the binary of a plain compile")
+
+
+def edits_of(src):
+    """Edits of a program as in the edit-compile loop, each on top of the one before: a new first
+    variable moves every other one down the stack, a literal changes in the last statement that
+    has one, and then it is the program it was again"""
+    lines = src.split("\n")
+    moved = "let cacheedit = 7;\n" + src
+    for i in reversed(range(len(lines))):
+        code, sep, comment = lines[i].partition("//")
+        literals = list(re.finditer(r"\b\d+\b", code))
+        if literals:
+            last = literals[-1]
+            value = int(last.group())
+            changed = str(value - 1 if value > 0 else value + 1)
+            lines[i] = code[: last.start()] + changed + code[last.end():] + sep + comment
+            break
+    return [moved, "let cacheedit = 7;\n" + "\n".join(lines), src]
+
+
+def check_cache_edits(results, hydro, programs, work_dir):
+    """A cache warmed by one version of a file must give the bytes of a plain compile of the next"""
+    edit_dir = os.path.join(work_dir, "edits")
+    cache = os.path.join(work_dir, "edit_cache")
+    os.makedirs(edit_dir)
+    sources = {}
+    for i, program in enumerate(program for program in programs if program.error is None):
+        path = os.path.join(edit_dir, f"{i}.hy")
+        with open(program.path) as src:
+            sources[path] = src.read()
+        shutil.copy(program.path, path)
+    paths = list(sources)
+    compile_batch(hydro, paths, ["--cache", cache], work_dir)
+    for step in range(3):
+        for path, src in sources.items():
+            with open(path, "w") as out:
+                out.write(edits_of(src)[step])
+        plain_errors = compile_batch(hydro, paths, [], work_dir)
+        expected = {path: read_bytes(binary_of(path)) for path in paths if path not in plain_errors}
+        cached_errors = compile_batch(hydro, paths, ["--cache", cache], work_dir)
+        for path in paths:
+            what = f"{path} edit {step + 1}"
+            # the edits keep the program valid, an error means the edit went wrong
+            if path in plain_errors or path in cached_errors:
+                results.check(False, f"{what}: {plain_errors.get(path)}, {cached_errors.get(path)} with --cache")
+                continue
+            same = os.path.exists(binary_of(path)) and read_bytes(binary_of(path)) == expected[path]
+            results.check(same, f"{what} --cache: not the binary of a plain compile")
+
+
+def top_level_starts(src):
+    """Where the lines that start a top-level statement begin, the places to put one more"""
+    starts = []
+    depth = 0
+    offset = 0
+    for line in src.splitlines(keepends=True):
+        code = line.partition("//")[0]
+        word = code.strip().split("(")[0].split(" ")[0]
+        if depth == 0 and word not in ("", "elif", "else", "}"):
+            starts.append(offset)
+        depth += code.count("{") - code.count("}")
+        offset += len(line)
+    return starts
+
+
+def check_parallel_errors(results, hydro, programs, work_dir):
+    """With -j a big program stops at the error of a plain compile, the first one when it has several"""
+    error_dir = os.path.join(work_dir, "errors")
+    os.makedirs(error_dir)
+    paths = []
+    for program in programs:
+        if program.error is not None or program.has_fns:
+            continue
+        with open(program.path) as src:
+            text = src.read()
+        starts = top_level_starts(text)
+        if len(starts) < 10:
+            continue
+        picks = [starts[len(starts) * tenth // 10] for tenth in (1, 5, 9)]
+        # the statements to put in, and the name in the error a plain compile stops at
+        variants = [([(pick, "exit(undeclared);\n")], "undeclared") for pick in picks]
+        variants.append(([(picks[0], "let twice = 1;\nlet twice = 2;\n"), (picks[2], "exit(later);\n")], "twice"))
+        variants.append(([(picks[1], "exit(first);\n"), (picks[2], "let twice = 1;\nlet twice = 2;\n")], "first"))
+        for i, (inserts, name) in enumerate(variants):
+            edited = text
+            for at, stmt in sorted(inserts, reverse=True):
+                edited = edited[:at] + stmt + edited[at:]
+            path = os.path.join(error_dir, f"{os.path.basename(binary_of(program.path))}_{i}.hy")
+            with open(path, "w") as out:
+                out.write(edited)
+            paths.append((path, name))
+    expected = compile_batch(hydro, [path for path, _ in paths], [], work_dir)
+    for path, name in paths:
+        results.check(name in expected.get(path, ""), f"{path}: error {expected.get(path)}, not about {name}")
+    # one file at a time, in a batch -j would give each file a thread of its own
+    for flags in (["-j", "4"], ["-j", "4", "-O0"]):
+        for path, _ in paths:
+            done = subprocess.run([hydro, *flags, path], cwd=error_dir, capture_output=True, text=True)
+            got = done.stderr.strip() if done.returncode != 0 else None
+            results.check(got == expected.get(path), f"{path} {' '.join(flags)}: error {got}, not {expected.get(path)}")
+
+
+def source_tokens(src):
+    """The tokens of a program, the comments left out, each punctuation character one token"""
+    code = re.sub(r"//[^\n]*|/\*.*?\*/", " ", src, flags=re.S)
+    return re.findall(r"[A-Za-z][A-Za-z0-9]*|\d+|\S", code)
+
+
+def check_time_report(results, hydro, programs, work_dir):
+    """--time-report=json writes a line of JSON per file, in the order of the files, even with -j, and
+    its counts are those of the source"""
+    paths = [program.path for program in programs if program.error is None]
+    manifest = os.path.join(work_dir, "manifest")
+    with open(manifest, "w") as out:
+        out.write("\n".join(paths) + "\n")
+    done = subprocess.run([hydro, "--time-report=json", "-j", "4", "@" + manifest], capture_output=True, text=True)
+    lines = [line for line in done.stderr.splitlines() if line.startswith("{")]
+    results.check(len(lines) == len(paths), f"--time-report=json: {len(lines)} reports for {len(paths)} files")
+    for path, line in zip(paths, lines):
+        try:
+            report = json.loads(line)
+        except json.JSONDecodeError as error:
+            results.check(False, f"{path} --time-report=json: {error} in {line[:200]}")
+            continue
+        results.check(report["file"] == path, f"{path} --time-report=json: the report of {report['file']}")
+        names = [phase["name"] for phase in report["phases"]]
+        results.check(names[:2] == ["read", "parse"] and "generate" in names, f"{path}: phases {names}")
+        results.check(all(phase["wall_ms"] >= 0 and phase["cpu_ms"] >= 0 for phase in report["phases"]),
+                      f"{path}: a phase took negative time")
+        with open(path) as src:
+            tokens = source_tokens(src.read())
+        results.check(report["tokens"] == len(tokens), f"{path}: {report['tokens']} tokens, not {len(tokens)}")
+        # one statement per keyword, and one literal node per literal before the optimizer
+        for kind in ("exit", "let", "if", "elif", "else", "for", "return", "fn"):
+            counted = report["statements"][kind]
+            expected = tokens.count(kind)
+            results.check(counted == expected, f"{path}: {counted} {kind} statements, not {expected}")
+        literals = sum(token.isdigit() for token in tokens)
+        counted = report["expressions"]["int_lit"]
+        results.check(counted == literals, f"{path}: {counted} literals, not {literals}")
+        results.check(report["instructions"] > 0, f"{path}: no instructions")
+
+
+def check_profiles(results, hydro, programs, work_dir):
+    """An instrumented binary exits like the plain one, and so does the one built from its profile"""
+    for program in programs:
+        if program.error is not None:
+            continue
+        what = f"{program.path} --instrument"
+        run_dir = os.path.join(work_dir, "profile")
+        shutil.rmtree(run_dir, ignore_errors=True)
+        os.makedirs(run_dir)
+        for flags in (["--instrument"], ["--profile-use"]):
+            done = subprocess.run([hydro, *flags, program.path], cwd=run_dir, capture_output=True, text=True)
+            if done.returncode != 0:
+                results.check(False, f"{what} {' '.join(flags)}: {done.stderr.strip()}")
+                break
+            got = run_binary(os.path.join(run_dir, "out"))
+            results.check(got == program.status, f"{what} {' '.join(flags)}: exit {got}, not {program.status}")
+            # a binary killed by its trap writes no profile to use
+            if not os.path.exists(os.path.join(run_dir, "out.profile")):
+                break
+
+
+def check_allocations(results, build_dir, programs, work_dir):
+    paths = [program.path for program in programs if program.error is None and program.status is not None]
+    done = subprocess.run([os.path.join(build_dir, "alloc_count"), os.path.join(work_dir, "alloc_out"), *paths],
+                          capture_output=True, text=True)
+    for line in done.stdout.splitlines():
+        path, _, counts = line.partition(":")
+        later = counts.split()[1:]
+        results.check(all(count == "0" for count in later), f"{path}: allocations per compile {counts.strip()}")
+    results.check(done.returncode == 0, f"alloc_count failed: {done.stderr.strip()}")
+
+
+def case_programs():
+    programs = []
+    for name in sorted(os.listdir(CASES)):
+        if not name.endswith(".hy"):
+            continue
+        path = os.path.join(CASES, name)
+        with open(path) as src:
+            header = src.readline().strip()
+        if header.startswith("// exit "):
+            programs.append(Program(path, status=int(header.split()[2])))
+        elif header.startswith("// error: "):
+            programs.append(Program(path, error=header[len("// error: "):]))
+        else:
+            sys.exit(f"{path} doesn't start with // exit N or // error: TEXT")
+    return programs
+
+
+def copy_cases(results, work_dir):
+    """The cases are compiled in a copy, the binaries go next to them"""
+    case_dir = os.path.join(work_dir, "cases")
+    os.makedirs(case_dir)
+    programs = []
+    for program in case_programs():
+        path = os.path.join(case_dir, os.path.basename(program.path))
+        shutil.copy(program.path, path)
+        programs.append(Program(path, program.status, program.error))
+        if program.status is not None:
+            with open(path) as src:
+                status = hy_reference.run(src.read())
+            results.check(status == program.status, f"{path}: the reference interpreter exits {status}")
+    return programs
+
+
+def fuzz_programs(work_dir, count, seed):
+    fuzz_dir = os.path.join(work_dir, "fuzz")
+    os.makedirs(fuzz_dir)
+    programs = []
+    for i in range(count):
+        # every other one has functions, and every other pair divides by anything, 0 too
+        src = hy_reference.Generator(seed * 1_000_000 + i, fns=i % 2 == 1, traps=i % 4 >= 2).program()
+        path = os.path.join(fuzz_dir, f"fuzz{i}.hy")
+        with open(path, "w") as out:
+            out.write(src)
+        programs.append(Program(path, status=hy_reference.run(src)))
+    return programs
+
+
+def corpus_programs(build_dir, work_dir, scale, hydro=None):
+    """The corpus at the scale, run by the reference interpreter, or by the
+    binary of hydro -O0 when it is given. The frame of a big program has to
+    stay small, the binaries get a stack of 1 MiB."""
+    corpus_dir = os.path.join(work_dir, f"corpus{scale}")
+    os.makedirs(corpus_dir)
+    subprocess.run([os.path.join(build_dir, "hydro_bench"), "--scale", str(scale), "--corpus", corpus_dir,
+                    "--no-bench"], check=True)
+    paths = sorted(os.path.join(corpus_dir, name) for name in os.listdir(corpus_dir))
+    if hydro is None:
+        programs = []
+        for path in paths:
+            with open(path) as src:
+                programs.append(Program(path, status=hy_reference.run(src.read())))
+        return programs
+    compile_batch(hydro, paths, ["-O0"], work_dir)
+    stack_bytes = 1 << 20
+    return [Program(path, run_binary(binary_of(path), stack_bytes), stack_bytes=stack_bytes) for path in paths]
+
+
+def deep_programs(work_dir):
+    """Nested parentheses and a chain of operands, both far deeper than the native stack"""
+    deep_dir = os.path.join(work_dir, "deep")
+    os.makedirs(deep_dir)
+    depth = 200_000
+    operands = 1_000_000
+    sources = {
+        "left.hy": ("let a = 1;\nexit(" + "(" * depth + "a" + " + 1)" * depth + ");\n", (1 + depth) & 0xFF),
+        "right.hy": ("let a = 1;\nexit(" + "(1 + " * depth + "a" + ")" * depth + ");\n", (1 + depth) & 0xFF),
+        "chain.hy": ("let a = 3;\nexit(" + " + ".join(["a"] * operands) + ");\n", (3 * operands) & 0xFF),
+    }
+    programs = []
+    for name, (src, status) in sources.items():
+        path = os.path.join(deep_dir, name)
+        with open(path, "w") as out:
+            out.write(src)
+        programs.append(Program(path, status=status))
+    return programs
+
+
+def check_server(results, hydro, programs, work_dir):
+    server_dir = os.path.join(work_dir, "server")
+    os.makedirs(server_dir)
+    socket_path = os.path.join(server_dir, "socket")
+    server = subprocess.Popen([hydro, "--daemon", socket_path])
+    try:
+        for _ in range(100):
+            if os.path.exists(socket_path):
+                break
+            time.sleep(0.05)
+        mode = stat.S_IMODE(os.stat(socket_path).st_mode)
+        results.check(mode == 0o600, f"the socket of the server has mode {mode:o}")
+        # connected, half a request and then nothing, the server has to drop it
+        with socket.socket(socket.AF_UNIX) as stalled:
+            stalled.connect(socket_path)
+            stalled.sendall(b"/\n")
+            for program in programs:
+                if program.error is not None:
+                    continue
+                try:
+                    done = subprocess.run([hydro, "--connect", socket_path, program.path], cwd=server_dir,
+                                          capture_output=True, text=True, timeout=60)
+                except subprocess.TimeoutExpired:
+                    results.check(False, f"{program.path} --connect: no answer while a client hangs")
+                    break
+                what = f"{program.path} --connect: {done.stderr.strip()}"
+                results.check(done.returncode == 0 and run_binary(os.path.join(server_dir, "out")) == program.status,
+                              what)
+    finally:
+        server.kill()
+        server.wait()
+
+
+def check_nasm(results, hydro, programs, work_dir):
+    """--nasm must fail a compile whose nasm or ld fails, in a batch too. The
+    tools are scripts that exit with the status they are given."""
+    tool_dir = os.path.join(work_dir, "tools")
+    os.makedirs(tool_dir)
+    env = dict(os.environ, PATH=tool_dir + os.pathsep + os.environ["PATH"])
+    paths = [program.path for program in programs if program.error is None][:2]
+    manifest = os.path.join(work_dir, "nasm_manifest")
+    with open(manifest, "w") as out:
+        out.write("\n".join(paths) + "\n")
+    for nasm_status, ld_status, error in ((1, 0, "Could not assemble"), (0, 1, "Could not link")):
+        for tool, status in (("nasm", nasm_status), ("ld", ld_status)):
+            script = os.path.join(tool_dir, tool)
+            with open(script, "w") as out:
+                out.write(f"#!/bin/sh\nexit {status}\n")
+            os.chmod(script, 0o755)
+        done = subprocess.run([hydro, "--nasm", "@" + manifest], cwd=work_dir, env=env, capture_output=True, text=True)
+        results.check(done.returncode != 0, f"--nasm: succeeded though a tool failed, {error}")
+        for path in paths:
+            results.check(f"{path}: {error}" in done.stderr, f"{path} --nasm: {done.stderr.strip()}, not {error}")
+
+
+def check_tsan(results, build_dir, programs, work_dir):
+    paths = [program.path for program in programs if program.error is None]
+    for flags in (["-j", "4"], ["-j", "4", "--cache", os.path.join(work_dir, "tsan_cache")]):
+        done = subprocess.run([os.path.join(build_dir, "hydro_tsan"), *flags, *paths], capture_output=True, text=True)
+        ok = done.returncode == 0 and "ThreadSanitizer" not in done.stderr
+        results.check(ok, f"hydro_tsan {' '.join(flags)}: {done.stderr[:2000]}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="the tests of hydro")
+    parser.add_argument("--fuzz", type=int, default=200, help="the number of random programs")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--tsan", action="store_true", help="also look for races with a ThreadSanitizer build")
+    parser.add_argument("--keep", help="work in this directory and keep it, to look at the programs")
+    args = parser.parse_args()
+
+    work_dir = args.keep or tempfile.mkdtemp(prefix="hydro_tests.")
+    if args.keep:
+        shutil.rmtree(work_dir, ignore_errors=True)
+        os.makedirs(work_dir)
+    build_dir = os.path.join(work_dir, "build")
+    os.makedirs(build_dir)
+    build(build_dir, args.tsan)
+    hydro = os.path.join(build_dir, "hydro")
+
+    sections = {}
+    results = sections["cases"] = Results()
+    cases = copy_cases(results, work_dir)
+    check_all_flags(results, hydro, cases, work_dir)
+
+    results = sections["fuzz"] = Results()
+    fuzz = fuzz_programs(work_dir, args.fuzz, args.seed)
+    check_all_flags(results, hydro, fuzz, work_dir)
+
+    results = sections["corpus"] = Results()
+    small = corpus_programs(build_dir, work_dir, 10)
+    big = corpus_programs(build_dir, work_dir, 150, hydro)
+    check_all_flags(results, hydro, small + big, work_dir)
+
+    results = sections["units"] = Results()
+    check_units(results, build_dir, cases + fuzz + small + big)
+
+    results = sections["deep"] = Results()
+    check_all_flags(results, hydro, deep_programs(work_dir), work_dir)
+
+    results = sections["same binaries"] = Results()
+    check_same_binaries(results, hydro, cases + fuzz + big, work_dir)
+
+    results = sections["parallel errors"] = Results()
+    check_parallel_errors(results, hydro, big, work_dir)
+
+    results = sections["cache edits"] = Results()
+    check_cache_edits(results, hydro, cases + fuzz + big, work_dir)
+
+    results = sections["time report"] = Results()
+    check_time_report(results, hydro, cases + fuzz + big, work_dir)
+
+    results = sections["profiles"] = Results()
+    check_profiles(results, hydro, cases + fuzz + small, work_dir)
+
+    results = sections["allocations"] = Results()
+    check_allocations(results, build_dir, cases + fuzz + small + big, work_dir)
+
+    results = sections["server"] = Results()
+    check_server(results, hydro, cases, work_dir)
+
+    results = sections["nasm"] = Results()
+    check_nasm(results, hydro, cases, work_dir)
+
+    if args.tsan:
+        results = sections["tsan"] = Results()
+        check_tsan(results, build_dir, fuzz + big, work_dir)
+
+    failed = False
+    for name, results in sections.items():
+        print(f"{name}: {results.checks} checks, {len(results.failures)} failed")
+        failed = failed or bool(results.failures)
+    if not args.keep:
+        shutil.rmtree(work_dir)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,105 @@
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+
+#include <unistd.h>
+
+#include "../source.hpp"
+#include "../tokenization.hpp"
+#include "check.hpp"
+
+/* A source file is mapped when it is a regular file and read into a buffer
+** otherwise, its view survives both moves, and the tokens lexed from it are
+** slices of it rather than copies.
+*/
+namespace {
+
+std::string write_temp(const std::string& text)
+{
+    char path[] = "/tmp/hydro_source_test.XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(::write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()));
+    ::close(fd);
+    return path;
+}
+
+std::string read_with_stream(const char* path)
+{
+    std::ifstream in(path);
+    return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+}
+
+void test_mapped()
+{
+    const std::string text = "let value = 12345;\nexit(value);\n";
+    const std::string path = write_temp(text);
+    SourceFile file;
+    CHECK(file.open(path.c_str()));
+    CHECK(file.view() == text);
+
+    // the literal is a slice of the file, not a copy of it
+    Interner interner;
+    const std::string_view src = file.view();
+    for (const Token& token : Tokenizer(src, interner).tokenize()) {
+        if (token.value.has_value()) {
+            CHECK(token.value->data() >= src.data());
+            CHECK(token.value->data() + token.value->size() <= src.data() + src.size());
+            CHECK(*token.value == "12345");
+        }
+    }
+
+    SourceFile moved(std::move(file));
+    CHECK(moved.view() == text);
+    CHECK(moved.view().data() == src.data());
+    CHECK(file.view().empty()); // NOLINT(bugprone-use-after-move)
+    unlink(path.c_str());
+}
+
+void test_read()
+{
+    // it says it is empty and isn't, so it can't be mapped
+    const char* path = "/proc/self/status";
+    SourceFile file;
+    CHECK(file.open(path));
+    CHECK(file.view().substr(0, 5) == "Name:");
+    SourceFile assigned;
+    assigned = std::move(file);
+    CHECK(assigned.view().substr(0, 5) == "Name:");
+
+    // a text that short lives in the buffer object itself, so the view has to follow it
+    const char* short_path = "/proc/sys/kernel/ostype";
+    const std::string text = read_with_stream(short_path);
+    SourceFile short_file;
+    CHECK(short_file.open(short_path));
+    CHECK(short_file.view() == text);
+    SourceFile constructed(std::move(short_file));
+    CHECK(constructed.view() == text);
+    assigned = std::move(constructed);
+    CHECK(assigned.view() == text);
+
+    const std::string empty_path = write_temp("");
+    SourceFile empty;
+    CHECK(empty.open(empty_path.c_str()));
+    CHECK(empty.view().empty());
+    unlink(empty_path.c_str());
+}
+
+void test_missing()
+{
+    SourceFile file;
+    CHECK(!file.open("/nonexistent/hydro/file.hy"));
+    CHECK(file.view().empty());
+}
+
+}
+
+int main()
+{
+    test_mapped();
+    test_read();
+    test_missing();
+    return check_status();
+}
@@ -0,0 +1,58 @@
+#include <cstdint>
+#include <thread>
+
+#include "../spsc_queue.hpp"
+#include "check.hpp"
+
+/* Values come out of the queue in the order they went in, however often the
+** two threads find it full or empty, and closing it lets a producer that
+** waits for room go.
+*/
+namespace {
+
+void test_order()
+{
+    constexpr uint64_t count = 1'000'000;
+    SpscQueue<uint64_t, 4> queue;
+    std::thread producer([&queue] {
+        for (uint64_t i = 0; i < count; i++) {
+            *queue.back() = i;
+            queue.push();
+        }
+    });
+    bool in_order = true;
+    for (uint64_t i = 0; i < count; i++) {
+        in_order &= queue.front() == i;
+        queue.pop();
+    }
+    producer.join();
+    CHECK(in_order);
+}
+
+void test_close()
+{
+    SpscQueue<int, 2> queue;
+    int pushed = 0;
+    std::thread producer([&queue, &pushed] {
+        // the third back() waits for room that never comes, until the consumer closes
+        while (int* slot = queue.back()) {
+            *slot = pushed++;
+            queue.push();
+        }
+    });
+    CHECK(queue.front() == 0);
+    queue.close();
+    producer.join();
+    CHECK(pushed == 2);
+    // once closed there is no room any more
+    CHECK(queue.back() == nullptr);
+}
+
+}
+
+int main()
+{
+    test_order();
+    test_close();
+    return check_status();
+}
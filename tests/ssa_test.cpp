@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "../source.hpp"
+#include "../ssa_passes.hpp"
+#include "check.hpp"
+
+/* The SSA form of every program given on the command line is run by an
+** interpreter before and after the passes, and both runs must end the same
+** way. What the passes leave must be well formed: no copies, a phi operand
+** for every predecessor, and every value defined before it is used. A few
+** small programs check what each pass takes away.
+*/
+namespace {
+
+struct Run {
+    enum class End : uint8_t {
+        exit,
+        trap,
+        too_long // the interpreter gave up, the program may still be fine
+    };
+    End end;
+    uint64_t code = 0;
+    bool operator==(const Run&) const = default;
+};
+
+Run exited(const uint64_t code)
+{
+    return { Run::End::exit, code };
+}
+
+const Run trapped { Run::End::trap };
+const Run gave_up { Run::End::too_long };
+
+class Interpreter {
+public:
+    explicit Interpreter(const SsaFunction& fn)
+        : m_fn(fn)
+        , m_values(fn.values.size(), 0)
+        , m_defined(fn.values.size(), false)
+    {
+        for (ValueId id = 0; id < fn.values.size(); id++) {
+            if (fn.is_constant(id)) {
+                m_values[id] = fn.values[id].imm;
+                m_defined[id] = true;
+            }
+        }
+    }
+
+    Run run(size_t steps = 1'000'000)
+    {
+        BlockId block = 0;
+        BlockId pred = 0;
+        bool entry = true;
+        while (steps-- > 0) {
+            const SsaBlock& b = m_fn.blocks[block];
+            CHECK(!b.removed);
+            if (!entry) {
+                enter_phis(b, pred);
+            }
+            entry = false;
+            for (const ValueId id : b.values) {
+                if (!eval(id)) {
+                    return trapped;
+                }
+            }
+            const SsaTerm& term = b.term;
+            pred = block;
+            switch (term.kind) {
+            case SsaTerm::Kind::jump:
+                block = term.then_block;
+                break;
+            case SsaTerm::Kind::branch:
+                block = get(term.lhs) != 0 ? term.then_block : term.else_block;
+                break;
+            case SsaTerm::Kind::branch_le:
+                block = static_cast<int64_t>(get(term.lhs)) <= static_cast<int64_t>(get(term.rhs)) ? term.then_block
+                                                                                                   : term.else_block;
+                break;
+            case SsaTerm::Kind::exit:
+                return exited(get(term.lhs));
+            }
+        }
+        return gave_up;
+    }
+
+private:
+    uint64_t get(const ValueId id)
+    {
+        const ValueId value = m_fn.resolve(id);
+        CHECK(m_defined[value]);
+        return m_values[value];
+    }
+
+    // the phis of a block take their operands all at once, one may read another
+    void enter_phis(const SsaBlock& block, const BlockId pred)
+    {
+        const auto it = std::find(block.preds.begin(), block.preds.end(), pred);
+        CHECK(it != block.preds.end());
+        const auto index = static_cast<size_t>(it - block.preds.begin());
+        m_incoming.clear();
+        for (const ValueId phi : block.phis) {
+            if (m_fn.values[phi].op == SsaOp::phi) {
+                CHECK(m_fn.values[phi].args.size() == block.preds.size());
+                m_incoming.push_back(get(m_fn.values[phi].args[index]));
+            }
+        }
+        size_t next = 0;
+        for (const ValueId phi : block.phis) {
+            if (m_fn.values[phi].op == SsaOp::phi) {
+                m_values[phi] = m_incoming[next++];
+                m_defined[phi] = true;
+            }
+        }
+    }
+
+    // false if it divides by zero
+    bool eval(const ValueId id)
+    {
+        const SsaValue& value = m_fn.values[id];
+        if (!is_bin_op(value.op)) {
+            return true;
+        }
+        const uint64_t lhs = get(value.lhs);
+        const uint64_t rhs = get(value.rhs);
+        if (value.op == SsaOp::div && rhs == 0) {
+            return false;
+        }
+        m_values[id] = ssa::fold(value.op, lhs, rhs).value();
+        m_defined[id] = true;
+        return true;
+    }
+
+    const SsaFunction& m_fn;
+    std::vector<uint64_t> m_values;
+    std::vector<bool> m_defined;
+    std::vector<uint64_t> m_incoming;
+};
+
+struct Built {
+    SsaFunction raw;
+    SsaFunction optimized;
+};
+
+std::optional<Built> build(const std::string_view src)
+{
+    Interner interner;
+    Tokenizer tokenizer(src, interner);
+    Parser parser;
+    parser.reset(tokenizer);
+    try {
+        const std::optional<NodeProg> prog = parser.parse_prog();
+        if (!prog.has_value() || uses_functions(*prog)) {
+            return {};
+        }
+        Built built { SsaBuilder(*prog, interner).build(), SsaBuilder(*prog, interner).build() };
+        SsaPassManager().run(built.optimized);
+        return built;
+    }
+    catch (const CompileError&) {
+        return {};
+    }
+}
+
+// the blocks and edges agree, and nothing the passes should have removed is left
+void check_well_formed(const SsaFunction& fn)
+{
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+        const SsaBlock& block = fn.blocks[id];
+        if (block.removed) {
+            continue;
+        }
+        for (const BlockId succ : fn.succs(id)) {
+            const std::vector<BlockId>& preds = fn.blocks[succ].preds;
+            CHECK(!fn.blocks[succ].removed);
+            CHECK(std::find(preds.begin(), preds.end(), id) != preds.end());
+        }
+        for (const ValueId phi : block.phis) {
+            CHECK(fn.values[phi].op == SsaOp::phi);
+            CHECK(fn.values[phi].args.size() == block.preds.size());
+        }
+        for (const ValueId value : block.values) {
+            CHECK(is_bin_op(fn.values[value].op));
+            CHECK(fn.values[fn.values[value].lhs].op != SsaOp::copy);
+            CHECK(fn.values[fn.values[value].rhs].op != SsaOp::copy);
+        }
+    }
+}
+
+// the values with this operation in the blocks that are left
+size_t count(const SsaFunction& fn, const SsaOp op)
+{
+    size_t n = 0;
+    for (const SsaBlock& block : fn.blocks) {
+        if (block.removed) {
+            continue;
+        }
+        for (const ValueId id : block.phis) {
+            n += fn.values[id].op == op;
+        }
+        for (const ValueId id : block.values) {
+            n += fn.values[id].op == op;
+        }
+    }
+    return n;
+}
+
+Run run(const SsaFunction& fn)
+{
+    return Interpreter(fn).run();
+}
+
+void test_passes()
+{
+    // the code after an exit goes, and the division by zero with it
+    std::optional<Built> built = build("let x = 3;\nexit(x);\nlet y = x / 0;\nexit(y);");
+    CHECK(count(built->raw, SsaOp::div) == 1);
+    CHECK(count(built->optimized, SsaOp::div) == 0);
+    CHECK(run(built->optimized) == exited(3));
+
+    // the second i * i is the first one
+    built = build("let s = 0;\nfor i = 1 : 1 : 3 {\n    s = s + i * i + i * i;\n}\nexit(s);");
+    CHECK(count(built->raw, SsaOp::mul) == 2);
+    CHECK(count(built->optimized, SsaOp::mul) == 1);
+    CHECK(run(built->optimized) == exited(28));
+
+    // an unused product goes, an unused division that may trap stays
+    built = build("let d = 0;\nfor i = 1 : 1 : 2 {\n    let u = i * 7;\n    let t = 5 / d;\n}\nexit(1);");
+    CHECK(count(built->optimized, SsaOp::mul) == 0);
+    CHECK(count(built->optimized, SsaOp::div) == 1);
+    CHECK(run(built->optimized) == trapped);
+
+    // the branch on a constant goes, and so does the phi that merged its arms
+    built = build("let x = 1;\nif (x - 1) {\n    x = 2;\n}\nexit(x);");
+    CHECK(count(built->raw, SsaOp::phi) == 1);
+    CHECK(count(built->optimized, SsaOp::phi) == 0);
+    CHECK(run(built->optimized) == exited(1));
+
+    // a loop that never ends is given up on, not run forever
+    built = build("let x = 0;\nfor i = 0 : 0 : 1 {\n    x = x + 1;\n}\nexit(x);");
+    CHECK(Interpreter(built->raw).run(1000) == gave_up);
+}
+
+void test_programs(const int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        SourceFile file;
+        CHECK(file.open(argv[i]));
+        const std::optional<Built> built = build(file.view());
+        if (!built.has_value()) {
+            continue;
+        }
+        check_well_formed(built->optimized);
+        const Run before = run(built->raw);
+        const Run after = run(built->optimized);
+        if (before.end != Run::End::too_long && after.end != Run::End::too_long && before != after) {
+            std::cerr << argv[i] << ": the passes changed how the program ends" << std::endl;
+            CHECK(before == after);
+        }
+    }
+}
+
+}
+
+int main(const int argc, char* argv[])
+{
+    test_passes();
+    test_programs(argc, argv);
+    return check_status();
+}
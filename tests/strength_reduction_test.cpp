@@ -0,0 +1,266 @@
+#include <array>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "../strength_reduction.hpp"
+#include "check.hpp"
+
+/* The reciprocals are checked against real division over divisors small and
+** large and dividends at the edges, and the sequences gen_div and gen_mul
+** emit are run on a small machine, which also checks that they leave alone
+** the registers they promise not to touch and use no div or mul where a
+** cheaper sequence exists.
+*/
+namespace {
+
+using u128 = unsigned __int128;
+
+uint64_t divide(const uint64_t x, const strength::MagicDivisor& magic)
+{
+    const auto t = static_cast<uint64_t>((static_cast<u128>(x) * magic.multiplier) >> 64);
+    if (magic.add) {
+        return (((x - t) >> 1) + t) >> magic.shift;
+    }
+    return t >> magic.shift;
+}
+
+std::vector<uint64_t> dividends(const uint64_t d, std::mt19937_64& rng)
+{
+    const uint64_t last = UINT64_MAX / d * d; // the largest multiple of d
+    std::vector<uint64_t> xs = { 0, 1, d - 1, d, d + 1, last, last - 1, UINT64_MAX, UINT64_MAX - 1,
+                                 static_cast<uint64_t>(INT64_MAX), static_cast<uint64_t>(INT64_MIN) };
+    for (int i = 0; i < 64; i++) {
+        xs.push_back(rng());
+        xs.push_back(rng() >> (rng() % 64));
+    }
+    return xs;
+}
+
+void check_magic(const uint64_t d, std::mt19937_64& rng)
+{
+    if (d < 2 || std::has_single_bit(d)) {
+        return;
+    }
+    const strength::MagicDivisor magic = strength::magic_divisor(d);
+    for (const uint64_t x : dividends(d, rng)) {
+        if (divide(x, magic) != x / d) {
+            std::cerr << x << " / " << d << " is " << x / d << ", not " << divide(x, magic) << std::endl;
+            CHECK(divide(x, magic) == x / d);
+            return;
+        }
+    }
+}
+
+void test_magic()
+{
+    std::mt19937_64 rng(1);
+    for (uint64_t d = 2; d < 20'000; d++) {
+        check_magic(d, rng);
+    }
+    for (int shift = 2; shift < 64; shift++) {
+        const uint64_t power = uint64_t { 1 } << shift;
+        check_magic(power - 1, rng);
+        check_magic(power + 1, rng);
+    }
+    check_magic(UINT64_MAX, rng);
+    for (int i = 0; i < 20'000; i++) {
+        check_magic(rng() >> (rng() % 64), rng);
+    }
+    // the two kinds of reciprocal, 3 fits in 64 bits and 7 needs 65
+    CHECK(!strength::magic_divisor(3).add);
+    CHECK(strength::magic_divisor(7).add);
+}
+
+// the registers and what runs on them, for the instructions of the sequences
+class Machine final : public InstrSink {
+public:
+    void emit(const Instr& instr) override
+    {
+        code.push_back(instr);
+    }
+
+    // false if it divided by zero
+    bool run()
+    {
+        for (const Instr& instr : code) {
+            switch (instr.op) {
+            case Op::mov:
+                set(instr.dst, value(instr.src));
+                break;
+            case Op::xor_:
+                set(instr.dst, value(instr.dst) ^ value(instr.src));
+                break;
+            case Op::add:
+                set(instr.dst, value(instr.dst) + value(instr.src));
+                break;
+            case Op::sub:
+                set(instr.dst, value(instr.dst) - value(instr.src));
+                break;
+            case Op::shl:
+                set(instr.dst, value(instr.dst) << (value(instr.src) & 63));
+                break;
+            case Op::shr:
+                set(instr.dst, value(instr.dst) >> (value(instr.src) & 63));
+                break;
+            case Op::imul:
+                set(instr.dst, value(instr.dst) * value(instr.src));
+                break;
+            case Op::lea:
+                set(instr.dst, reg(instr.src.reg) + reg(instr.src.index) * (instr.src.scale + uint64_t { 0 }));
+                break;
+            case Op::mul: {
+                const u128 product = static_cast<u128>(reg(Reg::rax)) * value(instr.dst);
+                reg(Reg::rax) = static_cast<uint64_t>(product);
+                reg(Reg::rdx) = static_cast<uint64_t>(product >> 64);
+                break;
+            }
+            case Op::div: {
+                const uint64_t divisor = value(instr.dst);
+                if (divisor == 0 || reg(Reg::rdx) != 0) {
+                    return false;
+                }
+                const uint64_t dividend = reg(Reg::rax);
+                reg(Reg::rax) = dividend / divisor;
+                reg(Reg::rdx) = dividend % divisor;
+                break;
+            }
+            default:
+                CHECK(false);
+                break;
+            }
+        }
+        return true;
+    }
+
+    bool uses(const Op op) const
+    {
+        for (const Instr& instr : code) {
+            if (instr.op == op) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t& reg(const Reg reg)
+    {
+        return regs[static_cast<size_t>(reg)];
+    }
+
+    std::array<uint64_t, 16> regs {};
+    std::vector<Instr> code;
+
+private:
+    uint64_t value(const Operand& operand)
+    {
+        return operand.kind == Operand::Kind::imm ? operand.value : reg(operand.reg);
+    }
+
+    // writing the 32 bit half of a register clears the upper half
+    void set(const Operand& operand, const uint64_t v)
+    {
+        reg(operand.reg) = operand.width == 32 ? static_cast<uint32_t>(v) : v;
+    }
+};
+
+Machine machine_with(std::mt19937_64& rng)
+{
+    Machine machine;
+    for (uint64_t& r : machine.regs) {
+        r = rng();
+    }
+    return machine;
+}
+
+// only dst and the registers the sequence may clobber differ afterwards
+bool others_kept(const Machine& before, const Machine& after, const Reg dst, const Reg a, const Reg b)
+{
+    for (size_t i = 0; i < before.regs.size(); i++) {
+        const auto reg = static_cast<Reg>(i);
+        if (reg != dst && reg != a && reg != b && before.regs[i] != after.regs[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_div()
+{
+    std::mt19937_64 rng(2);
+    const uint64_t divisors[] = { 1, 2, 3, 5, 7, 10, 16, 641, 1u << 31, 0xFFFFFFFF, 1ull << 63,
+                                  (1ull << 63) + 1, UINT64_MAX, 0 };
+    const Reg regs[] = { Reg::rbx, Reg::rcx, Reg::rsi, Reg::r11, Reg::r15 };
+    for (const uint64_t d : divisors) {
+        for (const Reg src : regs) {
+            for (const Reg dst : { src, Reg::rcx, Reg::rax, Reg::rdx, Reg::r9 }) {
+                for (int i = 0; i < 50; i++) {
+                    Machine machine = machine_with(rng);
+                    const uint64_t x = machine.reg(src);
+                    strength::gen_div(machine, dst, src, d);
+                    const Machine before = machine;
+                    const bool ok = machine.run();
+                    CHECK(ok == (d != 0));
+                    CHECK(!ok || machine.reg(dst) == x / d);
+                    CHECK(!ok || others_kept(before, machine, dst, Reg::rax, Reg::rdx));
+                    // only a division by zero is a div, for its trap
+                    CHECK(machine.uses(Op::div) == (d == 0));
+                }
+            }
+        }
+    }
+}
+
+void test_mul()
+{
+    std::mt19937_64 rng(3);
+    std::vector<uint64_t> factors;
+    for (uint64_t factor = 0; factor < 300; factor++) {
+        factors.push_back(factor);
+    }
+    for (const uint64_t factor : { uint64_t { INT32_MAX }, uint64_t { INT32_MAX } + 1, uint64_t { 1 } << 40,
+                                   (uint64_t { 1 } << 40) + 1, UINT64_MAX, UINT64_MAX / 3 }) {
+        factors.push_back(factor);
+    }
+    const Reg regs[] = { Reg::rax, Reg::rbx, Reg::rsi, Reg::r12 };
+    for (const uint64_t factor : factors) {
+        for (const Reg src : regs) {
+            for (const Reg dst : { src, Reg::rcx, Reg::r13 }) {
+                Machine machine = machine_with(rng);
+                const uint64_t x = machine.reg(src);
+                strength::gen_mul(machine, dst, src, factor);
+                const Machine before = machine;
+                CHECK(machine.run());
+                CHECK(machine.reg(dst) == x * factor);
+                CHECK(others_kept(before, machine, dst, Reg::rdx, dst));
+                CHECK(!machine.uses(Op::mul));
+                // a factor with nothing but 3, 5, 9 and twos in it needs no imul
+                uint64_t rest = factor == 0 ? 1 : factor >> std::countr_zero(factor);
+                int lea = 0;
+                for (const uint64_t a : { 9, 5, 3 }) {
+                    while (rest % a == 0 && lea < 2) {
+                        rest /= a;
+                        lea++;
+                    }
+                }
+                if (rest == 1) {
+                    CHECK(!machine.uses(Op::imul));
+                }
+                // rdx only holds a factor too big for an immediate
+                if (factor <= static_cast<uint64_t>(INT32_MAX)) {
+                    CHECK(others_kept(before, machine, dst, dst, dst));
+                }
+            }
+        }
+    }
+}
+
+}
+
+int main()
+{
+    test_magic();
+    test_div();
+    test_mul();
+    return check_status();
+}
@@ -0,0 +1,87 @@
+#include <map>
+#include <random>
+#include <vector>
+
+#include "../symbol_table.hpp"
+#include "check.hpp"
+
+/* The table against a plain model, a stack of maps, over random
+** declarations, lookups and scopes. A name can't be declared while it is
+** visible, and leaving a scope makes its names, and only those, vanish.
+*/
+namespace {
+
+void test_scopes()
+{
+    ScopedSymbolTable<int> table(4);
+    table.begin_scope();
+    CHECK(table.declare(1, 10));
+    CHECK(!table.declare(1, 11)); // no shadowing
+    CHECK(*table.find(1) == 10);
+    table.begin_scope();
+    CHECK(table.declare(2, 20));
+    // past the size it was made with, the table grows
+    CHECK(table.declare(100, 1000));
+    CHECK(table.innermost_size() == 2);
+    CHECK(table.innermost_begin()->name == 2);
+    CHECK(table.innermost_end() - table.innermost_begin() == 2);
+    *table.find(1) = 12;
+    table.end_scope();
+    CHECK(table.find(2) == nullptr);
+    CHECK(table.find(100) == nullptr);
+    CHECK(*table.find(1) == 12);
+    CHECK(table.size() == 1);
+    table.reset(8);
+    CHECK(table.find(1) == nullptr);
+    CHECK(table.size() == 0);
+}
+
+void test_against_model()
+{
+    constexpr Symbol names = 50;
+    std::mt19937 rng(1);
+    ScopedSymbolTable<int> table(names);
+    std::vector<std::map<Symbol, int>> model(1);
+    table.begin_scope();
+    for (int step = 0; step < 100'000; step++) {
+        const Symbol name = rng() % names;
+        const unsigned kind = rng() % 10;
+        bool visible = false;
+        int value = 0;
+        for (const std::map<Symbol, int>& scope : model) {
+            if (const auto it = scope.find(name); it != scope.end()) {
+                visible = true;
+                value = it->second;
+            }
+        }
+        if (kind < 4) {
+            CHECK(table.declare(name, step) == !visible);
+            if (!visible) {
+                model.back()[name] = step;
+            }
+        }
+        else if (kind < 7) {
+            const int* found = table.find(name);
+            CHECK((found != nullptr) == visible);
+            CHECK(found == nullptr || *found == value);
+        }
+        else if (kind < 8 || model.size() == 1) {
+            table.begin_scope();
+            model.emplace_back();
+        }
+        else {
+            table.end_scope();
+            model.pop_back();
+        }
+        CHECK(table.innermost_size() == model.back().size());
+    }
+}
+
+}
+
+int main()
+{
+    test_scopes();
+    test_against_model();
+    return check_status();
+}
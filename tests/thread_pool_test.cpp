@@ -0,0 +1,65 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../thread_pool.hpp"
+#include "check.hpp"
+
+/* Every task of a batch runs exactly once, on a worker the pool has, for any
+** number of tasks and threads, and a pool runs batch after batch. A worker
+** whose share is done takes tasks from the share of a slow one.
+*/
+namespace {
+
+void test_every_task_once()
+{
+    for (size_t threads = 1; threads <= 8; threads++) {
+        WorkStealingPool pool(threads);
+        CHECK(pool.threads() == threads);
+        for (size_t count = 0; count <= 100; count += count < 20 ? 1 : 37) {
+            std::vector<std::atomic<int>> runs(count);
+            std::atomic<bool> bad_worker = false;
+            pool.run(count, [&](const size_t worker, const size_t index) {
+                if (worker >= threads) {
+                    bad_worker = true;
+                }
+                runs[index].fetch_add(1);
+            });
+            bool once = true;
+            for (const std::atomic<int>& run : runs) {
+                once &= run.load() == 1;
+            }
+            CHECK(once);
+            CHECK(!bad_worker);
+        }
+    }
+}
+
+void test_stealing()
+{
+    constexpr size_t count = 16;
+    WorkStealingPool pool(2);
+    // worker 0's share starts with a task that takes long, worker 1 is done with its own long before
+    std::vector<size_t> ran_on(count);
+    pool.run(count, [&](const size_t worker, const size_t index) {
+        if (index == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        ran_on[index] = worker;
+    });
+    size_t stolen = 0;
+    for (size_t index = 0; index < count / 2; index++) {
+        stolen += ran_on[index] == 1;
+    }
+    CHECK(stolen > 0);
+}
+
+}
+
+int main()
+{
+    test_every_task_once();
+    test_stealing();
+    return check_status();
+}
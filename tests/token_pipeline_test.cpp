@@ -0,0 +1,118 @@
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../source.hpp"
+#include "../token_pipeline.hpp"
+#include "check.hpp"
+
+/* The tokens that come out of the pipeline must be the ones the lexer gives
+** on its own, with the same error at the same point, for every program given
+** on the command line and for sources that fill the chunks exactly, cross
+** them and fail in them. A parser that stops early must not leave the lexer
+** thread waiting for room.
+*/
+namespace {
+
+struct Stream {
+    std::vector<Token> tokens;
+    std::vector<std::string> names;
+    std::optional<std::string> error;
+};
+
+// the tokens up to the end of the file, which the source keeps returning after it
+Stream read(TokenSource& source, const Interner& interner)
+{
+    Stream stream;
+    try {
+        for (Token token = source.next(); token.type != TokenType::eof; token = source.next()) {
+            stream.tokens.push_back(token);
+        }
+        CHECK(source.next().type == TokenType::eof);
+    }
+    catch (const CompileError& error) {
+        stream.error = error.what();
+    }
+    for (const Token& token : stream.tokens) {
+        stream.names.push_back(token.type == TokenType::ident ? std::string(interner.name(token.sym)) : "");
+    }
+    return stream;
+}
+
+bool same_token(const Token& a, const Token& b)
+{
+    const bool same_value = a.value.has_value() == b.value.has_value()
+        && (!a.value.has_value() || (a.value->data() == b.value->data() && a.value->size() == b.value->size()));
+    return a.type == b.type && a.line == b.line && same_value;
+}
+
+void check_same(const std::string_view src, const std::string& what)
+{
+    Interner plain_names;
+    Tokenizer tokenizer(src, plain_names);
+    const Stream plain = read(tokenizer, plain_names);
+    Interner piped_names;
+    PipelinedTokenizer pipeline(src, piped_names);
+    const Stream piped = read(pipeline, piped_names);
+    bool same = plain.error == piped.error && plain.tokens.size() == piped.tokens.size() && plain.names == piped.names;
+    for (size_t i = 0; same && i < plain.tokens.size(); i++) {
+        same = same_token(plain.tokens[i], piped.tokens[i]);
+    }
+    if (!same) {
+        std::cerr << what << ": the pipeline gave " << piped.tokens.size() << " tokens and "
+                  << piped.error.value_or("no error") << ", the lexer " << plain.tokens.size() << " and "
+                  << plain.error.value_or("no error") << std::endl;
+    }
+    CHECK(same);
+}
+
+// a chunk holds 512 tokens and the queue 8 chunks, let x = 1; is 5 tokens
+std::vector<std::string> chunk_sources()
+{
+    std::vector<std::string> sources = { "", "\n\n", "// only a comment" };
+    for (const size_t tokens : { 510, 511, 512, 513, 1024, 4095, 4096, 4097, 5000, 20'000 }) {
+        std::string src;
+        for (size_t i = 0; i < tokens; i++) {
+            src += i % 7 == 0 ? "\n" : " ";
+            src += i % 3 == 0 ? "x" + std::to_string(i % 50) : std::to_string(i);
+        }
+        sources.push_back(src);
+        sources.push_back(src + " $");
+        sources.push_back(src + " 99999999999999999999");
+    }
+    return sources;
+}
+
+void test_early_stop()
+{
+    std::string src;
+    for (int i = 0; i < 100'000; i++) {
+        src += "let x" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    Interner interner;
+    // the destructor closes the queue while the lexer is far ahead, waiting for room
+    for (const size_t taken : { 0, 1, 600, 5000 }) {
+        PipelinedTokenizer pipeline(src, interner);
+        for (size_t i = 0; i < taken; i++) {
+            CHECK(pipeline.next().type != TokenType::eof);
+        }
+    }
+}
+
+}
+
+int main(const int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        SourceFile file;
+        CHECK(file.open(argv[i]));
+        check_same(file.view(), argv[i]);
+    }
+    size_t index = 0;
+    for (const std::string& src : chunk_sources()) {
+        check_same(src, "chunk source " + std::to_string(index++));
+    }
+    test_early_stop();
+    return check_status();
+}
@@ -0,0 +1,183 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../elf_writer.hpp"
+#include "../x86_encoder.hpp"
+#include "check.hpp"
+
+/* The bytes the encoder gives each form of every instruction the generators
+** emit, as GNU as assembles them: REX for r8 to r15, the SIB byte for an
+** rsp or r12 base, a displacement for rbp and r13, imm8 where it fits. The
+** jumps are patched to their labels, and an executable written with the
+** code runs and exits with the status it set.
+*/
+namespace {
+
+std::string hex(const std::vector<uint8_t>& bytes)
+{
+    std::string text;
+    char digits[3];
+    for (const uint8_t byte : bytes) {
+        std::snprintf(digits, sizeof(digits), "%02x", byte);
+        text += digits;
+    }
+    return text;
+}
+
+std::string encode(const std::vector<Instr>& instrs)
+{
+    X86Encoder encoder;
+    for (const Instr& instr : instrs) {
+        encoder.emit(instr);
+    }
+    CHECK(encoder.finish());
+    return hex(encoder.code());
+}
+
+void test_instructions()
+{
+    struct Case {
+        Instr instr;
+        const char* bytes;
+    };
+    const Case cases[] = {
+        { { Op::mov, op_reg(Reg::rax), op_imm(60) }, "48c7c03c000000" }, // mov rax, 60
+        { { Op::mov, op_reg(Reg::r15), op_imm(0xFFFFFFFFFFFFFFFFull) }, "49bfffffffffffffffff" }, // movabs r15, -1
+        { { Op::mov, op_reg(Reg::rdi), op_imm(0x123456789ull) }, "48bf8967452301000000" }, // movabs rdi, 0x123456789
+        { { Op::mov, op_reg(Reg::r9), op_imm(0x80000000ull) }, "49b90000008000000000" }, // movabs r9, 0x80000000
+        { { Op::mov, op_mem(Reg::rsp, 8), op_reg(Reg::rbx) }, "48895c2408" }, // mov qword [rsp+8], rbx
+        { { Op::mov, op_reg(Reg::rcx), op_mem(Reg::rbp, -16) }, "488b4df0" }, // mov rcx, qword [rbp-16]
+        { { Op::mov, op_reg(Reg::rax), op_mem(Reg::rbp, 0) }, "488b4500" }, // mov rax, qword [rbp]
+        { { Op::mov, op_reg(Reg::r8), op_mem(Reg::r13, 0) }, "4d8b4500" }, // mov r8, qword [r13]
+        { { Op::mov, op_reg(Reg::rax), op_mem(Reg::r12, 0) }, "498b0424" }, // mov rax, qword [r12]
+        { { Op::mov, op_mem(Reg::rsp, 4096), op_reg(Reg::r10) }, "4c89942400100000" }, // mov qword [rsp+4096], r10
+        { { Op::mov, op_reg(Reg::rdx), op_reg(Reg::r11) }, "4c89da" }, // mov rdx, r11
+        { { Op::lea, op_reg(Reg::rax), op_mem(Reg::rbx, Reg::rbx, 4, 0) }, "488d049b" }, // lea rax, [rbx+rbx*4]
+        { { Op::lea, op_reg(Reg::r14), op_mem(Reg::rsi, Reg::r9, 8, -8) }, "4e8d74cef8" }, // lea r14, [rsi+r9*8-8]
+        { { Op::lea, op_reg(Reg::rax), op_mem(Reg::r13, Reg::rax, 2, 0) }, "498d444500" }, // lea rax, [r13+rax*2]
+        { { Op::push, op_reg(Reg::rax) }, "50" }, // push rax
+        { { Op::push, op_reg(Reg::r12) }, "4154" }, // push r12
+        { { Op::push, op_mem(Reg::rsp, 24) }, "ff742418" }, // push qword [rsp+24]
+        { { Op::pop, op_reg(Reg::r15) }, "415f" }, // pop r15
+        { { Op::add, op_reg(Reg::rax), op_reg(Reg::rbx) }, "4801d8" }, // add rax, rbx
+        { { Op::add, op_reg(Reg::rsp), op_imm(8) }, "4883c408" }, // add rsp, 8
+        { { Op::add, op_reg(Reg::r8), op_imm(1000) }, "4981c0e8030000" }, // add r8, 1000
+        { { Op::sub, op_reg(Reg::rsp), op_imm(128) }, "4881ec80000000" }, // sub rsp, 128
+        { { Op::sub, op_mem(Reg::rbp, -8), op_reg(Reg::rcx) }, "48294df8" }, // sub qword [rbp-8], rcx
+        { { Op::add, op_reg(Reg::rdx), op_mem(Reg::rsp, 0) }, "48031424" }, // add rdx, qword [rsp]
+        { { Op::cmp, op_reg(Reg::rcx), op_imm(0x7FFFFFFF) }, "4881f9ffffff7f" }, // cmp rcx, 0x7fffffff
+        { { Op::cmp, op_mem(Reg::rbp, -24), op_imm(5) }, "48837de805" }, // cmp qword [rbp-24], 5
+        { { Op::cmp, op_reg(Reg::r10), op_reg(Reg::rax) }, "4939c2" }, // cmp r10, rax
+        { { Op::test, op_reg(Reg::rax), op_reg(Reg::rax) }, "4885c0" }, // test rax, rax
+        { { Op::test, op_mem(Reg::rsp, 0), op_reg(Reg::r9) }, "4c850c24" }, // test qword [rsp], r9
+        { { Op::xor_, op_reg(Reg::rdx, 32), op_reg(Reg::rdx, 32) }, "31d2" }, // xor edx, edx
+        { { Op::xor_, op_reg(Reg::r8, 32), op_reg(Reg::r8, 32) }, "4531c0" }, // xor r8d, r8d
+        { { Op::imul, op_reg(Reg::rax), op_reg(Reg::r13) }, "490fafc5" }, // imul rax, r13
+        { { Op::imul, op_reg(Reg::rbx), op_imm(3) }, "486bdb03" }, // imul rbx, rbx, 3
+        { { Op::imul, op_reg(Reg::r11), op_imm(1000) }, "4d69dbe8030000" }, // imul r11, r11, 1000
+        { { Op::imul, op_reg(Reg::rcx), op_mem(Reg::rsp, 16) }, "480faf4c2410" }, // imul rcx, qword [rsp+16]
+        { { Op::mul, op_reg(Reg::rdx) }, "48f7e2" }, // mul rdx
+        { { Op::div, op_reg(Reg::rbx) }, "48f7f3" }, // div rbx
+        { { Op::div, op_mem(Reg::rsp, 0) }, "48f73424" }, // div qword [rsp]
+        { { Op::div, op_reg(Reg::r12) }, "49f7f4" }, // div r12
+        { { Op::shl, op_reg(Reg::rax), op_imm(3) }, "48c1e003" }, // shl rax, 3
+        { { Op::shr, op_reg(Reg::r14), op_imm(63) }, "49c1ee3f" }, // shr r14, 63
+        { { Op::shl, op_reg(Reg::rdx), op_reg(Reg::rcx, 8) }, "48d3e2" }, // shl rdx, cl
+        { { Op::shr, op_mem(Reg::rbp, -8), op_imm(1) }, "48c16df801" }, // shr qword [rbp-8], 1
+        { { Op::ret }, "c3" }, // ret
+        { { Op::syscall }, "0f05" }, // syscall
+    };
+    for (const Case& c : cases) {
+        const std::string bytes = encode({ c.instr });
+        if (bytes != c.bytes) {
+            std::cerr << to_string(c.instr.op) << ": " << bytes << ", not " << c.bytes << std::endl;
+        }
+        CHECK(bytes == c.bytes);
+    }
+}
+
+void test_jumps()
+{
+    // forward over the ret, then back to the start from the end of the jle
+    CHECK(encode({ { Op::label, op_label(0) }, { Op::jmp, op_label(1) }, { Op::ret }, { Op::label, op_label(1) },
+                   { Op::jle, op_label(0) }, { Op::call, op_label(1) } })
+          == "e901000000" "c3" "0f8ef4ffffff" "e8f5ffffff");
+    CHECK(encode({ { Op::jz, op_label(0) }, { Op::jnz, op_label(0) }, { Op::jg, op_label(0) },
+                   { Op::jl, op_label(0) }, { Op::label, op_label(0) } })
+          == "0f8412000000" "0f850c000000" "0f8f06000000" "0f8c00000000");
+
+    X86Encoder encoder;
+    encoder.emit({ Op::jmp, op_label(3) });
+    CHECK(!encoder.finish());
+    CHECK(encoder.error() == "[Encode Error] Undefined label label3");
+    encoder.clear();
+    // no encoding has an immediate that big, the generators go through rax
+    encoder.emit({ Op::cmp, op_reg(Reg::rcx), op_imm(UINT64_MAX) });
+    CHECK(!encoder.finish());
+    CHECK(encoder.error() == "[Encode Error] Unsupported operands for cmp");
+}
+
+int run(const char* path)
+{
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl(path, path, nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_elf()
+{
+    X86Encoder encoder;
+    // a ret that never runs, the entry is after it
+    encoder.emit({ Op::ret });
+    encoder.emit({ Op::mov, op_reg(Reg::rax), op_imm(60) });
+    encoder.emit({ Op::mov, op_reg(Reg::rdi), op_imm(42) });
+    encoder.emit({ Op::syscall });
+    CHECK(encoder.finish());
+    char path[] = "/tmp/hydro_elf_test.XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    // an existing file keeps its mode, the one of mkstemp can't be executed
+    CHECK(fchmod(fd, 0700) == 0);
+    ::close(fd);
+
+    CHECK(write_elf(path, encoder.code(), 1));
+    CHECK(run(path) == 42);
+    const std::vector<uint8_t> data(100, 7);
+    CHECK(write_elf(path, encoder.code(), 1, data, 0x10000000));
+    CHECK(run(path) == 42);
+
+    FILE* file = std::fopen(path, "rb");
+    Elf64_Ehdr header {};
+    Elf64_Phdr segments[2] {};
+    CHECK(std::fread(&header, sizeof(header), 1, file) == 1);
+    CHECK(std::fread(segments, sizeof(segments), 1, file) == 1);
+    std::fclose(file);
+    CHECK(std::memcmp(header.e_ident, ELFMAG, SELFMAG) == 0);
+    CHECK(header.e_type == ET_EXEC && header.e_machine == EM_X86_64 && header.e_phnum == 2);
+    CHECK(header.e_entry == segments[0].p_vaddr + sizeof(header) + sizeof(segments) + 1);
+    CHECK(segments[0].p_flags == (PF_R | PF_X));
+    CHECK(segments[1].p_type == PT_LOAD && segments[1].p_flags == (PF_R | PF_W));
+    CHECK(segments[1].p_vaddr == 0x10000000 && segments[1].p_filesz == data.size());
+    CHECK(segments[1].p_offset % 0x1000 == 0);
+    unlink(path);
+}
+
+}
+
+int main()
+{
+    test_instructions();
+    test_jumps();
+    test_elf();
+    return check_status();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/* Runs a batch of independent tasks on a fixed number of threads. Every
+** worker gets a queue of its own with an even share of the tasks, works
+** through it front to back, and once it is empty steals from the back of
+** the others, so a worker that drew the small files helps with the big
+** ones. The tasks are numbered, which is all the queues hold.
+*/
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(const size_t threads)
+        : m_queues(threads)
+    {
+    }
+
+    [[nodiscard]] size_t threads() const
+    {
+        return m_queues.size();
+    }
+
+    // calls task(worker, index) for every index below count, and returns once all are done
+    template <typename Task>
+    void run(const size_t count, Task&& task)
+    {
+        // consecutive tasks go to the same worker, the inputs of a batch are often related
+        const size_t share = (count + threads() - 1) / threads();
+        for (size_t i = 0; i < count; i++) {
+            m_queues[i / share].tasks.push_back(i);
+        }
+        std::vector<std::jthread> workers;
+        workers.reserve(threads() - 1);
+        for (size_t worker = 1; worker < threads(); worker++) {
+            workers.emplace_back([this, worker, &task] { work(worker, task); });
+        }
+        // the calling thread is worker 0
+        work(0, task);
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    template <typename Task>
+    void work(const size_t worker, Task& task)
+    {
+        while (const std::optional<size_t> index = next_task(worker)) {
+            task(worker, *index);
+        }
+    }
+
+    std::optional<size_t> next_task(const size_t worker)
+    {
+        {
+            Queue& own = m_queues[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty()) {
+                const size_t index = own.tasks.front();
+                own.tasks.pop_front();
+                return index;
+            }
+        }
+        // no task is ever added while the workers run, so one round over the others is enough
+        for (size_t offset = 1; offset < threads(); offset++) {
+            Queue& victim = m_queues[(worker + offset) % threads()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                const size_t index = victim.tasks.back();
+                victim.tasks.pop_back();
+                return index;
+            }
+        }
+        return {};
+    }
+
+    std::vector<Queue> m_queues;
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "flat_ast.hpp"
+#include "instr.hpp"
+#include "parser.hpp"
+
+/* Where the time of a compile went, for --time-report. Every phase gets its
+** wall time, the CPU time of the process and the peak resident set size at
+** its end, next to counts of what the compile made. The CPU time and the
+** peak are of the whole process, so with -j they include the other files
+** that were compiled at the same time, and in the compile server the peak
+** is the one since it started.
+*/
+class TimeReport {
+public:
+    enum class Format { text, json };
+
+    // the kinds of NodeStmt in the order of its variant, then the branches of an if and the functions
+    static constexpr std::array<std::string_view, 10> stmt_kinds = { "exit", "let",    "scope", "if",   "assign",
+                                                                     "for",  "return", "elif",  "else", "fn" };
+    static constexpr std::array<std::string_view, 9> expr_kinds = { "int_lit", "ident", "add", "multi", "sub",
+                                                                    "div",     "shl",   "shr", "call" };
+
+    struct Phase {
+        std::string_view name;
+        double wall_ms;
+        double cpu_ms;
+        long peak_rss_kib;
+    };
+
+    struct Counts {
+        size_t tokens = 0; // the tokens the parser read, without the end of the file
+        std::array<size_t, stmt_kinds.size()> stmts {}; // the statements and if branches the parser made
+        std::array<size_t, expr_kinds.size()> exprs {}; // the expression nodes the parser made, by ExprKind
+        size_t arena_bytes = 0; // taken from the parser's arenas
+        size_t instrs = 0; // sent to the assembly printer or the encoder, after the peephole pass
+        size_t labels = 0;
+    };
+
+    // the clocks start over, for the file at input_path
+    void start(const std::string& input_path)
+    {
+        m_input_path = input_path;
+        m_phases.clear();
+        m_counts = {};
+        m_last_wall = std::chrono::steady_clock::now();
+        m_last_cpu = cpu_now();
+    }
+
+    // the phase ends here, it started at the end of the one before
+    void end_phase(const std::string_view name)
+    {
+        const auto wall = std::chrono::steady_clock::now();
+        const double cpu = cpu_now();
+        rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+        m_phases.push_back({ name, std::chrono::duration<double, std::milli>(wall - m_last_wall).count(),
+                             cpu - m_last_cpu, usage.ru_maxrss });
+        m_last_wall = wall;
+        m_last_cpu = cpu;
+    }
+
+    [[nodiscard]] Counts& counts()
+    {
+        return m_counts;
+    }
+
+    // the nodes made by the parser, the optimizer adds and drops some later
+    void count_nodes(const NodeProg& prog)
+    {
+        for (const ExprKind kind : prog.exprs.kinds) {
+            m_counts.exprs[static_cast<size_t>(kind)]++;
+        }
+        for (const NodeStmt* stmt : prog.stmts) {
+            count_stmt(stmt);
+        }
+        for (const NodeFn* fn : prog.fns) {
+            m_counts.stmts[fn_kind]++;
+            count_scope(fn->body);
+        }
+    }
+
+    // a table of the phases and then the counts
+    void write_text(std::ostream& out) const
+    {
+        out << "time report for " << m_input_path << std::endl;
+        out << std::fixed << std::setprecision(3);
+        out << "  phase          wall ms      cpu ms  peak rss KiB" << std::endl;
+        double wall = 0;
+        double cpu = 0;
+        for (const Phase& phase : m_phases) {
+            out << "  " << std::left << std::setw(10) << phase.name << std::right << std::setw(12) << phase.wall_ms
+                << std::setw(12) << phase.cpu_ms << std::setw(14) << phase.peak_rss_kib << std::endl;
+            wall += phase.wall_ms;
+            cpu += phase.cpu_ms;
+        }
+        out << "  " << std::left << std::setw(10) << "total" << std::right << std::setw(12) << wall << std::setw(12)
+            << cpu << std::endl;
+        out << std::defaultfloat;
+        out << "  tokens " << m_counts.tokens << ", arena bytes " << m_counts.arena_bytes << ", instructions "
+            << m_counts.instrs << ", labels " << m_counts.labels << std::endl;
+        out << "  statements:";
+        for (size_t i = 0; i < stmt_kinds.size(); i++) {
+            out << " " << stmt_kinds[i] << " " << m_counts.stmts[i];
+        }
+        out << std::endl << "  expressions:";
+        for (size_t i = 0; i < expr_kinds.size(); i++) {
+            out << " " << expr_kinds[i] << " " << m_counts.exprs[i];
+        }
+        out << std::endl;
+    }
+
+    // one line of JSON per file, so a batch can be read line by line
+    void write_json(std::ostream& out) const
+    {
+        out << "{\"file\":" << json_string(m_input_path) << ",\"phases\":[";
+        for (size_t i = 0; i < m_phases.size(); i++) {
+            const Phase& phase = m_phases[i];
+            out << (i == 0 ? "" : ",") << "{\"name\":\"" << phase.name << "\",\"wall_ms\":" << phase.wall_ms
+                << ",\"cpu_ms\":" << phase.cpu_ms << ",\"peak_rss_kib\":" << phase.peak_rss_kib << "}";
+        }
+        out << "],\"tokens\":" << m_counts.tokens << ",\"arena_bytes\":" << m_counts.arena_bytes
+            << ",\"instructions\":" << m_counts.instrs << ",\"labels\":" << m_counts.labels;
+        write_json_counts(out, "statements", stmt_kinds, m_counts.stmts);
+        write_json_counts(out, "expressions", expr_kinds, m_counts.exprs);
+        out << "}" << std::endl;
+    }
+
+private:
+    static double cpu_now()
+    {
+        timespec time {};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+        return static_cast<double>(time.tv_sec) * 1e3 + static_cast<double>(time.tv_nsec) / 1e6;
+    }
+
+    static std::string json_string(const std::string_view text)
+    {
+        constexpr char digits[] = "0123456789abcdef";
+        std::string quoted = "\"";
+        for (const char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                quoted += "\\u00";
+                quoted += digits[static_cast<unsigned char>(c) >> 4];
+                quoted += digits[static_cast<unsigned char>(c) & 0xF];
+            }
+            else {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    template <size_t N>
+    static void write_json_counts(std::ostream& out, const std::string_view key,
+                                  const std::array<std::string_view, N>& kinds, const std::array<size_t, N>& counts)
+    {
+        out << ",\"" << key << "\":{";
+        for (size_t i = 0; i < N; i++) {
+            out << (i == 0 ? "" : ",") << "\"" << kinds[i] << "\":" << counts[i];
+        }
+        out << "}";
+    }
+
+    static constexpr size_t elif_kind = 7;
+    static constexpr size_t else_kind = 8;
+    static constexpr size_t fn_kind = 9;
+
+    void count_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        for (const NodeStmt* stmt : scope->stmts) {
+            count_stmt(stmt);
+        }
+    }
+
+    void count_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        m_counts.stmts[stmt->var.index()]++;
+        if (const auto* scope = std::get_if<NodeScope*>(&stmt->var)) {
+            count_scope(*scope);
+        }
+        else if (const auto* stmt_for = std::get_if<NodeStmtFor*>(&stmt->var)) {
+            count_scope((*stmt_for)->body);
+        }
+        else if (const auto* stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            count_scope((*stmt_if)->scope);
+            for (std::optional<NodeIfPred*> pred = (*stmt_if)->pred; pred.has_value();) {
+                if (const auto* elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                    m_counts.stmts[elif_kind]++;
+                    count_scope((*elif)->scope);
+                    pred = (*elif)->pred;
+                }
+                else {
+                    m_counts.stmts[else_kind]++;
+                    count_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                    pred.reset();
+                }
+            }
+        }
+    }
+
+    std::string m_input_path;
+    std::vector<Phase> m_phases;
+    Counts m_counts;
+    std::chrono::steady_clock::time_point m_last_wall;
+    double m_last_cpu = 0;
+};
+
+/* Passes the instructions on and counts them, for the report */
+class CountingSink final : public InstrSink {
+public:
+    CountingSink(InstrSink& next, TimeReport::Counts& counts)
+        : m_next(next)
+        , m_counts(counts)
+    {
+    }
+
+    void emit(const Instr& instr) override
+    {
+        m_counts.instrs++;
+        if (instr.op == Op::label) {
+            m_counts.labels++;
+        }
+        m_next.emit(instr);
+    }
+
+private:
+    InstrSink& m_next;
+    TimeReport::Counts& m_counts;
+};
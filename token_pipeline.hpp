@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "compile_error.hpp"
+#include "spsc_queue.hpp"
+#include "tokenization.hpp"
+
+/* Lexes on a thread of its own while the parser pulls the tokens, so the two
+** run side by side. The tokens go over in chunks, which keeps the threads from
+** meeting on every token, and at most a few chunks are in flight, so memory
+** stays flat however big the file is. An invalid token ends the stream, the
+** parser gets the error once it reaches that point.
+*/
+class PipelinedTokenizer final : public TokenSource {
+public:
+    // the source must outlive the tokens, the interner is the lexer's until the end of the stream
+    PipelinedTokenizer(const std::string_view src, Interner& interner)
+        : m_lexer([this, src, &interner] { lex(src, interner); })
+    {
+    }
+
+    ~PipelinedTokenizer() override
+    {
+        // the parser may stop early on an error, which must not leave the lexer waiting for room
+        m_queue.close();
+    }
+
+    PipelinedTokenizer(const PipelinedTokenizer&) = delete;
+    PipelinedTokenizer& operator=(const PipelinedTokenizer&) = delete;
+
+    Token next() override
+    {
+        if (m_chunk == nullptr) {
+            m_chunk = &m_queue.front();
+        }
+        while (m_next == m_chunk->size) {
+            if (m_chunk->last) {
+                if (!m_chunk->error.empty()) {
+                    throw CompileError(m_chunk->error);
+                }
+                return { TokenType::eof, m_last_line };
+            }
+            m_queue.pop();
+            m_chunk = &m_queue.front();
+            m_next = 0;
+        }
+        const Token& token = m_chunk->tokens[m_next++];
+        m_last_line = token.line;
+        return token;
+    }
+
+private:
+    struct Chunk {
+        std::array<Token, 512> tokens;
+        size_t size = 0;
+        bool last = false; // the end of the stream, after the tokens of this chunk
+        std::string error; // why the lexer stopped, if it wasn't the end of the file
+    };
+
+    void lex(const std::string_view src, Interner& interner)
+    {
+        Tokenizer tokenizer(src, interner);
+        Chunk* chunk = m_queue.back();
+        if (chunk == nullptr) {
+            return;
+        }
+        // the slots go round, a chunk still holds what it was filled with the last time
+        *chunk = {};
+        try {
+            for (Token token = tokenizer.next(); token.type != TokenType::eof; token = tokenizer.next()) {
+                chunk->tokens[chunk->size++] = token;
+                if (chunk->size == chunk->tokens.size()) {
+                    m_queue.push();
+                    if ((chunk = m_queue.back()) == nullptr) {
+                        return;
+                    }
+                    chunk->size = 0;
+                    chunk->last = false;
+                }
+            }
+        }
+        catch (const CompileError& error) {
+            chunk->error = error.what();
+        }
+        chunk->last = true;
+        m_queue.push();
+    }
+
+    SpscQueue<Chunk, 8> m_queue;
+    Chunk* m_chunk = nullptr; // the one the parser takes its tokens from, at the front of the queue
+    size_t m_next = 0;
+    int m_last_line = 1;
+    std::jthread m_lexer; // last, it starts once everything else is there
+};
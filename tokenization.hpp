@@ -1,8 +1,16 @@
 #pragma once
 
+#include <array>
+#include <cassert>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "compile_error.hpp"
+#include "interner.hpp"
+#include "lexer_scan.hpp"
+
 /* Used to define the type of tokens for our programming language */
 enum class TokenType {
     exit,
@@ -23,7 +31,11 @@ enum class TokenType {
     elif,
     else_,
     colon,
-    for_
+    for_,
+    fn,
+    return_,
+    comma,
+    eof // the end of the token stream
 };
 
 /* Used for converting a token to a string for an easy usage for further operations */
@@ -68,6 +80,14 @@ inline std::string to_string(const TokenType type)
         return "`:`";
     case TokenType::for_:
         return "`for`";
+    case TokenType::fn:
+        return "`fn`";
+    case TokenType::return_:
+        return "`return`";
+    case TokenType::comma:
+        return "`,`";
+    case TokenType::eof:
+        return "end of file";
     }
     assert(false);
 }
@@ -94,162 +114,225 @@ inline std::optional<int> bin_prec(const TokenType type)
 struct Token {
     TokenType type; // The type of the token
     int line; // the line in the file where the token is located
-    std::optional<std::string> value {}; // the value of the token if it is an identifier or an integer literal
+    std::optional<std::string_view> value {}; // a slice of the source if it is an integer literal
+    Symbol sym {}; // the interned name if it is an identifier
+};
+
+/* Keywords are recognized with a perfect hash over the length and the first
+** and last characters, so an identifier costs one table probe and at most
+** one string compare. The hash is checked for collisions at compile time.
+*/
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+inline constexpr std::array<Keyword, 8> keywords { {
+    { "exit", TokenType::exit },
+    { "let", TokenType::let },
+    { "if", TokenType::if_ },
+    { "elif", TokenType::elif },
+    { "else", TokenType::else_ },
+    { "for", TokenType::for_ },
+    { "fn", TokenType::fn },
+    { "return", TokenType::return_ },
+} };
+
+constexpr size_t keyword_table_size = 16;
+
+constexpr size_t keyword_hash(const std::string_view text)
+{
+    return (text.size() * 3 + static_cast<unsigned char>(text.front())
+               + static_cast<unsigned char>(text.back()) * 6)
+        & (keyword_table_size - 1);
+}
+
+constexpr std::array<std::optional<Keyword>, keyword_table_size> make_keyword_table()
+{
+    std::array<std::optional<Keyword>, keyword_table_size> table {};
+    for (const Keyword& keyword : keywords) {
+        table[keyword_hash(keyword.text)] = keyword;
+    }
+    return table;
+}
+
+inline constexpr std::array<std::optional<Keyword>, keyword_table_size> keyword_table = make_keyword_table();
+
+constexpr bool keyword_hash_is_perfect()
+{
+    for (const Keyword& keyword : keywords) {
+        if (keyword_table[keyword_hash(keyword.text)]->type != keyword.type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(keyword_hash_is_perfect(), "keyword_hash has a collision, pick other constants");
+
+inline std::optional<TokenType> lookup_keyword(const std::string_view text)
+{
+    const std::optional<Keyword>& slot = keyword_table[keyword_hash(text)];
+    if (slot.has_value() && slot->text == text) {
+        return slot->type;
+    }
+    return {};
+}
+
+/* Maps a single character token to its type */
+inline TokenType punct_type(const char c)
+{
+    switch (c) {
+    case '(':
+        return TokenType::open_paren;
+    case ')':
+        return TokenType::close_paren;
+    case ';':
+        return TokenType::semi;
+    case '=':
+        return TokenType::eq;
+    case '+':
+        return TokenType::plus;
+    case '*':
+        return TokenType::star;
+    case '-':
+        return TokenType::minus;
+    case '{':
+        return TokenType::open_curly;
+    case '}':
+        return TokenType::close_curly;
+    case ':':
+        return TokenType::colon;
+    case ',':
+        return TokenType::comma;
+    default:
+        assert(false); // Unreachable;
+        return TokenType::semi;
+    }
+}
+
+/* Where the parser pulls its tokens from, one at a time. Once the tokens run
+** out, every call returns an eof token.
+*/
+class TokenSource {
+public:
+    virtual ~TokenSource() = default;
+    virtual Token next() = 0;
 };
 
-class Tokenizer {
+/* Lexes on demand, so the tokens of a file never all have to be in memory at
+** once. The source is left off where the last token ended.
+*/
+class Tokenizer final : public TokenSource {
 public:
-    explicit Tokenizer(std::string src) // the constructor of the class
-        : m_src(std::move(src)) // move is used in order to avoid copying for nothing the string
+    // the source must outlive the tokens and the interner, it may be a part of a file starting on first_line
+    Tokenizer(const std::string_view src, Interner& interner, const int first_line = 1)
+        : m_src(src)
+        , m_interner(interner)
+        , m_pos(src.data())
+        , m_line(first_line)
+        , m_last_line(first_line)
+    {
+    }
+
+    /* Uses the SSE2/AVX2 block scanners when they were compiled in */
+    Token next() override
     {
+        return next_token<scan::has_simd>();
     }
 
+    // the tokens of the whole source, without the eof token
     std::vector<Token> tokenize()
     {
-        std::vector<Token> tokens; //here we retain the tokens
-        std::string buf; // here we build the tokens temporarily
-        int line_count = 1; // the line in the file where the token is located
-        while (peek().has_value()) {
-            if (std::isalpha(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit") {
-                    tokens.push_back({ TokenType::exit, line_count });
-                    buf.clear();
-                }
-                else if (buf == "let") {
-                    tokens.push_back({ TokenType::let, line_count });
-                    buf.clear();
-                }
-                else if (buf == "if") {
-                    tokens.push_back({ TokenType::if_, line_count });
-                    buf.clear();
-                }
-                else if (buf == "elif") {
-                    tokens.push_back({ TokenType::elif, line_count });
-                    buf.clear();
-                }
-                else if (buf == "else") {
-                    tokens.push_back({ TokenType::else_, line_count });
-                    buf.clear();
-                }
-                else if (buf == "for") {
-                    tokens.push_back({ TokenType::for_, line_count });
-                    buf.clear();
-                }
-                else {
-                    tokens.push_back({ TokenType::ident, line_count, buf });
-                    buf.clear();
-                }
-            }
-            else if (std::isdigit(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
+        std::vector<Token> tokens;
+        tokenize_impl<scan::has_simd>(tokens);
+        return tokens;
+    }
+
+    // the same into a vector from an earlier file, which keeps its capacity
+    void tokenize(std::vector<Token>& tokens)
+    {
+        tokens.clear();
+        tokenize_impl<scan::has_simd>(tokens);
+    }
+
+    /* The portable one-character-at-a-time version, produces the same tokens,
+    ** which tests/lexer_test.cpp checks against the block scanners
+    */
+    std::vector<Token> tokenize_scalar()
+    {
+        std::vector<Token> tokens;
+        tokenize_impl<false>(tokens);
+        return tokens;
+    }
+
+private:
+    template <bool Simd>
+    void tokenize_impl(std::vector<Token>& tokens) //here we retain the tokens
+    {
+        for (Token token = next_token<Simd>(); token.type != TokenType::eof; token = next_token<Simd>()) {
+            tokens.push_back(token);
+        }
+    }
+
+    template <bool Simd>
+    Token next_token()
+    {
+        const char* const end = m_src.data() + m_src.size();
+        while (m_pos != end) {
+            const char* p = m_pos;
+            switch (scan::classify(*p)) {
+            case CharClass::space:
+                m_pos = scan::skip_spaces<Simd>(p, end, m_line);
+                break;
+            case CharClass::alpha: {
+                m_pos = scan::skip_alnum<Simd>(p + 1, end);
+                // the token refers to the source, nothing is copied
+                const std::string_view buf(p, static_cast<size_t>(m_pos - p));
+                if (const auto keyword = lookup_keyword(buf)) {
+                    return lexed({ keyword.value(), m_line });
                 }
-                tokens.push_back({ TokenType::int_lit, line_count, buf });
-                buf.clear();
+                return lexed({ TokenType::ident, m_line, {}, m_interner.intern(buf) });
             }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
-                consume();
-                consume();
-                while (peek().has_value() && peek().value() != '\n') {
-                    consume();
+            case CharClass::digit:
+                m_pos = scan::skip_digits<Simd>(p + 1, end);
+                return lexed({ TokenType::int_lit, m_line, std::string_view(p, static_cast<size_t>(m_pos - p)) });
+            case CharClass::slash:
+                if (p + 1 != end && p[1] == '/') {
+                    // the newline itself is left for the whitespace case
+                    m_pos = scan::find_newline<Simd>(p + 2, end);
                 }
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-                consume();
-                consume();
-                while (peek().has_value()) {
-                    if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/') {
-                        break;
+                else if (p + 1 != end && p[1] == '*') {
+                    m_pos = scan::find_block_comment_end<Simd>(p + 2, end);
+                    if (m_pos != end) {
+                        m_pos += 2;
                     }
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
                 }
-                if (peek().has_value()) {
-                    consume();
+                else {
+                    m_pos = p + 1;
+                    return lexed({ TokenType::fslash, m_line });
                 }
-            }
-            else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({ TokenType::open_paren, line_count });
-            }
-            else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({ TokenType::close_paren, line_count });
-            }
-            else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({ TokenType::semi, line_count });
-            }
-            else if (peek().value() == '=') {
-                consume();
-                tokens.push_back({ TokenType::eq, line_count });
-            }
-            else if (peek().value() == '+') {
-                consume();
-                tokens.push_back({ TokenType::plus, line_count });
-            }
-            else if (peek().value() == '*') {
-                consume();
-                tokens.push_back({ TokenType::star, line_count });
-            }
-            else if (peek().value() == '-') {
-                consume();
-                tokens.push_back({ TokenType::minus, line_count });
-            }
-            else if (peek().value() == '/') {
-                consume();
-                tokens.push_back({ TokenType::fslash, line_count });
-            }
-            else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({ TokenType::open_curly, line_count });
-            }
-            else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({ TokenType::close_curly, line_count });
-            }
-            else if (peek().value() == ':') {
-                consume();
-                tokens.push_back({ TokenType::colon, line_count });
-            }
-            else if (peek().value() == '\n') {
-                consume();
-                line_count++;
-            }
-            else if (std::isspace(peek().value())) {
-                consume();
-            }
-            else {
-                std::cerr << "Invalid token" << std::endl;
-                exit(EXIT_FAILURE);
+                break;
+            case CharClass::punct:
+                m_pos = p + 1;
+                return lexed({ punct_type(*p), m_line });
+            case CharClass::invalid:
+                throw CompileError("Invalid token");
             }
         }
-        m_index = 0;
-        return tokens;
+        // the end of the file is on the line of the last token
+        return { TokenType::eof, m_last_line };
     }
 
-private:
-    [[nodiscard]] std::optional<char> peek(const size_t offset = 0) const
-    {    // here we check if the index is greater than the length of the string
-        if (m_index + offset >= m_src.length()) {
-            return {};
-        }
-        // here we return the character at the index + offset
-        return m_src.at(m_index + offset);
-    }
-    // here we consume the character at the index by returning it
-    char consume()
+    Token lexed(const Token token)
     {
-        return m_src.at(m_index++);
+        m_last_line = token.line;
+        return token;
     }
 
-    const std::string m_src;
-    size_t m_index = 0;
+    const std::string_view m_src;
+    Interner& m_interner;
+    const char* m_pos; // where the next token starts, or whitespace before it
+    int m_line; // the line in the file where the token is located
+    int m_last_line;
 };
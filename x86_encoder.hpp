@@ -0,0 +1,391 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "instr.hpp"
+
+/* Turns the instructions the generators emit into x86-64 machine code, so
+** no assembler or linker has to be spawned. Only the instructions and operand
+** forms the generators use are supported: mov, push, pop, add, sub, imul,
+** mul, lea, div, xor, cmp, test, shl, shr, jmp, jz, jnz, jg, jl, jle,
+** call, ret and syscall, with register, immediate and [base + index * scale
+** +/- disp] memory operands. Jumps and calls always use 32 bit
+** displacements, which are patched once every label is known.
+*/
+class X86Encoder final : public InstrSink {
+public:
+    void emit(const Instr& instr) override
+    {
+        if (!encode(instr) && m_error.empty()) {
+            m_error = std::string("[Encode Error] Unsupported operands for ") + to_string(instr.op);
+        }
+    }
+
+    // patches the jumps once every instruction is in, returns false if something couldn't be encoded
+    bool finish()
+    {
+        return m_error.empty() && resolve_fixups();
+    }
+
+    // why finish() failed, the first error only
+    [[nodiscard]] const std::string& error() const
+    {
+        return m_error;
+    }
+
+    [[nodiscard]] const std::vector<uint8_t>& code() const
+    {
+        return m_code;
+    }
+
+    // starts over for the next program, keeping the memory
+    void clear()
+    {
+        m_code.clear();
+        m_labels.clear();
+        m_fixups.clear();
+        m_error.clear();
+    }
+
+private:
+    static constexpr size_t undefined = std::numeric_limits<size_t>::max();
+
+    struct Fixup {
+        size_t pos; // where the 32 bit displacement starts
+        LabelId label;
+    };
+
+    static uint8_t code(const Reg reg)
+    {
+        return static_cast<uint8_t>(reg);
+    }
+
+    static bool fits_int8(const int64_t value)
+    {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool imm_fits_int32(const uint64_t imm)
+    {
+        return imm <= static_cast<uint64_t>(INT32_MAX);
+    }
+
+    void emit8(const uint8_t byte)
+    {
+        m_code.push_back(byte);
+    }
+
+    void emit32(const uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            emit8(static_cast<uint8_t>(value >> (i * 8)));
+        }
+    }
+
+    void emit64(const uint64_t value)
+    {
+        emit32(static_cast<uint32_t>(value));
+        emit32(static_cast<uint32_t>(value >> 32));
+    }
+
+    // the REX prefix, left out when it would be empty
+    void rex(const bool wide, const uint8_t reg_field, const Operand& rm)
+    {
+        const uint8_t rm_code = code(rm.reg);
+        const uint8_t index = has_index(rm) ? code(rm.index) >> 3 : 0;
+        const uint8_t byte = 0x40 | (wide ? 0x08 : 0) | ((reg_field >> 3) << 2) | (index << 1) | (rm_code >> 3);
+        if (byte != 0x40) {
+            emit8(byte);
+        }
+    }
+
+    void modrm(const uint8_t reg_field, const Operand& rm)
+    {
+        const uint8_t base = code(rm.reg) & 7;
+        if (rm.kind == Operand::Kind::reg) {
+            emit8(0xC0 | ((reg_field & 7) << 3) | base);
+            return;
+        }
+        // rbp and r13 can't be encoded without a displacement, rsp, r12 and an index need a SIB byte
+        uint8_t mod = 0x80;
+        if (rm.disp == 0 && base != 5) {
+            mod = 0x00;
+        }
+        else if (fits_int8(rm.disp)) {
+            mod = 0x40;
+        }
+        if (has_index(rm)) {
+            emit8(mod | ((reg_field & 7) << 3) | 4);
+            emit8(static_cast<uint8_t>(std::countr_zero(rm.scale) << 6 | (code(rm.index) & 7) << 3 | base));
+        }
+        else {
+            emit8(mod | ((reg_field & 7) << 3) | base);
+            if (base == 4) {
+                emit8(0x24);
+            }
+        }
+        if (mod == 0x40) {
+            emit8(static_cast<uint8_t>(rm.disp));
+        }
+        else if (mod == 0x80) {
+            emit32(static_cast<uint32_t>(rm.disp));
+        }
+    }
+
+    // an instruction with a register and a register or memory operand
+    void op_rm(const std::initializer_list<uint8_t> opcode, const uint8_t reg_field, const Operand& rm,
+               const bool wide = true)
+    {
+        rex(wide, reg_field, rm);
+        for (const uint8_t byte : opcode) {
+            emit8(byte);
+        }
+        modrm(reg_field, rm);
+    }
+
+    static bool has_index(const Operand& op)
+    {
+        return op.kind == Operand::Kind::mem && op.scale != 0;
+    }
+
+    static bool is_rm(const Operand& op)
+    {
+        return op.kind == Operand::Kind::reg || op.kind == Operand::Kind::mem;
+    }
+
+    // add, sub and cmp share their encodings, only the opcode and the /digit differ
+    bool arith(const uint8_t rm_reg, const uint8_t reg_rm, const uint8_t digit, const Operand& dst,
+               const Operand& src)
+    {
+        if (is_rm(dst) && src.kind == Operand::Kind::reg) {
+            op_rm({ rm_reg }, code(src.reg), dst);
+        }
+        else if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::mem) {
+            op_rm({ reg_rm }, code(dst.reg), src);
+        }
+        else if (is_rm(dst) && src.kind == Operand::Kind::imm && imm_fits_int32(src.value)) {
+            if (fits_int8(static_cast<int64_t>(src.value))) {
+                op_rm({ 0x83 }, digit, dst);
+                emit8(static_cast<uint8_t>(src.value));
+            }
+            else {
+                op_rm({ 0x81 }, digit, dst);
+                emit32(static_cast<uint32_t>(src.value));
+            }
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    // the second opcode byte of a conditional jump
+    static uint8_t condition_code(const Op op)
+    {
+        switch (op) {
+        case Op::jz:
+            return 0x84;
+        case Op::jnz:
+            return 0x85;
+        case Op::jg:
+            return 0x8F;
+        case Op::jl:
+            return 0x8C;
+        default:
+            return 0x8E; // jle
+        }
+    }
+
+    void jump(const std::initializer_list<uint8_t> opcode, const Operand& target)
+    {
+        for (const uint8_t byte : opcode) {
+            emit8(byte);
+        }
+        m_fixups.push_back({ m_code.size(), static_cast<LabelId>(target.value) });
+        emit32(0);
+    }
+
+    bool encode(const Instr& instr)
+    {
+        const Operand& dst = instr.dst;
+        const Operand& src = instr.src;
+        switch (instr.op) {
+        case Op::label: {
+            const auto label = static_cast<LabelId>(dst.value);
+            if (label >= m_labels.size()) {
+                m_labels.resize(label + 1, undefined);
+            }
+            m_labels[label] = m_code.size();
+            return true;
+        }
+        case Op::comment:
+            return true;
+        case Op::mov:
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::imm) {
+                if (imm_fits_int32(src.value)) {
+                    op_rm({ 0xC7 }, 0, dst);
+                    emit32(static_cast<uint32_t>(src.value));
+                }
+                else {
+                    // movabs, the only form with a full 64 bit immediate
+                    rex(true, 0, dst);
+                    emit8(0xB8 + (code(dst.reg) & 7));
+                    emit64(src.value);
+                }
+            }
+            else if (is_rm(dst) && src.kind == Operand::Kind::reg) {
+                op_rm({ 0x89 }, code(src.reg), dst);
+            }
+            else if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::mem) {
+                op_rm({ 0x8B }, code(dst.reg), src);
+            }
+            else {
+                return false;
+            }
+            return true;
+        case Op::lea:
+            if (dst.kind != Operand::Kind::reg || src.kind != Operand::Kind::mem) {
+                return false;
+            }
+            op_rm({ 0x8D }, code(dst.reg), src);
+            return true;
+        case Op::push:
+            if (dst.kind == Operand::Kind::reg) {
+                rex(false, 0, dst);
+                emit8(0x50 + (code(dst.reg) & 7));
+            }
+            else if (dst.kind == Operand::Kind::mem) {
+                op_rm({ 0xFF }, 6, dst, false);
+            }
+            else {
+                return false;
+            }
+            return true;
+        case Op::pop:
+            if (dst.kind != Operand::Kind::reg) {
+                return false;
+            }
+            rex(false, 0, dst);
+            emit8(0x58 + (code(dst.reg) & 7));
+            return true;
+        case Op::add:
+            return arith(0x01, 0x03, 0, dst, src);
+        case Op::sub:
+            return arith(0x29, 0x2B, 5, dst, src);
+        case Op::cmp:
+            return arith(0x39, 0x3B, 7, dst, src);
+        case Op::test:
+            if (!is_rm(dst) || src.kind != Operand::Kind::reg) {
+                return false;
+            }
+            op_rm({ 0x85 }, code(src.reg), dst);
+            return true;
+        case Op::xor_:
+            if (dst.kind != Operand::Kind::reg || src.kind != Operand::Kind::reg) {
+                return false;
+            }
+            op_rm({ 0x31 }, code(src.reg), dst, dst.width == 64);
+            return true;
+        case Op::imul:
+            if (dst.kind == Operand::Kind::reg && is_rm(src)) {
+                op_rm({ 0x0F, 0xAF }, code(dst.reg), src);
+            }
+            else if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::imm && imm_fits_int32(src.value)) {
+                // imul r, imm is short for imul r, r, imm
+                if (fits_int8(static_cast<int64_t>(src.value))) {
+                    op_rm({ 0x6B }, code(dst.reg), dst);
+                    emit8(static_cast<uint8_t>(src.value));
+                }
+                else {
+                    op_rm({ 0x69 }, code(dst.reg), dst);
+                    emit32(static_cast<uint32_t>(src.value));
+                }
+            }
+            else {
+                return false;
+            }
+            return true;
+        case Op::mul:
+        case Op::div:
+            if (!is_rm(dst)) {
+                return false;
+            }
+            op_rm({ 0xF7 }, instr.op == Op::mul ? 4 : 6, dst);
+            return true;
+        case Op::shl:
+        case Op::shr: {
+            if (!is_rm(dst)) {
+                return false;
+            }
+            const uint8_t digit = instr.op == Op::shl ? 4 : 5;
+            if (src.kind == Operand::Kind::reg && src.width == 8 && src.reg == Reg::rcx) {
+                op_rm({ 0xD3 }, digit, dst);
+            }
+            else if (src.kind == Operand::Kind::imm && src.value < 64) {
+                op_rm({ 0xC1 }, digit, dst);
+                emit8(static_cast<uint8_t>(src.value));
+            }
+            else {
+                return false;
+            }
+            return true;
+        }
+        case Op::jmp:
+            if (dst.kind != Operand::Kind::label) {
+                return false;
+            }
+            jump({ 0xE9 }, dst);
+            return true;
+        case Op::jz:
+        case Op::jnz:
+        case Op::jg:
+        case Op::jl:
+        case Op::jle:
+            if (dst.kind != Operand::Kind::label) {
+                return false;
+            }
+            jump({ 0x0F, condition_code(instr.op) }, dst);
+            return true;
+        case Op::call:
+            if (dst.kind != Operand::Kind::label) {
+                return false;
+            }
+            jump({ 0xE8 }, dst);
+            return true;
+        case Op::ret:
+            emit8(0xC3);
+            return true;
+        case Op::syscall:
+            emit8(0x0F);
+            emit8(0x05);
+            return true;
+        }
+        return false;
+    }
+
+    bool resolve_fixups()
+    {
+        for (const Fixup& fixup : m_fixups) {
+            if (fixup.label >= m_labels.size() || m_labels[fixup.label] == undefined) {
+                m_error = "[Encode Error] Undefined label label" + std::to_string(fixup.label);
+                return false;
+            }
+            // relative to the end of the displacement, which ends the instruction
+            const auto rel = static_cast<int64_t>(m_labels[fixup.label]) - static_cast<int64_t>(fixup.pos + 4);
+            const auto value = static_cast<uint32_t>(static_cast<int32_t>(rel));
+            std::memcpy(&m_code[fixup.pos], &value, sizeof(value));
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> m_code;
+    std::vector<size_t> m_labels; // the offset of every label, indexed by its id
+    std::vector<Fixup> m_fixups;
+    std::string m_error;
+};